@@ -0,0 +1,710 @@
+/* bench.c
+ *
+ * Microbenchmarks for the hash kernels and for hashing files end to end,
+ * with output meant to be kept and diffed between commits.
+ *
+ * Each benchmark runs a fixed number of operations per iteration: a few
+ * warmup iterations that are thrown away, then a fixed number that are
+ * timed. The report gives the median, p99, minimum and mean of the time per
+ * operation over the timed iterations. The process is pinned to one CPU
+ * (the first it may run on, or --cpu), so the numbers don't move with the
+ * scheduler. idhash_pixels starts its two threads on that same CPU.
+ *
+ * Inputs come from a fixed seed, so every run measures the same work:
+ *
+ *   bit_array_sum/...    the popcount in bit_array.h, against other ways
+ *                        of counting bits, over 4096 words
+ *   histogram_median     256 histograms built from random 8x8 pixels
+ *   idhash_pixels        64 random 8x8 pixel arrays
+ *   idhash_distance/...  idhash_hash_dist on 4096 pairs, and one hash
+ *                        against a table of 4096 into a distance array
+ *   metric/...           the same table through each metric's batch
+ *                        kernel (see metric.c)
+ *   index_query/...      nearest neighbour and radius 10 queries by a
+ *                        linear scan of 65536 hashes, and the 20 nearest
+ *                        and radius 10 counts on one thread through
+ *                        hash_index.c (uniform hashes, so this
+ *                        measures its overhead: nothing is pruned) and
+ *                        through the bit-sliced scan of bitslice.c
+ *   batch_query/...      radius 10 counts of 512 queries against the same
+ *                        index, one query at a time and as one tiled batch
+ *   idhash_file          vips_thumbnail through the hash, per file, over a
+ *                        corpus of generated JPEGs (or --corpus <DIR>), with
+ *                        the libvips operation cache off
+ *
+ * The output is TSV, one line per benchmark after a header, with the
+ * settings on a '#' line; --json writes the same as JSON. --compare reads
+ * two TSV reports and prints the change in median per benchmark, exiting
+ * with failure when one got slower by more than --tolerance (default 10%).
+ *
+ * Compile
+ *
+gcc bench.c -o idhash-bench -DCMD_BENCH -O2 -g -Wall -pthread `pkg-config vips --cflags --libs`
+ *
+ * Usage
+ *
+ * ./idhash-bench [--cpu <N>] [--warmup <N>] [--iterations <N>]
+ *   [--filter <SUBSTRING>] [--corpus <DIR>] [--files <N>] [--json]
+ *   [--out <FILE>]
+ *
+ * ./idhash-bench --compare <OLD_TSV> <NEW_TSV> [--tolerance <FRACTION>]
+ *
+ */
+
+#define _GNU_SOURCE
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef ERRNO_H
+#  define ERRNO_H
+#  include <errno.h>
+#endif
+
+#ifndef SCHED_H
+#  define SCHED_H
+#  include <sched.h>
+#endif
+
+#ifndef DIRENT_H
+#  define DIRENT_H
+#  include <dirent.h>
+#endif
+
+#ifndef UNISTD_H
+#  define UNISTD_H
+#  include <unistd.h>
+#endif
+
+#ifndef IDHASH_H
+#  define IDHASH_H
+#  include "idhash.h"
+#endif
+
+#ifndef HASH_INDEX_H
+#  define HASH_INDEX_H
+#  include "hash_index.c"
+#endif
+
+#ifndef BITSLICE_H
+#  define BITSLICE_H
+#  include "bitslice.c"
+#endif
+
+#define BENCH_NWORDS 4096
+#define BENCH_NHISTOGRAMS 256
+#define BENCH_NPIXELS 64
+#define BENCH_NHASHES 4096
+#define BENCH_NTABLE 65536
+#define BENCH_NQUERIES 16
+#define BENCH_RADIUS 10
+#define BENCH_K 20
+#define BENCH_NBATCH 512
+
+/* Fixed inputs shared by the benchmarks, built once.
+ */
+typedef struct bench_data bench_data;
+struct bench_data {
+  guint64 words[BENCH_NWORDS];
+  histogram* histograms;
+  PixelRGB (*pixels)[64];
+  idhash_hash* hashes;
+  idhash_hash* table;
+  hash_index* index;    // of table
+  bitslice* slices;     // of table
+  hash_index* queries;  // of the first BENCH_NBATCH hashes
+  guint* dist;
+  char** files;
+  size_t nfiles;
+};
+
+typedef struct bench bench;
+struct bench {
+  const char* name;
+  // Operations per iteration, or 0 for one per corpus file.
+  size_t ops;
+  void (*run)(bench_data* d);
+};
+
+typedef struct bench_opts bench_opts;
+struct bench_opts {
+  int cpu;
+  int warmup;
+  int iterations;
+  const char* filter;
+  const char* corpus;
+  int nfiles;
+  int json;
+};
+
+/* Per-operation times of one benchmark, in nanoseconds.
+ */
+typedef struct bench_result bench_result;
+struct bench_result {
+  const char* name;
+  size_t ops;
+  double median;
+  double p99;
+  double min;
+  double mean;
+};
+
+// Written by every benchmark so the compiler can't drop the work.
+static volatile guint64 bench_sink;
+
+static guint64 bench_rand(guint64* s){
+  guint64 z = (*s += 0x9e3779b97f4a7c15u);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+  return z ^ (z >> 31);
+}
+
+static idhash_hash bench_rand_hash(guint64* s){
+  return (idhash_hash){bench_rand(s), bench_rand(s), bench_rand(s),
+    bench_rand(s)};
+}
+
+/* Other ways to count the bits of a guint64, to compare bit_array_sum with.
+ */
+static int bit_array_sum_kernighan(guint64 z){
+  int count = 0;
+  for(; z; z &= z - 1) ++count;
+  return count;
+}
+
+static int bit_array_sum_swar(guint64 z){
+  z = z - ((z >> 1) & 0x5555555555555555u);
+  z = (z & 0x3333333333333333u) + ((z >> 2) & 0x3333333333333333u);
+  z = (z + (z >> 4)) & 0x0f0f0f0f0f0f0f0fu;
+  return (z * 0x0101010101010101u) >> 56;
+}
+
+static int bit_array_sum_builtin(guint64 z){
+  return __builtin_popcountll(z);
+}
+
+static void bench_sum_shift(bench_data* d){
+  guint64 sum = 0;
+  for(int i=0; i<BENCH_NWORDS; ++i) sum += bit_array_sum(d->words[i]);
+  bench_sink = sum;
+}
+
+static void bench_sum_kernighan(bench_data* d){
+  guint64 sum = 0;
+  for(int i=0; i<BENCH_NWORDS; ++i)
+    sum += bit_array_sum_kernighan(d->words[i]);
+  bench_sink = sum;
+}
+
+static void bench_sum_swar(bench_data* d){
+  guint64 sum = 0;
+  for(int i=0; i<BENCH_NWORDS; ++i) sum += bit_array_sum_swar(d->words[i]);
+  bench_sink = sum;
+}
+
+static void bench_sum_builtin(bench_data* d){
+  guint64 sum = 0;
+  for(int i=0; i<BENCH_NWORDS; ++i) sum += bit_array_sum_builtin(d->words[i]);
+  bench_sink = sum;
+}
+
+static void bench_histogram_median(bench_data* d){
+  guint64 sum = 0;
+  for(int i=0; i<BENCH_NHISTOGRAMS; ++i){
+    histogram_median(d->histograms + i);
+    sum += d->histograms[i].median;
+  }
+  bench_sink = sum;
+}
+
+static void bench_idhash_pixels(bench_data* d){
+  guint64 sum = 0;
+  idhash_result res;
+  for(int i=0; i<BENCH_NPIXELS; ++i){
+    idhash_pixels(d->pixels[i], 8, 8, &res);
+    sum += res.dx ^ res.iy;
+  }
+  bench_sink = sum;
+}
+
+static void bench_distance_scalar(bench_data* d){
+  guint64 sum = 0;
+  for(int i=0; i<BENCH_NHASHES; ++i)
+    sum += idhash_hash_dist(d->hashes + i,
+      d->hashes + (i + 1) % BENCH_NHASHES);
+  bench_sink = sum;
+}
+
+static void bench_distance_batch(bench_data* d){
+  const idhash_hash* q = d->table;
+  for(int i=0; i<BENCH_NHASHES; ++i)
+    d->dist[i] = idhash_hash_dist(q, d->hashes + i);
+  bench_sink = d->dist[BENCH_NHASHES - 1];
+}
+
+static void bench_metric_batch(bench_data* d, const char* name){
+  metric_find(name)->batch(d->table, d->hashes, BENCH_NHASHES, d->dist);
+  bench_sink = d->dist[BENCH_NHASHES - 1];
+}
+
+static void bench_metric_idhash(bench_data* d){
+  bench_metric_batch(d, "idhash");
+}
+
+static void bench_metric_dhash(bench_data* d){
+  bench_metric_batch(d, "dhash");
+}
+
+static void bench_metric_weighted(bench_data* d){
+  bench_metric_batch(d, "weighted");
+}
+
+static void bench_query_nearest(bench_data* d){
+  guint64 sum = 0;
+  for(int k=0; k<BENCH_NQUERIES; ++k){
+    const idhash_hash* q = d->hashes + k;
+    guint best = G_MAXUINT;
+    size_t arg = 0;
+    for(size_t i=0; i<BENCH_NTABLE; ++i){
+      const guint dist = idhash_hash_dist(q, d->table + i);
+      if(dist < best) best = dist, arg = i;
+    }
+    sum += arg;
+  }
+  bench_sink = sum;
+}
+
+static void bench_query_radius(bench_data* d){
+  guint64 sum = 0;
+  for(int k=0; k<BENCH_NQUERIES; ++k){
+    const idhash_hash* q = d->hashes + k;
+    for(size_t i=0; i<BENCH_NTABLE; ++i)
+      sum += idhash_hash_dist(q, d->table + i) <= BENCH_RADIUS;
+  }
+  bench_sink = sum;
+}
+
+static void bench_query_radius_index(bench_data* d){
+  const hash_index_opts opts = {0, BENCH_RADIUS};
+  guint64 sum = 0;
+  for(int k=0; k<BENCH_NQUERIES; ++k)
+    sum += hash_index_count(d->index, &opts, d->hashes + k, 0);
+  bench_sink = sum;
+}
+
+static void bench_query_nearest_index(bench_data* d){
+  const hash_index_opts opts = {0, 0, 0, 1};
+  hash_index_neighbour nearest[BENCH_K];
+  guint64 sum = 0;
+  for(int k=0; k<BENCH_NQUERIES; ++k){
+    hash_index_nearest(d->index, &opts, d->hashes + k, BENCH_K, nearest, 0);
+    sum += nearest[BENCH_K - 1].dist;
+  }
+  bench_sink = sum;
+}
+
+static void bench_batch_single(bench_data* d){
+  const hash_index_opts opts = {0, BENCH_RADIUS, 0, 1};
+  guint64 sum = 0;
+  for(int k=0; k<BENCH_NBATCH; ++k)
+    sum += hash_index_count(d->index, &opts, d->hashes + k, 0);
+  bench_sink = sum;
+}
+
+static void bench_batch_tiled(bench_data* d){
+  const hash_index_opts opts = {0, BENCH_RADIUS, 0, 1};
+  size_t counts[BENCH_NBATCH];
+  hash_index_match(d->index, d->queries, &opts, 0, counts, 0);
+  guint64 sum = 0;
+  for(int k=0; k<BENCH_NBATCH; ++k) sum += counts[k];
+  bench_sink = sum;
+}
+
+static void bench_query_radius_bitslice(bench_data* d){
+  const bitslice_opts opts = {0, BENCH_RADIUS};
+  guint64 sum = 0;
+  for(int k=0; k<BENCH_NQUERIES; ++k)
+    sum += bitslice_count(d->slices, &opts, d->hashes + k, 0);
+  bench_sink = sum;
+}
+
+static void bench_idhash_file(bench_data* d){
+  guint64 sum = 0;
+  idhash_result res;
+  for(size_t i=0; i<d->nfiles; ++i){
+    if(idhash_file(d->files[i], &res))
+      vips_error_exit(NULL);
+    sum += res.dx;
+  }
+  bench_sink = sum;
+}
+
+static const bench benches[] = {
+  {"bit_array_sum/shift", BENCH_NWORDS, bench_sum_shift},
+  {"bit_array_sum/kernighan", BENCH_NWORDS, bench_sum_kernighan},
+  {"bit_array_sum/swar", BENCH_NWORDS, bench_sum_swar},
+  {"bit_array_sum/builtin", BENCH_NWORDS, bench_sum_builtin},
+  {"histogram_median", BENCH_NHISTOGRAMS, bench_histogram_median},
+  {"idhash_pixels", BENCH_NPIXELS, bench_idhash_pixels},
+  {"idhash_distance/scalar", BENCH_NHASHES, bench_distance_scalar},
+  {"idhash_distance/batch", BENCH_NHASHES, bench_distance_batch},
+  {"metric/idhash", BENCH_NHASHES, bench_metric_idhash},
+  {"metric/dhash", BENCH_NHASHES, bench_metric_dhash},
+  {"metric/weighted", BENCH_NHASHES, bench_metric_weighted},
+  {"index_query/nearest", BENCH_NQUERIES, bench_query_nearest},
+  {"index_query/radius", BENCH_NQUERIES, bench_query_radius},
+  {"index_query/nearest_index", BENCH_NQUERIES, bench_query_nearest_index},
+  {"index_query/radius_index", BENCH_NQUERIES, bench_query_radius_index},
+  {"index_query/radius_bitslice", BENCH_NQUERIES,
+    bench_query_radius_bitslice},
+  {"batch_query/single", BENCH_NBATCH, bench_batch_single},
+  {"batch_query/tiled", BENCH_NBATCH, bench_batch_tiled},
+  {"idhash_file", 0, bench_idhash_file},
+};
+#define NBENCHES (sizeof benches / sizeof benches[0])
+
+static int bench_selected(const bench_opts* opts, const bench* b){
+  return !opts->filter || strstr(b->name, opts->filter);
+}
+
+/* Pin the calling thread to @cpu, or to the first CPU it may run on if @cpu
+ * is negative. Return the CPU, or -1 if it couldn't be pinned.
+ */
+int bench_pin(int cpu){
+  cpu_set_t set;
+  if(cpu < 0){
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof set, &set)) return -1;
+    for(cpu=0; cpu<CPU_SETSIZE && !CPU_ISSET(cpu, &set); ++cpu);
+    if(cpu == CPU_SETSIZE) return -1;
+  }
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if(sched_setaffinity(0, sizeof set, &set)){
+    fprintf(stderr, "bench_pin: cpu %d: %s\n", cpu, strerror(errno));
+    return -1;
+  }
+  return cpu;
+}
+
+/* Write @n noise images of 1024x768 as JPEGs in a new directory under /tmp,
+ * and return their paths in @d. The directory path is copied to @dir.
+ * Return 0 on success, or -1 with the reason in the vips error buffer.
+ */
+int bench_corpus_generate(bench_data* d, int n, char dir[static 32]){
+  strcpy(dir, "/tmp/idhash-bench.XXXXXX");
+  if(!mkdtemp(dir)){
+    vips_error("bench", "mkdtemp: %s", strerror(errno));
+    return -1;
+  }
+  d->files = calloc(n, sizeof *d->files);
+  for(int i=0; i<n; ++i){
+    VipsImage* im;
+    if(vips_gaussnoise(&im, 1024, 768, "mean", 128.0, "sigma", 40.0 + i,
+      NULL))
+      return -1;
+    d->files[i] = g_strdup_printf("%s/%d.jpg", dir, i);
+    const int z = vips_jpegsave(im, d->files[i], "Q", 85, NULL);
+    g_object_unref(im);
+    if(z) return -1;
+    ++d->nfiles;
+  }
+  return 0;
+}
+
+/* Collect the regular files directly in @dir, sorted, into @d. Return 0 on
+ * success, or -1 if @dir can't be read.
+ */
+int bench_corpus_read(bench_data* d, const char* dir){
+  DIR* dp = opendir(dir);
+  if(!dp){
+    fprintf(stderr, "bench: %s: %s\n", dir, strerror(errno));
+    return -1;
+  }
+  size_t cap = 0;
+  struct dirent* e;
+  while((e = readdir(dp))){
+    if(e->d_type != DT_REG && e->d_type != DT_UNKNOWN) continue;
+    if(e->d_name[0] == '.') continue;
+    if(d->nfiles == cap)
+      d->files = realloc(d->files, (cap = cap ? 2*cap : 64) * sizeof *d->files);
+    d->files[d->nfiles++] = g_strdup_printf("%s/%s", dir, e->d_name);
+  }
+  closedir(dp);
+  qsort(d->files, d->nfiles, sizeof *d->files,
+    (int (*)(const void*, const void*)) strcmp);
+  return 0;
+}
+
+void bench_data_init(bench_data* d){
+  guint64 s = 1;
+  for(int i=0; i<BENCH_NWORDS; ++i) d->words[i] = bench_rand(&s);
+
+  d->pixels = malloc(BENCH_NPIXELS * sizeof *d->pixels);
+  for(int i=0; i<BENCH_NPIXELS; ++i)
+    for(int j=0; j<64; ++j){
+      const guint64 r = bench_rand(&s);
+      d->pixels[i][j][0] = d->pixels[i][j][1] = d->pixels[i][j][2] = r;
+    }
+
+  // The x-direction histograms of random pixels, as histogram_thread_x
+  // builds them before it takes the median.
+  d->histograms = calloc(BENCH_NHISTOGRAMS, sizeof *d->histograms);
+  for(int i=0; i<BENCH_NHISTOGRAMS; ++i){
+    PixelRGB* px = d->pixels[i % BENCH_NPIXELS];
+    PixelRGB shifted[64];
+    for(int j=0; j<64; ++j)
+      shifted[j][0] = shifted[j][1] = shifted[j][2] = px[j][0] + i;
+    for(int y=0; y<8; y++){
+      for(int x=0; x<7; x++)
+        histogram_process_pixel_pair(d->histograms + i, shifted, x + 8*y,
+          x + 1 + 8*y);
+      histogram_process_pixel_pair(d->histograms + i, shifted, 8*y, 7 + 8*y);
+    }
+  }
+
+  d->hashes = malloc(BENCH_NHASHES * sizeof *d->hashes);
+  for(int i=0; i<BENCH_NHASHES; ++i) d->hashes[i] = bench_rand_hash(&s);
+  d->table = malloc(BENCH_NTABLE * sizeof *d->table);
+  for(int i=0; i<BENCH_NTABLE; ++i) d->table[i] = bench_rand_hash(&s);
+  d->index = hash_index_create(d->table, BENCH_NTABLE);
+  d->slices = bitslice_create(d->table, BENCH_NTABLE);
+  d->queries = hash_index_create(d->hashes, BENCH_NBATCH);
+  d->dist = malloc(BENCH_NHASHES * sizeof *d->dist);
+}
+
+void bench_data_destroy(bench_data* d){
+  for(size_t i=0; i<d->nfiles; ++i) g_free(d->files[i]);
+  free(d->files);
+  free(d->histograms);
+  free(d->pixels);
+  free(d->hashes);
+  free(d->table);
+  hash_index_destroy(d->index);
+  bitslice_close(d->slices);
+  hash_index_destroy(d->queries);
+  free(d->dist);
+}
+
+static int bench_cmp_double(const void* a, const void* b){
+  const double x = *(const double*) a, y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+/* Run @b with the warmup and iteration counts in @opts, into @res.
+ */
+void bench_run(const bench* b, bench_data* d, const bench_opts* opts,
+  bench_result* res)
+{
+  const size_t ops = b->ops ? b->ops : d->nfiles;
+  double* t = malloc(opts->iterations * sizeof *t);
+  for(int i=0; i<opts->warmup; ++i) b->run(d);
+  for(int i=0; i<opts->iterations; ++i){
+    const uint64_t start = timing_now();
+    b->run(d);
+    t[i] = (double) (timing_now() - start) / ops;
+  }
+  qsort(t, opts->iterations, sizeof *t, bench_cmp_double);
+  double sum = 0;
+  for(int i=0; i<opts->iterations; ++i) sum += t[i];
+  // Nearest rank.
+  const int n = opts->iterations;
+  *res = (bench_result){
+    .name = b->name,
+    .ops = ops,
+    .median = t[(n - 1) / 2],
+    .p99 = t[(99*n + 99) / 100 - 1],
+    .min = t[0],
+    .mean = sum / n,
+  };
+  free(t);
+}
+
+void bench_print_tsv(FILE* fp, const bench_opts* opts, int cpu,
+  const bench_result* res, size_t n)
+{
+  fprintf(fp, "# idhash-bench cpu %d warmup %d iterations %d\n", cpu,
+    opts->warmup, opts->iterations);
+  fprintf(fp, "name\tops\tmedian_ns\tp99_ns\tmin_ns\tmean_ns\n");
+  for(size_t i=0; i<n; ++i)
+    fprintf(fp, "%s\t%zu\t%.3f\t%.3f\t%.3f\t%.3f\n", res[i].name, res[i].ops,
+      res[i].median, res[i].p99, res[i].min, res[i].mean);
+}
+
+void bench_print_json(FILE* fp, const bench_opts* opts, int cpu,
+  const bench_result* res, size_t n)
+{
+  fprintf(fp, "{\"cpu\": %d, \"warmup\": %d, \"iterations\": %d, "
+    "\"benchmarks\": [\n", cpu, opts->warmup, opts->iterations);
+  for(size_t i=0; i<n; ++i)
+    fprintf(fp, "  {\"name\": \"%s\", \"ops\": %zu, \"median_ns\": %.3f, "
+      "\"p99_ns\": %.3f, \"min_ns\": %.3f, \"mean_ns\": %.3f}%s\n",
+      res[i].name, res[i].ops, res[i].median, res[i].p99, res[i].min,
+      res[i].mean, i + 1 < n ? "," : "");
+  fprintf(fp, "]}\n");
+}
+
+/* Read the medians of a TSV report into @res, up to @max of them. The names
+ * point into memory owned by the caller afterwards. Return the number read,
+ * or -1 if @fname can't be opened.
+ */
+long bench_read_tsv(const char* fname, bench_result* res, size_t max){
+  FILE* fp = fopen(fname, "r");
+  if(!fp){
+    fprintf(stderr, "bench: %s: %s\n", fname, strerror(errno));
+    return -1;
+  }
+  char line[512], name[256];
+  size_t n = 0;
+  while(n < max && fgets(line, sizeof line, fp)){
+    if(*line == '#' || !strncmp(line, "name\t", 5)) continue;
+    bench_result r = {0};
+    if(sscanf(line, "%255[^\t]\t%zu\t%lf\t%lf\t%lf\t%lf", name, &r.ops,
+      &r.median, &r.p99, &r.min, &r.mean) != 6)
+      continue;
+    r.name = g_strdup(name);
+    res[n++] = r;
+  }
+  fclose(fp);
+  return n;
+}
+
+/* Print the change in median of each benchmark in both reports. Return the
+ * number that got slower by more than @tolerance, or -1 if a report can't
+ * be read.
+ */
+int bench_compare(const char* old_fname, const char* new_fname,
+  double tolerance)
+{
+  bench_result old[256], new[256];
+  const long nold = bench_read_tsv(old_fname, old, 256);
+  const long nnew = nold < 0 ? -1 : bench_read_tsv(new_fname, new, 256);
+  if(nnew < 0){
+    for(long i=0; i<nold; ++i) g_free((char*) old[i].name);
+    return -1;
+  }
+  int slower = 0;
+  printf("name\told_ns\tnew_ns\tchange\n");
+  for(long i=0; i<nnew; ++i){
+    long j = 0;
+    while(j < nold && strcmp(old[j].name, new[i].name)) ++j;
+    if(j == nold){
+      printf("%s\t-\t%.3f\tnew\n", new[i].name, new[i].median);
+      continue;
+    }
+    const double change = new[i].median / old[j].median - 1;
+    const int regressed = change > tolerance;
+    slower += regressed;
+    printf("%s\t%.3f\t%.3f\t%+.1f%%%s\n", new[i].name, old[j].median,
+      new[i].median, 100*change, regressed ? "\tSLOWER" : "");
+  }
+  for(long i=0; i<nold; ++i) g_free((char*) old[i].name);
+  for(long i=0; i<nnew; ++i) g_free((char*) new[i].name);
+  return slower;
+}
+
+#ifdef CMD_BENCH
+int main(int argc, char* argv[argc]){
+  bench_opts opts = {.cpu=-1, .warmup=5, .iterations=50, .nfiles=32};
+  const char* out = 0;
+  const char* compare[2] = {0};
+  double tolerance = 0.1;
+  int usage = 0;
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--cpu") && i+1 < argc) opts.cpu = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--warmup") && i+1 < argc)
+      opts.warmup = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--iterations") && i+1 < argc)
+      opts.iterations = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--filter") && i+1 < argc)
+      opts.filter = argv[++i];
+    else if(!strcmp(argv[i], "--corpus") && i+1 < argc)
+      opts.corpus = argv[++i];
+    else if(!strcmp(argv[i], "--files") && i+1 < argc)
+      opts.nfiles = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--json")) opts.json = 1;
+    else if(!strcmp(argv[i], "--out") && i+1 < argc) out = argv[++i];
+    else if(!strcmp(argv[i], "--compare") && i+2 < argc)
+      compare[0] = argv[i+1], compare[1] = argv[i+2], i += 2;
+    else if(!strcmp(argv[i], "--tolerance") && i+1 < argc)
+      tolerance = atof(argv[++i]);
+    else usage = 1;
+  }
+  if(usage || opts.iterations < 1 || opts.warmup < 0 || opts.nfiles < 1){
+    fprintf(stderr, "Usage: %s [--cpu <N>] [--warmup <N>] [--iterations <N>] "
+      "[--filter <SUBSTRING>] [--corpus <DIR>] [--files <N>] [--json] "
+      "[--out <FILE>]\n"
+      "       %s --compare <OLD_TSV> <NEW_TSV> [--tolerance <FRACTION>]\n",
+      argv[0], argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if(compare[0]){
+    const int slower = bench_compare(compare[0], compare[1], tolerance);
+    return slower ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  if(VIPS_INIT(argv[0]))
+    vips_error_exit(NULL);
+  // Hashing the same files every iteration would otherwise measure the
+  // operation cache.
+  vips_cache_set_max(0);
+  const int cpu = bench_pin(opts.cpu);
+  if(cpu < 0 && opts.cpu >= 0) exit(EXIT_FAILURE);
+
+  bench_data d = {0};
+  bench_data_init(&d);
+  char dir[32] = {0};
+  int need_corpus = 0;
+  for(size_t i=0; i<NBENCHES; ++i)
+    need_corpus |= !benches[i].ops && bench_selected(&opts, benches + i);
+  if(need_corpus){
+    const int z = opts.corpus ? bench_corpus_read(&d, opts.corpus)
+      : bench_corpus_generate(&d, opts.nfiles, dir);
+    if(z){
+      if(!opts.corpus) vips_error_exit(NULL);
+      exit(EXIT_FAILURE);
+    }
+    if(!d.nfiles){
+      fprintf(stderr, "bench: %s: no files\n", opts.corpus);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  bench_result res[NBENCHES];
+  size_t n = 0;
+  for(size_t i=0; i<NBENCHES; ++i){
+    if(!bench_selected(&opts, benches + i)) continue;
+    fprintf(stderr, "%s\n", benches[i].name);
+    bench_run(benches + i, &d, &opts, res + n++);
+  }
+
+  FILE* fp = out ? fopen(out, "w") : stdout;
+  if(!fp){
+    fprintf(stderr, "bench: %s: %s\n", out, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if(opts.json) bench_print_json(fp, &opts, cpu, res, n);
+  else bench_print_tsv(fp, &opts, cpu, res, n);
+  if(out) fclose(fp);
+
+  if(*dir){
+    for(size_t i=0; i<d.nfiles; ++i) remove(d.files[i]);
+    remove(dir);
+  }
+  bench_data_destroy(&d);
+  vips_shutdown();
+  return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,732 @@
+/* bitslice.c
+ *
+ * A second layout for a table of hashes, bit-sliced, with a threshold scan
+ * that gives up on a block of records as soon as all of them are too far.
+ *
+ * Records go in blocks of 256. A block stores, for each bit position k of
+ * each component, one 256-bit word whose bit r is bit k of record r: 256
+ * words, 8 KB, the same size as 256 rows of idhash_hash. Comparing a query
+ * with a whole block then works one bit position at a time: the query's bit
+ * is a constant, so one XOR gives that position's difference for all 256
+ * records, and one AND or OR applies the importance masks. The words are
+ * GCC vectors, one AVX2 register each where there is AVX2 (the scan is
+ * built twice, as metric.c's kernels are, and picks at run time).
+ *
+ * The distances are kept as 256 counters side by side in bit planes (plane j
+ * holds bit j of every counter). The words of +1s of 8 positions are summed
+ * into 4 planes with a carry-save tree of full adders and the sum added to
+ * the counters. After each 8 positions the planes are compared with the
+ * threshold T, all records at once, and if every record in the block is
+ * over it the block is dropped. The 8 positions are always a run of 8 bits
+ * of one component, 4 cache lines of the block's d and 4 of its i, and
+ * the runs where the query has the most important positions go first: for
+ * idhash those count for every record, so the counters climb fastest
+ * there. Blocks that get through have exact distances in their counters.
+ *
+ * Records keep their table order, so a match's index is the same as in the
+ * hash database it was built from, paths and all.
+ *
+ * The file, in host byte order:
+ *
+ *   char    magic[8]         "IDHASHS1"
+ *   guint64 count            records
+ *   guint64 reserved[6]     so the blocks start on a cache line
+ *   bitslice_block blocks[(count + 255) / 256]
+ *
+ * The last block is padded with zeroed records, which scans leave out.
+ *
+ * Compile test
+ *
+gcc bitslice.c -o test-bitslice -DTEST_BITSLICE -O2 -g -Wall `pkg-config vips --cflags --libs`
+ *
+ * Compile
+ *
+gcc bitslice.c -o idhash-slice -DCMD_BITSLICE -O2 -g -Wall `pkg-config vips --cflags --libs`
+ *
+ * Usage: build a bit-sliced table from a hash database, or print each
+ * record within --radius (default 10) of each hash of <QUERIES> as
+ * <query>\t<index>\t<distance> lines, or with --count how many, as
+ * idhash-query does (see hash_index.c)
+ *
+ * ./idhash-slice --build <DB> <SLICED>
+ * ./idhash-slice [--metric <NAME>] [--radius <R>] [--count] [--no-stop]
+ *   [--stats] <SLICED> <QUERIES>
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef STDINT_H
+#  define STDINT_H
+#  include <stdint.h>
+#endif
+
+#ifndef INTTYPES_H
+#  define INTTYPES_H
+#  include <inttypes.h>
+#endif
+
+#ifndef METRIC_H
+#  define METRIC_H
+#  include "metric.c"
+#endif
+
+#ifndef HASH_DB_H
+#  define HASH_DB_H
+#  include "hash_db.c"
+#endif
+
+#ifndef TIMING_H
+#  define TIMING_H
+#  include "timing.c"
+#endif
+
+#define BITSLICE_MAGIC "IDHASHS1"
+#define BITSLICE_BLOCK 256
+#define SZ_BITSLICE_MAGIC 8
+
+// Counter planes: weighted counts up to 256 before halving.
+#define BITSLICE_PLANES 9
+
+#ifndef BITSLICE_DEFAULT_RADIUS
+#  define BITSLICE_DEFAULT_RADIUS 10
+#endif
+
+typedef struct bitslice_header bitslice_header;
+struct bitslice_header {
+  char magic[SZ_BITSLICE_MAGIC];
+  guint64 count;
+  guint64 reserved[6];
+};
+
+// 256 records' bits, record r at bit r % 64 of element r / 64.
+typedef metric_v4 bitslice_word;
+
+/* BITSLICE_BLOCK records: d[0][k] and d[1][k] hold bit k of dx and dy of
+ * each record, i[0][k] and i[1][k] bit k of ix and iy.
+ */
+typedef struct bitslice_block bitslice_block;
+struct bitslice_block {
+  bitslice_word d[2][64];
+  bitslice_word i[2][64];
+};
+
+typedef struct bitslice bitslice;
+struct bitslice {
+  const bitslice_block* blocks;
+  size_t count;
+  size_t nblocks;
+  void* map;      // the mapped file, or 0 if the blocks were allocated
+  size_t size;
+};
+
+typedef struct bitslice_opts bitslice_opts;
+struct bitslice_opts {
+  const metric* metric;  // or 0 for the default
+  guint radius;
+  int no_stop;           // add up all 128 positions of every block
+};
+
+typedef struct bitslice_stats bitslice_stats;
+struct bitslice_stats {
+  uint64_t blocks;       // compared with a query
+  uint64_t dropped;      // of those, given up on early
+  uint64_t positions;    // bit positions added, out of 128 per block
+};
+
+/* Called with the index of each record within the radius, and its
+ * distance.
+ */
+typedef void (*bitslice_fn)(size_t id, guint dist, void* arg);
+
+static void bitslice_fill(
+  bitslice_block* blocks,
+  const idhash_hash* hashes,
+  size_t count)
+{
+  for(size_t j=0; j<count; ++j){
+    bitslice_block* b = blocks + j / BITSLICE_BLOCK;
+    const int e = j % BITSLICE_BLOCK / 64;
+    const guint64 r = 1ull << (j % 64);
+    const guint64 w[4] = {hashes[j].dx, hashes[j].dy, hashes[j].ix,
+      hashes[j].iy};
+    for(int k=0; k<64; ++k){
+      if(w[0] >> k & 1) b->d[0][k][e] |= r;
+      if(w[1] >> k & 1) b->d[1][k][e] |= r;
+      if(w[2] >> k & 1) b->i[0][k][e] |= r;
+      if(w[3] >> k & 1) b->i[1][k][e] |= r;
+    }
+  }
+}
+
+/* Slice the @count hashes of @hashes into memory. Return 0 if memory runs
+ * out.
+ */
+bitslice* bitslice_create(const idhash_hash* hashes, size_t count){
+  const size_t nblocks = (count + BITSLICE_BLOCK - 1) / BITSLICE_BLOCK;
+  const size_t size = (nblocks + 1) * sizeof(bitslice_block);
+  bitslice_block* blocks = aligned_alloc(64, size);
+  if(!blocks) return 0;
+  memset(blocks, 0, size);
+  bitslice_fill(blocks, hashes, count);
+  bitslice* s = calloc(1, sizeof *s);
+  if(!s){
+    free(blocks);
+    return 0;
+  }
+  s->blocks = blocks;
+  s->count = count;
+  s->nblocks = nblocks;
+  return s;
+}
+
+/* Write the @count hashes of @hashes to @fp, bit-sliced. Return 0 on
+ * success, -1 on a write error or if memory runs out.
+ */
+int bitslice_write(FILE* fp, const idhash_hash* hashes, size_t count){
+  bitslice_header h = {.count = count};
+  memcpy(h.magic, BITSLICE_MAGIC, SZ_BITSLICE_MAGIC);
+  if(1 != fwrite(&h, sizeof h, 1, fp)) return -1;
+  bitslice_block* b = aligned_alloc(32, sizeof *b);
+  if(!b) return -1;
+  for(size_t j=0; j<count; j+=BITSLICE_BLOCK){
+    memset(b, 0, sizeof *b);
+    bitslice_fill(b, hashes + j,
+      count - j < BITSLICE_BLOCK ? count - j : BITSLICE_BLOCK);
+    if(1 != fwrite(b, sizeof *b, 1, fp)){
+      free(b);
+      return -1;
+    }
+  }
+  free(b);
+  return 0;
+}
+
+/* Map the bit-sliced table @fname for reading. Return 0 if it can't be
+ * opened, isn't one or memory runs out.
+ */
+bitslice* bitslice_open(const char* fname){
+  int fd = open(fname, O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st)){
+    fprintf(stderr, "Failed to open bit-sliced table %s: %s\n", fname,
+      strerror(errno));
+    if(fd >= 0) close(fd);
+    return 0;
+  }
+  const size_t size = st.st_size;
+  void* map = size < sizeof(bitslice_header) ? MAP_FAILED
+    : mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  const bitslice_header* h = map;
+  if(map == MAP_FAILED
+    || memcmp(h->magic, BITSLICE_MAGIC, SZ_BITSLICE_MAGIC)
+    || (size - sizeof *h) / sizeof(bitslice_block)
+      < (h->count + BITSLICE_BLOCK - 1) / BITSLICE_BLOCK){
+    fprintf(stderr, "Not a bit-sliced table: %s\n", fname);
+    if(map != MAP_FAILED) munmap(map, size);
+    return 0;
+  }
+  bitslice* s = calloc(1, sizeof *s);
+  if(!s){
+    fprintf(stderr, "Out of memory opening %s\n", fname);
+    munmap(map, size);
+    return 0;
+  }
+  s->blocks = (const bitslice_block*) (h + 1);
+  s->count = h->count;
+  s->nblocks = (h->count + BITSLICE_BLOCK - 1) / BITSLICE_BLOCK;
+  s->map = map;
+  s->size = size;
+  return s;
+}
+
+void bitslice_close(bitslice* s){
+  if(!s) return;
+  if(s->map) munmap(s->map, s->size);
+  else free((void*) s->blocks);
+  free(s);
+}
+
+/* Record @j of @s, put back together.
+ */
+idhash_hash bitslice_get(const bitslice* s, size_t j){
+  const bitslice_block* b = s->blocks + j / BITSLICE_BLOCK;
+  const int e = j % BITSLICE_BLOCK / 64, r = j % 64;
+  guint64 w[4] = {0};
+  for(int k=0; k<64; ++k){
+    w[0] |= (b->d[0][k][e] >> r & 1) << k;
+    w[1] |= (b->d[1][k][e] >> r & 1) << k;
+    w[2] |= (b->i[0][k][e] >> r & 1) << k;
+    w[3] |= (b->i[1][k][e] >> r & 1) << k;
+  }
+  return (idhash_hash){w[0], w[1], w[2], w[3]};
+}
+
+// How a position adds to the counters, by metric.
+enum { BITSLICE_IDHASH, BITSLICE_DHASH, BITSLICE_WEIGHTED };
+
+/* A query, as its 16 runs of 8 bit positions in the order to add them:
+ * each run as component << 3 | bit / 8, so a run is one cache line of the
+ * block's d and one of its i, with the query's bits there as all-0 or
+ * all-1 words.
+ */
+typedef struct bitslice_query bitslice_query;
+struct bitslice_query {
+  int kind;
+  guint limit;           // largest counter within the radius
+  int first_check;       // positions added before a counter can pass limit
+  guint8 run[16];
+  guint64 d[128];
+  guint64 i[128];
+};
+
+static int bitslice_query_init(
+  bitslice_query* bq,
+  const bitslice_opts* opts,
+  const idhash_hash* q)
+{
+  const metric* m = opts->metric ? opts->metric : metric_registry;
+  bq->kind = !strcmp(m->name, "idhash") ? BITSLICE_IDHASH
+    : !strcmp(m->name, "dhash") ? BITSLICE_DHASH
+    : !strcmp(m->name, "weighted") ? BITSLICE_WEIGHTED : -1;
+  if(bq->kind < 0){
+    fprintf(stderr, "No bit-sliced scan for metric %s\n", m->name);
+    return -1;
+  }
+  const guint radius = opts->radius < METRIC_MAX ? opts->radius : METRIC_MAX;
+  // weighted is (both + either + 1) / 2, within the radius while the sum,
+  // which is what's counted, is at most twice it.
+  bq->limit = bq->kind == BITSLICE_WEIGHTED ? 2 * radius : radius;
+  bq->first_check = bq->kind == BITSLICE_WEIGHTED ? bq->limit / 2
+    : bq->limit;
+  const guint64 d[2] = {q->dx, q->dy}, i[2] = {q->ix, q->iy};
+  // Runs with the most important positions first.
+  int n = 0;
+  for(int important=8; important>=0; --important)
+    for(int r=0; r<16; ++r){
+      const int c = r >> 3, shift = (r & 7) * 8;
+      if(__builtin_popcountll(i[c] >> shift & 0xff) != important) continue;
+      bq->run[n / 8] = r;
+      for(int k=shift; k<shift+8; ++k, ++n){
+        bq->d[n] = -(d[c] >> k & 1);
+        bq->i[n] = -(i[c] >> k & 1);
+      }
+    }
+  return 0;
+}
+
+/* Add the 8 words @w, bit by bit, into 4 planes @s: a carry-save tree of
+ * full adders, as in Harley-Seal popcounts.
+ */
+#define BITSLICE_FULL_ADD(h, l, a, b, c) do { \
+    const bitslice_word u_ = (a) ^ (b); \
+    h = ((a) & (b)) | (u_ & (c)); \
+    l = u_ ^ (c); \
+  } while(0)
+
+static inline __attribute__((always_inline)) void bitslice_sum8(
+  const bitslice_word w[8],
+  bitslice_word s[4])
+{
+  bitslice_word o1, o2, o3, t1, t2, t3, t4, t5, f1;
+  BITSLICE_FULL_ADD(t1, o1, w[0], w[1], w[2]);
+  BITSLICE_FULL_ADD(t2, o2, o1, w[3], w[4]);
+  BITSLICE_FULL_ADD(t3, o3, o2, w[5], w[6]);
+  s[0] = o3 ^ w[7];
+  t4 = o3 & w[7];
+  BITSLICE_FULL_ADD(f1, t5, t1, t2, t3);
+  s[1] = t5 ^ t4;
+  t4 &= t5;
+  s[2] = f1 ^ t4;
+  s[3] = f1 & t4;
+}
+
+/* Add the 4-plane numbers @s to the counters @c.
+ */
+static inline __attribute__((always_inline)) void bitslice_add(
+  bitslice_word c[BITSLICE_PLANES],
+  const bitslice_word s[4])
+{
+  bitslice_word carry = {0};
+  for(int j=0; j<4; ++j){
+    const bitslice_word in = carry;
+    BITSLICE_FULL_ADD(carry, c[j], c[j], s[j], in);
+  }
+  for(int j=4; j<BITSLICE_PLANES; ++j){
+    const bitslice_word t = c[j] & carry;
+    c[j] ^= carry;
+    carry = t;
+  }
+}
+
+/* Set @left to the records of @valid whose counters aren't over @limit.
+ * Return whether there are any.
+ */
+static inline __attribute__((always_inline)) int bitslice_within(
+  const bitslice_word c[BITSLICE_PLANES],
+  guint limit,
+  const bitslice_word* valid,
+  bitslice_word* left)
+{
+  bitslice_word over = {0}, equal = ~over;
+  for(int j=BITSLICE_PLANES; j-- > 0; ){
+    if(limit >> j & 1) equal &= c[j];
+    else {
+      over |= equal & c[j];
+      equal &= ~c[j];
+    }
+  }
+  *left = *valid & ~over;
+  return ((*left)[0] | (*left)[1] | (*left)[2] | (*left)[3]) != 0;
+}
+
+/* Add up the positions of @bq for block @b into @out, whose records @valid
+ * are real. Set @within to the records within the limit, all 0 if the
+ * block was dropped, and return the positions added.
+ */
+static inline __attribute__((always_inline)) int bitslice_scan_kind(
+  const bitslice_block* b,
+  const bitslice_query* bq,
+  int kind,
+  int stop,
+  const bitslice_word* valid,
+  bitslice_word* within,
+  bitslice_word out[BITSLICE_PLANES])
+{
+  // Counted here, where they can't alias the block, and copied out.
+  bitslice_word c[BITSLICE_PLANES] = {{0}};
+  for(int n=0; n<128; n+=8){
+    const int comp = bq->run[n / 8] >> 3, k = (bq->run[n / 8] & 7) * 8;
+    bitslice_word u[8], both[8], sum[4];
+    for(int j=0; j<8; ++j){
+      u[j] = b->d[comp][k+j] ^ bq->d[n+j];
+      if(kind != BITSLICE_DHASH){
+        const bitslice_word ri = b->i[comp][k+j];
+        both[j] = u[j] & ri & bq->i[n+j];
+        u[j] &= ri | bq->i[n+j];
+      }
+    }
+    bitslice_sum8(u, sum);
+    bitslice_add(c, sum);
+    if(kind == BITSLICE_WEIGHTED){
+      bitslice_sum8(both, sum);
+      bitslice_add(c, sum);
+    }
+    if(stop && n + 8 > bq->first_check
+      && !bitslice_within(c, bq->limit, valid, within))
+      return n+8;
+  }
+  bitslice_within(c, bq->limit, valid, within);
+  memcpy(out, c, sizeof c);
+  return 128;
+}
+
+#define BITSLICE_SCAN(SUFFIX, TARGET) \
+static TARGET int bitslice_scan##SUFFIX( \
+  const bitslice_block* b, \
+  const bitslice_query* bq, \
+  int stop, \
+  const bitslice_word* valid, \
+  bitslice_word* within, \
+  bitslice_word c[BITSLICE_PLANES]) \
+{ \
+  switch(bq->kind){ \
+    case BITSLICE_IDHASH: \
+      return bitslice_scan_kind(b, bq, BITSLICE_IDHASH, stop, valid, \
+        within, c); \
+    case BITSLICE_DHASH: \
+      return bitslice_scan_kind(b, bq, BITSLICE_DHASH, stop, valid, \
+        within, c); \
+    default: \
+      return bitslice_scan_kind(b, bq, BITSLICE_WEIGHTED, stop, valid, \
+        within, c); \
+  } \
+}
+
+BITSLICE_SCAN(_avx2, __attribute__((target("avx2"))))
+BITSLICE_SCAN(_base, )
+
+/* Compare the query @bq with block @blk of @s, setting @within to the
+ * records within the limit and @c to their counters. Return the positions
+ * added, less than 128 if the block was dropped.
+ */
+static int bitslice_scan_block(
+  const bitslice* s,
+  size_t blk,
+  const bitslice_query* bq,
+  int stop,
+  guint64 within[4],
+  bitslice_word c[BITSLICE_PLANES])
+{
+  const size_t left = s->count - blk * BITSLICE_BLOCK;
+  bitslice_word valid;
+  for(int e=0; e<4; ++e)
+    valid[e] = left >= 64 * (e+1) ? ~(guint64) 0
+      : left <= 64 * e ? 0 : (1ull << (left - 64 * e)) - 1;
+  bitslice_word w;
+  const int npos = __builtin_cpu_supports("avx2")
+    ? bitslice_scan_avx2(s->blocks + blk, bq, stop, &valid, &w, c)
+    : bitslice_scan_base(s->blocks + blk, bq, stop, &valid, &w, c);
+  memcpy(within, &w, sizeof w);
+  return npos;
+}
+
+/* Call @fn for every record of @s within @opts->radius of @q, and return
+ * how many there were, or -1 if the metric has no bit-sliced scan. @stats,
+ * if not 0, is added to.
+ */
+long bitslice_radius(
+  const bitslice* s,
+  const bitslice_opts* opts,
+  const idhash_hash* q,
+  bitslice_fn fn,
+  void* arg,
+  bitslice_stats* stats)
+{
+  bitslice_query bq;
+  if(bitslice_query_init(&bq, opts, q)) return -1;
+  bitslice_stats st = {s->nblocks};
+  bitslice_word c[BITSLICE_PLANES];
+  long found = 0;
+  for(size_t blk=0; blk<s->nblocks; ++blk){
+    guint64 within[4];
+    const int npos = bitslice_scan_block(s, blk, &bq, !opts->no_stop,
+      within, c);
+    st.positions += npos;
+    st.dropped += npos < 128;
+    for(int e=0; e<4; ++e)
+      for(; within[e]; within[e] &= within[e] - 1){
+        const int r = __builtin_ctzll(within[e]);
+        guint v = 0;
+        for(int j=0; j<BITSLICE_PLANES; ++j) v |= (c[j][e] >> r & 1) << j;
+        fn(blk * BITSLICE_BLOCK + e * 64 + r,
+          bq.kind == BITSLICE_WEIGHTED ? (v + 1) >> 1 : v, arg);
+        ++found;
+      }
+  }
+  if(stats){
+    stats->blocks += st.blocks;
+    stats->dropped += st.dropped;
+    stats->positions += st.positions;
+  }
+  return found;
+}
+
+/* How many records of @s are within @opts->radius of @q, or -1 if the
+ * metric has no bit-sliced scan.
+ */
+long bitslice_count(
+  const bitslice* s,
+  const bitslice_opts* opts,
+  const idhash_hash* q,
+  bitslice_stats* stats)
+{
+  bitslice_query bq;
+  if(bitslice_query_init(&bq, opts, q)) return -1;
+  bitslice_stats st = {s->nblocks};
+  bitslice_word c[BITSLICE_PLANES];
+  long found = 0;
+  for(size_t blk=0; blk<s->nblocks; ++blk){
+    guint64 within[4];
+    const int npos = bitslice_scan_block(s, blk, &bq, !opts->no_stop,
+      within, c);
+    for(int e=0; e<4; ++e) found += __builtin_popcountll(within[e]);
+    st.positions += npos;
+    st.dropped += npos < 128;
+  }
+  if(stats){
+    stats->blocks += st.blocks;
+    stats->dropped += st.dropped;
+    stats->positions += st.positions;
+  }
+  return found;
+}
+
+/* Print how many blocks were dropped early and what fraction of the
+ * positions was added.
+ */
+void bitslice_print_stats(FILE* fp, const bitslice_stats* st){
+  const double d = st->blocks ? st->blocks / 100. : 1;
+  fprintf(fp, "%" PRIu64 " blocks: %.2f%% dropped early, %.2f%% of "
+    "positions added\n", st->blocks, st->dropped / d,
+    st->positions / 128. / d);
+}
+
+#ifdef TEST_BITSLICE
+static guint64 test_rand(guint64* s){
+  guint64 z = (*s += 0x9e3779b97f4a7c15u);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+  return z ^ (z >> 31);
+}
+
+#define TEST_N 1000
+
+typedef struct test_hits test_hits;
+struct test_hits {
+  guint dist[TEST_N];
+  long n;
+};
+
+static void test_hit(size_t id, guint dist, void* arg){
+  test_hits* h = (test_hits*) arg;
+  assert(id < TEST_N && h->dist[id] == G_MAXUINT);
+  h->dist[id] = dist;
+  ++h->n;
+}
+
+int main(){
+  // Uniform hashes, some flat ones, and near-duplicates.
+  idhash_hash* h = calloc(TEST_N, sizeof(idhash_hash));
+  guint64 seed = 1;
+  for(int i=0; i<TEST_N; ++i){
+    idhash_hash x = {test_rand(&seed), test_rand(&seed),
+      test_rand(&seed) | test_rand(&seed), test_rand(&seed)};
+    if(i % 5 == 1) x.dx &= test_rand(&seed) & test_rand(&seed);
+    if(i % 3 == 2 && i > 4){
+      x = h[i - 1 - test_rand(&seed) % 4];
+      x.dx ^= test_rand(&seed) & test_rand(&seed) & test_rand(&seed);
+    }
+    h[i] = x;
+  }
+  bitslice* s = bitslice_create(h, TEST_N);
+  assert(s->nblocks == (TEST_N + BITSLICE_BLOCK - 1) / BITSLICE_BLOCK);
+  for(int i=0; i<TEST_N; ++i){
+    const idhash_hash x = bitslice_get(s, i);
+    assert(!memcmp(&x, h + i, sizeof x));
+  }
+
+  // The file holds the same blocks.
+  char fname[] = "/tmp/test-bitslice.XXXXXX";
+  int fd = mkstemp(fname);
+  FILE* fp = fdopen(fd, "w");
+  assert(!bitslice_write(fp, h, TEST_N));
+  fclose(fp);
+  bitslice* f = bitslice_open(fname);
+  assert(f && f->count == TEST_N && f->nblocks == s->nblocks);
+  assert(!memcmp(f->blocks, s->blocks, s->nblocks * sizeof(bitslice_block)));
+  bitslice_close(f);
+  unlink(fname);
+
+  const guint radii[] = {0, 3, 10, 30, 64, 128, 200};
+  test_hits* hits = malloc(sizeof(test_hits));
+  for(size_t k=0; k<METRIC_COUNT; ++k){
+    bitslice_stats st = {0};
+    for(size_t r=0; r < sizeof radii / sizeof *radii; ++r)
+      for(int stop=0; stop<2; ++stop){
+        bitslice_opts opts = {metric_registry + k, radii[r], !stop};
+        for(int q=0; q<TEST_N; q+=29){
+          for(int i=0; i<TEST_N; ++i) hits->dist[i] = G_MAXUINT;
+          hits->n = 0;
+          const long n = bitslice_radius(s, &opts, h + q, test_hit, hits,
+            radii[r] == 10 ? &st : 0);
+          assert(n == hits->n);
+          assert(n == bitslice_count(s, &opts, h + q, 0));
+          for(int i=0; i<TEST_N; ++i){
+            const guint d = metric_registry[k].dist(h + q, h + i);
+            assert(hits->dist[i] == (d <= radii[r] ? d : G_MAXUINT));
+          }
+        }
+      }
+    printf("%s at radius 10: ", metric_registry[k].name);
+    bitslice_print_stats(stdout, &st);
+    assert(st.dropped > 0);
+  }
+  free(hits);
+  bitslice_close(s);
+  free(h);
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#elif defined(CMD_BITSLICE)
+typedef struct slice_print slice_print;
+struct slice_print {
+  size_t q;
+};
+
+static void slice_print_hit(size_t id, guint dist, void* arg){
+  printf("%zu\t%zu\t%u\n", ((slice_print*) arg)->q, id, dist);
+}
+
+int main(int argc, char* argv[argc]){
+  bitslice_opts opts = {0, BITSLICE_DEFAULT_RADIUS};
+  int build = 0, count = 0, stats = 0, usage = 0, nargs = 0;
+  char* args[2] = {0};
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--metric") && i+1 < argc){
+      opts.metric = metric_find(argv[++i]);
+      if(!opts.metric){
+        fprintf(stderr, "Unknown metric %s. Metrics:\n", argv[i]);
+        metric_print_list(stderr);
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if(!strcmp(argv[i], "--radius") && i+1 < argc)
+      opts.radius = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--build")) build = 1;
+    else if(!strcmp(argv[i], "--count")) count = 1;
+    else if(!strcmp(argv[i], "--no-stop")) opts.no_stop = 1;
+    else if(!strcmp(argv[i], "--stats")) stats = 1;
+    else if(nargs < 2) args[nargs++] = argv[i];
+    else usage = 1;
+  }
+  if(usage || nargs != 2){
+    fprintf(stderr, "Usage: %s --build <DB> <SLICED>\n"
+      "       %s [--metric <NAME>] [--radius <R>] [--count] [--no-stop] "
+      "[--stats] <SLICED> <QUERIES>\n", argv[0], argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if(build){
+    hash_db* db = hash_db_open(args[0]);
+    if(!db) exit(EXIT_FAILURE);
+    FILE* fp = fopen(args[1], "w");
+    if(!fp){
+      fprintf(stderr, "Failed to create %s: %s\n", args[1], strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    if(bitslice_write(fp, db->hashes, db->count) | fclose(fp)){
+      fprintf(stderr, "Failed to write %s\n", args[1]);
+      exit(EXIT_FAILURE);
+    }
+    hash_db_close(db);
+    return EXIT_SUCCESS;
+  }
+  bitslice* s = bitslice_open(args[0]);
+  if(!s) exit(EXIT_FAILURE);
+  hash_db* queries = hash_db_open(args[1]);
+  if(!queries) exit(EXIT_FAILURE);
+  const uint64_t t = timing_now();
+  bitslice_stats st = {0};
+  slice_print p = {0};
+  for(; p.q < queries->count; ++p.q){
+    const idhash_hash* q = queries->hashes + p.q;
+    const long n = count ? bitslice_count(s, &opts, q, &st)
+      : bitslice_radius(s, &opts, q, slice_print_hit, &p, &st);
+    if(n < 0) exit(EXIT_FAILURE);
+    if(count) printf("%zu\t%ld\n", p.q, n);
+  }
+  const int failed = fflush(stdout) != 0;
+  if(failed) fprintf(stderr, "Failed to write the results.\n");
+  if(stats){
+    fprintf(stderr, "%.3f s\n", (timing_now() - t) / 1e9);
+    bitslice_print_stats(stderr, &st);
+  }
+  hash_db_close(queries);
+  bitslice_close(s);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
@@ -1,75 +1,309 @@
 /*
-gcc check_directory_for_vips_errors.c -o test-check-directory-for-vips-errors -DTEST_CHECK_DIRECTORY_FOR_VIPS_ERRORS -g -Wall `pkg-config vips --cflags --libs`
+gcc check_directory_for_vips_errors.c -o test-check-directory-for-vips-errors -DTEST_CHECK_DIRECTORY_FOR_VIPS_ERRORS -g -Wall -pthread `pkg-config vips --cflags --libs`
 
-Try to load each regular file in @dir into VIPS. Write errors to an error file.
+Check that each regular file in @dir can be loaded by VIPS, on several threads,
+and write a report line for each file that fails (or for every file, with
+--all) to a report file, error_file.txt by default. One thread walks the
+directory and queues the paths; --jobs threads take them off the queue and
+check them, so a flat directory is checked as much in parallel as a tree.
+
+There are two levels:
+
+  header  find a loader from the file's magic bytes and read the header
+          (format and dimensions). No pixels are decoded. This is the
+          default, and catches files that aren't images, unsupported
+          formats, and broken headers.
+  decode  also decode every pixel, failing on truncated or corrupt image
+          data.
+
+Report lines are tab-separated, in completion order:
+
+  <status> <loader> <width> <height> <path> <message>
+
+where status is one of ok, io, empty, unknown-format, header, decode. A count
+per status is printed on stderr at the end.
+
+The vips error buffer is shared by all threads, so with several jobs a message
+may carry text from another file's failure. The status is always right.
+
+Usage: ./test-check-directory-for-vips-errors [--level header|decode]
+         [--jobs <N>] [--recursive] [--all] [--report <FILE>]
+         [--profile <NAME>] <DIRECTORY>
 */
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <vips/vips.h>
 #include "join_dir_to_name.c"
+#include "vips_profile.c"
+#include "dir_walk.c"
 
-void check_directory_for_vips_errors(char dir[SZ_PATH]){
-  VipsImage* in;
-  // redirect stderr to error file 
-  // loop over files in dir
-  // run a vips command
-  char* error_fname = "error_file.txt";
-  DIR* d; 
-  if(!(d = opendir(dir))){
-    fprintf(stderr, "Failed to open directory %s.", dir);
-    exit(EXIT_FAILURE);
-  }
-  // Define an output error file.
-  FILE* efp=0;
-  if(!(efp = fopen(error_fname, "w"))){
-    fprintf(stderr, "Failed to open error file %s.\n", error_fname);
-    exit(EXIT_FAILURE);
-  } 
-  struct dirent* e={0};
-  struct stat stat={0};
-  char path[2*SZ_PATH]={0};
-  int fd;
-  while((e = readdir(d))){
-    // Form the full path to the directory entry.
-    join_dir_to_name(path, dir, e->d_name);
-    // Stat to check its type. 
-    if(-1 == (fd = open(path, O_RDONLY)) || fstat(fd, &stat)){
-      fprintf(stderr, "Unable to stat %s to check its " 
-        "type.\n", path);
-      exit(EXIT_FAILURE);
-    } 
-    // Ignore entries that are not regular files.
-    if(!S_ISREG(stat.st_mode))
-      continue;
-    // Regular file. Try to open and close with VIPS (writing errors to 
-    // the error file). 
-    if(!(in = vips_image_new_from_file(path, NULL))){
-      fprintf(efp, "%s", vips_error_buffer());
-      vips_error_clear();
-    } else {
+#define SZ_CHECK_MESSAGE 512
+
+// Paths waiting for a checker. The walk blocks when the queue is full, so a
+// huge tree isn't held in memory.
+#ifndef SZ_CHECK_QUEUE
+#  define SZ_CHECK_QUEUE 1024
+#endif
+
+typedef enum check_level {
+  CHECK_LEVEL_HEADER,
+  CHECK_LEVEL_DECODE,
+} check_level;
+
+typedef enum check_status {
+  CHECK_OK,
+  CHECK_IO,              // couldn't stat the file
+  CHECK_EMPTY,           // zero bytes
+  CHECK_UNKNOWN_FORMAT,  // no loader recognizes the magic bytes
+  CHECK_HEADER,          // a loader matched, but the header didn't load
+  CHECK_DECODE,          // the header loaded, but the pixels didn't
+  NCHECK_STATUS
+} check_status;
+
+static const char* check_status_names[NCHECK_STATUS] = {
+  "ok", "io", "empty", "unknown-format", "header", "decode"
+};
+
+typedef struct check_opts check_opts;
+struct check_opts {
+  check_level level;
+  int jobs;       // worker threads, or 0 for one per online CPU
+  int recursive;  // descend into subdirectories
+  int all;        // report files that pass, too
+};
+
+// The report, shared by the checkers.
+typedef struct check_report check_report;
+struct check_report {
+  const check_opts* opts;
+  FILE* fp;
+  pthread_mutex_t lock;
+  long counts[NCHECK_STATUS];
+};
+
+// Paths from the walk to the checkers.
+typedef struct check_queue check_queue;
+struct check_queue {
+  char* paths[SZ_CHECK_QUEUE];
+  size_t head;
+  size_t count;
+  int done;          // the walk is over
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  check_report* report;
+};
+
+static pthread_mutex_t check_error_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Move the vips error buffer into @msg, on one line, and clear it.
+ */
+static void check_take_vips_error(char msg[SZ_CHECK_MESSAGE]){
+  pthread_mutex_lock(&check_error_lock);
+  g_strlcpy(msg, vips_error_buffer(), SZ_CHECK_MESSAGE);
+  vips_error_clear();
+  pthread_mutex_unlock(&check_error_lock);
+  for(char* c = msg; *c; ++c)
+    if(*c == '\n' || *c == '\t') *c = ' ';
+  g_strchomp(msg);
+}
+
+/* Decode every pixel of @in. Return 0 on success, -1 on a decode error.
+ */
+static int check_decode(VipsImage* in){
+  double avg;
+  return vips_avg(in, &avg, NULL);
+}
+
+/* Check the file @path and add it to @report.
+ */
+static void check_file(check_report* report, const char* path){
+  check_status status = CHECK_OK;
+  const char* loader = "-";
+  int width=0, height=0;
+  char msg[SZ_CHECK_MESSAGE] = "";
+  struct stat st;
+  VipsImage* in=0;
+
+  if(stat(path, &st)){
+    status = CHECK_IO;
+    g_strlcpy(msg, strerror(errno), SZ_CHECK_MESSAGE);
+  } else if(!st.st_size){
+    status = CHECK_EMPTY;
+  } else if(!(loader = vips_foreign_find_load(path))){
+    // Loaders are matched on the leading bytes of the file.
+    status = CHECK_UNKNOWN_FORMAT;
+    loader = "-";
+    check_take_vips_error(msg);
+  } else if(!(in = vips_image_new_from_file(path,
+    "access", vips_profile_access(), NULL))){
+    // Loading is lazy: this reads the header only.
+    status = CHECK_HEADER;
+    check_take_vips_error(msg);
+  } else {
+    width = vips_image_get_width(in);
+    height = vips_image_get_height(in);
+    if(report->opts->level == CHECK_LEVEL_DECODE){
+      // Reopen so truncated or corrupt data fails instead of being padded.
       g_object_unref(in);
+      in = vips_image_new_from_file(path,
+        "access", VIPS_ACCESS_SEQUENTIAL,
+#if VIPS_MAJOR_VERSION > 8 || (VIPS_MAJOR_VERSION == 8 && VIPS_MINOR_VERSION >= 12)
+        "fail_on", VIPS_FAIL_ON_ERROR,
+#else
+        "fail", TRUE,
+#endif
+        NULL);
+      if(!in || check_decode(in)){
+        status = CHECK_DECODE;
+        check_take_vips_error(msg);
+      }
+    }
+  }
+  if(in) g_object_unref(in);
+
+  pthread_mutex_lock(&report->lock);
+  ++report->counts[status];
+  if(status != CHECK_OK || report->opts->all)
+    fprintf(report->fp, "%s\t%s\t%d\t%d\t%s\t%s\n", check_status_names[status],
+      loader, width, height, path, msg);
+  pthread_mutex_unlock(&report->lock);
+}
+
+// The walk's callback: queue the path, waiting for room.
+static int check_queue_visit(const dir_walk_entry* e, void* arg){
+  check_queue* q = (check_queue*) arg;
+  char* path = strdup(e->path);
+  pthread_mutex_lock(&q->lock);
+  while(q->count == SZ_CHECK_QUEUE)
+    pthread_cond_wait(&q->not_full, &q->lock);
+  q->paths[(q->head + q->count++) % SZ_CHECK_QUEUE] = path;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+  return 0;
+}
+
+static void* check_worker(void* arg){
+  check_queue* q = (check_queue*) arg;
+  for(;;){
+    pthread_mutex_lock(&q->lock);
+    while(!q->count && !q->done)
+      pthread_cond_wait(&q->not_empty, &q->lock);
+    if(!q->count){
+      pthread_mutex_unlock(&q->lock);
+      break;
     }
+    char* path = q->paths[q->head];
+    q->head = (q->head + 1) % SZ_CHECK_QUEUE;
+    --q->count;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    check_file(q->report, path);
+    free(path);
   }
-  // Clean up.
-  fclose(efp);
-  closedir(d);
+  vips_thread_shutdown();
+  return 0;
+}
+
+/* Check each regular file in @dir at @opts->level on @opts->jobs threads,
+ * writing a report line per file to @fp and a count per status to stderr.
+ * Entries that can't be inspected at all are reported on stderr. Return the
+ * number of files that failed the check plus the number of those entries.
+ */
+long check_directory_for_vips_errors(
+  char dir[SZ_PATH],
+  const check_opts* opts,
+  FILE* fp)
+{
+  check_report report = {opts, fp};
+  pthread_mutex_init(&report.lock, 0);
+  check_queue* q = calloc(1, sizeof *q);
+  q->report = &report;
+  pthread_mutex_init(&q->lock, 0);
+  pthread_cond_init(&q->not_empty, 0);
+  pthread_cond_init(&q->not_full, 0);
+  fprintf(fp, "# status\tloader\twidth\theight\tpath\tmessage\n");
+  const int jobs = opts->jobs > 0 ? opts->jobs : dir_walk_ncpus();
+  pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+  for(int i=0; i<jobs; ++i)
+    pthread_create(threads + i, 0, check_worker, q);
+  // Entries that are not regular files are skipped by the walk, using the
+  // type in the directory entry. Reading directories is cheap next to
+  // loading images, so one thread does it.
+  dir_walk_opts walk_opts = {opts->recursive, 1, 1};
+  long nerrors = dir_walk_run(dir, &walk_opts, check_queue_visit, q);
+  pthread_mutex_lock(&q->lock);
+  q->done = 1;
+  pthread_cond_broadcast(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+  for(int i=0; i<jobs; ++i)
+    pthread_join(threads[i], 0);
+  free(threads);
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->not_empty);
+  pthread_cond_destroy(&q->not_full);
+  free(q);
+  pthread_mutex_destroy(&report.lock);
+  for(int i=0; i<NCHECK_STATUS; ++i){
+    fprintf(stderr, "%s%s: %ld", i ? "  " : "", check_status_names[i],
+      report.counts[i]);
+    if(i) nerrors += report.counts[i];
+  }
+  fprintf(stderr, "\n");
+  return nerrors;
 }
 
 #ifdef TEST_CHECK_DIRECTORY_FOR_VIPS_ERRORS
+static void usage(const char* prog){
+  fprintf(stderr, "Usage: %s [--level header|decode] [--jobs <N>] "
+    "[--recursive] [--all] [--report <FILE>] [--profile <NAME>] "
+    "<DIRECTORY>\n", prog);
+  exit(EXIT_FAILURE);
+}
+
 int main(int argc, char* argv[argc]){
-  if(argc!=2){
-    fprintf(stderr, "Usage: %s <DIRECTORY>\n", argv[0]);
-    exit(EXIT_FAILURE);
+  vips_profile profile={0};
+  vips_profile_parse_args(&profile, DEFAULT_VIPS_PROFILE, &argc, argv);
+  check_opts opts = {CHECK_LEVEL_HEADER, 0, 0, 0};
+  char* dir=0, * report_fname = "error_file.txt";
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--level") && i+1 < argc){
+      ++i;
+      if(!strcmp(argv[i], "header")) opts.level = CHECK_LEVEL_HEADER;
+      else if(!strcmp(argv[i], "decode")) opts.level = CHECK_LEVEL_DECODE;
+      else usage(argv[0]);
+    }
+    else if(!strcmp(argv[i], "--jobs") && i+1 < argc)
+      opts.jobs = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--recursive")) opts.recursive = 1;
+    else if(!strcmp(argv[i], "--all")) opts.all = 1;
+    else if(!strcmp(argv[i], "--report") && i+1 < argc)
+      report_fname = argv[++i];
+    else if(!dir && *argv[i] != '-') dir = argv[i];
+    else usage(argv[0]);
   }
+  if(!dir) usage(argv[0]);
   if(VIPS_INIT(argv[0]))
     vips_error_exit(NULL);
-  check_directory_for_vips_errors(argv[1]);
-  return EXIT_SUCCESS;
+  vips_profile_apply(&profile);
+
+  FILE* fp = !strcmp(report_fname, "-") ? stdout : fopen(report_fname, "w");
+  if(!fp){
+    fprintf(stderr, "Failed to open report file %s.\n", report_fname);
+    exit(EXIT_FAILURE);
+  }
+  long nerrors = check_directory_for_vips_errors(dir, &opts, fp);
+  if(fp != stdout) fclose(fp);
+  vips_profile_print_stats(stderr);
+  return nerrors ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 #endif
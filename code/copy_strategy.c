@@ -0,0 +1,377 @@
+/* copy_strategy.c
+ *
+ * Make a file at one path with the contents of another, as cheaply as the
+ * filesystems allow. Strategies are tried in this order, starting from the
+ * one the caller asks for:
+ *
+ *   reflink          FICLONE: a new inode sharing the source's extents
+ *                    (btrfs, xfs, bcachefs). Metadata only.
+ *   hardlink         a second name for the source inode. Metadata only.
+ *   symlink          a link to the source's absolute path. Metadata only.
+ *   copy_file_range  an in-kernel copy, which NFS and some filesystems
+ *                    offload or reflink on their own.
+ *   copy             read/write through a user-space buffer.
+ *
+ * A strategy that fails because the filesystem (or the pair of filesystems)
+ * doesn't support it is remembered for that pair of devices, so the next
+ * copy between them starts at the first strategy that worked. One that
+ * fails for this file only (a full link count, a protected or immutable
+ * inode) falls through to the next strategy for this copy alone. Other
+ * errors (a missing source, a full disk) fail the copy.
+ *
+ * The link strategies make the source and the copy the same file, which is
+ * what the evaluation sets need (they are only ever read). Ask for
+ * copy_file_range or copy when the copies must be independent.
+ *
+ * The destination is replaced if it exists.
+ *
+ * Compile test
+ *
+gcc copy_strategy.c -o test-copy-strategy -DTEST_COPY_STRATEGY -g -Wall -pthread
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef ERRNO_H
+#  define ERRNO_H
+#  include <errno.h>
+#endif
+
+#ifndef ASSERT_H
+#  define ASSERT_H
+#  include <assert.h>
+#endif
+
+#ifndef LIMITS_H
+#  define LIMITS_H
+#  include <limits.h>
+#endif
+
+#ifndef UNISTD_H
+#  define UNISTD_H
+#  include <unistd.h>
+#endif
+
+#ifndef FCNTL_H
+#  define FCNTL_H
+#  include <fcntl.h>
+#endif
+
+#ifndef STAT_H
+#  define STAT_H
+#  include <sys/stat.h>
+#endif
+
+#ifndef IOCTL_H
+#  define IOCTL_H
+#  include <sys/ioctl.h>
+#endif
+
+#ifndef SYSCALL_H
+#  define SYSCALL_H
+#  include <sys/syscall.h>
+#endif
+
+#ifndef PTHREAD_H
+#  define PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#ifdef __linux__
+#  ifndef LINUX_FS_H
+#    define LINUX_FS_H
+#    include <linux/fs.h>
+#  endif
+#endif
+
+#ifndef SZ_COPY_BUF
+#  define SZ_COPY_BUF (1<<16)
+#endif
+
+// Pairs of devices whose working strategy is remembered.
+#ifndef COPY_STRATEGY_CACHE
+#  define COPY_STRATEGY_CACHE 16
+#endif
+
+typedef enum copy_strategy {
+  COPY_REFLINK,
+  COPY_HARDLINK,
+  COPY_SYMLINK,
+  COPY_RANGE,
+  COPY_USER,
+  NCOPY_STRATEGY
+} copy_strategy;
+
+static const char* copy_strategy_names[NCOPY_STRATEGY] = {
+  "reflink", "hardlink", "symlink", "copy_file_range", "copy"
+};
+
+/* Name of @strategy.
+ */
+const char* copy_strategy_name(copy_strategy strategy){
+  return copy_strategy_names[strategy];
+}
+
+/* Parse a strategy name, or "auto" for the first strategy. Return -1 if
+ * @name isn't one.
+ */
+int copy_strategy_parse(const char* name){
+  if(!strcmp(name, "auto")) return COPY_REFLINK;
+  for(int i=0; i<NCOPY_STRATEGY; ++i)
+    if(!strcmp(name, copy_strategy_names[i])) return i;
+  return -1;
+}
+
+// The first strategy known to work from one device to another.
+typedef struct copy_strategy_entry copy_strategy_entry;
+struct copy_strategy_entry {
+  dev_t src;
+  dev_t dst;
+  copy_strategy first;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  copy_strategy_entry entries[COPY_STRATEGY_CACHE];
+  int n;
+} copy_strategy_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static copy_strategy copy_strategy_cached(dev_t src, dev_t dst){
+  copy_strategy first = COPY_REFLINK;
+  pthread_mutex_lock(&copy_strategy_cache.lock);
+  for(int i=0; i<copy_strategy_cache.n; ++i){
+    copy_strategy_entry* e = copy_strategy_cache.entries + i;
+    if(e->src == src && e->dst == dst) first = e->first;
+  }
+  pthread_mutex_unlock(&copy_strategy_cache.lock);
+  return first;
+}
+
+static void copy_strategy_remember(dev_t src, dev_t dst, copy_strategy first){
+  pthread_mutex_lock(&copy_strategy_cache.lock);
+  int i=0;
+  while(i<copy_strategy_cache.n && (copy_strategy_cache.entries[i].src != src
+    || copy_strategy_cache.entries[i].dst != dst))
+    ++i;
+  if(i == copy_strategy_cache.n && i < COPY_STRATEGY_CACHE)
+    ++copy_strategy_cache.n;
+  if(i < COPY_STRATEGY_CACHE)
+    copy_strategy_cache.entries[i] = (copy_strategy_entry){src, dst, first};
+  pthread_mutex_unlock(&copy_strategy_cache.lock);
+}
+
+/* Forget the strategies remembered so far.
+ */
+void copy_strategy_reset(){
+  pthread_mutex_lock(&copy_strategy_cache.lock);
+  copy_strategy_cache.n = 0;
+  pthread_mutex_unlock(&copy_strategy_cache.lock);
+}
+
+// Return 1 if @err from @strategy means it can't work between these
+// filesystems, as opposed to this one copy failing.
+static int copy_strategy_unsupported(copy_strategy strategy, int err){
+  return err == EXDEV || err == EOPNOTSUPP || err == ENOTTY || err == ENOSYS
+    || (err == EINVAL && strategy == COPY_REFLINK);
+}
+
+// Return 1 if @err means a strategy can't work for this file, though it may
+// for others: too many links, a protected, immutable or append-only inode,
+// or a file copy_file_range won't take.
+static int copy_strategy_not_this_file(int err){
+  return err == EMLINK || err == EPERM || err == EBADF || err == EINVAL;
+}
+
+// Called through syscall, so neither _GNU_SOURCE nor glibc 2.27 is needed.
+static int copy_fd_range(int in, int out, off_t size){
+  while(size > 0){
+    ssize_t n = syscall(__NR_copy_file_range, in, 0, out, 0, (size_t) size, 0);
+    if(0 > n && errno == EINTR) continue;
+    if(0 > n) return -1;
+    if(!n) break;
+    size -= n;
+  }
+  return 0;
+}
+
+static int copy_fd_user(int in, int out){
+  char* buf = malloc(SZ_COPY_BUF);
+  ssize_t n;
+  int z=0;
+  while(!z && (n = read(in, buf, SZ_COPY_BUF))){
+    if(0 > n){
+      if(errno != EINTR) z = -1;
+      continue;
+    }
+    for(ssize_t off=0, w; !z && off < n; off += w)
+      if(0 > (w = write(out, buf + off, n - off)))
+        z = errno == EINTR ? (w = 0) : -1;
+  }
+  int err = errno;
+  free(buf);
+  errno = err;
+  return z;
+}
+
+// Try one strategy. Return 0 on success, else -1 with errno set.
+static int copy_strategy_try(
+  copy_strategy strategy,
+  const char* src,
+  const char* dst,
+  int in,
+  const struct stat* st)
+{
+  if(strategy == COPY_HARDLINK || strategy == COPY_SYMLINK){
+    if(unlink(dst) && errno != ENOENT) return -1;
+    if(strategy == COPY_HARDLINK) return link(src, dst);
+    char abs[PATH_MAX];
+    if(!realpath(src, abs)) return -1;
+    return symlink(abs, dst);
+  }
+  // Replace rather than truncate, so a link left by an earlier run doesn't
+  // send the data back into its source.
+  if(unlink(dst) && errno != ENOENT) return -1;
+  int out = open(dst, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  if(0 > out) return -1;
+  int z;
+  if(strategy == COPY_REFLINK){
+#ifdef FICLONE
+    z = ioctl(out, FICLONE, in);
+#else
+    errno = EOPNOTSUPP;
+    z = -1;
+#endif
+  } else {
+    z = lseek(in, 0, SEEK_SET) ? -1
+      : strategy == COPY_RANGE ? copy_fd_range(in, out, st->st_size)
+      : copy_fd_user(in, out);
+  }
+  int err = errno;
+  if(close(out) && !z) z = -1, err = errno;
+  // Leave no empty or partial copy behind.
+  if(z){
+    unlink(dst);
+    errno = err;
+  }
+  return z;
+}
+
+/* Make @dst a copy of @src, trying strategies from @first on (see above).
+ * Return the strategy that worked, or -1 with errno set.
+ */
+int copy_with_strategy(const char* src, const char* dst, copy_strategy first){
+  struct stat st, dst_st;
+  int in = open(src, O_RDONLY|O_CLOEXEC);
+  if(0 > in) return -1;
+  if(fstat(in, &st)) return close(in), -1;
+
+  // The destination's device is its directory's.
+  char dir[PATH_MAX];
+  const char* slash = strrchr(dst, '/');
+  snprintf(dir, sizeof dir, "%.*s", slash ? (int)(slash - dst) + 1 : 1,
+    slash ? dst : ".");
+  if(stat(dir, &dst_st)) return close(in), -1;
+
+  copy_strategy cached = copy_strategy_cached(st.st_dev, dst_st.st_dev);
+  copy_strategy strategy = first > cached ? first : cached;
+  int z=-1;
+  for(; strategy<NCOPY_STRATEGY; ++strategy){
+    if(!(z = copy_strategy_try(strategy, src, dst, in, &st))) break;
+    if(copy_strategy_unsupported(strategy, errno)){
+      if(strategy + 1 < NCOPY_STRATEGY)
+        copy_strategy_remember(st.st_dev, dst_st.st_dev, strategy + 1);
+    } else if(!copy_strategy_not_this_file(errno)) break;
+  }
+  int err = errno;
+  close(in);
+  errno = err;
+  return z ? -1 : (int) strategy;
+}
+
+#ifdef TEST_COPY_STRATEGY
+static void check_contents(const char* path, const char* expect){
+  char buf[64]={0};
+  FILE* fp = fopen(path, "r");
+  assert(fp);
+  assert(fread(buf, 1, sizeof buf - 1, fp) == strlen(expect));
+  fclose(fp);
+  assert(!strcmp(buf, expect));
+}
+
+int main(){
+  char dir[] = "/tmp/test_copy_strategy_XXXXXX";
+  assert(mkdtemp(dir));
+  char src[PATH_MAX], dst[PATH_MAX];
+  snprintf(src, sizeof src, "%s/src.txt", dir);
+  snprintf(dst, sizeof dst, "%s/dst.txt", dir);
+  FILE* fp = fopen(src, "w");
+  assert(fp);
+  fputs("Hello, world!", fp);
+  fclose(fp);
+
+  assert(0 > copy_strategy_parse("teleport"));
+  assert(COPY_REFLINK == copy_strategy_parse("auto"));
+
+  // Every strategy, forced, copies the contents. Each run starts over, so
+  // the cache from an earlier strategy doesn't skip ahead of the one asked
+  // for (symlink always works, so that is as far as the fallback goes).
+  for(int i=0; i<NCOPY_STRATEGY; ++i){
+    copy_strategy_reset();
+    int used = copy_with_strategy(src, dst, i);
+    assert(used >= i);
+    printf("%s -> %s\n", copy_strategy_name(i), copy_strategy_name(used));
+    check_contents(dst, "Hello, world!");
+    struct stat a, b, l;
+    assert(!stat(src, &a) && !stat(dst, &b) && !lstat(dst, &l));
+    assert((a.st_ino == b.st_ino) == (used == COPY_HARDLINK
+      || used == COPY_SYMLINK));
+    assert(S_ISLNK(l.st_mode) == (used == COPY_SYMLINK));
+  }
+
+  // A copy over an existing hardlink doesn't write through to the source.
+  copy_strategy_reset();
+  assert(COPY_HARDLINK == copy_with_strategy(src, dst, COPY_HARDLINK));
+  char other[PATH_MAX];
+  snprintf(other, sizeof other, "%s/other.txt", dir);
+  fp = fopen(other, "w");
+  fputs("Hello, place!", fp);
+  fclose(fp);
+  assert(COPY_USER == copy_with_strategy(other, dst, COPY_USER));
+  check_contents(dst, "Hello, place!");
+  check_contents(src, "Hello, world!");
+
+  // A link that fails for one file only (a directory can't be linked, as
+  // a protected inode can't) falls through for that file, and the next
+  // file is still linked.
+  copy_strategy_reset();
+  assert(COPY_SYMLINK == copy_with_strategy(dir, dst, COPY_HARDLINK));
+  assert(!unlink(dst));
+  assert(COPY_HARDLINK == copy_with_strategy(src, dst, COPY_HARDLINK));
+  struct stat a, b;
+  assert(!stat(src, &a) && !lstat(dst, &b) && a.st_ino == b.st_ino);
+
+  // Missing sources fail instead of falling through.
+  char missing[PATH_MAX];
+  snprintf(missing, sizeof missing, "%s/missing", dir);
+  assert(-1 == copy_with_strategy(missing, dst, COPY_REFLINK));
+  assert(errno == ENOENT);
+
+  assert(!remove(src) && !remove(dst) && !remove(other) && !remove(dir));
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#endif
@@ -1,7 +1,11 @@
 /******************************************************************************* 
-gcc -g -Wall count_jpegs.c -o test-count-jpegs -DTEST_COUNT_JPEGS
+gcc -g -Wall count_jpegs.c -o test-count-jpegs -DTEST_COUNT_JPEGS -pthread
+gcc -g -Wall count_jpegs.c -o count-images -DCMD_COUNT_IMAGES -pthread
 
-Count the jpegs in a directory.
+Count the jpegs in a directory, or the files of each image type, identified
+by content.
+
+Usage: ./count-images [--jobs <N>] <DIR>
 *******************************************************************************/
 
 #ifndef STDLIB_H
@@ -49,63 +53,67 @@ Count the jpegs in a directory.
 #  include "path.c"
 #endif
 
-// return 1 if @substr matches the end of @str (and is no bigger than @str),
-// else return 0.
-int ends_with(char* s, char* ss){
-  size_t ns = strlen(s), nss = strlen(ss);
-  return nss > ns ? 0 : !strncmp(s + ns - nss, ss, nss);
-}
+#ifndef DIR_WALK_H
+#  define DIR_WALK_H
+#  include "dir_walk.c"
+#endif
 
-// 0-terminated list of accepted jpeg extensions
-static char* jpeg_exts[] = {"jpg", "JPG", "jpeg", "JPEG", 0};
+#ifndef STDATOMIC_H
+#  define STDATOMIC_H
+#  include <stdatomic.h>
+#endif
 
-// return a newly allocated string just big enough for "${s1}${s2}".
-// the returned string must be freed.
-char* concat(char* s1, char* s2){
-  size_t n = strlen(s1) + strlen(s2) + 1/*nullbyte*/;
-  char* s = calloc(n, 1);
-  snprintf(s, n, "%s%s", s1, s2);
-  return s;
-}
+#ifndef SNIFF_H
+#  define SNIFF_H
+#  include "sniff.c"
+#endif
 
-// return 1 if @path has an extension from @jpeg_extensions
-int is_jpeg(char* path){
-  for(char** pext=jpeg_exts; *pext; ++pext){
-    char* dot_ext = concat(".", *pext);
-    if(ends_with(path, dot_ext)) return 1;
-    free(dot_ext);
+// per-type counts, bumped from the walk's worker threads. index 0 counts
+// files that couldn't be read, index 1 + t counts files of sniff_type t.
+typedef struct count_images_arg count_images_arg;
+struct count_images_arg {
+  atomic_ulong counts[1 + NSNIFF_TYPE];
+};
+
+static int count_images_visit(const dir_walk_entry* e, void* arg){
+  count_images_arg* a = (count_images_arg*) arg;
+  int type = sniff_at(e->dirfd, e->name);
+  atomic_fetch_add_explicit(&a->counts[1 + type], 1, memory_order_relaxed);
+  if(0 > type){
+    fprintf(stderr, "Failed to read %s.\n", e->path);
+    return 1;
   }
   return 0;
 }
 
-// count file names with extension from @jpeg_exts
-void count_jpegs(unsigned* count, char* dname){
-  // iterate through each regular file in directory, counting the paths with 
-  // a jpeg extension from @jpeg_exts
-  DIR* pdir = opendir(dname);
-  int fd=-1;
-  struct dirent* pdirent=0;
-  struct stat st={0};
-  while((pdirent = readdir(pdir))){
-    path* ppath = path_new(dname, pdirent->d_name, "");
-    char* fullpath = path_full(ppath);
-
-    // open and stat file
-    if(-1 == (fd = open(fullpath, O_RDONLY)) || fstat(fd, &st)){
-      fprintf(stderr, "Failed to open/stat file %s.\n", fullpath);
-      exit(EXIT_FAILURE);
-    }
-
-    // is it a regular file? does it have a jpeg extension?
-    if(S_ISREG(st.st_mode) && is_jpeg(fullpath))
-      ++(*count);
+// count the regular files in @dname by their true type, read from the first
+// bytes of each file (see sniff.c), on @jobs threads (0 for one per cpu).
+// the walk isn't recursive, so the threads share out the files of @dname
+// themselves, in dir_walk's batches, rather than its subdirectories.
+// @counts[t] is set to the number of files of sniff_type t. files that can't
+// be read, and entries that can't be inspected, are reported and skipped.
+// return the number of those.
+long count_images(unsigned long counts[NSNIFF_TYPE], char* dname, int jobs){
+  count_images_arg a;
+  for(int i=0; i<1+NSNIFF_TYPE; ++i)
+    atomic_init(&a.counts[i], 0);
+  // symlinks to regular files count, as they did when every entry was
+  // opened and fstat'ed.
+  dir_walk_opts opts = {0, jobs, 1};
+  long nerrors = dir_walk_run(dname, &opts, count_images_visit, &a);
+  for(int i=0; i<NSNIFF_TYPE; ++i)
+    counts[i] = atomic_load(&a.counts[1 + i]);
+  return nerrors;
+}
 
-    //clean up
-    free(fullpath);
-    path_free(ppath);
-    close(fd);
-  }
-  closedir(pdir);
+// count the jpegs in @dname, by content rather than by extension, so a
+// mislabeled file is neither skipped nor passed on to fail in decode.
+// return the number of entries that couldn't be inspected.
+long count_jpegs(unsigned* count, char* dname){
+  unsigned long counts[NSNIFF_TYPE]={0};
+  long nerrors = count_images(counts, dname, 0);
+  *count = counts[SNIFF_JPEG];
+  return nerrors;
 }
 
 #ifdef TEST_COUNT_JPEGS
@@ -124,31 +132,63 @@ int main(){
   //assert count is zero
   assert(!count);
 
-  //loop over extensions. make a tempfile for each (4 total).
-  for(char** pext = jpeg_exts; *pext; ++pext){
+  //make a tempfile for each extension, with the first bytes of a jpeg, plus
+  //a png named like a jpeg and a jpeg named like a png. the extension
+  //doesn't matter, only the content does.
+  static const struct { char* ext; char* bytes; } files[] = {
+    {"jpg", "\xff\xd8\xff\xe0"}, {"JPG", "\xff\xd8\xff\xe0"},
+    {"jpeg", "\xff\xd8\xff\xdb"}, {"JPEG", "\xff\xd8\xff\xe1"},
+    {"png", "\xff\xd8\xff\xe0"}, {"jpg", "\x89PNG\r\n\x1a\n"},
+    {"txt", "hello"}, {0, 0}
+  };
+  for(int i=0; files[i].ext; ++i){
     //make tempfile path object
-    path* ppath = path_new(dname, "test_file_XXXXXX", *pext);
+    path* ppath = path_new(dname, "test_file_XXXXXX", files[i].ext);
     //create full path string
     char* pfull = path_full(ppath);
     //make tempfile
-    if(0>mkstemps(pfull, path_has_ext(ppath) ? 
-      1/*dot*/ + strlen(ppath->ext) : 0))
-    {
+    int fd = mkstemps(pfull, path_has_ext(ppath) ?
+      1/*dot*/ + strlen(ppath->ext) : 0);
+    if(0>fd || 0>write(fd, files[i].bytes, strlen(files[i].bytes))){
       fprintf(stderr, "Unable to make tempfile %s.\n", pfull);
       free(pfull);
       path_free(ppath);
       exit(EXIT_FAILURE);
-    } 
+    }
+    close(fd);
     free(pfull);
     path_free(ppath);
   }
 
   //count jpegs in tmp dir
   count=0;
-  count_jpegs(&count, dname);
-
-  //assert count is 4
-  assert(count == 4);
+  assert(!count_jpegs(&count, dname));
+  assert(count == 5);
+
+  //count each type, on several threads
+  unsigned long counts[NSNIFF_TYPE]={0};
+  assert(!count_images(counts, dname, 3));
+  assert(counts[SNIFF_JPEG] == 5);
+  assert(counts[SNIFF_PNG] == 1);
+  assert(counts[SNIFF_UNKNOWN] == 1);
+
+  //a flat directory of many files, sniffed on several threads, counts
+  //the same as on one
+  char fname[sizeof dname + 16];
+  for(int i=0; i<300; ++i){
+    snprintf(fname, sizeof fname, "%s/many_%d", dname, i);
+    FILE* fp = fopen(fname, "wb");
+    assert(fp);
+    fputs(files[i % 7].bytes, fp);
+    fclose(fp);
+  }
+  for(int jobs=1; jobs<=8; jobs*=8){
+    memset(counts, 0, sizeof counts);
+    assert(!count_images(counts, dname, jobs));
+    assert(counts[SNIFF_JPEG] == 5 + 300/7*5 + 5);
+    assert(counts[SNIFF_PNG] == 1 + 300/7 + 1);
+    assert(counts[SNIFF_UNKNOWN] == 1 + 300/7);
+  }
 
   //remove all regular files in dname
   int fd=0;
@@ -182,4 +222,23 @@ int main(){
   puts("OK");
   return EXIT_SUCCESS;
 }
+#elif defined(CMD_COUNT_IMAGES)
+int main(int argc, char* argv[argc]){
+  int jobs=0;
+  char* dname=0;
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--jobs") && i+1 < argc) jobs = atoi(argv[++i]);
+    else if(!dname) dname = argv[i];
+    else dname = 0, i = argc;
+  }
+  if(!dname){
+    fprintf(stderr, "Usage: %s [--jobs <N>] <DIR>\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  unsigned long counts[NSNIFF_TYPE]={0};
+  long nerrors = count_images(counts, dname, jobs);
+  for(int i=0; i<NSNIFF_TYPE; ++i)
+    printf("%s %lu\n", sniff_type_name(i), counts[i]);
+  return nerrors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 #endif
@@ -0,0 +1,809 @@
+/* dedupe.c
+ *
+ * Apply one action to every duplicate in the groups written by
+ * idhash-groups (groups.c), without asking about each file the way
+ * prompt_remove does:
+ *
+ *   delete      unlink the duplicate
+ *   hardlink    replace the duplicate with a hard link to the kept image
+ *   reflink     replace the duplicate with a reflink (FICLONE) copy of the
+ *               kept image, a separate file sharing its extents
+ *   quarantine  move the duplicate into the --save directory
+ *
+ * A link replaces the duplicate atomically: it is made under a temporary
+ * name in the duplicate's directory and renamed over it. Every operation
+ * is an *at call relative to a directory file descriptor, and each thread
+ * keeps the last directories it used open, so files sorted by path cost
+ * one open per directory. Groups are spread over --jobs threads.
+ *
+ * Nothing is done to a duplicate whose kept image is missing, or which is
+ * already the same inode as it (a second run finds everything linked).
+ *
+ * --dry-run checks every file the same way and prints the summary without
+ * changing anything.
+ *
+ * With --save <DIR>, originals are moved into DIR (named
+ * <group>.<index>.<basename>) instead of being unlinked or overwritten, so
+ * the action can be undone; deleting DIR commits it. DIR must be on the
+ * same filesystem for a quick rename, and files are copied otherwise.
+ * A name already taken in DIR, by an earlier run say, fails the item
+ * rather than being replaced.
+ * --journal <FILE> appends one line per action done,
+ *
+ *   <action>\t<path>\t<kept path>\t<saved path or ->
+ *
+ * and `--undo <FILE>` moves the saved originals back, last first.
+ *
+ * Compile test
+ *
+gcc dedupe.c -o test-dedupe -DTEST_DEDUPE -g -Wall -pthread
+ *
+ * Compile
+ *
+gcc dedupe.c -o idhash-dedupe -DCMD_DEDUPE -g -Wall -pthread
+ *
+ * Usage
+ *
+ * ./idhash-dedupe [--dry-run] [--jobs <N>] [--journal <FILE>] [--save <DIR>]
+ *   delete|hardlink|reflink|quarantine <GROUPS>
+ * ./idhash-dedupe --undo <JOURNAL>
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef ERRNO_H
+#  define ERRNO_H
+#  include <errno.h>
+#endif
+
+#ifndef STDINT_H
+#  define STDINT_H
+#  include <stdint.h>
+#endif
+
+#ifndef INTTYPES_H
+#  define INTTYPES_H
+#  include <inttypes.h>
+#endif
+
+#ifndef STDATOMIC_H
+#  define STDATOMIC_H
+#  include <stdatomic.h>
+#endif
+
+#ifndef COPY_STRATEGY_H
+#  define COPY_STRATEGY_H
+#  include "copy_strategy.c"
+#endif
+
+#ifndef DIR_WALK_H
+#  define DIR_WALK_H
+#  include "dir_walk.c"
+#endif
+
+typedef enum dedupe_action {
+  DEDUPE_DELETE,
+  DEDUPE_HARDLINK,
+  DEDUPE_REFLINK,
+  DEDUPE_QUARANTINE,
+  NDEDUPE_ACTION
+} dedupe_action;
+
+const char* const dedupe_action_names[NDEDUPE_ACTION] = {
+  "delete", "hardlink", "reflink", "quarantine"
+};
+
+/* Parse an action name. Return -1 if @name isn't one.
+ */
+int dedupe_action_parse(const char* name){
+  for(int i=0; i<NDEDUPE_ACTION; ++i)
+    if(!strcmp(name, dedupe_action_names[i])) return i;
+  return -1;
+}
+
+typedef struct dedupe_opts dedupe_opts;
+struct dedupe_opts {
+  dedupe_action action;
+  int dry_run;
+  int jobs;              // threads, or 0 for one per online CPU
+  const char* save;      // directory for originals, or 0
+  FILE* journal;         // or 0
+};
+
+/* A duplicate and the image kept in its group.
+ */
+typedef struct dedupe_item dedupe_item;
+struct dedupe_item {
+  long group;
+  unsigned long index;
+  char* path;
+  const char* keep;
+  size_t keep_at;     // index of keep while reading
+};
+
+typedef struct dedupe_summary dedupe_summary;
+struct dedupe_summary {
+  long groups;
+  long duplicates;
+  long done;          // acted on, or would be in a dry run
+  long linked;        // already the kept inode
+  long failed;
+  uint64_t bytes;     // size of the duplicates done
+};
+
+/* Read the groups written by idhash-groups from @fp: the kept paths go in
+ * @keep, and a dedupe_item per dup line in @items, pointing into @keep.
+ * Return 0 on success, -1 on a malformed line.
+ */
+int dedupe_read_groups(
+  FILE* fp,
+  char*** keep,
+  size_t* nkeep,
+  dedupe_item** items,
+  size_t* nitems)
+{
+  char* line = 0;
+  size_t sz = 0, cap_keep = 0, cap_items = 0;
+  long lineno = 0, group = -1;
+  int z = 0;
+  ssize_t n;
+  *keep = 0, *nkeep = 0, *items = 0, *nitems = 0;
+  while(!z && 0 < (n = getline(&line, &sz, fp))){
+    ++lineno;
+    if(*line == '#' || *line == '\n') continue;
+    if(line[n-1] == '\n') line[--n] = 0;
+    long g;
+    unsigned long index;
+    char kind[5];
+    int off = 0;
+    if(3 != sscanf(line, "%ld\t%4[^\t]\t%lu\t%n", &g, kind, &index, &off)
+      || !off || !line[off] || !strcmp(line + off, "-")
+      || (strcmp(kind, "keep") && strcmp(kind, "dup"))
+      || (!strcmp(kind, "dup") && g != group)){
+      fprintf(stderr, "Malformed group on line %ld.\n", lineno);
+      z = -1;
+      continue;
+    }
+    if(!strcmp(kind, "keep")){
+      if(*nkeep == cap_keep)
+        *keep = realloc(*keep, (cap_keep = cap_keep ? 2*cap_keep : 64)
+          * sizeof **keep);
+      (*keep)[(*nkeep)++] = strdup(line + off);
+      group = g;
+      continue;
+    }
+    if(*nitems == cap_items)
+      *items = realloc(*items, (cap_items = cap_items ? 2*cap_items : 64)
+        * sizeof **items);
+    (*items)[(*nitems)++] = (dedupe_item){g, index, strdup(line + off), 0,
+      *nkeep - 1};
+  }
+  free(line);
+  // Point the items at their kept paths once the array stops moving.
+  for(size_t i=0; i<*nitems; ++i)
+    (*items)[i].keep = (*keep)[(*items)[i].keep_at];
+  return z;
+}
+
+/* An open directory, reused while the next path is in the same one.
+ */
+typedef struct dedupe_dir dedupe_dir;
+struct dedupe_dir {
+  char path[PATH_MAX];
+  int fd;
+};
+
+/* Open the directory of @path, or reuse @d's. Point @name at the last
+ * component. Return the directory fd, or -1 with errno set.
+ */
+static int dedupe_dir_open(dedupe_dir* d, const char* path, const char** name){
+  const char* slash = strrchr(path, '/');
+  *name = slash ? slash + 1 : path;
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof dir, "%.*s", slash ? (int) (slash - path) + 1 : 1,
+    slash ? path : ".");
+  if(d->fd >= 0 && !strcmp(dir, d->path)) return d->fd;
+  if(d->fd >= 0) close(d->fd);
+  d->fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  strcpy(d->path, d->fd >= 0 ? dir : "");
+  return d->fd;
+}
+
+typedef struct dedupe_work dedupe_work;
+struct dedupe_work {
+  dedupe_item* items;
+  size_t nitems;
+  const dedupe_opts* opts;
+  int save_fd;
+  atomic_size_t next;
+  atomic_long done;
+  atomic_long linked;
+  atomic_long failed;
+  atomic_uint_fast64_t bytes;
+  pthread_mutex_t lock;      // the journal and stderr
+};
+
+static void dedupe_fail(dedupe_work* w, const dedupe_item* it,
+  const char* what)
+{
+  const int err = errno;
+  pthread_mutex_lock(&w->lock);
+  fprintf(stderr, "%s: %s: %s\n", it->path, what, strerror(err));
+  pthread_mutex_unlock(&w->lock);
+  atomic_fetch_add(&w->failed, 1);
+}
+
+#ifndef RENAME_NOREPLACE
+#  define RENAME_NOREPLACE (1 << 0)
+#endif
+
+/* Rename @name in @dfd to @to in @tfd, failing with EEXIST rather than
+ * replacing what is there. renameat2 is called through syscall, as
+ * copy_file_range is in copy_strategy.c; where the filesystem can't do
+ * RENAME_NOREPLACE, a link and an unlink do the same.
+ */
+static int dedupe_rename_new(int dfd, const char* name, int tfd,
+  const char* to)
+{
+#ifdef SYS_renameat2
+  if(!syscall(SYS_renameat2, dfd, name, tfd, to, RENAME_NOREPLACE))
+    return 0;
+  if(errno != EINVAL && errno != ENOSYS) return -1;
+#endif
+  if(linkat(dfd, name, tfd, to, 0)) return -1;
+  return unlinkat(dfd, name, 0);
+}
+
+/* Copy @name in @dfd to a new file @to in @tfd, with its mode, and sync
+ * it. Fail with EEXIST rather than replace a file, and leave no partial
+ * copy behind. Return 0 or -1 with errno set.
+ */
+static int dedupe_copy_new(int dfd, const char* name, int tfd,
+  const char* to)
+{
+  struct stat st;
+  int in = openat(dfd, name, O_RDONLY | O_CLOEXEC);
+  if(in < 0) return -1;
+  if(fstat(in, &st)) return close(in), -1;
+  int out = openat(tfd, to, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+    S_IRUSR | S_IWUSR);
+  if(out < 0) return close(in), -1;
+  int z = copy_fd_range(in, out, st.st_size);
+  if(z && (copy_strategy_unsupported(COPY_RANGE, errno)
+    || copy_strategy_not_this_file(errno)))
+    z = lseek(in, 0, SEEK_SET) || lseek(out, 0, SEEK_SET)
+      || ftruncate(out, 0) || copy_fd_user(in, out);
+  // The umask doesn't apply to fchmod.
+  if(!z) z = fchmod(out, st.st_mode & 07777) || fsync(out);
+  const int err = errno;
+  close(in);
+  if(close(out) && !z) z = -1;
+  if(z){
+    unlinkat(tfd, to, 0);
+    errno = err;
+  }
+  return z;
+}
+
+/* Move the original of @it out of the way: into the save directory as
+ * @saved if there is one, else unlink it. Nothing already in the save
+ * directory is replaced: the item fails with EEXIST instead. Return 0 or
+ * -1 with errno set.
+ */
+static int dedupe_save(dedupe_work* w, const dedupe_item* it, int dfd,
+  const char* name, char saved[static PATH_MAX])
+{
+  if(!w->opts->save){
+    strcpy(saved, "-");
+    return unlinkat(dfd, name, 0);
+  }
+  char sname[NAME_MAX + 1];
+  snprintf(sname, sizeof sname, "%ld.%lu.%s", it->group, it->index, name);
+  snprintf(saved, PATH_MAX, "%s/%s", w->opts->save, sname);
+  if(!dedupe_rename_new(dfd, name, w->save_fd, sname)) return 0;
+  if(errno != EXDEV) return -1;
+  // Another filesystem: copy, then unlink.
+  if(dedupe_copy_new(dfd, name, w->save_fd, sname)) return -1;
+  return unlinkat(dfd, name, 0);
+}
+
+/* Put the original of @it, moved out of the way as @saved by dedupe_save,
+ * back as @name in @dfd. Return 0 or -1 with errno set.
+ */
+static int dedupe_unsave(dedupe_work* w, int dfd, const char* name,
+  const char* saved)
+{
+  const char* sname = strrchr(saved, '/') + 1;
+  if(!dedupe_rename_new(w->save_fd, sname, dfd, name)) return 0;
+  if(errno != EXDEV || dedupe_copy_new(w->save_fd, sname, dfd, name))
+    return -1;
+  return unlinkat(w->save_fd, sname, 0);
+}
+
+// Record what was done to @it, its original now @saved, in the journal.
+static void dedupe_journal(dedupe_work* w, const dedupe_item* it,
+  const char* saved)
+{
+  if(!w->opts->journal) return;
+  pthread_mutex_lock(&w->lock);
+  fprintf(w->opts->journal, "%s\t%s\t%s\t%s\n",
+    dedupe_action_names[w->opts->action], it->path, it->keep, saved);
+  fflush(w->opts->journal);
+  pthread_mutex_unlock(&w->lock);
+}
+
+// Puts the copy in place of the duplicate. The tests make it fail.
+static int (*dedupe_renameat)(int, const char*, int, const char*) = renameat;
+
+/* Make a copy of the kept image named @tmp in @dfd, by @action.
+ */
+static int dedupe_make_copy(dedupe_action action, int kfd, const char* kname,
+  int dfd, const char* tmp, mode_t mode)
+{
+  if(action == DEDUPE_HARDLINK) return linkat(kfd, kname, dfd, tmp, 0);
+  int in = openat(kfd, kname, O_RDONLY | O_CLOEXEC);
+  if(in < 0) return -1;
+  int out = openat(dfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+  if(out < 0) return close(in), -1;
+#ifdef FICLONE
+  int z = ioctl(out, FICLONE, in);
+#else
+  errno = EOPNOTSUPP;
+  int z = -1;
+#endif
+  const int err = errno;
+  close(in);
+  close(out);
+  if(z){
+    unlinkat(dfd, tmp, 0);
+    errno = err;
+  }
+  return z;
+}
+
+static void dedupe_one(dedupe_work* w, dedupe_item* it, dedupe_dir* dd,
+  dedupe_dir* kd)
+{
+  const dedupe_opts* opts = w->opts;
+  const char *name, *kname;
+  const int dfd = dedupe_dir_open(dd, it->path, &name);
+  if(dfd < 0) return dedupe_fail(w, it, "open directory");
+  const int kfd = dedupe_dir_open(kd, it->keep, &kname);
+  struct stat st, kst;
+  if(fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW))
+    return dedupe_fail(w, it, "stat");
+  if(!S_ISREG(st.st_mode)){
+    errno = EINVAL;
+    return dedupe_fail(w, it, "not a regular file");
+  }
+  // Never touch a duplicate without the image that stands in for it.
+  if(kfd < 0 || fstatat(kfd, kname, &kst, 0))
+    return dedupe_fail(w, it, it->keep);
+  if(st.st_dev == kst.st_dev && st.st_ino == kst.st_ino){
+    atomic_fetch_add(&w->linked, 1);
+    return;
+  }
+  if(opts->dry_run){
+    atomic_fetch_add(&w->done, 1);
+    atomic_fetch_add(&w->bytes, st.st_size);
+    return;
+  }
+
+  char saved[PATH_MAX];
+  if(opts->action == DEDUPE_DELETE || opts->action == DEDUPE_QUARANTINE){
+    if(dedupe_save(w, it, dfd, name, saved))
+      return dedupe_fail(w, it, opts->save ? "save" : "unlink");
+  } else {
+    char tmp[NAME_MAX + 1];
+    snprintf(tmp, sizeof tmp, ".idhash-dedupe.%lu.tmp", it->index);
+    const mode_t mode = st.st_mode & 07777;
+    if(dedupe_make_copy(opts->action, kfd, kname, dfd, tmp, mode))
+      return dedupe_fail(w, it, dedupe_action_names[opts->action]);
+    // Without a save directory the rename replaces the original.
+    if(opts->save && dedupe_save(w, it, dfd, name, saved)){
+      const int err = errno;
+      unlinkat(dfd, tmp, 0);
+      errno = err;
+      return dedupe_fail(w, it, "save");
+    }
+    if(!opts->save) strcpy(saved, "-");
+    if(dedupe_renameat(dfd, tmp, dfd, name)){
+      const int err = errno;
+      unlinkat(dfd, tmp, 0);
+      // The original is saved already: put it back, or failing that,
+      // journal it so --undo can.
+      if(opts->save && dedupe_unsave(w, dfd, name, saved)){
+        dedupe_journal(w, it, saved);
+        errno = err;
+        return dedupe_fail(w, it, "rename, and the original is saved");
+      }
+      errno = err;
+      return dedupe_fail(w, it, "rename");
+    }
+  }
+  atomic_fetch_add(&w->done, 1);
+  atomic_fetch_add(&w->bytes, st.st_size);
+  dedupe_journal(w, it, saved);
+}
+
+static void* dedupe_thread(void* arg){
+  dedupe_work* w = (dedupe_work*) arg;
+  dedupe_dir dd = {.fd = -1}, kd = {.fd = -1};
+  for(size_t i; (i = atomic_fetch_add(&w->next, 1)) < w->nitems; )
+    dedupe_one(w, w->items + i, &dd, &kd);
+  if(dd.fd >= 0) close(dd.fd);
+  if(kd.fd >= 0) close(kd.fd);
+  return 0;
+}
+
+/* Apply @opts->action to the @nitems duplicates in @items, on
+ * @opts->jobs threads, into @sum. Return 0, or -1 if the save directory
+ * can't be opened.
+ */
+int dedupe_run(dedupe_item* items, size_t nitems, const dedupe_opts* opts,
+  dedupe_summary* sum)
+{
+  dedupe_work w = {items, nitems, opts, -1};
+  if(opts->save && 0 > (w.save_fd =
+    open(opts->save, O_RDONLY | O_DIRECTORY | O_CLOEXEC))){
+    fprintf(stderr, "%s: %s\n", opts->save, strerror(errno));
+    return -1;
+  }
+  atomic_init(&w.next, 0);
+  atomic_init(&w.done, 0);
+  atomic_init(&w.linked, 0);
+  atomic_init(&w.failed, 0);
+  atomic_init(&w.bytes, 0);
+  pthread_mutex_init(&w.lock, 0);
+  const int jobs = opts->jobs > 0 ? opts->jobs : dir_walk_ncpus();
+  pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+  for(int i=0; i<jobs; ++i)
+    pthread_create(threads + i, 0, dedupe_thread, &w);
+  for(int i=0; i<jobs; ++i)
+    pthread_join(threads[i], 0);
+  free(threads);
+  pthread_mutex_destroy(&w.lock);
+  if(w.save_fd >= 0) close(w.save_fd);
+  sum->duplicates = nitems;
+  sum->done = atomic_load(&w.done);
+  sum->linked = atomic_load(&w.linked);
+  sum->failed = atomic_load(&w.failed);
+  sum->bytes = atomic_load(&w.bytes);
+  return 0;
+}
+
+void dedupe_print_summary(FILE* fp, const dedupe_summary* sum,
+  const dedupe_opts* opts)
+{
+  fprintf(fp, "%s%s: %ld groups, %ld duplicates\n",
+    dedupe_action_names[opts->action], opts->dry_run ? " (dry run)" : "",
+    sum->groups, sum->duplicates);
+  fprintf(fp, "%s: %ld (%" PRIu64 " bytes)\n",
+    opts->dry_run ? "would do" : "done", sum->done, sum->bytes);
+  fprintf(fp, "already linked: %ld\n", sum->linked);
+  fprintf(fp, "failed: %ld\n", sum->failed);
+}
+
+/* Move the originals saved in the journal @fp back, last first. Return
+ * the number of failures.
+ */
+long dedupe_undo(FILE* fp){
+  char** lines = 0;
+  size_t n = 0, cap = 0, sz = 0;
+  char* line = 0;
+  ssize_t len;
+  while(0 < (len = getline(&line, &sz, fp))){
+    if(line[len-1] == '\n') line[len-1] = 0;
+    if(n == cap) lines = realloc(lines, (cap = cap ? 2*cap : 64)
+      * sizeof *lines);
+    lines[n++] = strdup(line);
+  }
+  free(line);
+  long failed = 0, restored = 0;
+  for(size_t i=n; i-- > 0; ){
+    char* f[4] = {lines[i]};
+    for(int j=1; j<4 && f[j-1]; ++j)
+      if((f[j] = strchr(f[j-1], '\t'))) *f[j]++ = 0;
+    if(!f[3] || strchr(f[3], '\t')){
+      fprintf(stderr, "Malformed journal line %zu.\n", i + 1);
+      ++failed;
+    } else if(!strcmp(f[3], "-")){
+      fprintf(stderr, "%s: %s without --save, can't undo\n", f[1], f[0]);
+      ++failed;
+    } else if(rename(f[3], f[1])
+      && (errno != EXDEV || 0 > copy_with_strategy(f[3], f[1], COPY_RANGE)
+        || unlink(f[3]))){
+      fprintf(stderr, "%s: %s\n", f[1], strerror(errno));
+      ++failed;
+    } else {
+      ++restored;
+    }
+    free(lines[i]);
+  }
+  free(lines);
+  fprintf(stderr, "%ld restored, %ld failed\n", restored, failed);
+  return failed;
+}
+
+#ifdef TEST_DEDUPE
+static void test_write(const char* path, const char* s){
+  FILE* fp = fopen(path, "w");
+  assert(fp);
+  fputs(s, fp);
+  fclose(fp);
+}
+
+static void test_check(const char* path, const char* expect){
+  char buf[64] = {0};
+  FILE* fp = fopen(path, "r");
+  assert(fp);
+  assert(fread(buf, 1, sizeof buf - 1, fp) == strlen(expect));
+  fclose(fp);
+  assert(!strcmp(buf, expect));
+}
+
+static int test_renameat_fails(int a, const char* b, int c, const char* d){
+  errno = EIO;
+  return -1;
+}
+
+static ino_t test_ino(const char* path){
+  struct stat st;
+  assert(!stat(path, &st));
+  return st.st_ino;
+}
+
+int main(){
+  char dir[] = "/tmp/test-dedupe.XXXXXX";
+  assert(mkdtemp(dir));
+  char a[64], b[64], c[64], save[64], journal[64], groups[512];
+  snprintf(a, sizeof a, "%s/a.jpg", dir);
+  snprintf(b, sizeof b, "%s/b.jpg", dir);
+  snprintf(c, sizeof c, "%s/c.jpg", dir);
+  snprintf(save, sizeof save, "%s/save", dir);
+  snprintf(journal, sizeof journal, "%s/journal", dir);
+  assert(!mkdir(save, 0755));
+  snprintf(groups, sizeof groups, "0\tkeep\t0\t%s\n0\tdup\t1\t%s\n"
+    "0\tdup\t2\t%s\n1\tkeep\t3\t%s/gone.jpg\n1\tdup\t4\t%s\n", a, b, c, dir,
+    a);
+
+  for(int action=DEDUPE_DELETE; action<NDEDUPE_ACTION; ++action){
+    test_write(a, "aaa");
+    test_write(b, "bb");
+    test_write(c, "c");
+    FILE* fp = fmemopen(groups, strlen(groups), "r");
+    char** keep;
+    dedupe_item* items;
+    size_t nkeep, nitems;
+    assert(!dedupe_read_groups(fp, &keep, &nkeep, &items, &nitems));
+    fclose(fp);
+    assert(nkeep == 2 && nitems == 3);
+    assert(items[0].keep == keep[0] && items[2].keep == keep[1]);
+
+    // A dry run changes nothing. The second group's kept image is missing.
+    dedupe_opts opts = {action, 1, 2, save};
+    dedupe_summary sum = {0};
+    assert(!dedupe_run(items, nitems, &opts, &sum));
+    assert(sum.done == 2 && sum.failed == 1 && sum.bytes == 3);
+    test_check(b, "bb");
+
+    opts.dry_run = 0;
+    opts.journal = fopen(journal, "w");
+    sum = (dedupe_summary){0};
+    if(action == DEDUPE_REFLINK){
+      // Only on a filesystem with reflinks.
+      assert(!dedupe_run(items, nitems, &opts, &sum));
+      fclose(opts.journal);
+      if(sum.done) test_check(b, "aaa");
+      else test_check(b, "bb");
+    } else {
+      assert(!dedupe_run(items, nitems, &opts, &sum));
+      fclose(opts.journal);
+      assert(sum.done == 2 && sum.failed == 1);
+      test_check(a, "aaa");
+      if(action == DEDUPE_HARDLINK){
+        assert(test_ino(b) == test_ino(a) && test_ino(c) == test_ino(a));
+        // Running again finds them linked.
+        sum = (dedupe_summary){0};
+        opts.journal = 0;
+        assert(!dedupe_run(items, nitems, &opts, &sum));
+        assert(sum.linked == 2 && !sum.done);
+      } else {
+        assert(access(b, F_OK) && access(c, F_OK));
+      }
+    }
+
+    // Undo puts the originals back.
+    fp = fopen(journal, "r");
+    assert(!dedupe_undo(fp));
+    fclose(fp);
+    test_check(b, "bb");
+    test_check(c, "c");
+
+    for(size_t i=0; i<nitems; ++i) free(items[i].path);
+    for(size_t i=0; i<nkeep; ++i) free(keep[i]);
+    free(items);
+    free(keep);
+  }
+
+  // Without --save, delete can't be undone.
+  FILE* fp = fmemopen(groups, strlen(groups), "r");
+  char** keep;
+  dedupe_item* items;
+  size_t nkeep, nitems;
+  assert(!dedupe_read_groups(fp, &keep, &nkeep, &items, &nitems));
+  fclose(fp);
+  dedupe_opts opts = {DEDUPE_DELETE, 0, 1, 0, fopen(journal, "w")};
+  dedupe_summary sum = {0};
+  assert(!dedupe_run(items, nitems, &opts, &sum));
+  fclose(opts.journal);
+  assert(sum.done == 2 && access(b, F_OK));
+  fp = fopen(journal, "r");
+  assert(2 == dedupe_undo(fp));
+  fclose(fp);
+  for(size_t i=0; i<nitems; ++i) free(items[i].path);
+  for(size_t i=0; i<nkeep; ++i) free(keep[i]);
+  free(items);
+  free(keep);
+
+  // A saved original is never replaced: the duplicate whose name is taken
+  // fails and stays.
+  char taken[128];
+  snprintf(taken, sizeof taken, "%s/0.1.b.jpg", save);
+  test_write(a, "aaa");
+  test_write(b, "bb");
+  test_write(c, "c");
+  test_write(taken, "old");
+  fp = fmemopen(groups, strlen(groups), "r");
+  assert(!dedupe_read_groups(fp, &keep, &nkeep, &items, &nitems));
+  fclose(fp);
+  opts = (dedupe_opts){DEDUPE_DELETE, 0, 1, save};
+  sum = (dedupe_summary){0};
+  assert(!dedupe_run(items, nitems, &opts, &sum));
+  assert(sum.done == 1 && sum.failed == 2);
+  test_check(taken, "old");
+  test_check(b, "bb");
+  assert(access(c, F_OK));
+  unlink(taken);
+  snprintf(taken, sizeof taken, "%s/0.2.c.jpg", save);
+  unlink(taken);
+  for(size_t i=0; i<nitems; ++i) free(items[i].path);
+  for(size_t i=0; i<nkeep; ++i) free(keep[i]);
+  free(items);
+  free(keep);
+
+  // A link that can't be renamed into place leaves the duplicate as it
+  // was, and nothing in the save directory.
+  test_write(a, "aaa");
+  test_write(b, "bb");
+  test_write(c, "c");
+  fp = fmemopen(groups, strlen(groups), "r");
+  assert(!dedupe_read_groups(fp, &keep, &nkeep, &items, &nitems));
+  fclose(fp);
+  opts = (dedupe_opts){DEDUPE_HARDLINK, 0, 1, save};
+  sum = (dedupe_summary){0};
+  dedupe_renameat = test_renameat_fails;
+  assert(!dedupe_run(items, nitems, &opts, &sum));
+  dedupe_renameat = renameat;
+  assert(!sum.done && sum.failed == 3);
+  test_check(b, "bb");
+  test_check(c, "c");
+  assert(test_ino(b) != test_ino(a) && test_ino(c) != test_ino(a));
+  DIR* dp = opendir(save);
+  for(struct dirent* e; (e = readdir(dp)); ) assert(e->d_name[0] == '.');
+  closedir(dp);
+  dp = opendir(dir);
+  for(struct dirent* e; (e = readdir(dp)); )
+    assert(!strstr(e->d_name, ".tmp"));
+  closedir(dp);
+  for(size_t i=0; i<nitems; ++i) free(items[i].path);
+  for(size_t i=0; i<nkeep; ++i) free(keep[i]);
+  free(items);
+  free(keep);
+
+  // The copy for another filesystem keeps the mode and replaces nothing.
+  const int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+  const int sfd = open(save, O_RDONLY | O_DIRECTORY);
+  assert(!chmod(b, 0604));
+  assert(!dedupe_copy_new(dfd, "b.jpg", sfd, "copy"));
+  snprintf(taken, sizeof taken, "%s/copy", save);
+  test_check(taken, "bb");
+  struct stat st;
+  assert(!stat(taken, &st) && (st.st_mode & 07777) == 0604);
+  assert(dedupe_copy_new(dfd, "a.jpg", sfd, "copy") && errno == EEXIST);
+  test_check(taken, "bb");
+  unlink(taken);
+  unlink(b);
+  close(dfd);
+  close(sfd);
+
+  // Malformed: a dup before its group's keep line.
+  fp = fmemopen("0\tdup\t1\tx\n", 11, "r");
+  assert(dedupe_read_groups(fp, &keep, &nkeep, &items, &nitems));
+  fclose(fp);
+  free(items);
+  free(keep);
+
+  unlink(a);
+  unlink(journal);
+  rmdir(save);
+  rmdir(dir);
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#elif defined(CMD_DEDUPE)
+int main(int argc, char* argv[argc]){
+  dedupe_opts opts = {0};
+  const char *journal = 0, *undo = 0, *action = 0, *fname = 0;
+  int usage = 0;
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--dry-run")) opts.dry_run = 1;
+    else if(!strcmp(argv[i], "--jobs") && i+1 < argc)
+      opts.jobs = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--journal") && i+1 < argc) journal = argv[++i];
+    else if(!strcmp(argv[i], "--save") && i+1 < argc) opts.save = argv[++i];
+    else if(!strcmp(argv[i], "--undo") && i+1 < argc) undo = argv[++i];
+    else if(!action) action = argv[i];
+    else if(!fname) fname = argv[i];
+    else usage = 1;
+  }
+  if(undo){
+    FILE* fp = fopen(undo, "r");
+    if(!fp){
+      fprintf(stderr, "%s: %s\n", undo, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    const long failed = dedupe_undo(fp);
+    fclose(fp);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+  const int a = action ? dedupe_action_parse(action) : -1;
+  opts.action = a;
+  if(usage || a < 0 || !fname || (a == DEDUPE_QUARANTINE && !opts.save)){
+    fprintf(stderr, "Usage: %s [--dry-run] [--jobs <N>] [--journal <FILE>] "
+      "[--save <DIR>] delete|hardlink|reflink|quarantine <GROUPS>\n"
+      "       %s --undo <JOURNAL>\n"
+      "quarantine moves duplicates into the --save directory.\n",
+      argv[0], argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  FILE* fp = strcmp(fname, "-") ? fopen(fname, "r") : stdin;
+  if(!fp){
+    fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  char** keep;
+  dedupe_item* items;
+  size_t nkeep, nitems;
+  const int z = dedupe_read_groups(fp, &keep, &nkeep, &items, &nitems);
+  if(fp != stdin) fclose(fp);
+  if(z) exit(EXIT_FAILURE);
+  if(journal && !opts.dry_run && !(opts.journal = fopen(journal, "a"))){
+    fprintf(stderr, "%s: %s\n", journal, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  dedupe_summary sum = {.groups = nkeep};
+  if(dedupe_run(items, nitems, &opts, &sum)) exit(EXIT_FAILURE);
+  if(opts.journal) fclose(opts.journal);
+  dedupe_print_summary(stdout, &sum, &opts);
+  for(size_t i=0; i<nitems; ++i) free(items[i].path);
+  for(size_t i=0; i<nkeep; ++i) free(keep[i]);
+  free(items);
+  free(keep);
+  return sum.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,618 @@
+/* dir_walk.c
+ *
+ * Walk a directory tree, calling a function for every regular file.
+ *
+ * Directories are read in large batches with getdents64, and the file type
+ * comes from d_type, so most entries are never stat'ed. Only entries whose
+ * type the filesystem doesn't report (DT_UNKNOWN), and symlinks when they
+ * are followed, get an fstatat. Subdirectories are opened with openat
+ * relative to their parent's fd, so the kernel never resolves a full path.
+ *
+ * With more than one job, each worker thread keeps its own deque of
+ * directories still to be read. A worker takes the newest directory from
+ * its own deque (depth first, so the set of open directory fds stays small)
+ * and steals the oldest directory from another worker when its own deque
+ * runs dry (breadth first, so a thief takes a big subtree).
+ *
+ * Files are shared out the same way: the worker reading a directory queues
+ * its regular files in batches of up to DIR_WALK_BATCH as it goes, and
+ * handles the last batch itself, so the callbacks for one flat directory
+ * of many files run on every worker. With one job they run in place.
+ *
+ * Failures to open or read a directory, or to stat an entry, are reported on
+ * stderr and counted, and the walk carries on with the rest of the tree.
+ * Symlinks to directories are never followed.
+ *
+ * Compile test
+ *
+gcc dir_walk.c -o test-dir-walk -DTEST_DIR_WALK -g -Wall -pthread
+ *
+ * Compile
+ *
+gcc dir_walk.c -o dir-walk -DCMD_DIR_WALK -g -Wall -pthread
+ *
+ * Usage
+ *
+ * ./dir-walk [--jobs <N>] [--count] <DIR>
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef ERRNO_H
+#  define ERRNO_H
+#  include <errno.h>
+#endif
+
+#ifndef ASSERT_H
+#  define ASSERT_H
+#  include <assert.h>
+#endif
+
+#ifndef UNISTD_H
+#  define UNISTD_H
+#  include <unistd.h>
+#endif
+
+#ifndef FCNTL_H
+#  define FCNTL_H
+#  include <fcntl.h>
+#endif
+
+#ifndef STAT_H
+#  define STAT_H
+#  include <sys/stat.h>
+#endif
+
+#ifndef DIRENT_H
+#  define DIRENT_H
+#  include <dirent.h>
+#endif
+
+#ifndef SYSCALL_H
+#  define SYSCALL_H
+#  include <sys/syscall.h>
+#endif
+
+#ifndef PTHREAD_H
+#  define PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#ifndef STDATOMIC_H
+#  define STDATOMIC_H
+#  include <stdatomic.h>
+#endif
+
+#ifndef SZ_PATH
+#  define SZ_PATH 4096
+#endif
+
+// Size of the buffer each worker hands to getdents64.
+#ifndef SZ_DIR_WALK_BUF
+#  define SZ_DIR_WALK_BUF (1<<16)
+#endif
+
+// Regular files queued per task when there is more than one job.
+#ifndef DIR_WALK_BATCH
+#  define DIR_WALK_BATCH 16
+#endif
+
+// The record getdents64 fills in. glibc only declares it (as struct dirent64)
+// from 2.30, and only with _GNU_SOURCE, so spell it out.
+struct dir_walk_dirent64 {
+  unsigned long long d_ino;
+  long long d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// A regular file found by the walk. @dirfd and @name can be used with the
+// *at() calls. @path is only valid during the callback.
+typedef struct dir_walk_entry dir_walk_entry;
+struct dir_walk_entry {
+  int dirfd;
+  const char* name;
+  const char* path;
+  int depth;
+  int worker;
+};
+
+// Return nonzero from the callback to count the entry as a failure.
+typedef int (*dir_walk_fn)(const dir_walk_entry* entry, void* arg);
+
+typedef struct dir_walk_opts dir_walk_opts;
+struct dir_walk_opts {
+  int recursive;        // descend into subdirectories
+  int jobs;             // worker threads, or 0 for one per online CPU
+  int follow_symlinks;  // report symlinks to regular files as files
+  void (*thread_exit)(void);  // called on each spawned worker before it exits
+};
+
+// An open directory. Each queued subdirectory holds a reference, so the fd
+// stays open for the openat of every child and is closed after the last.
+typedef struct dir_walk_dir dir_walk_dir;
+struct dir_walk_dir {
+  int fd;
+  char* path;
+  atomic_int refs;
+};
+
+// Names of regular files in one directory, each '\0'-terminated.
+typedef struct dir_walk_batch dir_walk_batch;
+struct dir_walk_batch {
+  int n;
+  size_t len;
+  char names[DIR_WALK_BATCH * 64];
+};
+
+// A directory to read, or a batch of files in @parent to report.
+typedef struct dir_walk_task dir_walk_task;
+struct dir_walk_task {
+  dir_walk_dir* parent;  // 0 for the root
+  char* name;            // or 0 for @files
+  int depth;
+  dir_walk_batch* files;
+};
+
+typedef struct dir_walk_deque dir_walk_deque;
+struct dir_walk_deque {
+  pthread_mutex_t lock;
+  dir_walk_task* tasks;
+  size_t cap;
+  size_t head;
+  size_t count;
+};
+
+typedef struct dir_walk dir_walk;
+struct dir_walk {
+  const dir_walk_opts* opts;
+  dir_walk_fn fn;
+  void* arg;
+  int jobs;
+  dir_walk_deque* deques;
+  atomic_long pending;  // tasks pushed but not yet finished
+  atomic_long queued;   // tasks sitting in a deque
+  atomic_long nerrors;
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle;
+};
+
+typedef struct dir_walk_worker dir_walk_worker;
+struct dir_walk_worker {
+  dir_walk* walk;
+  int id;
+  char* buf;
+  char path[SZ_PATH];
+};
+
+static void dir_walk_dir_release(dir_walk_dir* dir){
+  if(dir && 1 == atomic_fetch_sub(&dir->refs, 1)){
+    close(dir->fd);
+    free(dir->path);
+    free(dir);
+  }
+}
+
+static void dir_walk_deque_push(dir_walk_deque* dq, dir_walk_task task){
+  pthread_mutex_lock(&dq->lock);
+  if(dq->count == dq->cap){
+    size_t cap = dq->cap ? 2*dq->cap : 64;
+    dir_walk_task* tasks = calloc(cap, sizeof(dir_walk_task));
+    for(size_t i=0; i<dq->count; ++i)
+      tasks[i] = dq->tasks[(dq->head + i) % dq->cap];
+    free(dq->tasks);
+    dq->tasks = tasks;
+    dq->cap = cap;
+    dq->head = 0;
+  }
+  dq->tasks[(dq->head + dq->count++) % dq->cap] = task;
+  pthread_mutex_unlock(&dq->lock);
+}
+
+// Take from the back of a worker's own deque (newest first).
+static int dir_walk_deque_pop(dir_walk_deque* dq, dir_walk_task* task){
+  int found=0;
+  pthread_mutex_lock(&dq->lock);
+  if(dq->count){
+    *task = dq->tasks[(dq->head + --dq->count) % dq->cap];
+    found=1;
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return found;
+}
+
+// Take from the front of another worker's deque (oldest first).
+static int dir_walk_deque_steal(dir_walk_deque* dq, dir_walk_task* task){
+  int found=0;
+  pthread_mutex_lock(&dq->lock);
+  if(dq->count){
+    *task = dq->tasks[dq->head];
+    dq->head = (dq->head + 1) % dq->cap;
+    --dq->count;
+    found=1;
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return found;
+}
+
+static void dir_walk_push(dir_walk* w, int id, dir_walk_task task){
+  atomic_fetch_add(&w->pending, 1);
+  dir_walk_deque_push(w->deques + id, task);
+  atomic_fetch_add(&w->queued, 1);
+  pthread_mutex_lock(&w->idle_lock);
+  pthread_cond_signal(&w->idle);
+  pthread_mutex_unlock(&w->idle_lock);
+}
+
+static int dir_walk_take(dir_walk* w, int id, dir_walk_task* task){
+  if(dir_walk_deque_pop(w->deques + id, task)) goto found;
+  for(int i=1; i<w->jobs; ++i)
+    if(dir_walk_deque_steal(w->deques + (id + i) % w->jobs, task)) goto found;
+  return 0;
+found:
+  atomic_fetch_sub(&w->queued, 1);
+  return 1;
+}
+
+static void dir_walk_finish(dir_walk* w){
+  if(1 == atomic_fetch_sub(&w->pending, 1)){
+    pthread_mutex_lock(&w->idle_lock);
+    pthread_cond_broadcast(&w->idle);
+    pthread_mutex_unlock(&w->idle_lock);
+  }
+}
+
+static void dir_walk_error(dir_walk* w, const char* what, const char* dir,
+  const char* name)
+{
+  fprintf(stderr, "%s %s%s%s: %s\n", what, dir, *dir && name ? "/" : "",
+    name ? name : "", strerror(errno));
+  atomic_fetch_add(&w->nerrors, 1);
+}
+
+/* Report the files in @batch, in @dir at @depth.
+ */
+static void dir_walk_files(dir_walk_worker* wk, const dir_walk_dir* dir,
+  int depth, const dir_walk_batch* batch)
+{
+  dir_walk* w = wk->walk;
+  dir_walk_entry entry = {dir->fd, 0, wk->path, depth, wk->id};
+  const char* name = batch->names;
+  for(int i=0; i<batch->n; ++i, name += strlen(name) + 1){
+    if(SZ_PATH <= snprintf(wk->path, SZ_PATH, "%s/%s", dir->path, name)){
+      errno = ENAMETOOLONG;
+      dir_walk_error(w, "Path too long", dir->path, name);
+      continue;
+    }
+    entry.name = name;
+    if(w->fn(&entry, w->arg)) atomic_fetch_add(&w->nerrors, 1);
+  }
+}
+
+/* Open the directory named by @task, report every regular file in it, and
+ * queue its subdirectories. With more than one job, full batches of files
+ * are queued too.
+ */
+static void dir_walk_read(dir_walk_worker* wk, dir_walk_task* task){
+  dir_walk* w = wk->walk;
+  dir_walk_dir* parent = task->parent;
+  const int flags = O_RDONLY|O_DIRECTORY|O_CLOEXEC|(parent ? O_NOFOLLOW : 0);
+  int fd = openat(parent ? parent->fd : AT_FDCWD, task->name, flags);
+  if(0 > fd){
+    dir_walk_error(w, "Failed to open directory",
+      parent ? parent->path : "", task->name);
+    dir_walk_dir_release(parent);
+    free(task->name);
+    return;
+  }
+
+  dir_walk_dir* dir = calloc(1, sizeof(dir_walk_dir));
+  dir->fd = fd;
+  atomic_init(&dir->refs, 1);
+  if(parent){
+    size_t n = strlen(parent->path) + strlen(task->name) + 2;
+    dir->path = malloc(n);
+    snprintf(dir->path, n, "%s/%s", parent->path, task->name);
+    free(task->name);
+  } else {
+    // Keep the root as given, minus trailing separators, so "/" becomes ""
+    // and children of "dir/" are "dir/name".
+    dir->path = task->name;
+    for(size_t n = strlen(dir->path); n && dir->path[n-1] == '/'; --n)
+      dir->path[n-1] = 0;
+  }
+  dir_walk_dir_release(parent);
+
+  dir_walk_batch* batch = calloc(1, sizeof *batch);
+  for(;;){
+    long n = syscall(SYS_getdents64, fd, wk->buf, SZ_DIR_WALK_BUF);
+    if(!n) break;
+    if(0 > n){
+      dir_walk_error(w, "Failed to read directory", dir->path, 0);
+      break;
+    }
+    for(long off=0; off<n;){
+      struct dir_walk_dirent64* d = (struct dir_walk_dirent64*)(wk->buf + off);
+      off += d->d_reclen;
+      char* name = d->d_name;
+      if(name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+        continue;
+      unsigned char type = d->d_type;
+      if(type == DT_UNKNOWN || (type == DT_LNK && w->opts->follow_symlinks)){
+        struct stat st;
+        int at = type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW;
+        if(fstatat(fd, name, &st, at)){
+          dir_walk_error(w, "Failed to stat", dir->path, name);
+          continue;
+        }
+        type = S_ISREG(st.st_mode) ? DT_REG
+          : S_ISDIR(st.st_mode) && type != DT_LNK ? DT_DIR : DT_UNKNOWN;
+      }
+      if(type == DT_DIR && w->opts->recursive){
+        atomic_fetch_add(&dir->refs, 1);
+        dir_walk_push(w, wk->id,
+          (dir_walk_task){dir, strdup(name), task->depth + 1});
+      } else if(type == DT_REG){
+        const size_t len = strlen(name) + 1;
+        if(batch->n == DIR_WALK_BATCH
+          || batch->len + len > sizeof batch->names){
+          if(w->jobs == 1) dir_walk_files(wk, dir, task->depth, batch);
+          else {
+            atomic_fetch_add(&dir->refs, 1);
+            dir_walk_push(w, wk->id,
+              (dir_walk_task){dir, 0, task->depth, batch});
+            batch = malloc(sizeof *batch);
+          }
+          batch->n = 0;
+          batch->len = 0;
+        }
+        memcpy(batch->names + batch->len, name, len);
+        batch->len += len;
+        ++batch->n;
+      }
+    }
+  }
+  dir_walk_files(wk, dir, task->depth, batch);
+  free(batch);
+  dir_walk_dir_release(dir);
+}
+
+static void* dir_walk_worker_run(void* _arg){
+  dir_walk_worker* wk = (dir_walk_worker*) _arg;
+  dir_walk* w = wk->walk;
+  dir_walk_task task;
+  for(;;){
+    if(dir_walk_take(w, wk->id, &task)){
+      if(task.files){
+        dir_walk_files(wk, task.parent, task.depth, task.files);
+        dir_walk_dir_release(task.parent);
+        free(task.files);
+      } else
+        dir_walk_read(wk, &task);
+      dir_walk_finish(w);
+      continue;
+    }
+    pthread_mutex_lock(&w->idle_lock);
+    while(!atomic_load(&w->queued) && atomic_load(&w->pending))
+      pthread_cond_wait(&w->idle, &w->idle_lock);
+    int done = !atomic_load(&w->pending);
+    pthread_mutex_unlock(&w->idle_lock);
+    if(done) break;
+  }
+  return 0;
+}
+
+// Start routine of the spawned workers.
+static void* dir_walk_thread(void* _arg){
+  dir_walk_worker* wk = (dir_walk_worker*) _arg;
+  dir_walk_worker_run(wk);
+  if(wk->walk->opts->thread_exit) wk->walk->opts->thread_exit();
+  return 0;
+}
+
+/* Number of online CPUs, or 1 if that can't be determined.
+ */
+static int dir_walk_ncpus(){
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int) n : 1;
+}
+
+/* Call @fn(entry, @arg) for every regular file under @root. With more than
+ * one job, @fn is called from several threads at once. Return the number of
+ * failures: directories or entries that couldn't be read, plus the entries
+ * @fn returned nonzero for.
+ */
+long dir_walk_run(
+  const char* root,
+  const dir_walk_opts* opts,
+  dir_walk_fn fn,
+  void* arg)
+{
+  dir_walk w = {opts, fn, arg, 0};
+  w.jobs = opts->jobs > 0 ? opts->jobs : dir_walk_ncpus();
+  w.deques = calloc(w.jobs, sizeof(dir_walk_deque));
+  for(int i=0; i<w.jobs; ++i)
+    pthread_mutex_init(&w.deques[i].lock, 0);
+  pthread_mutex_init(&w.idle_lock, 0);
+  pthread_cond_init(&w.idle, 0);
+
+  dir_walk_push(&w, 0, (dir_walk_task){0, strdup(root), 0, 0});
+
+  dir_walk_worker* workers = calloc(w.jobs, sizeof(dir_walk_worker));
+  pthread_t* threads = calloc(w.jobs, sizeof(pthread_t));
+  for(int i=0; i<w.jobs; ++i){
+    workers[i].walk = &w;
+    workers[i].id = i;
+    workers[i].buf = malloc(SZ_DIR_WALK_BUF);
+  }
+  // Run worker 0 on the calling thread, so a single job spawns nothing.
+  for(int i=1; i<w.jobs; ++i)
+    pthread_create(threads+i, 0, dir_walk_thread, workers+i);
+  dir_walk_worker_run(workers);
+  for(int i=1; i<w.jobs; ++i)
+    pthread_join(threads[i], 0);
+
+  for(int i=0; i<w.jobs; ++i){
+    free(workers[i].buf);
+    free(w.deques[i].tasks);
+    pthread_mutex_destroy(&w.deques[i].lock);
+  }
+  free(workers);
+  free(threads);
+  free(w.deques);
+  pthread_mutex_destroy(&w.idle_lock);
+  pthread_cond_destroy(&w.idle);
+  return atomic_load(&w.nerrors);
+}
+
+#if defined(TEST_DIR_WALK) || defined(CMD_DIR_WALK)
+static int dir_walk_count(const dir_walk_entry* e, void* arg){
+  atomic_fetch_add((atomic_long*) arg, 1);
+  return 0;
+}
+#endif
+
+#ifdef TEST_DIR_WALK
+static int dir_walk_check_path(const dir_walk_entry* e, void* arg){
+  // The path and the (dirfd, name) pair must name the same file.
+  struct stat a, b;
+  assert(!stat(e->path, &a) && !fstatat(e->dirfd, e->name, &b, 0));
+  assert(a.st_ino == b.st_ino);
+  return dir_walk_count(e, arg);
+}
+
+typedef struct test_spread test_spread;
+struct test_spread {
+  atomic_long n;
+  atomic_long by_worker[8];
+};
+
+// Slow enough that the reader can't keep every batch to itself.
+static int dir_walk_check_spread(const dir_walk_entry* e, void* arg){
+  test_spread* s = (test_spread*) arg;
+  assert(e->worker >= 0 && e->worker < 8);
+  atomic_fetch_add(s->by_worker + e->worker, 1);
+  usleep(100);
+  return dir_walk_check_path(e, &s->n);
+}
+
+static void touch(const char* dir, const char* name){
+  char path[SZ_PATH];
+  assert(SZ_PATH > snprintf(path, SZ_PATH, "%s/%s", dir, name));
+  FILE* fp = fopen(path, "w");
+  assert(fp);
+  fclose(fp);
+}
+
+int main(){
+  char root[] = "/tmp/test_dir_walk_XXXXXX";
+  char path[SZ_PATH];
+  assert(mkdtemp(root));
+
+  // root/{0..9}/{0..9}/f{0..4} plus root/top and a symlink root/link -> top
+  touch(root, "top");
+  for(int i=0; i<10; ++i){
+    snprintf(path, SZ_PATH, "%s/%d", root, i);
+    assert(!mkdir(path, 0700));
+    for(int j=0; j<10; ++j){
+      snprintf(path, SZ_PATH, "%s/%d/%d", root, i, j);
+      assert(!mkdir(path, 0700));
+      for(int k=0; k<5; ++k){
+        char name[16];
+        snprintf(name, sizeof name, "f%d", k);
+        touch(path, name);
+      }
+    }
+  }
+  snprintf(path, SZ_PATH, "%s/link", root);
+  assert(!symlink("top", path));
+
+  for(int jobs=1; jobs<=8; jobs*=2){
+    atomic_long n = 0;
+    dir_walk_opts opts = {1, jobs, 0};
+    assert(!dir_walk_run(root, &opts, dir_walk_check_path, &n));
+    assert(n == 501);
+
+    n = 0;
+    opts.follow_symlinks = 1;
+    assert(!dir_walk_run(root, &opts, dir_walk_count, &n));
+    assert(n == 502);
+
+    n = 0;
+    opts.recursive = 0;
+    assert(!dir_walk_run(root, &opts, dir_walk_count, &n));
+    assert(n == 2);
+  }
+
+  // A flat directory is shared by every worker, not left to its reader.
+  snprintf(path, SZ_PATH, "%s/flat", root);
+  assert(!mkdir(path, 0700));
+  for(int i=0; i<2000; ++i){
+    char name[16];
+    snprintf(name, sizeof name, "f%d", i);
+    touch(path, name);
+  }
+  for(int jobs=1; jobs<=8; jobs*=4){
+    test_spread spread = {0};
+    dir_walk_opts opts = {0, jobs, 0};
+    assert(!dir_walk_run(path, &opts, dir_walk_check_spread, &spread));
+    assert(spread.n == 2000);
+    int workers = 0;
+    for(int i=0; i<8; ++i) workers += !!spread.by_worker[i];
+    assert(jobs == 1 ? workers == 1 : workers > 1);
+  }
+
+  // A missing root is an error, not an exit.
+  {
+    atomic_long n = 0;
+    dir_walk_opts opts = {1, 2, 0};
+    snprintf(path, SZ_PATH, "%s/missing", root);
+    assert(1 == dir_walk_run(path, &opts, dir_walk_count, &n));
+  }
+
+  snprintf(path, SZ_PATH, "rm -r %s", root);
+  assert(!system(path));
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#elif defined(CMD_DIR_WALK)
+static int dir_walk_print(const dir_walk_entry* e, void* arg){
+  puts(e->path);
+  return 0;
+}
+
+int main(int argc, char* argv[argc]){
+  dir_walk_opts opts = {1, 0, 0};
+  int count=0;
+  char* root=0;
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--jobs") && i+1 < argc) opts.jobs = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--count")) count=1;
+    else if(!root) root = argv[i];
+  }
+  if(!root){
+    fprintf(stderr, "Usage: %s [--jobs <N>] [--count] <DIR>\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  atomic_long n = 0;
+  long nerrors = dir_walk_run(root, &opts,
+    count ? dir_walk_count : dir_walk_print, &n);
+  if(count) printf("%ld\n", (long) n);
+  return nerrors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
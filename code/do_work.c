@@ -1,5 +1,5 @@
 /*
-gcc do_work.c -o do-work -DTEST_DO_WORK -g -Wall `pkg-config vips --cflags --libs` -lm -luuid
+gcc do_work.c -o do-work -DTEST_DO_WORK -g -Wall -pthread `pkg-config vips --cflags --libs` -lm -luuid
 
 Pre-step
 
@@ -113,6 +113,11 @@ Done!
 #  include "roc_point.c"
 #endif
 
+#ifndef VIPS_PROFILE_H
+#  define VIPS_PROFILE_H
+#  include "vips_profile.c"
+#endif
+
 guint max(guint x, guint y){
   return x < y ? y : x;
 }
@@ -167,8 +172,11 @@ void do_work(){
   generate_numbered_files(DEFAULT_JPEGS_DIR, DEFAULT_NUMBERED_JPEGS_DIR, 1);
 
   // generate duplicates and non-duplicates (tested)
-  generate_duplicates(DEFAULT_NUMBERED_JPEGS_DIR, DEFAULT_DUPLICATES_DIR);
-  generate_nonduplicates(DEFAULT_NUMBERED_JPEGS_DIR, DEFAULT_NONDUPLICATES_DIR);
+  // (the pairs are only read, so links are fine where copies aren't cheap)
+  generate_duplicates(DEFAULT_NUMBERED_JPEGS_DIR, DEFAULT_DUPLICATES_DIR,
+    COPY_REFLINK);
+  generate_nonduplicates(DEFAULT_NUMBERED_JPEGS_DIR, DEFAULT_NONDUPLICATES_DIR,
+    COPY_REFLINK);
 
   // run idhash_directory on duplicates/ and non-duplicates/ (winging it)
   int iterations = DEFAULT_ITERATIONS;
@@ -226,8 +234,14 @@ void do_work(){
 }
 
 #ifdef TEST_DO_WORK
-int main() {
+int main(int argc, char* argv[argc]) {
+  vips_profile profile={0};
+  vips_profile_parse_args(&profile, DEFAULT_VIPS_PROFILE, &argc, argv);
+  if(VIPS_INIT(argv[0]))
+    vips_error_exit(NULL);
+  vips_profile_apply(&profile);
   do_work();
+  vips_profile_print_stats(stderr);
   return EXIT_SUCCESS;
 }
 #endif
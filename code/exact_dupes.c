@@ -0,0 +1,596 @@
+/* exact_dupes.c
+ *
+ * Find byte-identical files in a list of paths without reading most of
+ * them, so each set of copies is decoded and hashed once.
+ *
+ * As fdupes does, the files are narrowed down in steps, each reading more
+ * of fewer files:
+ *
+ *   size                 from stat; a file of unique size has no copy
+ *   first and last 4 KB  an XXH64 digest of both ends, two preads
+ *   whole file           an XXH64 digest, read sequentially in 1 MB chunks
+ *
+ * Files no longer than both ends together are read whole at the second
+ * step and skip the third. Files that share a size, both ends and the
+ * whole digest are taken as copies: the chance of two different files
+ * agreeing on all three is about 2^-64 per pair, against nothing at all
+ * for files of unequal size, which never meet.
+ *
+ * Each file's group is given by its leader, the first file of its group in
+ * list order, which is the one to decode. A file that can't be stat'ed or
+ * read is its own group, and left for the decoder to fail on.
+ *
+ * Steps run on --jobs threads, each taking the next file.
+ *
+ * Compile test
+ *
+gcc exact_dupes.c -o test-exact-dupes -DTEST_EXACT_DUPES -O2 -g -Wall -pthread
+ *
+ * Compile
+ *
+gcc exact_dupes.c -o idhash-exact -DCMD_EXACT_DUPES -O2 -g -Wall -pthread
+ *
+ * Usage: read paths from stdin, or from the file <LIST>, separated by
+ * newlines or by '\0' with -0, and print each group of two or more
+ * identical files as <group>\t<path> lines, the group being the number of
+ * its leader in the list, counting from 0
+ *
+ * ./idhash-exact [-0] [--jobs <N>] [--stats] {- | --from <LIST>}
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef STDINT_H
+#  define STDINT_H
+#  include <stdint.h>
+#endif
+
+#ifndef INTTYPES_H
+#  define INTTYPES_H
+#  include <inttypes.h>
+#endif
+
+#ifndef FCNTL_H
+#  define FCNTL_H
+#  include <fcntl.h>
+#endif
+
+#ifndef UNISTD_H
+#  define UNISTD_H
+#  include <unistd.h>
+#endif
+
+#ifndef SYS_STAT_H
+#  define SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
+#ifndef PTHREAD_H
+#  define PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#ifndef STDATOMIC_H
+#  define STDATOMIC_H
+#  include <stdatomic.h>
+#endif
+
+// Bytes digested from each end of a file, and per read of a whole file.
+#define EXACT_DUPES_END 4096
+#ifndef EXACT_DUPES_CHUNK
+#  define EXACT_DUPES_CHUNK (1 << 20)
+#endif
+
+#define EXACT_XXH_P1 0x9e3779b185ebca87u
+#define EXACT_XXH_P2 0xc2b2ae3d27d4eb4fu
+#define EXACT_XXH_P3 0x165667b19e3779f9u
+#define EXACT_XXH_P4 0x85ebca77c2b2ae63u
+#define EXACT_XXH_P5 0x27d4eb2f165667c5u
+
+/* XXH64, fed in pieces.
+ */
+typedef struct exact_xxh64 exact_xxh64;
+struct exact_xxh64 {
+  uint64_t v[4];
+  uint64_t seed;
+  uint64_t total;
+  unsigned char tail[32];
+  size_t ntail;
+};
+
+static inline uint64_t exact_rotl(uint64_t x, int r){
+  return x << r | x >> (64 - r);
+}
+
+static inline uint64_t exact_read64(const unsigned char* p){
+  uint64_t x;
+  memcpy(&x, p, sizeof x);
+  return x;
+}
+
+static inline uint64_t exact_xxh_round(uint64_t acc, uint64_t in){
+  return exact_rotl(acc + in * EXACT_XXH_P2, 31) * EXACT_XXH_P1;
+}
+
+static inline uint64_t exact_xxh_merge(uint64_t acc, uint64_t v){
+  return (acc ^ exact_xxh_round(0, v)) * EXACT_XXH_P1 + EXACT_XXH_P4;
+}
+
+void exact_xxh64_init(exact_xxh64* x, uint64_t seed){
+  *x = (exact_xxh64){{seed + EXACT_XXH_P1 + EXACT_XXH_P2,
+    seed + EXACT_XXH_P2, seed, seed - EXACT_XXH_P1}, seed};
+}
+
+static inline void exact_xxh64_stripe(
+  exact_xxh64* x,
+  const unsigned char* p)
+{
+  for(int i=0; i<4; ++i)
+    x->v[i] = exact_xxh_round(x->v[i], exact_read64(p + 8*i));
+}
+
+void exact_xxh64_update(exact_xxh64* x, const void* data, size_t len){
+  const unsigned char* p = data;
+  x->total += len;
+  if(x->ntail){
+    const size_t take = 32 - x->ntail < len ? 32 - x->ntail : len;
+    memcpy(x->tail + x->ntail, p, take);
+    x->ntail += take;
+    p += take;
+    len -= take;
+    if(x->ntail < 32) return;
+    exact_xxh64_stripe(x, x->tail);
+    x->ntail = 0;
+  }
+  for(; len >= 32; p += 32, len -= 32) exact_xxh64_stripe(x, p);
+  memcpy(x->tail, p, len);
+  x->ntail = len;
+}
+
+uint64_t exact_xxh64_digest(const exact_xxh64* x){
+  uint64_t h;
+  if(x->total >= 32){
+    h = exact_rotl(x->v[0], 1) + exact_rotl(x->v[1], 7)
+      + exact_rotl(x->v[2], 12) + exact_rotl(x->v[3], 18);
+    for(int i=0; i<4; ++i) h = exact_xxh_merge(h, x->v[i]);
+  } else h = x->seed + EXACT_XXH_P5;
+  h += x->total;
+  const unsigned char* p = x->tail;
+  size_t len = x->ntail;
+  for(; len >= 8; p += 8, len -= 8)
+    h = exact_rotl(h ^ exact_xxh_round(0, exact_read64(p)), 27)
+      * EXACT_XXH_P1 + EXACT_XXH_P4;
+  if(len >= 4){
+    uint32_t k;
+    memcpy(&k, p, sizeof k);
+    h = exact_rotl(h ^ k * EXACT_XXH_P1, 23) * EXACT_XXH_P2 + EXACT_XXH_P3;
+    p += 4;
+    len -= 4;
+  }
+  for(; len; ++p, --len)
+    h = exact_rotl(h ^ *p * EXACT_XXH_P5, 11) * EXACT_XXH_P1;
+  h ^= h >> 33;
+  h *= EXACT_XXH_P2;
+  h ^= h >> 29;
+  h *= EXACT_XXH_P3;
+  return h ^ h >> 32;
+}
+
+typedef struct exact_dupes_opts exact_dupes_opts;
+struct exact_dupes_opts {
+  int jobs;     // threads, or 0 for one per online CPU
+};
+
+// How far the files got.
+typedef struct exact_dupes_stats exact_dupes_stats;
+struct exact_dupes_stats {
+  size_t files;
+  size_t failed;     // couldn't be stat'ed or read
+  size_t sized;      // shared a size with another file
+  size_t ends;       // and both ends, and were read whole
+  size_t copies;     // files with an earlier copy in the list
+  uint64_t bytes;    // read
+};
+
+typedef struct exact_dupes_file exact_dupes_file;
+struct exact_dupes_file {
+  uint64_t size;
+  uint64_t ends;     // digest of both ends, of the whole file if short
+  uint64_t whole;    // digest of the whole file
+  size_t index;
+  int failed;
+};
+
+typedef struct exact_dupes_work exact_dupes_work;
+struct exact_dupes_work {
+  char* const* paths;
+  exact_dupes_file* files;
+  // The files of this step, by position in @files.
+  const size_t* todo;
+  size_t ntodo;
+  atomic_size_t next;
+  atomic_uint_fast64_t bytes;
+  void (*step)(exact_dupes_work* w, exact_dupes_file* f, unsigned char* buf);
+};
+
+static void exact_dupes_stat(
+  exact_dupes_work* w,
+  exact_dupes_file* f,
+  unsigned char* buf)
+{
+  struct stat st;
+  f->failed = stat(w->paths[f->index], &st) || !S_ISREG(st.st_mode);
+  f->size = f->failed ? 0 : st.st_size;
+}
+
+/* Read @len bytes at @offset of @fd into @buf. Return 0 if they all came.
+ */
+static int exact_dupes_pread(int fd, unsigned char* buf, size_t len,
+  off_t offset)
+{
+  while(len){
+    const ssize_t z = pread(fd, buf, len, offset);
+    if(z <= 0) return -1;
+    buf += z;
+    len -= z;
+    offset += z;
+  }
+  return 0;
+}
+
+static void exact_dupes_ends(
+  exact_dupes_work* w,
+  exact_dupes_file* f,
+  unsigned char* buf)
+{
+  const int fd = open(w->paths[f->index], O_RDONLY);
+  const int whole = f->size <= 2 * EXACT_DUPES_END;
+  const size_t len = whole ? f->size : 2 * EXACT_DUPES_END;
+  f->failed = fd < 0 || exact_dupes_pread(fd, buf, whole ? len
+    : EXACT_DUPES_END, 0) || (!whole && exact_dupes_pread(fd,
+    buf + EXACT_DUPES_END, EXACT_DUPES_END, f->size - EXACT_DUPES_END));
+  if(fd >= 0) close(fd);
+  exact_xxh64 x;
+  exact_xxh64_init(&x, 0);
+  exact_xxh64_update(&x, buf, len);
+  f->ends = exact_xxh64_digest(&x);
+  if(whole) f->whole = f->ends;
+  atomic_fetch_add(&w->bytes, len);
+}
+
+static void exact_dupes_whole(
+  exact_dupes_work* w,
+  exact_dupes_file* f,
+  unsigned char* buf)
+{
+  const int fd = open(w->paths[f->index], O_RDONLY);
+  if(fd < 0){
+    f->failed = 1;
+    return;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  exact_xxh64 x;
+  exact_xxh64_init(&x, 0);
+  ssize_t z;
+  while(0 < (z = read(fd, buf, EXACT_DUPES_CHUNK)))
+    exact_xxh64_update(&x, buf, z);
+  close(fd);
+  // Changed since it was stat'ed: not a copy of anything.
+  f->failed = z < 0 || x.total != f->size;
+  f->whole = exact_xxh64_digest(&x);
+  atomic_fetch_add(&w->bytes, x.total);
+}
+
+static void* exact_dupes_worker(void* _arg){
+  exact_dupes_work* w = (exact_dupes_work*) _arg;
+  unsigned char* buf = malloc(EXACT_DUPES_CHUNK > 2 * EXACT_DUPES_END
+    ? EXACT_DUPES_CHUNK : 2 * EXACT_DUPES_END);
+  for(size_t i; (i = atomic_fetch_add(&w->next, 1)) < w->ntodo; )
+    w->step(w, w->files + w->todo[i], buf);
+  free(buf);
+  return 0;
+}
+
+/* Run @step on the @ntodo files @todo on @jobs threads.
+ */
+static void exact_dupes_run(
+  exact_dupes_work* w,
+  int jobs,
+  void (*step)(exact_dupes_work*, exact_dupes_file*, unsigned char*),
+  const size_t* todo,
+  size_t ntodo)
+{
+  w->step = step;
+  w->todo = todo;
+  w->ntodo = ntodo;
+  atomic_store(&w->next, 0);
+  if(jobs > (int) ntodo) jobs = ntodo ? ntodo : 1;
+  pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+  for(int i=1; i<jobs; ++i)
+    pthread_create(threads + i, 0, exact_dupes_worker, w);
+  exact_dupes_worker(w);
+  for(int i=1; i<jobs; ++i) pthread_join(threads[i], 0);
+  free(threads);
+}
+
+static int exact_dupes_cmp(const void* a, const void* b){
+  const exact_dupes_file* x = a;
+  const exact_dupes_file* y = b;
+  if(x->failed != y->failed) return x->failed - y->failed;
+  if(x->size != y->size) return (x->size > y->size) - (x->size < y->size);
+  if(x->ends != y->ends) return (x->ends > y->ends) - (x->ends < y->ends);
+  if(x->whole != y->whole) return (x->whole > y->whole) - (x->whole < y->whole);
+  return (x->index > y->index) - (x->index < y->index);
+}
+
+/* Whether sorted files @a and @b agree as far as @step went: 0 stat,
+ * 1 both ends, 2 the whole file.
+ */
+static int exact_dupes_same(
+  const exact_dupes_file* a,
+  const exact_dupes_file* b,
+  int step)
+{
+  return !a->failed && !b->failed && a->size == b->size
+    && (step < 1 || a->ends == b->ends)
+    && (step < 2 || a->whole == b->whole);
+}
+
+/* Put the positions of the @n sorted @files that agree with a neighbour
+ * as far as @step into @todo, and return how many there are.
+ */
+static size_t exact_dupes_shared(
+  const exact_dupes_file* files,
+  size_t n,
+  int step,
+  size_t* todo)
+{
+  size_t ntodo = 0;
+  for(size_t i=0; i<n; ++i)
+    if((i && exact_dupes_same(files + i - 1, files + i, step))
+      || (i+1 < n && exact_dupes_same(files + i, files + i + 1, step)))
+      todo[ntodo++] = i;
+  return ntodo;
+}
+
+/* Set @leader[i] to the first of the @n files @paths that is byte for byte
+ * the same as file i: i itself if none comes before it. Return how many
+ * files have an earlier copy. @stats, if not 0, is set.
+ */
+size_t exact_dupes_find(
+  char* const* paths,
+  size_t n,
+  const exact_dupes_opts* opts,
+  size_t* leader,
+  exact_dupes_stats* stats)
+{
+  int jobs = opts->jobs;
+  if(jobs <= 0){
+    const long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    jobs = ncpus > 0 ? ncpus : 1;
+  }
+  exact_dupes_file* files = calloc(n + 1, sizeof *files);
+  size_t* todo = malloc((n + 1) * sizeof(size_t));
+  exact_dupes_work w = {paths, files};
+  atomic_init(&w.bytes, 0);
+  for(size_t i=0; i<n; ++i) files[i].index = todo[i] = i;
+  exact_dupes_stats st = {n};
+
+  exact_dupes_run(&w, jobs, exact_dupes_stat, todo, n);
+  qsort(files, n, sizeof *files, exact_dupes_cmp);
+  st.sized = exact_dupes_shared(files, n, 0, todo);
+  exact_dupes_run(&w, jobs, exact_dupes_ends, todo, st.sized);
+  qsort(files, n, sizeof *files, exact_dupes_cmp);
+  // Short files were read whole already.
+  st.ends = 0;
+  const size_t nends = exact_dupes_shared(files, n, 1, todo);
+  for(size_t i=0; i<nends; ++i)
+    if(files[todo[i]].size > 2 * EXACT_DUPES_END) todo[st.ends++] = todo[i];
+  exact_dupes_run(&w, jobs, exact_dupes_whole, todo, st.ends);
+  qsort(files, n, sizeof *files, exact_dupes_cmp);
+
+  // Copies are adjacent now, their leader first.
+  for(size_t i=0; i<n; ++i){
+    st.failed += files[i].failed;
+    if(i && exact_dupes_same(files + i - 1, files + i, 2)){
+      leader[files[i].index] = leader[files[i-1].index];
+      ++st.copies;
+    } else leader[files[i].index] = files[i].index;
+  }
+  st.bytes = atomic_load(&w.bytes);
+  if(stats) *stats = st;
+  free(files);
+  free(todo);
+  return st.copies;
+}
+
+void exact_dupes_print_stats(FILE* fp, const exact_dupes_stats* st){
+  fprintf(fp, "%zu files, %zu failed: %zu share a size, %zu both ends; "
+    "%zu copies; %" PRIu64 " bytes read\n", st->files, st->failed,
+    st->sized, st->ends, st->copies, st->bytes);
+}
+
+/* Read the paths separated by @delim from @in, skipping empty ones, and
+ * return them, setting @n to how many there are.
+ */
+char** exact_dupes_read_paths(FILE* in, int delim, size_t* n){
+  char** paths = 0;
+  size_t cap = 0;
+  char* line = 0;
+  size_t len = 0;
+  ssize_t z;
+  *n = 0;
+  while(0 < (z = getdelim(&line, &len, delim, in))){
+    if(line[z-1] == delim) line[--z] = 0;
+    if(!z) continue;
+    if(*n == cap) paths = realloc(paths, (cap = cap ? 2*cap : 1024)
+      * sizeof(char*));
+    paths[(*n)++] = strdup(line);
+  }
+  free(line);
+  return paths;
+}
+
+#ifdef TEST_EXACT_DUPES
+#ifndef ASSERT_H
+#  define ASSERT_H
+#  include <assert.h>
+#endif
+
+static uint64_t test_xxh64(const void* data, size_t len){
+  exact_xxh64 x;
+  exact_xxh64_init(&x, 0);
+  exact_xxh64_update(&x, data, len);
+  return exact_xxh64_digest(&x);
+}
+
+static char* test_file(const char* dir, const char* name,
+  const unsigned char* data, size_t len)
+{
+  char* path = malloc(strlen(dir) + strlen(name) + 2);
+  sprintf(path, "%s/%s", dir, name);
+  FILE* fp = fopen(path, "wb");
+  assert(fp && (!len || 1 == fwrite(data, len, 1, fp)) && !fclose(fp));
+  return path;
+}
+
+int main(){
+  // Reference values.
+  assert(test_xxh64("", 0) == 0xef46db3751d8e999u);
+  assert(test_xxh64("abc", 3) == 0x44bc2cf5ad770999u);
+
+  // Any split of the input gives the same digest.
+  enum { LEN = 3 * EXACT_DUPES_END + 7 };
+  unsigned char* data = malloc(LEN);
+  uint64_t s = 1;
+  for(size_t i=0; i<LEN; ++i) data[i] = (s = s * 6364136223846793005u + 1)
+    >> 56;
+  for(size_t len=0; len<200; ++len){
+    const uint64_t h = test_xxh64(data, len);
+    for(size_t cut=0; cut<=len; cut+=7){
+      exact_xxh64 x;
+      exact_xxh64_init(&x, 0);
+      exact_xxh64_update(&x, data, cut);
+      exact_xxh64_update(&x, data + cut, len - cut);
+      assert(exact_xxh64_digest(&x) == h);
+    }
+  }
+
+  char dir[] = "/tmp/test-exact-dupes.XXXXXX";
+  assert(mkdtemp(dir));
+  unsigned char* other = malloc(LEN);
+  memcpy(other, data, LEN);
+  other[LEN / 2] ^= 1;               // same size and ends, other middle
+  char* paths[] = {
+    test_file(dir, "0", data, LEN),
+    test_file(dir, "1", other, LEN),
+    test_file(dir, "2", data, LEN),          // copy of 0
+    test_file(dir, "3", data, 100),
+    test_file(dir, "4", data + 1, 100),      // same size, other bytes
+    test_file(dir, "5", data, 100),          // copy of 3
+    test_file(dir, "6", data, 0),
+    test_file(dir, "7", data, 0),            // copy of 6
+    test_file(dir, "8", data, 2 * EXACT_DUPES_END),
+    test_file(dir, "9", data, 2 * EXACT_DUPES_END),   // copy of 8
+    test_file(dir, "10", other, LEN),        // copy of 1
+    test_file(dir, "11", data, 55),          // size of its own
+    strdup("/nonexistent/exact"),
+    strdup(dir),                             // a directory
+    0,
+  };
+  paths[14] = malloc(strlen(dir) + 8);
+  sprintf(paths[14], "%s/link", dir);
+  assert(!link(paths[0], paths[14]));        // hard link to 0
+  const size_t n = sizeof paths / sizeof *paths;
+  const size_t expect[] = {0, 1, 0, 3, 4, 3, 6, 6, 8, 8, 1, 11, 12, 13, 0};
+  size_t leader[sizeof paths / sizeof *paths];
+  for(int jobs=1; jobs<=3; jobs+=2){
+    exact_dupes_stats st;
+    const exact_dupes_opts opts = {jobs};
+    assert(exact_dupes_find(paths, n, &opts, leader, &st) == 6);
+    for(size_t i=0; i<n; ++i) assert(leader[i] == expect[i]);
+    assert(st.files == n && st.failed == 2 && st.copies == 6);
+    // 11 and the failures aren't read; 0, 1, 2, 10 and the link are read
+    // whole.
+    assert(st.sized == n - 3 && st.ends == 5);
+  }
+  assert(!exact_dupes_find(paths, 0, &(exact_dupes_opts){0}, leader, 0));
+
+  // Read back from a list.
+  FILE* in = tmpfile();
+  fputs("a\n\nbb\nc", in);
+  rewind(in);
+  size_t nread;
+  char** read = exact_dupes_read_paths(in, '\n', &nread);
+  fclose(in);
+  assert(nread == 3 && !strcmp(read[1], "bb") && !strcmp(read[2], "c"));
+  for(size_t i=0; i<nread; ++i) free(read[i]);
+  free(read);
+
+  for(size_t i=0; i<n; ++i){
+    if(i != 12 && i != 13) assert(!unlink(paths[i]));
+    free(paths[i]);
+  }
+  assert(!rmdir(dir));
+  free(data);
+  free(other);
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#elif defined(CMD_EXACT_DUPES)
+int main(int argc, char* argv[argc]){
+  exact_dupes_opts opts = {0};
+  int delim = '\n', stats = 0, stream = 0, usage = 0;
+  char* list = 0;
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "-0")) delim = '\0';
+    else if(!strcmp(argv[i], "--jobs") && i+1 < argc)
+      opts.jobs = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--stats")) stats = 1;
+    else if(!strcmp(argv[i], "--from") && i+1 < argc) list = argv[++i];
+    else if(!strcmp(argv[i], "-")) stream = 1;
+    else usage = 1;
+  }
+  if(usage || stream == !!list){
+    fprintf(stderr, "Usage: %s [-0] [--jobs <N>] [--stats] "
+      "{- | --from <LIST>}\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  FILE* in = list ? fopen(list, "r") : stdin;
+  if(!in){
+    fprintf(stderr, "Failed to open path list %s.\n", list);
+    exit(EXIT_FAILURE);
+  }
+  size_t n;
+  char** paths = exact_dupes_read_paths(in, delim, &n);
+  if(in != stdin) fclose(in);
+  size_t* leader = malloc((n + 1) * sizeof(size_t));
+  size_t* members = calloc(n + 1, sizeof(size_t));
+  exact_dupes_stats st;
+  exact_dupes_find(paths, n, &opts, leader, &st);
+  for(size_t i=0; i<n; ++i) ++members[leader[i]];
+  for(size_t i=0; i<n; ++i)
+    if(members[leader[i]] > 1) printf("%zu\t%s\n", leader[i], paths[i]);
+  const int failed = fflush(stdout) != 0;
+  if(stats) exact_dupes_print_stats(stderr, &st);
+  for(size_t i=0; i<n; ++i) free(paths[i]);
+  free(paths);
+  free(leader);
+  free(members);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
@@ -11,17 +11,21 @@
  *
  * Compile
  *
-gcc generate_duplicates.c -DTEST_GENERATE_DUPLICATES -luuid -o test-generate-duplicates -Wall -g
+gcc generate_duplicates.c -DTEST_GENERATE_DUPLICATES -luuid -o test-generate-duplicates -Wall -g -pthread
  *
-gcc generate_duplicates.c -DCMD_GENERATE_DUPLICATES -luuid -o generate-duplicates -Wall -g -luuid
+gcc generate_duplicates.c -DCMD_GENERATE_DUPLICATES -luuid -o generate-duplicates -Wall -g -luuid -pthread
  * 
  * 
  * Run 
  *
  * ./test-generate-duplicates 
  * 
- * ./generate-duplicates <SOURCE_DIR> <TARGET_DIR> 
- *  
+ * ./generate-duplicates [--copy <STRATEGY>] <SOURCE_DIR> <TARGET_DIR>
+ *
+ * The copies are reflinks, hardlinks or symlinks where the filesystem allows
+ * (see copy_strategy.c), so a large set costs metadata instead of data
+ * writes. --copy copy_file_range (or copy) forces real copies.
+ *
 
  * Debug
  *
@@ -93,9 +97,9 @@ gcc generate_duplicates.c -DCMD_GENERATE_DUPLICATES -luuid -o generate-duplicate
 #  include "join_dir_to_name.c"
 #endif
 
-#ifndef COPY_H
-#  define COPY_H
-#  include "copy.c"
+#ifndef COPY_STRATEGY_H
+#  define COPY_STRATEGY_H
+#  include "copy_strategy.c"
 #endif
 
 #ifndef UUID_H
@@ -108,52 +112,55 @@ gcc generate_duplicates.c -DCMD_GENERATE_DUPLICATES -luuid -o generate-duplicate
 #  include "split.c"
 #endif
 
-void generate_duplicates(
-  char source_dir[SZ_PATH],
-  char target_dir[SZ_PATH]) 
-{
-  // Open source dir
-  DIR* d = opendir(source_dir);
-  int fd;
-  struct dirent* e;
-  struct stat stat;
+#ifndef DIR_WALK_H
+#  define DIR_WALK_H
+#  include "dir_walk.c"
+#endif
+
+typedef struct generate_duplicates_arg generate_duplicates_arg;
+struct generate_duplicates_arg {
+  char* target_dir;
+  copy_strategy first;
+};
+
+static int generate_duplicates_visit(const dir_walk_entry* e, void* arg){
+  generate_duplicates_arg* a = (generate_duplicates_arg*) arg;
+  char* target_dir = a->target_dir;
   char name[SZ_NAME]={0}, ext[SZ_NAME]={0}, in_path[SZ_PATH]={0},
     out_path_a[SZ_PATH]={0}, out_path_b[SZ_PATH]={0}, 
     name_wext_a[3*SZ_NAME]={0}, name_wext_b[3*SZ_NAME]={0};
-  if(d){
-    // Loop over directory entries.
-    while((e = readdir(d))){
-      // Form input file path from dir and entry name.
-      join_dir_to_name(in_path, source_dir, e->d_name);
-      // Stat the entry, so we can get the type from the stat mode.
-      if(-1 == (fd = open(in_path, O_RDONLY)) || fstat(fd, &stat)){
-        fprintf(stderr, "Failed to inspect %s\n", e->d_name);
-        exit(EXIT_FAILURE);
-      }
-      // Only copy regular files. Check using S_ISREG macro and the stat mode.
-      if(S_ISREG(stat.st_mode)){
-        // Split into name and extension. e.g. "/foo/bar.baz" -> "bar" and "baz"
-        split(name, ext, in_path);
-        // Make output names with _a and _b extensions in the names.
-        snprintf(name_wext_a, 3*SZ_NAME, "%s_a.%s", name, ext);
-        snprintf(name_wext_b, 3*SZ_NAME, "%s_b.%s", name, ext);
-        join_dir_to_name(out_path_a, target_dir, name_wext_a);
-        join_dir_to_name(out_path_b, target_dir, name_wext_b);
-        // Use constructed input and output paths to make two copies.
-        if(copy(in_path, out_path_a) || copy(in_path, out_path_b)){
-          close(fd);
-          closedir(d);
-          fprintf(stderr, "Couldn't copy file %s.", in_path);
-          exit(EXIT_FAILURE);
-        }
-      }
-      close(fd);
-    }
-    closedir(d);
-  }else{
-    fprintf(stderr, "Couldn't open directory.");
-    exit(EXIT_FAILURE);
+  strncpy(in_path, e->path, SZ_PATH-1);
+  // Split into name and extension. e.g. "/foo/bar.baz" -> "bar" and "baz"
+  split(name, ext, in_path);
+  // Make output names with _a and _b extensions in the names.
+  snprintf(name_wext_a, 3*SZ_NAME, "%s_a.%s", name, ext);
+  snprintf(name_wext_b, 3*SZ_NAME, "%s_b.%s", name, ext);
+  join_dir_to_name(out_path_a, target_dir, name_wext_a);
+  join_dir_to_name(out_path_b, target_dir, name_wext_b);
+  // Use constructed input and output paths to make two copies.
+  if(0 > copy_with_strategy(in_path, out_path_a, a->first)
+    || 0 > copy_with_strategy(in_path, out_path_b, a->first)){
+    fprintf(stderr, "Couldn't copy file %s: %s\n", in_path, strerror(errno));
+    return 1;
   }
+  return 0;
+}
+
+/* Make the _a and _b copies of each regular file in @source_dir in
+ * @target_dir, trying copy strategies from @first on (see copy_strategy.c).
+ * Files that can't be read or copied are reported and skipped. Return the
+ * number of those.
+ */
+long generate_duplicates(
+  char source_dir[SZ_PATH],
+  char target_dir[SZ_PATH],
+  copy_strategy first)
+{
+  generate_duplicates_arg arg = {target_dir, first};
+  // Only regular files are copied. Their type comes from the directory
+  // entry, so nothing is opened just to be fstat'ed.
+  dir_walk_opts opts = {0, 1, 1};
+  return dir_walk_run(source_dir, &opts, generate_duplicates_visit, &arg);
 }
 
 #ifdef TEST_GENERATE_DUPLICATES
@@ -207,7 +214,7 @@ int main(){
   }
 
   // Generate duplicates in target dir.
-  generate_duplicates(source_dir_name, target_dir_name);
+  generate_duplicates(source_dir_name, target_dir_name, COPY_REFLINK);
 
   // Form the expected names.
   char exp_path_1_a[SZ_PATH]={0}, exp_path_1_b[SZ_PATH]={0},
@@ -248,13 +255,21 @@ int main(){
   return EXIT_SUCCESS;
 }
 #elif defined(CMD_GENERATE_DUPLICATES)
-// Usage: ./generate-duplicates <SOURCE_DIR> <TARGET_DIR> 
+// Usage: ./generate-duplicates [--copy <STRATEGY>] <SOURCE_DIR> <TARGET_DIR>
 int main(int argc, char* argv[argc]){
-  if(argc!=3){
-    printf("Usage: %s <SOURCE_DIR> <TARGET_DIR>\n", argv[0]);
+  const char* prog = argv[0];
+  int first = COPY_REFLINK;
+  if(argc==5 && !strcmp(argv[1], "--copy")){
+    first = copy_strategy_parse(argv[2]);
+    argv += 2;
+    argc -= 2;
+  }
+  if(argc!=3 || 0>first){
+    printf("Usage: %s [--copy auto|reflink|hardlink|symlink|copy_file_range"
+      "|copy] <SOURCE_DIR> <TARGET_DIR>\n", prog);
     exit(EXIT_FAILURE);
   }
-  generate_duplicates(argv[1], argv[2]);
-  return EXIT_SUCCESS;
+  return generate_duplicates(argv[1], argv[2], first) ? EXIT_FAILURE
+    : EXIT_SUCCESS;
 }
 #endif
@@ -13,7 +13,10 @@ gcc  generate_nonduplicates.c -o generate-nonduplicates -luuid -DRUN_GENERATE_NO
  *
  *  USAGE
  *
- *  ./generate_nonduplicates <SOURCE_DIR> <TARGET_DIR>
+ *  ./generate_nonduplicates [--copy <STRATEGY>] <SOURCE_DIR> <TARGET_DIR>
+ *
+ *  Copies are reflinks, hardlinks or symlinks where the filesystem allows
+ *  (see copy_strategy.c). --copy copy_file_range (or copy) forces real copies.
  *
  *
  *  COMPILE TEST
@@ -89,9 +92,9 @@ gcc generate_nonduplicates.c -o test-generate-nonduplicates -luuid -DTEST_GENERA
 #  include "join_dir_to_name.c"
 #endif
 
-#ifndef COPY_H
-#  define COPY_H
-#  include "copy.c"
+#ifndef COPY_STRATEGY_H
+#  define COPY_STRATEGY_H
+#  include "copy_strategy.c"
 #endif
 
 #ifndef UUID_H
@@ -121,9 +124,13 @@ file_info* file_info_zero(file_info* f_info){
   return f_info;
 }
 
+// The first copy strategy to try (see copy_strategy.c).
+static copy_strategy copy_file_first = COPY_REFLINK;
+
 void copy_file_from_to(char* source, char* target){
-  if(copy(source, target)){
-    fprintf(stderr, "Couldn't copy file %s to %s.", source, target);
+  if(0 > copy_with_strategy(source, target, copy_file_first)){
+    fprintf(stderr, "Couldn't copy file %s to %s: %s\n", source, target,
+      strerror(errno));
     exit(EXIT_FAILURE);
   } 
 }
@@ -271,12 +278,16 @@ static void close_files_and_dirs(){
  * original filename, and each original filename gets exactly one pair of files.
  * The "a" copy is always a copy of the file its named after. The "b" copy is
  * always a copy of the file before that (using a circular version of the list
- * returned by readdir).
+ * returned by readdir). Copies are made with strategies from @first on (see
+ * copy_strategy.c).
  */
 static void generate_nonduplicates(
   char source_dir[SZ_PATH], 
-  char target_dir[SZ_PATH])
+  char target_dir[SZ_PATH],
+  copy_strategy first)
 {
+  copy_file_first = first;
+
   // Buffers for building the a and b output file names.
   char name_wext_a[3*SZ_NAME]={0}, name_wext_b[3*SZ_NAME]={0};
 
@@ -391,7 +402,7 @@ int main(){
     fprintf(stderr, "Failed to created directory %s.\n", target_dir_name);
     exit(EXIT_FAILURE);
   } 
-  generate_nonduplicates(source_dir_name, target_dir_name);
+  generate_nonduplicates(source_dir_name, target_dir_name, COPY_REFLINK);
 
   // Form the expected paths for the output files, and test they are correct.
   char exp_path_1_a[SZ_PATH]={0}, exp_path_1_b[SZ_PATH]={0}, 
@@ -434,11 +445,19 @@ int main(){
 }
 #elif defined(RUN_GENERATE_NONDUPLICATES)
 int main(int argc, char* argv[]){
-  if(argc!=3 || !*argv[1] || !*argv[2]){
-    fprintf(stderr, "Usage: %s <SOURCE_DIR> <TARGET_DIR>\n", argv[0]);
+  const char* prog = argv[0];
+  int first = COPY_REFLINK;
+  if(argc==5 && !strcmp(argv[1], "--copy")){
+    first = copy_strategy_parse(argv[2]);
+    argv += 2;
+    argc -= 2;
+  }
+  if(argc!=3 || !*argv[1] || !*argv[2] || 0>first){
+    fprintf(stderr, "Usage: %s [--copy auto|reflink|hardlink|symlink"
+      "|copy_file_range|copy] <SOURCE_DIR> <TARGET_DIR>\n", prog);
     exit(EXIT_FAILURE);
   } 
-  generate_nonduplicates(argv[1], argv[2]);
+  generate_nonduplicates(argv[1], argv[2], first);
   return EXIT_SUCCESS;
 }
 #endif
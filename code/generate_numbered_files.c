@@ -7,7 +7,7 @@
  *
  * Compile
  *
-gcc generate_numbered_files.c -o generate-numbered-files -DCMD_GENERATE_NUMBERED_FILES -luuid
+gcc generate_numbered_files.c -o generate-numbered-files -DCMD_GENERATE_NUMBERED_FILES -luuid -pthread
  * 
  *
  * Usage
@@ -17,7 +17,7 @@ gcc generate_numbered_files.c -o generate-numbered-files -DCMD_GENERATE_NUMBERED
  *
  * Compile test
  * 
-gcc generate_numbered_files.c -DTEST_GENERATE_NUMBERED_FILES -luuid -o test-generate-numbered-files
+gcc generate_numbered_files.c -DTEST_GENERATE_NUMBERED_FILES -luuid -pthread -o test-generate-numbered-files
  * 
  *
  * Test
@@ -91,6 +91,11 @@ gcc generate_numbered_files.c -DTEST_GENERATE_NUMBERED_FILES -luuid -o test-gene
 #  include "split.c"
 #endif
 
+#ifndef DIR_WALK_H
+#  define DIR_WALK_H
+#  include "dir_walk.c"
+#endif
+
 #ifndef SZ_NAME
 #  define SZ_NAME 256
 #endif
@@ -103,43 +108,41 @@ gcc generate_numbered_files.c -DTEST_GENERATE_NUMBERED_FILES -luuid -o test-gene
 #  define PATH_SEP '/'
 #endif
 
-void generate_numbered_files(
+typedef struct generate_numbered_files_arg generate_numbered_files_arg;
+struct generate_numbered_files_arg {
+  char* target_dir;
+  int i;
+};
+
+static int generate_numbered_files_visit(const dir_walk_entry* e, void* _arg){
+  generate_numbered_files_arg* arg = (generate_numbered_files_arg*) _arg;
+  char old_name[SZ_NAME]={0}, ext[SZ_NAME]={0}, new_name[2*SZ_NAME], 
+    in_path[SZ_PATH]={0}, out_path[SZ_PATH]={0};
+  strncpy(in_path, e->path, SZ_PATH-1);
+  split(old_name, ext, in_path);
+  snprintf(new_name, 2*SZ_NAME, "%d%s%s", arg->i++, *ext?".":"", ext);
+  join_dir_to_name(out_path, arg->target_dir, new_name);
+  if(copy(in_path, out_path)){
+    fprintf(stderr, "Failed to copy %s to %s.\n", in_path, out_path);
+    return 1;
+  }
+  return 0;
+}
+
+/* Copy each regular file in @source_dir to @target_dir, numbered from
+ * @start_index. Files that can't be read or copied are reported and skipped.
+ * Return the number of those.
+ */
+long generate_numbered_files(
   char source_dir[SZ_PATH],
   char target_dir[SZ_PATH],
   int start_index) 
 {
-  //Open source dir
-  DIR* d = opendir(source_dir);
-  int fd, i = start_index > 0 ? start_index : 0;
-  struct dirent* e;
-  struct stat stat;
-  char old_name[SZ_NAME]={0}, ext[SZ_NAME]={0}, new_name[2*SZ_NAME], 
-    in_path[SZ_PATH]={0}, out_path[SZ_PATH]={0};
-  if(d){
-    while((e = readdir(d))){
-      join_dir_to_name(in_path, source_dir, e->d_name);
-      if(0>(fd = open(in_path, O_RDONLY)) || fstat(fd, &stat)){
-        fprintf(stderr, "Failed to open and/or stat file.");
-        exit(EXIT_FAILURE);
-      }
-      if(S_ISREG(stat.st_mode)){
-        split(old_name, ext, in_path);
-        snprintf(new_name, 2*SZ_NAME, "%d%s%s", i++, *ext?".":"", ext);
-        join_dir_to_name(out_path, target_dir, new_name);
-        if(copy(in_path, out_path)){
-          close(fd);
-          closedir(d);
-          fprintf(stderr, "Failed to copy %s to %s.\n", in_path, out_path);
-          exit(EXIT_FAILURE);
-        }
-      }
-      close(fd);
-    }
-    closedir(d);
-  }else{
-    fprintf(stderr, "Couldn't open directory.");
-    exit(EXIT_FAILURE);
-  }
+  generate_numbered_files_arg arg = {target_dir,
+    start_index > 0 ? start_index : 0};
+  // One job, so the numbering follows the directory order.
+  dir_walk_opts opts = {0, 1, 1};
+  return dir_walk_run(source_dir, &opts, generate_numbered_files_visit, &arg);
 }
 
 #ifdef TEST_GENERATE_NUMBERED_FILES
@@ -206,7 +209,7 @@ int main(int argc, char* argv[argc]) {
       argv[0]);
     exit(EXIT_FAILURE);
   }
-  generate_numbered_files(argv[1], argv[2], 1);
-  return EXIT_SUCCESS;
+  return generate_numbered_files(argv[1], argv[2], 1) ? EXIT_FAILURE
+    : EXIT_SUCCESS;
 }
 #endif
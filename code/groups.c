@@ -0,0 +1,466 @@
+/* groups.c
+ *
+ * Turn a stream of matching pairs into groups of near-duplicates, each with
+ * one image to keep, for review before deleting the rest.
+ *
+ * Pairs are indices into a hash database (hash_db.c), one per line, as the
+ * truth file of synth_hashes.c and a threshold join write them:
+ *
+ *   <a>\t<b>[\t<anything>]
+ *
+ * with '#' lines ignored. They are streamed into a union_find (see
+ * union_find.c), never stored: the reading thread parses them into batches
+ * of GROUPS_BATCH pairs, and with more than one job a pool of threads takes
+ * batches off a short queue and adds them with union_find_union_atomic.
+ * Memory is 8 bytes per image in the database, plus 12 per image in a group
+ * when choosing what to keep, so 100M images fit in about 1 GB however many
+ * pairs there are.
+ *
+ * The image kept in each group is the one with the most pixels (read from
+ * the header only), the oldest modification time, or the smallest index,
+ * which is all a database without paths has. Ties go to the smallest index.
+ * An image whose size or time can't be read is never kept unless the whole
+ * group fails.
+ *
+ * Output is one line per image in a group, with the image kept first and
+ * groups in order of their smallest index:
+ *
+ *   <group>\tkeep|dup\t<index>\t<path>
+ *
+ * The path is "-" for a database without paths. --remove-list writes just
+ * the paths of the dup images instead, one per line, which is the input
+ * prompt_remove_all expects.
+ *
+ * Compile test
+ *
+gcc groups.c -o test-groups -DTEST_GROUPS -g -Wall -pthread `pkg-config vips --cflags --libs`
+ *
+ * Compile
+ *
+gcc groups.c -o idhash-groups -DCMD_GROUPS -O2 -g -Wall -pthread `pkg-config vips --cflags --libs`
+ *
+ * Usage
+ *
+ * ./idhash-groups [--jobs <N>] [--keep largest|oldest|first] [--remove-list]
+ *   <DB> <PAIRS>
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef ERRNO_H
+#  define ERRNO_H
+#  include <errno.h>
+#endif
+
+#ifndef PTHREAD_H
+#  define PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#ifndef SYS_STAT_H
+#  define SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
+#ifndef HASH_DB_H
+#  define HASH_DB_H
+#  include "hash_db.c"
+#endif
+
+#ifndef UNION_FIND_H
+#  define UNION_FIND_H
+#  include "union_find.c"
+#endif
+
+#ifndef DIR_WALK_H
+#  define DIR_WALK_H
+#  include "dir_walk.c"
+#endif
+
+#define GROUPS_BATCH 65536
+
+typedef enum groups_keep {
+  GROUPS_KEEP_LARGEST,
+  GROUPS_KEEP_OLDEST,
+  GROUPS_KEEP_FIRST
+} groups_keep;
+
+const char* const groups_keep_names[] = {"largest", "oldest", "first"};
+
+typedef struct groups_opts groups_opts;
+struct groups_opts {
+  int jobs;               // threads, or 0 for one per online CPU
+  groups_keep keep;
+  int remove_list;
+};
+
+typedef struct groups_batch groups_batch;
+struct groups_batch {
+  uint32_t (*pairs)[2];
+  size_t n;
+};
+
+/* Full batches from the reader to the union threads. A NULL pairs array
+ * means there are no more.
+ */
+typedef struct groups_queue groups_queue;
+struct groups_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t nonempty;
+  pthread_cond_t nonfull;
+  groups_batch* ring;
+  size_t cap;
+  size_t head;
+  size_t count;
+  union_find* uf;
+};
+
+static void groups_queue_push(groups_queue* q, groups_batch b){
+  pthread_mutex_lock(&q->lock);
+  while(q->count == q->cap) pthread_cond_wait(&q->nonfull, &q->lock);
+  q->ring[(q->head + q->count++) % q->cap] = b;
+  pthread_cond_signal(&q->nonempty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static groups_batch groups_queue_pop(groups_queue* q){
+  pthread_mutex_lock(&q->lock);
+  while(!q->count) pthread_cond_wait(&q->nonempty, &q->lock);
+  groups_batch b = q->ring[q->head];
+  q->head = (q->head + 1) % q->cap;
+  --q->count;
+  pthread_cond_signal(&q->nonfull);
+  pthread_mutex_unlock(&q->lock);
+  return b;
+}
+
+static void* groups_union_thread(void* arg){
+  groups_queue* q = (groups_queue*) arg;
+  for(groups_batch b; (b = groups_queue_pop(q)).pairs; ){
+    for(size_t i=0; i<b.n; ++i)
+      union_find_union_atomic(q->uf, b.pairs[i][0], b.pairs[i][1]);
+    free(b.pairs);
+  }
+  return 0;
+}
+
+/* Parse a pair from @line into @a and @b. Return 1 for a pair, 0 for a
+ * comment or blank line, -1 if the line is malformed or an index isn't
+ * below @n.
+ */
+static int groups_parse_pair(const char* line, size_t n, uint32_t* a,
+  uint32_t* b)
+{
+  if(*line == '#' || *line == '\n' || !*line) return 0;
+  char* end;
+  errno = 0;
+  const unsigned long long x = strtoull(line, &end, 10);
+  if(end == line || *end != '\t' || errno) return -1;
+  const char* p = end + 1;
+  const unsigned long long y = strtoull(p, &end, 10);
+  if(end == p || (*end && *end != '\t' && *end != '\n') || errno
+    || x >= n || y >= n)
+    return -1;
+  *a = x;
+  *b = y;
+  return 1;
+}
+
+/* Read the pairs in @fp into @uf, on @opts->jobs threads. Return the
+ * number of pairs, or -1 on a malformed line.
+ */
+long groups_read_pairs(FILE* fp, union_find* uf, const groups_opts* opts){
+  int jobs = opts->jobs > 0 ? opts->jobs : dir_walk_ncpus();
+  groups_queue q = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER};
+  q.uf = uf;
+  q.cap = 2 * jobs;
+  q.ring = calloc(q.cap, sizeof *q.ring);
+  pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+  if(jobs > 1)
+    for(int i=0; i<jobs; ++i)
+      pthread_create(threads + i, 0, groups_union_thread, &q);
+
+  char* line = 0;
+  size_t sz = 0;
+  long npairs = 0, lineno = 0;
+  groups_batch b = {0};
+  int z = 0;
+  while(0 < getline(&line, &sz, fp)){
+    ++lineno;
+    uint32_t x, y;
+    if(!(z = groups_parse_pair(line, uf->n, &x, &y))) continue;
+    if(z < 0){
+      fprintf(stderr, "Malformed pair on line %ld.\n", lineno);
+      break;
+    }
+    ++npairs;
+    if(jobs == 1){
+      union_find_union(uf, x, y);
+      continue;
+    }
+    if(!b.pairs) b.pairs = malloc(GROUPS_BATCH * sizeof *b.pairs);
+    b.pairs[b.n][0] = x;
+    b.pairs[b.n][1] = y;
+    if(++b.n == GROUPS_BATCH){
+      groups_queue_push(&q, b);
+      b = (groups_batch){0};
+    }
+  }
+  free(line);
+
+  if(jobs > 1){
+    if(b.n) groups_queue_push(&q, b);
+    else free(b.pairs);
+    for(int i=0; i<jobs; ++i) groups_queue_push(&q, (groups_batch){0});
+    for(int i=0; i<jobs; ++i) pthread_join(threads[i], 0);
+  }
+  free(threads);
+  free(q.ring);
+  return z < 0 ? -1 : npairs;
+}
+
+/* How much to prefer keeping each image in a group: larger is better, and
+ * 0 means it couldn't be read.
+ */
+typedef struct groups_keys groups_keys;
+struct groups_keys {
+  const hash_db* db;
+  groups_keep keep;
+  const uint32_t* images;
+  guint64* keys;
+  size_t n;
+  atomic_size_t next;
+  pthread_mutex_t err_lock;
+};
+
+static guint64 groups_key(groups_keys* k, uint32_t i){
+  if(k->keep == GROUPS_KEEP_FIRST) return 1;
+  size_t len;
+  const char* p = hash_db_path(k->db, i, &len);
+  char path[SZ_PATH];
+  if(!p || len >= SZ_PATH) return 0;
+  memcpy(path, p, len);
+  path[len] = 0;
+  if(k->keep == GROUPS_KEEP_OLDEST){
+    struct stat st;
+    if(stat(path, &st)){
+      pthread_mutex_lock(&k->err_lock);
+      fprintf(stderr, "%s: %s\n", path, strerror(errno));
+      pthread_mutex_unlock(&k->err_lock);
+      return 0;
+    }
+    const guint64 ns = (guint64) st.st_mtim.tv_sec * 1000000000u
+      + st.st_mtim.tv_nsec;
+    return G_MAXUINT64 - ns;
+  }
+  // Only the header is read.
+  VipsImage* im = vips_image_new_from_file(path, NULL);
+  if(!im){
+    // The vips error buffer is shared with the other key threads, so its
+    // text may be theirs: give a fixed reason.
+    vips_error_clear();
+    pthread_mutex_lock(&k->err_lock);
+    fprintf(stderr, "%s: libvips could not read the header\n", path);
+    pthread_mutex_unlock(&k->err_lock);
+    return 0;
+  }
+  const guint64 pixels = (guint64) vips_image_get_width(im)
+    * vips_image_get_height(im);
+  g_object_unref(im);
+  return pixels + 1;
+}
+
+static void* groups_key_thread(void* arg){
+  groups_keys* k = (groups_keys*) arg;
+  for(size_t i; (i = atomic_fetch_add(&k->next, 1)) < k->n; )
+    k->keys[i] = groups_key(k, k->images[i]);
+  if(k->keep == GROUPS_KEEP_LARGEST) vips_thread_shutdown();
+  return 0;
+}
+
+/* Write the groups of @uf, after union_find_groups, to @fp, keeping one
+ * image per group by @opts->keep. Return the number of groups, or -1 on a
+ * write error.
+ */
+long groups_write(FILE* fp, union_find* uf, const hash_db* db,
+  const groups_opts* opts)
+{
+  // The images in groups, a group at a time.
+  size_t n = 0;
+  for(size_t r=0; r<uf->n; ++r)
+    if(union_find_is_group(uf, r))
+      for(uint32_t i=r; i!=UNION_FIND_NONE; i=uf->next[i]) ++n;
+  uint32_t* images = malloc(n * sizeof *images + 1);
+  n = 0;
+  for(size_t r=0; r<uf->n; ++r)
+    if(union_find_is_group(uf, r))
+      for(uint32_t i=r; i!=UNION_FIND_NONE; i=uf->next[i]) images[n++] = i;
+
+  groups_keys k = {db, opts->keep, images, malloc(n * sizeof(guint64) + 1),
+    n};
+  atomic_init(&k.next, 0);
+  pthread_mutex_init(&k.err_lock, 0);
+  int jobs = opts->jobs > 0 ? opts->jobs : dir_walk_ncpus();
+  if(opts->keep == GROUPS_KEEP_FIRST) jobs = 1;
+  pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+  for(int i=0; i<jobs; ++i)
+    pthread_create(threads + i, 0, groups_key_thread, &k);
+  for(int i=0; i<jobs; ++i)
+    pthread_join(threads[i], 0);
+  free(threads);
+  pthread_mutex_destroy(&k.err_lock);
+
+  long ngroups = 0;
+  int z = 0;
+  for(size_t start=0; start<n && z >= 0; ++ngroups){
+    size_t end = start, best = start;
+    do {
+      if(k.keys[end] > k.keys[best]) best = end;
+    } while(uf->next[images[end++]] != UNION_FIND_NONE);
+    for(size_t j=0; j<end-start && z >= 0; ++j){
+      // The kept image first, then the rest in order.
+      const size_t at = !j ? best : start + j - (start + j <= best);
+      const uint32_t i = images[at];
+      size_t len = 1;
+      const char* path = hash_db_path(db, i, &len);
+      if(!path) path = "-";
+      if(opts->remove_list){
+        if(j) z = fprintf(fp, "%.*s\n", (int) len, path);
+      } else {
+        z = fprintf(fp, "%ld\t%s\t%u\t%.*s\n", ngroups, j ? "dup" : "keep",
+          i, (int) len, path);
+      }
+    }
+    start = end;
+  }
+  free(images);
+  free(k.keys);
+  return z < 0 ? -1 : ngroups;
+}
+
+#ifdef TEST_GROUPS
+int main(int argc, char* argv[argc]){
+  if(VIPS_INIT(argv[0]))
+    vips_error_exit(NULL);
+  char fname[] = "/tmp/test-groups.XXXXXX";
+  int fd = mkstemp(fname);
+  assert(fd >= 0);
+  close(fd);
+  const idhash_hash hashes[6] = {{0}};
+  const char* paths[6] = {"a", "b", "c", "d", "e", "f"};
+  FILE* fp = fopen(fname, "wb");
+  assert(!hash_db_write(fp, hashes, 6, paths));
+  fclose(fp);
+  hash_db* db = hash_db_open(fname);
+  assert(db);
+
+  assert(-1 == groups_parse_pair("1\t6\n", 6, 0, 0));
+  assert(-1 == groups_parse_pair("1 2\n", 6, 0, 0));
+  assert(0 == groups_parse_pair("# a b\n", 6, 0, 0));
+
+  const char* expected =
+    "0\tkeep\t1\tb\n0\tdup\t3\td\n0\tdup\t5\tf\n"
+    "1\tkeep\t2\tc\n1\tdup\t4\te\n";
+  for(int jobs=1; jobs<=4; jobs+=3){
+    FILE* in = tmpfile();
+    fputs("# pairs\n5\t3\t7\n3\t1\n2\t4\n5\t1\n", in);
+    rewind(in);
+    union_find* uf = union_find_create(db->count);
+    groups_opts opts = {jobs, GROUPS_KEEP_FIRST};
+    assert(4 == groups_read_pairs(in, uf, &opts));
+    fclose(in);
+    assert(!union_find_groups(uf));
+    char* buf = 0;
+    size_t sz = 0;
+    FILE* out = open_memstream(&buf, &sz);
+    assert(2 == groups_write(out, uf, db, &opts));
+    fclose(out);
+    assert(!strcmp(buf, expected));
+    free(buf);
+
+    opts.remove_list = 1;
+    out = open_memstream(&buf, &sz);
+    assert(2 == groups_write(out, uf, db, &opts));
+    fclose(out);
+    assert(!strcmp(buf, "d\nf\ne\n"));
+    free(buf);
+    union_find_destroy(uf);
+  }
+  hash_db_close(db);
+  remove(fname);
+
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#elif defined(CMD_GROUPS)
+int main(int argc, char* argv[argc]){
+  groups_opts opts = {0};
+  char* args[2] = {0};
+  int nargs = 0, usage = 0;
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--jobs") && i+1 < argc) opts.jobs = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--keep") && i+1 < argc){
+      ++i;
+      int k = 0;
+      while(k < 3 && strcmp(argv[i], groups_keep_names[k])) ++k;
+      usage |= k == 3;
+      opts.keep = k;
+    }
+    else if(!strcmp(argv[i], "--remove-list")) opts.remove_list = 1;
+    else if(nargs < 2) args[nargs++] = argv[i];
+    else usage = 1;
+  }
+  if(usage || nargs != 2){
+    fprintf(stderr, "Usage: %s [--jobs <N>] [--keep largest|oldest|first] "
+      "[--remove-list] <DB> <PAIRS>\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if(VIPS_INIT(argv[0]))
+    vips_error_exit(NULL);
+  hash_db* db = hash_db_open(args[0]);
+  if(!db) exit(EXIT_FAILURE);
+  if(!db->path_offsets && opts.keep != GROUPS_KEEP_FIRST){
+    fprintf(stderr, "%s has no paths: use --keep first.\n", args[0]);
+    exit(EXIT_FAILURE);
+  }
+  union_find* uf = union_find_create(db->count);
+  if(!uf){
+    fprintf(stderr, "Too many hashes: %zu.\n", db->count);
+    exit(EXIT_FAILURE);
+  }
+  FILE* fp = strcmp(args[1], "-") ? fopen(args[1], "r") : stdin;
+  if(!fp){
+    fprintf(stderr, "Failed to open %s: %s\n", args[1], strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  const long npairs = groups_read_pairs(fp, uf, &opts);
+  if(fp != stdin) fclose(fp);
+  if(npairs < 0 || union_find_groups(uf)) exit(EXIT_FAILURE);
+  const long ngroups = groups_write(stdout, uf, db, &opts);
+  if(ngroups < 0){
+    fprintf(stderr, "Failed to write the groups.\n");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, "%ld pairs, %ld groups, keep %s\n", npairs, ngroups,
+    groups_keep_names[opts.keep]);
+  union_find_destroy(uf);
+  hash_db_close(db);
+  vips_shutdown();
+  return EXIT_SUCCESS;
+}
+#endif
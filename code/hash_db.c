@@ -0,0 +1,437 @@
+/* hash_db.c
+ *
+ * A file of IDHashes laid out to be mapped into memory and searched in
+ * place, for tables too big to parse: 100M hashes is 3.2 GB.
+ *
+ * The layout, in host byte order:
+ *
+ *   char    magic[8]         "IDHASHD1"
+ *   guint64 count
+ *   guint64 paths            file offset of the path table, or 0 for none
+ *   guint64 reserved
+ *   idhash_hash hashes[count]
+ *
+ * and, if there are paths, the path table
+ *
+ *   guint64 offsets[count+1] path i is bytes[offsets[i]..offsets[i+1])
+ *   char    bytes[]          the paths, without terminating '\0's
+ *
+ * The 32-byte header keeps every hash 32-byte aligned in the mapping. A
+ * hash is named by its index, and the paths are only looked up for output,
+ * so a synthetic table (synth_hashes.c) needs none.
+ *
+ * hash_db_create makes a file of @count zeroed hashes mapped for writing,
+ * to be filled in place, and hash_db_write writes one from memory.
+ * `hash-db --from-records` converts the binary records of `idhash-components
+ * --binary` (idhash_record.c) into a database.
+ *
+ * Compile test
+ *
+gcc hash_db.c -o test-hash-db -DTEST_HASH_DB -g -Wall `pkg-config vips --cflags --libs`
+ *
+ * Compile
+ *
+gcc hash_db.c -o hash-db -DCMD_HASH_DB -g -Wall `pkg-config vips --cflags --libs`
+ *
+ * Usage: print the hashes as text records (see idhash_record.c), or convert
+ * binary records into a database
+ *
+ * ./hash-db <DB>
+ * ./hash-db --from-records <RECORDS> <DB>
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef ERRNO_H
+#  define ERRNO_H
+#  include <errno.h>
+#endif
+
+#ifndef ASSERT_H
+#  define ASSERT_H
+#  include <assert.h>
+#endif
+
+#ifndef FCNTL_H
+#  define FCNTL_H
+#  include <fcntl.h>
+#endif
+
+#ifndef UNISTD_H
+#  define UNISTD_H
+#  include <unistd.h>
+#endif
+
+#ifndef SYS_MMAN_H
+#  define SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
+
+#ifndef SYS_STAT_H
+#  define SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
+#ifndef IDHASH_H
+#  define IDHASH_H
+#  include "idhash.h"
+#endif
+
+#ifndef IDHASH_RECORD_H
+#  define IDHASH_RECORD_H
+#  include "idhash_record.c"
+#endif
+
+#define HASH_DB_MAGIC "IDHASHD1"
+#define SZ_HASH_DB_MAGIC 8
+
+typedef struct hash_db_header hash_db_header;
+struct hash_db_header {
+  char magic[SZ_HASH_DB_MAGIC];
+  guint64 count;
+  guint64 paths;
+  guint64 reserved;
+};
+
+/* A mapped database. @hashes is writable only if it came from
+ * hash_db_create.
+ */
+typedef struct hash_db hash_db;
+struct hash_db {
+  idhash_hash* hashes;
+  size_t count;
+  // The path table, or 0 if the database has no paths.
+  const guint64* path_offsets;
+  const char* path_bytes;
+  void* map;
+  size_t size;
+  int fd;        // kept for syncing, if from hash_db_create, or -1
+};
+
+/* Create the database @fname holding @count zeroed hashes and no paths, and
+ * map it for writing. The hashes are on disk once hash_db_close returns
+ * successfully. Return 0 if the file can't be created.
+ */
+hash_db* hash_db_create(const char* fname, size_t count){
+  const size_t size = sizeof(hash_db_header) + count * sizeof(idhash_hash);
+  int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0){
+    fprintf(stderr, "Failed to create hash database %s: %s\n", fname,
+      strerror(errno));
+    return 0;
+  }
+  void* map = MAP_FAILED;
+  if(!ftruncate(fd, size))
+    map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(map == MAP_FAILED){
+    fprintf(stderr, "Failed to create hash database %s: %s\n", fname,
+      strerror(errno));
+    close(fd);
+    return 0;
+  }
+  hash_db_header* h = map;
+  memcpy(h->magic, HASH_DB_MAGIC, SZ_HASH_DB_MAGIC);
+  h->count = count;
+  hash_db* db = calloc(1, sizeof *db);
+  db->hashes = (idhash_hash*) (h + 1);
+  db->count = count;
+  db->map = map;
+  db->size = size;
+  db->fd = fd;
+  return db;
+}
+
+/* Map the database @fname for reading. Return 0 if it can't be opened or
+ * isn't a hash database.
+ */
+hash_db* hash_db_open(const char* fname){
+  int fd = open(fname, O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st)){
+    fprintf(stderr, "Failed to open hash database %s: %s\n", fname,
+      strerror(errno));
+    if(fd >= 0) close(fd);
+    return 0;
+  }
+  const size_t size = st.st_size;
+  void* map = size < sizeof(hash_db_header) ? MAP_FAILED
+    : mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  const hash_db_header* h = map;
+  const size_t max = (size - sizeof *h) / sizeof(idhash_hash);
+  if(map == MAP_FAILED
+    || memcmp(h->magic, HASH_DB_MAGIC, SZ_HASH_DB_MAGIC)
+    || h->count > max
+    || (h->paths && (h->paths < sizeof *h + h->count * sizeof(idhash_hash)
+      || h->paths > size
+      || (size - h->paths) / sizeof(guint64) <= h->count))){
+    fprintf(stderr, "Not a hash database: %s\n", fname);
+    if(map != MAP_FAILED) munmap(map, size);
+    return 0;
+  }
+  hash_db* db = calloc(1, sizeof *db);
+  db->hashes = (idhash_hash*) (h + 1);
+  db->count = h->count;
+  db->map = map;
+  db->size = size;
+  db->fd = -1;
+  if(h->paths){
+    db->path_offsets = (const guint64*) ((const char*) map + h->paths);
+    db->path_bytes = (const char*) (db->path_offsets + h->count + 1);
+    const size_t nbytes = size - h->paths
+      - (h->count + 1) * sizeof(guint64);
+    for(size_t i=0; i<h->count; ++i)
+      if(db->path_offsets[i] > db->path_offsets[i+1]
+        || db->path_offsets[i+1] > nbytes){
+        fprintf(stderr, "Malformed path table in %s\n", fname);
+        munmap(map, size);
+        free(db);
+        return 0;
+      }
+  }
+  return db;
+}
+
+/* Unmap @db. A database from hash_db_create is written back and synced
+ * first. Return 0 on success, -1 if that failed.
+ */
+int hash_db_close(hash_db* db){
+  if(!db) return 0;
+  int failed = 0;
+  if(db->fd >= 0){
+    failed = msync(db->map, db->size, MS_SYNC) || fsync(db->fd);
+    if(failed)
+      fprintf(stderr, "Failed to write hash database: %s\n",
+        strerror(errno));
+    close(db->fd);
+  }
+  munmap(db->map, db->size);
+  free(db);
+  return failed ? -1 : 0;
+}
+
+/* The path of hash @i in @db, @len bytes long and not '\0'-terminated, or 0
+ * if the database has no paths.
+ */
+const char* hash_db_path(const hash_db* db, size_t i, size_t* len){
+  if(!db->path_offsets) return 0;
+  *len = db->path_offsets[i+1] - db->path_offsets[i];
+  return db->path_bytes + db->path_offsets[i];
+}
+
+/* A key for hash @i of @db that survives reordering and insertions: the
+ * 64-bit FNV-1a hash of its path, or its index if the database has no
+ * paths.
+ */
+guint64 hash_db_key(const hash_db* db, size_t i){
+  size_t len;
+  const char* path = hash_db_path(db, i, &len);
+  if(!path) return i;
+  guint64 h = 0xcbf29ce484222325u;
+  for(size_t j=0; j<len; ++j) h = (h ^ (unsigned char) path[j])
+    * 0x100000001b3u;
+  return h;
+}
+
+/* Write a database of the @count hashes in @hashes to @fp, with @paths if
+ * it isn't 0. Return 0 on success, -1 on a write error.
+ */
+int hash_db_write(
+  FILE* fp,
+  const idhash_hash* hashes,
+  size_t count,
+  const char* const* paths)
+{
+  hash_db_header h = {.count = count};
+  memcpy(h.magic, HASH_DB_MAGIC, SZ_HASH_DB_MAGIC);
+  if(paths) h.paths = sizeof h + count * sizeof *hashes;
+  if(1 != fwrite(&h, sizeof h, 1, fp)
+    || count != fwrite(hashes, sizeof *hashes, count, fp))
+    return -1;
+  if(!paths) return 0;
+  guint64 offset = 0;
+  for(size_t i=0; i<=count; ++i){
+    if(1 != fwrite(&offset, sizeof offset, 1, fp)) return -1;
+    if(i < count) offset += strlen(paths[i]);
+  }
+  for(size_t i=0; i<count; ++i){
+    const size_t len = strlen(paths[i]);
+    if(len && 1 != fwrite(paths[i], len, 1, fp)) return -1;
+  }
+  return 0;
+}
+
+typedef struct hash_db_record hash_db_record;
+struct hash_db_record {
+  guint64 seq;
+  idhash_hash hash;
+  char* path;
+};
+
+static int hash_db_record_cmp(const void* a, const void* b){
+  const guint64 x = ((const hash_db_record*) a)->seq;
+  const guint64 y = ((const hash_db_record*) b)->seq;
+  return (x > y) - (x < y);
+}
+
+/* Convert the binary records (see idhash_record.c) in @in into a database
+ * written to @out, in input order. Return the number of hashes, or -1 on a
+ * malformed record or a write error.
+ */
+long hash_db_from_records(FILE* in, FILE* out){
+  if(idhash_record_read_magic(in)) return -1;
+  hash_db_record* r = 0;
+  size_t n = 0, cap = 0;
+  idhash_result res;
+  guint64 seq;
+  int z;
+  while(0 < (z = idhash_record_read(in, &seq, &res))){
+    if(n == cap) r = realloc(r, (cap = cap ? 2*cap : 1024) * sizeof *r);
+    r[n++] = (hash_db_record){seq, idhash_hash_of(&res), strdup(res.path)};
+  }
+  long count = -1;
+  if(!z){
+    qsort(r, n, sizeof *r, hash_db_record_cmp);
+    idhash_hash* hashes = malloc(n * sizeof *hashes + 1);
+    const char** paths = malloc(n * sizeof *paths + 1);
+    for(size_t i=0; i<n; ++i) hashes[i] = r[i].hash, paths[i] = r[i].path;
+    if(!hash_db_write(out, hashes, n, paths)) count = n;
+    free(hashes);
+    free(paths);
+  }
+  for(size_t i=0; i<n; ++i) free(r[i].path);
+  free(r);
+  return count;
+}
+
+#ifdef TEST_HASH_DB
+int main(){
+  char fname[] = "/tmp/test-hash-db.XXXXXX";
+  int fd = mkstemp(fname);
+  assert(fd >= 0);
+  close(fd);
+
+  // Create in place, then read back.
+  hash_db* db = hash_db_create(fname, 3);
+  assert(db && db->count == 3);
+  for(size_t i=0; i<3; ++i) db->hashes[i] = (idhash_hash){i, 2*i, 3*i, 4*i};
+  assert(!hash_db_close(db));
+  db = hash_db_open(fname);
+  assert(db && db->count == 3);
+  assert(db->hashes[2].dx == 2 && db->hashes[2].iy == 8);
+  size_t len;
+  assert(!hash_db_path(db, 0, &len));
+  hash_db_close(db);
+
+  // Write with paths.
+  const idhash_hash hashes[2] = {{1, 2, 3, 4}, {5, 6, 7, G_MAXUINT64}};
+  const char* paths[2] = {"foo/1.jpg", ""};
+  FILE* fp = fopen(fname, "wb");
+  assert(fp);
+  assert(!hash_db_write(fp, hashes, 2, paths));
+  fclose(fp);
+  db = hash_db_open(fname);
+  assert(db && db->count == 2 && db->hashes[1].iy == G_MAXUINT64);
+  const char* p = hash_db_path(db, 0, &len);
+  assert(p && len == 9 && !memcmp(p, "foo/1.jpg", 9));
+  assert(hash_db_path(db, 1, &len) && !len);
+  hash_db_close(db);
+
+  // Records out of order come out in input order.
+  idhash_result a = {"a.jpg", 1, 1, 1, 1}, b = {"b.jpg", 2, 2, 2, 2};
+  FILE* in = tmpfile();
+  assert(!idhash_record_write_magic(in));
+  assert(!idhash_record_write(in, 1, &b));
+  assert(!idhash_record_write(in, 0, &a));
+  rewind(in);
+  fp = fopen(fname, "wb");
+  assert(2 == hash_db_from_records(in, fp));
+  fclose(fp);
+  fclose(in);
+  db = hash_db_open(fname);
+  assert(db && db->hashes[0].dx == 1 && db->hashes[1].dx == 2);
+  p = hash_db_path(db, 1, &len);
+  assert(len == 5 && !memcmp(p, "b.jpg", 5));
+  hash_db_close(db);
+
+  // A path table past the end, or running off it.
+  hash_db_header bad = {HASH_DB_MAGIC, 1, 1 << 30};
+  for(int i=0; i<2; ++i){
+    fp = fopen(fname, "wb");
+    assert(fp && 1 == fwrite(&bad, sizeof bad, 1, fp));
+    assert(1 == fwrite(hashes, sizeof *hashes, 1, fp));
+    fclose(fp);
+    assert(!hash_db_open(fname));
+    bad.paths = sizeof bad + sizeof *hashes;
+  }
+  bad.paths = G_MAXUINT64 - 7;
+  fp = fopen(fname, "wb");
+  assert(fp && 1 == fwrite(&bad, sizeof bad, 1, fp));
+  assert(1 == fwrite(hashes, sizeof *hashes, 1, fp));
+  fclose(fp);
+  assert(!hash_db_open(fname));
+
+  // Truncated.
+  assert(!truncate(fname, 40));
+  assert(!hash_db_open(fname));
+  remove(fname);
+
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#elif defined(CMD_HASH_DB)
+int main(int argc, char* argv[argc]){
+  if(argc == 4 && !strcmp(argv[1], "--from-records")){
+    FILE* in = strcmp(argv[2], "-") ? fopen(argv[2], "rb") : stdin;
+    FILE* out = in ? fopen(argv[3], "wb") : 0;
+    if(!in || !out){
+      fprintf(stderr, "Failed to open %s: %s\n", in ? argv[3] : argv[2],
+        strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    const long n = hash_db_from_records(in, out);
+    if(n < 0 || fclose(out)){
+      fprintf(stderr, "Failed to convert %s.\n", argv[2]);
+      exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "%ld hashes\n", n);
+    return EXIT_SUCCESS;
+  }
+  if(argc != 2){
+    fprintf(stderr, "Usage: %s {<DB> | --from-records <RECORDS> <DB>}\n",
+      argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  hash_db* db = hash_db_open(argv[1]);
+  if(!db) exit(EXIT_FAILURE);
+  idhash_result res = {{0}};
+  for(size_t i=0; i<db->count; ++i){
+    size_t len = 0;
+    const char* p = hash_db_path(db, i, &len);
+    if(p) memcpy(res.path, p, len < SZ_PATH ? len : SZ_PATH - 1);
+    else len = snprintf(res.path, SZ_PATH, "%zu", i);
+    res.path[len < SZ_PATH ? len : SZ_PATH - 1] = 0;
+    res.dx = db->hashes[i].dx;
+    res.dy = db->hashes[i].dy;
+    res.ix = db->hashes[i].ix;
+    res.iy = db->hashes[i].iy;
+    idhash_record_print(stdout, &res);
+  }
+  hash_db_close(db);
+  return EXIT_SUCCESS;
+}
+#endif
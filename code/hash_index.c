@@ -0,0 +1,1302 @@
+/* hash_index.c
+ *
+ * Threshold scans and all-pairs joins over a table of hashes that skip
+ * whole blocks of it by bit counts alone.
+ *
+ * The index is a copy of the table sorted by summary (see metric.c: the
+ * bits set in dx and dy, then the important bits set) and cut into blocks
+ * of HASH_INDEX_BLOCK hashes, each with the fieldwise range of its
+ * summaries. Sorting puts hashes with alike summaries together, so the
+ * ranges are narrow. Before a block is compared with a query, the metric
+ * bounds the distance from the query's summary to the block's range:
+ *
+ *   lower bound > radius    skipped: no hash in the block can match
+ *   upper bound <= radius   accepted: every hash matches, so counting needs
+ *                           no distances
+ *   otherwise               scanned with the metric's batch kernel
+ *
+ * A join bounds each pair of blocks the same way, then each hash against a
+ * block, and scans only what is left. A k-nearest query scans the blocks in
+ * order of lower bound, and stops at the first one whose bound is past the
+ * k-th best distance found so far. A batch of queries is indexed too and
+ * run in tiles of its blocks against each block of the index, so each block
+ * is read from memory once per tile rather than once per query. Each
+ * hash's original index is kept, and results are given in those.
+ *
+ * How much is pruned depends on the corpus: uniform random hashes (as
+ * synth_hashes.c makes) have summaries that all look alike and prune almost
+ * nothing, while flat images and strong gradients, whose difference hashes
+ * are nearly all 0 or all 1, prune the rest of the table. --stats reports
+ * the fractions for a given table.
+ *
+ * Memory is 44 bytes per hash: the hash, its summary and its index.
+ *
+ * Compile test
+ *
+gcc hash_index.c -o test-hash-index -DTEST_HASH_INDEX -O2 -g -Wall -pthread `pkg-config vips --cflags --libs`
+ *
+ * Compile
+ *
+gcc hash_index.c -o idhash-query -DCMD_HASH_INDEX -O2 -g -Wall -pthread `pkg-config vips --cflags --libs`
+ *
+ * Usage: print each hash of <DB> within --radius (default 10) of each
+ * hash of <QUERIES>, as <query>\t<index>\t<distance> lines, or with --count
+ * how many, as <query>\t<count>, or with --k the k nearest, in the same
+ * lines nearest first; with --batch, run the queries together, tile by
+ * tile, which is faster for many (the pairs come in no particular order);
+ * with --images, the queries are image files, numbered from 0, instead of
+ * a hash database; with --join, print every pair of <DB>
+ * within --radius as <a>\t<b>\t<distance>, a < b, for idhash-groups
+ *
+ * ./idhash-query [--metric <NAME>] [--radius <R> | --count | --k <K>]
+ *   [--batch] [--jobs <N>] [--no-prune] [--stats] <DB> <QUERIES>
+ * ./idhash-query [...] --images <DB> <IMAGE>...
+ * ./idhash-query --join [--metric <NAME>] [--radius <R>] [--jobs <N>]
+ *   [--no-prune] [--stats] <DB>
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef STDINT_H
+#  define STDINT_H
+#  include <stdint.h>
+#endif
+
+#ifndef INTTYPES_H
+#  define INTTYPES_H
+#  include <inttypes.h>
+#endif
+
+#ifndef PTHREAD_H
+#  define PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#ifndef STDATOMIC_H
+#  define STDATOMIC_H
+#  include <stdatomic.h>
+#endif
+
+#ifndef METRIC_H
+#  define METRIC_H
+#  include "metric.c"
+#endif
+
+#ifndef HASH_DB_H
+#  define HASH_DB_H
+#  include "hash_db.c"
+#endif
+
+#ifndef DIR_WALK_H
+#  define DIR_WALK_H
+#  include "dir_walk.c"
+#endif
+
+#define HASH_INDEX_BLOCK 256
+
+#ifndef HASH_INDEX_DEFAULT_RADIUS
+#  define HASH_INDEX_DEFAULT_RADIUS 10
+#endif
+
+typedef struct hash_index hash_index;
+struct hash_index {
+  idhash_hash* hashes;        // sorted by summary
+  metric_summary* summaries;  // of each hash
+  uint32_t* ids;              // index of each hash in the table it came from
+  metric_range* blocks;       // range of each block's summaries
+  size_t n;
+  size_t nblocks;
+};
+
+typedef struct hash_index_opts hash_index_opts;
+struct hash_index_opts {
+  const metric* metric;  // or 0 for the default
+  guint radius;
+  int no_prune;          // scan every block, to compare
+  int jobs;              // join and nearest threads, or 0 for one per
+                         // online CPU
+};
+
+// Comparisons of a hash against another, by how they were settled.
+typedef struct hash_index_stats hash_index_stats;
+struct hash_index_stats {
+  uint64_t skipped;
+  uint64_t accepted;
+  uint64_t scanned;
+};
+
+/* Called with the original index of each hash within the radius, and its
+ * distance.
+ */
+typedef void (*hash_index_fn)(uint32_t id, guint dist, void* arg);
+
+static int hash_index_cmp_key(const void* a, const void* b){
+  const uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+  return (x > y) - (x < y);
+}
+
+/* Index the @n hashes of @hashes, which needn't outlive the index. Return
+ * 0 if @n is too large or memory runs out.
+ */
+hash_index* hash_index_create(const idhash_hash* hashes, size_t n){
+  if(n >= UINT32_MAX) return 0;
+  hash_index* idx = calloc(1, sizeof(hash_index));
+  uint64_t* keys = malloc(n * sizeof(uint64_t) + 1);
+  idx->n = n;
+  idx->nblocks = (n + HASH_INDEX_BLOCK - 1) / HASH_INDEX_BLOCK;
+  idx->hashes = malloc(n * sizeof(idhash_hash) + 1);
+  idx->summaries = malloc(n * sizeof(metric_summary) + 1);
+  idx->ids = malloc(n * sizeof(uint32_t) + 1);
+  idx->blocks = malloc(idx->nblocks * sizeof(metric_range) + 1);
+  if(!keys || !idx->hashes || !idx->summaries || !idx->ids || !idx->blocks){
+    free(keys);
+    free(idx->hashes);
+    free(idx->summaries);
+    free(idx->ids);
+    free(idx->blocks);
+    free(idx);
+    return 0;
+  }
+  for(size_t i=0; i<n; ++i){
+    const metric_summary s = metric_summary_of(hashes + i);
+    keys[i] = (uint64_t) s.p[0] << 56 | (uint64_t) s.p[1] << 48
+      | (uint64_t) s.w[0] << 40 | (uint64_t) s.w[1] << 32 | i;
+  }
+  qsort(keys, n, sizeof(uint64_t), hash_index_cmp_key);
+  for(size_t i=0; i<n; ++i){
+    idx->ids[i] = keys[i] & 0xffffffff;
+    idx->hashes[i] = hashes[idx->ids[i]];
+    idx->summaries[i] = metric_summary_of(idx->hashes + i);
+  }
+  free(keys);
+  for(size_t b=0; b<idx->nblocks; ++b){
+    idx->blocks[b] = metric_range_empty();
+    const size_t end = b == idx->nblocks - 1 ? n : (b+1) * HASH_INDEX_BLOCK;
+    for(size_t i=b * HASH_INDEX_BLOCK; i<end; ++i)
+      metric_range_add(idx->blocks + b, idx->summaries + i);
+  }
+  return idx;
+}
+
+void hash_index_destroy(hash_index* idx){
+  if(!idx) return;
+  free(idx->hashes);
+  free(idx->summaries);
+  free(idx->ids);
+  free(idx->blocks);
+  free(idx);
+}
+
+static inline size_t hash_index_block_size(const hash_index* idx, size_t b){
+  return b == idx->nblocks - 1 ? idx->n - b * HASH_INDEX_BLOCK
+    : HASH_INDEX_BLOCK;
+}
+
+static inline const metric* hash_index_metric(const hash_index_opts* opts){
+  return opts->metric ? opts->metric : metric_registry;
+}
+
+/* How a hash or block with summaries in @a compares with block @b: -1 if
+ * it's too far, 1 if it's surely within the radius, 0 if it must be scanned.
+ */
+static inline int hash_index_settle(
+  const hash_index* idx,
+  const hash_index_opts* opts,
+  const metric_range* a,
+  size_t b)
+{
+  if(opts->no_prune) return 0;
+  guint lo, hi;
+  hash_index_metric(opts)->bound(a, idx->blocks + b, &lo, &hi);
+  return lo > opts->radius ? -1 : hi <= opts->radius;
+}
+
+/* Call @fn for every hash within @opts->radius of @q, block by block, and
+ * return how many there were. @stats, if not 0, is added to.
+ */
+size_t hash_index_radius(
+  const hash_index* idx,
+  const hash_index_opts* opts,
+  const idhash_hash* q,
+  hash_index_fn fn,
+  void* arg,
+  hash_index_stats* stats)
+{
+  const metric* m = hash_index_metric(opts);
+  const metric_summary s = metric_summary_of(q);
+  const metric_range r = metric_range_of(&s);
+  hash_index_stats st = {0};
+  guint dist[HASH_INDEX_BLOCK];
+  size_t found = 0;
+  for(size_t b=0; b<idx->nblocks; ++b){
+    const size_t n = hash_index_block_size(idx, b);
+    const int settled = hash_index_settle(idx, opts, &r, b);
+    if(settled < 0){
+      st.skipped += n;
+      continue;
+    }
+    // Accepted blocks still need their distances, for @fn.
+    if(settled) st.accepted += n;
+    else st.scanned += n;
+    const size_t first = b * HASH_INDEX_BLOCK;
+    m->batch(q, idx->hashes + first, n, dist);
+    for(size_t i=0; i<n; ++i)
+      if(dist[i] <= opts->radius){
+        fn(idx->ids[first + i], dist[i], arg);
+        ++found;
+      }
+  }
+  if(stats){
+    stats->skipped += st.skipped;
+    stats->accepted += st.accepted;
+    stats->scanned += st.scanned;
+  }
+  return found;
+}
+
+/* How many hashes are within @opts->radius of @q. Accepted blocks are
+ * counted whole, without computing a distance.
+ */
+size_t hash_index_count(
+  const hash_index* idx,
+  const hash_index_opts* opts,
+  const idhash_hash* q,
+  hash_index_stats* stats)
+{
+  const metric* m = hash_index_metric(opts);
+  const metric_summary s = metric_summary_of(q);
+  const metric_range r = metric_range_of(&s);
+  hash_index_stats st = {0};
+  guint dist[HASH_INDEX_BLOCK];
+  size_t found = 0;
+  for(size_t b=0; b<idx->nblocks; ++b){
+    const size_t n = hash_index_block_size(idx, b);
+    const int settled = hash_index_settle(idx, opts, &r, b);
+    if(settled < 0) st.skipped += n;
+    else if(settled){
+      st.accepted += n;
+      found += n;
+    } else {
+      st.scanned += n;
+      m->batch(q, idx->hashes + b * HASH_INDEX_BLOCK, n, dist);
+      for(size_t i=0; i<n; ++i) found += dist[i] <= opts->radius;
+    }
+  }
+  if(stats){
+    stats->skipped += st.skipped;
+    stats->accepted += st.accepted;
+    stats->scanned += st.scanned;
+  }
+  return found;
+}
+
+typedef struct hash_index_neighbour hash_index_neighbour;
+struct hash_index_neighbour {
+  uint32_t id;     // original index
+  guint dist;
+};
+
+/* Nearest-neighbour candidates are kept as dist << 32 | id in a bounded
+ * max-heap, so ties go to the lower index and results don't depend on the
+ * order blocks were scanned in.
+ */
+static void hash_index_heap_down(uint64_t* heap, size_t n, size_t i){
+  for(;;){
+    size_t top = i;
+    const size_t l = 2*i + 1, r = l + 1;
+    if(l < n && heap[l] > heap[top]) top = l;
+    if(r < n && heap[r] > heap[top]) top = r;
+    if(top == i) return;
+    const uint64_t t = heap[i];
+    heap[i] = heap[top];
+    heap[top] = t;
+    i = top;
+  }
+}
+
+static void hash_index_heap_add(
+  uint64_t* heap,
+  size_t* n,
+  size_t k,
+  uint64_t key)
+{
+  if(*n == k){
+    if(key >= heap[0]) return;
+    heap[0] = key;
+    hash_index_heap_down(heap, k, 0);
+    return;
+  }
+  size_t i = (*n)++;
+  for(; i && heap[(i-1) / 2] < key; i = (i-1) / 2) heap[i] = heap[(i-1) / 2];
+  heap[i] = key;
+}
+
+typedef struct hash_index_nearest_work hash_index_nearest_work;
+struct hash_index_nearest_work {
+  const hash_index* idx;
+  const metric* metric;
+  const idhash_hash* q;
+  size_t k;
+  const uint32_t* order;    // blocks by lower bound, nearest first
+  const guint8* lo;         // lower bound of each block
+  atomic_size_t next;       // next of order
+  atomic_uint bound;        // no neighbour is further, once a heap is full
+  uint64_t** heaps;         // of each thread
+  size_t* sizes;
+  atomic_int thread;
+  atomic_size_t scanned;
+};
+
+static void* hash_index_nearest_worker(void* _arg){
+  hash_index_nearest_work* w = (hash_index_nearest_work*) _arg;
+  const hash_index* idx = w->idx;
+  const int t = atomic_fetch_add(&w->thread, 1);
+  uint64_t* heap = w->heaps[t];
+  size_t n = 0, scanned = 0;
+  guint dist[HASH_INDEX_BLOCK];
+  for(size_t i; (i = atomic_fetch_add(&w->next, 1)) < idx->nblocks; ){
+    const size_t b = w->order[i];
+    // The rest of the blocks are at least this far, so none can help.
+    if(w->lo[b] > atomic_load_explicit(&w->bound, memory_order_relaxed))
+      break;
+    const size_t nb = hash_index_block_size(idx, b), first =
+      b * HASH_INDEX_BLOCK;
+    w->metric->batch(w->q, idx->hashes + first, nb, dist);
+    scanned += nb;
+    const guint bound = atomic_load_explicit(&w->bound,
+      memory_order_relaxed);
+    for(size_t j=0; j<nb; ++j)
+      if(dist[j] <= bound)
+        hash_index_heap_add(heap, &n, w->k,
+          (uint64_t) dist[j] << 32 | idx->ids[first + j]);
+    if(n < w->k) continue;
+    // A full heap bounds every thread's search.
+    guint top = heap[0] >> 32, cur = atomic_load(&w->bound);
+    while(top < cur && !atomic_compare_exchange_weak(&w->bound, &cur, top));
+  }
+  w->sizes[t] = n;
+  atomic_fetch_add(&w->scanned, scanned);
+  return 0;
+}
+
+/* Put the @k hashes nearest @q, or all of them if there are fewer, in @out
+ * by distance then original index, and return how many that was. Blocks
+ * are scanned nearest bound first on @opts->jobs threads, each keeping its
+ * own @k best, and a block is skipped once its lower bound is past the
+ * @k-th best distance some thread has found. @opts->radius is not used.
+ * @stats, if not 0, is added to.
+ */
+size_t hash_index_nearest(
+  const hash_index* idx,
+  const hash_index_opts* opts,
+  const idhash_hash* q,
+  size_t k,
+  hash_index_neighbour* out,
+  hash_index_stats* stats)
+{
+  if(k > idx->n) k = idx->n;
+  if(!k) return 0;
+  const metric* m = hash_index_metric(opts);
+  const metric_summary s = metric_summary_of(q);
+  const metric_range r = metric_range_of(&s);
+  // Blocks by lower bound: a counting sort, bounds being at most
+  // METRIC_MAX.
+  guint8* lo = malloc(idx->nblocks);
+  uint32_t* order = malloc(idx->nblocks * sizeof(uint32_t));
+  size_t start[METRIC_MAX + 2] = {0};
+  for(size_t b=0; b<idx->nblocks; ++b){
+    guint l = 0, h;
+    if(!opts->no_prune) m->bound(&r, idx->blocks + b, &l, &h);
+    lo[b] = l;
+    ++start[l + 1];
+  }
+  for(int d=0; d<=METRIC_MAX; ++d) start[d + 1] += start[d];
+  for(size_t b=0; b<idx->nblocks; ++b) order[start[lo[b]]++] = b;
+
+  int jobs = opts->jobs > 0 ? opts->jobs : dir_walk_ncpus();
+  if((size_t) jobs > idx->nblocks) jobs = idx->nblocks;
+  hash_index_nearest_work w = {idx, m, q, k, order, lo};
+  atomic_init(&w.next, 0);
+  atomic_init(&w.bound, METRIC_MAX);
+  atomic_init(&w.thread, 0);
+  atomic_init(&w.scanned, 0);
+  w.heaps = malloc(jobs * sizeof(uint64_t*));
+  w.sizes = calloc(jobs, sizeof(size_t));
+  for(int i=0; i<jobs; ++i) w.heaps[i] = malloc(k * sizeof(uint64_t));
+  if(jobs == 1) hash_index_nearest_worker(&w);
+  else {
+    pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+    for(int i=0; i<jobs; ++i)
+      pthread_create(threads+i, 0, hash_index_nearest_worker, &w);
+    for(int i=0; i<jobs; ++i)
+      pthread_join(threads[i], 0);
+    free(threads);
+  }
+
+  // Merge: the k smallest keys of all the heaps.
+  uint64_t* all = w.heaps[0];
+  size_t n = w.sizes[0];
+  for(int i=1; i<jobs; ++i)
+    for(size_t j=0; j<w.sizes[i]; ++j)
+      hash_index_heap_add(all, &n, k, w.heaps[i][j]);
+  qsort(all, n, sizeof(uint64_t), hash_index_cmp_key);
+  for(size_t j=0; j<n; ++j)
+    out[j] = (hash_index_neighbour){all[j] & 0xffffffff, all[j] >> 32};
+  if(stats){
+    const size_t scanned = atomic_load(&w.scanned);
+    stats->scanned += scanned;
+    stats->skipped += idx->n - scanned;
+  }
+  for(int i=0; i<jobs; ++i) free(w.heaps[i]);
+  free(w.heaps);
+  free(w.sizes);
+  free(order);
+  free(lo);
+  return n;
+}
+
+// A pair of a join or a batch match, kept in memory instead of written.
+typedef struct hash_index_pair hash_index_pair;
+struct hash_index_pair {
+  uint32_t a;     // or the query
+  uint32_t b;     // or the index
+  guint dist;
+};
+
+typedef struct hash_index_pairs hash_index_pairs;
+struct hash_index_pairs {
+  hash_index_pair* pairs;
+  size_t n;
+  size_t cap;
+};
+
+typedef struct hash_index_join_work hash_index_join_work;
+typedef struct hash_index_join_buffer hash_index_join_buffer;
+
+/* Writes the lines for the pair @a < @b of the join into @buf, and returns
+ * how many, in place of the one line the join writes by default.
+ */
+typedef long (*hash_index_join_emit)(
+  hash_index_join_work* w,
+  hash_index_join_buffer* buf,
+  uint32_t a,
+  uint32_t b,
+  guint dist);
+
+struct hash_index_join_work {
+  const hash_index* idx;
+  const hash_index_opts* opts;
+  FILE* out;
+  atomic_size_t next;       // next block of the outer loop
+  atomic_long npairs;
+  atomic_int failed;
+  pthread_mutex_t out_lock;
+  pthread_mutex_t stats_lock;
+  hash_index_stats stats;
+  hash_index_join_emit emit;   // or 0 for the default
+  const void* emit_arg;
+  hash_index_pairs* pairs;     // if not 0, where the pairs go instead of @out
+};
+
+// Lines, or with @pairs the pairs themselves, are gathered per thread and
+// written this many bytes at a time.
+#define HASH_INDEX_JOIN_BUFFER (1 << 16)
+
+struct hash_index_join_buffer {
+  char bytes[HASH_INDEX_JOIN_BUFFER];
+  size_t len;
+};
+
+static void hash_index_join_flush(
+  hash_index_join_work* w,
+  hash_index_join_buffer* buf)
+{
+  pthread_mutex_lock(&w->out_lock);
+  hash_index_pairs* p = w->pairs;
+  const size_t n = buf->len / sizeof(hash_index_pair);
+  if(!p){
+    if(buf->len && fwrite(buf->bytes, 1, buf->len, w->out) != buf->len)
+      atomic_store(&w->failed, 1);
+  } else if(p->n + n > p->cap){
+    const size_t cap = p->n + n > 2*p->cap ? p->n + n : 2*p->cap;
+    hash_index_pair* pairs = realloc(p->pairs, cap * sizeof *pairs);
+    if(pairs){
+      p->pairs = pairs;
+      p->cap = cap;
+    } else atomic_store(&w->failed, 1);
+  }
+  if(p && p->n + n <= p->cap){
+    memcpy(p->pairs + p->n, buf->bytes, n * sizeof(hash_index_pair));
+    p->n += n;
+  }
+  pthread_mutex_unlock(&w->out_lock);
+  buf->len = 0;
+}
+
+// Add the pair @a, @b at @dist to @buf, as a line, or as is with @w->pairs.
+static inline void hash_index_join_put(
+  hash_index_join_work* w,
+  hash_index_join_buffer* buf,
+  uint32_t a,
+  uint32_t b,
+  guint dist)
+{
+  if(buf->len > HASH_INDEX_JOIN_BUFFER - 32)
+    hash_index_join_flush(w, buf);
+  if(w->pairs){
+    const hash_index_pair pair = {a, b, dist};
+    memcpy(buf->bytes + buf->len, &pair, sizeof pair);
+    buf->len += sizeof pair;
+  } else
+    buf->len += sprintf(buf->bytes + buf->len, "%" PRIu32 "\t%" PRIu32
+      "\t%u\n", a, b, dist);
+}
+
+static void* hash_index_join_worker(void* _arg){
+  hash_index_join_work* w = (hash_index_join_work*) _arg;
+  const hash_index* idx = w->idx;
+  const hash_index_opts* opts = w->opts;
+  const metric* m = hash_index_metric(opts);
+  hash_index_join_buffer* buf = malloc(sizeof(hash_index_join_buffer));
+  buf->len = 0;
+  hash_index_stats st = {0};
+  guint dist[HASH_INDEX_BLOCK];
+  long npairs = 0;
+  for(size_t bi; (bi = atomic_fetch_add(&w->next, 1)) < idx->nblocks; ){
+    const size_t ni = hash_index_block_size(idx, bi);
+    for(size_t bj=bi; bj<idx->nblocks; ++bj){
+      const size_t nj = hash_index_block_size(idx, bj);
+      if(hash_index_settle(idx, opts, idx->blocks + bi, bj) < 0){
+        st.skipped += bi == bj ? ni * (ni-1) / 2 : ni * nj;
+        continue;
+      }
+      for(size_t i=bi * HASH_INDEX_BLOCK; i<bi * HASH_INDEX_BLOCK + ni; ++i){
+        // Within a block, each hash against the ones after it.
+        const size_t first = bi == bj ? i+1 : bj * HASH_INDEX_BLOCK;
+        const size_t n = bj * HASH_INDEX_BLOCK + nj - first;
+        if(!n) continue;
+        const metric_range r = metric_range_of(idx->summaries + i);
+        const int settled = hash_index_settle(idx, opts, &r, bj);
+        if(settled < 0){
+          st.skipped += n;
+          continue;
+        }
+        if(settled) st.accepted += n;
+        else st.scanned += n;
+        m->batch(idx->hashes + i, idx->hashes + first, n, dist);
+        for(size_t j=0; j<n; ++j){
+          if(dist[j] > opts->radius) continue;
+          uint32_t a = idx->ids[i], b = idx->ids[first + j];
+          if(a > b){ const uint32_t t = a; a = b; b = t; }
+          if(w->emit){
+            npairs += w->emit(w, buf, a, b, dist[j]);
+            continue;
+          }
+          hash_index_join_put(w, buf, a, b, dist[j]);
+          ++npairs;
+        }
+      }
+    }
+  }
+  hash_index_join_flush(w, buf);
+  free(buf);
+  atomic_fetch_add(&w->npairs, npairs);
+  pthread_mutex_lock(&w->stats_lock);
+  w->stats.skipped += st.skipped;
+  w->stats.accepted += st.accepted;
+  w->stats.scanned += st.scanned;
+  pthread_mutex_unlock(&w->stats_lock);
+  return 0;
+}
+
+/* Run the join set up in @w on @w->opts->jobs threads. Return the number
+ * of pairs, or -1 if writing failed. @stats, if not 0, is added to.
+ */
+static long hash_index_join_run(
+  hash_index_join_work* w,
+  hash_index_stats* stats)
+{
+  atomic_init(&w->next, 0);
+  atomic_init(&w->npairs, 0);
+  atomic_init(&w->failed, 0);
+  pthread_mutex_init(&w->out_lock, 0);
+  pthread_mutex_init(&w->stats_lock, 0);
+  int jobs = w->opts->jobs > 0 ? w->opts->jobs : dir_walk_ncpus();
+  if((size_t) jobs > w->idx->nblocks)
+    jobs = w->idx->nblocks ? w->idx->nblocks : 1;
+  pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+  for(int i=0; i<jobs; ++i)
+    pthread_create(threads+i, 0, hash_index_join_worker, w);
+  for(int i=0; i<jobs; ++i)
+    pthread_join(threads[i], 0);
+  free(threads);
+  pthread_mutex_destroy(&w->out_lock);
+  pthread_mutex_destroy(&w->stats_lock);
+  if(stats){
+    stats->skipped += w->stats.skipped;
+    stats->accepted += w->stats.accepted;
+    stats->scanned += w->stats.scanned;
+  }
+  return atomic_load(&w->failed) ? -1 : atomic_load(&w->npairs);
+}
+
+/* Write every pair of hashes in @idx within @opts->radius to @out, as
+ * <a>\t<b>\t<distance> lines with a < b original indices, in no particular
+ * order, on @opts->jobs threads. Return the number of pairs, or -1 if
+ * writing failed. @stats, if not 0, is added to.
+ */
+long hash_index_join(
+  const hash_index* idx,
+  const hash_index_opts* opts,
+  FILE* out,
+  hash_index_stats* stats)
+{
+  hash_index_join_work w = {idx, opts, out};
+  return hash_index_join_run(&w, stats);
+}
+
+/* hash_index_join, but with the pairs appended to @out rather than
+ * written. Return the number of pairs, or -1 if memory ran out.
+ */
+long hash_index_join_pairs(
+  const hash_index* idx,
+  const hash_index_opts* opts,
+  hash_index_pairs* out,
+  hash_index_stats* stats)
+{
+  hash_index_join_work w = {idx, opts};
+  w.pairs = out;
+  return hash_index_join_run(&w, stats);
+}
+
+/* A batch of queries against the index runs tile by tile: HASH_INDEX_TILE
+ * blocks of the queries, indexed themselves so a tile's summaries are
+ * alike, against each block of the index in turn. A block is read from
+ * memory once per tile and then stays in cache for the tile's queries,
+ * where one query at a time would stream the whole index per query.
+ */
+#define HASH_INDEX_TILE 4
+
+typedef struct hash_index_match_work hash_index_match_work;
+struct hash_index_match_work {
+  hash_index_join_work join;    // output, next tile, pairs and stats
+  const hash_index* queries;
+  size_t k;                     // nearest to find, or 0 for the radius
+  size_t* counts;               // of each query, or 0
+  hash_index_neighbour* nearest;
+  size_t* nnearest;
+};
+
+static void* hash_index_match_worker(void* _arg){
+  hash_index_match_work* w = (hash_index_match_work*) _arg;
+  const hash_index* idx = w->join.idx;
+  const hash_index* qs = w->queries;
+  const hash_index_opts* opts = w->join.opts;
+  const metric* m = hash_index_metric(opts);
+  const size_t k = w->k, tile = HASH_INDEX_TILE * HASH_INDEX_BLOCK;
+  const size_t ntiles = (qs->n + tile - 1) / tile;
+  hash_index_join_buffer* buf = w->join.out || w->join.pairs ?
+    malloc(sizeof(hash_index_join_buffer)) : 0;
+  if(buf) buf->len = 0;
+  uint64_t* heaps = k ? malloc(tile * k * sizeof(uint64_t)) : 0;
+  size_t sizes[HASH_INDEX_TILE * HASH_INDEX_BLOCK];
+  size_t counts[HASH_INDEX_TILE * HASH_INDEX_BLOCK];
+  guint limits[HASH_INDEX_TILE * HASH_INDEX_BLOCK];
+  metric_range ranges[HASH_INDEX_TILE * HASH_INDEX_BLOCK];
+  hash_index_stats st = {0};
+  guint dist[HASH_INDEX_BLOCK];
+  long npairs = 0;
+  for(size_t t; (t = atomic_fetch_add(&w->join.next, 1)) < ntiles; ){
+    const size_t first = t * tile;
+    const size_t nq = qs->n - first < tile ? qs->n - first : tile;
+    metric_range tr = metric_range_empty();
+    for(size_t i=0; i<nq; ++i){
+      metric_range_add(&tr, qs->summaries + first + i);
+      ranges[i] = metric_range_of(qs->summaries + first + i);
+      limits[i] = k ? METRIC_MAX : opts->radius;
+      sizes[i] = counts[i] = 0;
+    }
+    // The furthest any query of the tile still needs to look.
+    guint tile_limit = k ? METRIC_MAX : opts->radius;
+    for(size_t b=0; b<idx->nblocks; ++b){
+      const size_t n = hash_index_block_size(idx, b);
+      const idhash_hash* block = idx->hashes + b * HASH_INDEX_BLOCK;
+      guint lo = 0, hi = METRIC_MAX;
+      if(!opts->no_prune) m->bound(&tr, idx->blocks + b, &lo, &hi);
+      if(lo > tile_limit){
+        st.skipped += n * nq;
+        continue;
+      }
+      for(size_t i=0; i<nq; ++i){
+        lo = 0;
+        hi = METRIC_MAX;
+        if(!opts->no_prune) m->bound(ranges + i, idx->blocks + b, &lo, &hi);
+        if(lo > limits[i]){
+          st.skipped += n;
+          continue;
+        }
+        // Counts need no distances for a block that surely matches.
+        if(!k && !buf && hi <= opts->radius){
+          st.accepted += n;
+          counts[i] += n;
+          continue;
+        }
+        if(!k && hi <= opts->radius) st.accepted += n;
+        else st.scanned += n;
+        m->batch(qs->hashes + first + i, block, n, dist);
+        const uint32_t q = qs->ids[first + i];
+        for(size_t j=0; j<n; ++j){
+          if(dist[j] > limits[i]) continue;
+          const uint32_t id = idx->ids[b * HASH_INDEX_BLOCK + j];
+          if(k){
+            hash_index_heap_add(heaps + i * k, sizes + i, k,
+              (uint64_t) dist[j] << 32 | id);
+            continue;
+          }
+          ++counts[i];
+          if(!buf) continue;
+          hash_index_join_put(&w->join, buf, q, id, dist[j]);
+          ++npairs;
+        }
+        if(k && sizes[i] == k) limits[i] = heaps[i * k] >> 32;
+      }
+      if(k){
+        tile_limit = 0;
+        for(size_t i=0; i<nq; ++i)
+          if(limits[i] > tile_limit) tile_limit = limits[i];
+      }
+    }
+    for(size_t i=0; i<nq; ++i){
+      const uint32_t q = qs->ids[first + i];
+      if(w->counts) w->counts[q] = counts[i];
+      if(!k) continue;
+      uint64_t* heap = heaps + i * k;
+      qsort(heap, sizes[i], sizeof(uint64_t), hash_index_cmp_key);
+      for(size_t j=0; j<sizes[i]; ++j)
+        w->nearest[q * k + j] = (hash_index_neighbour){heap[j] & 0xffffffff,
+          heap[j] >> 32};
+      w->nnearest[q] = sizes[i];
+    }
+  }
+  if(buf){
+    hash_index_join_flush(&w->join, buf);
+    free(buf);
+  }
+  free(heaps);
+  atomic_fetch_add(&w->join.npairs, npairs);
+  pthread_mutex_lock(&w->join.stats_lock);
+  w->join.stats.skipped += st.skipped;
+  w->join.stats.accepted += st.accepted;
+  w->join.stats.scanned += st.scanned;
+  pthread_mutex_unlock(&w->join.stats_lock);
+  return 0;
+}
+
+static long hash_index_match_run(hash_index_match_work* w,
+  hash_index_stats* stats)
+{
+  const size_t tile = HASH_INDEX_TILE * HASH_INDEX_BLOCK;
+  const size_t ntiles = (w->queries->n + tile - 1) / tile;
+  atomic_init(&w->join.next, 0);
+  atomic_init(&w->join.npairs, 0);
+  atomic_init(&w->join.failed, 0);
+  pthread_mutex_init(&w->join.out_lock, 0);
+  pthread_mutex_init(&w->join.stats_lock, 0);
+  int jobs = w->join.opts->jobs > 0 ? w->join.opts->jobs : dir_walk_ncpus();
+  if((size_t) jobs > ntiles) jobs = ntiles ? ntiles : 1;
+  if(jobs == 1) hash_index_match_worker(w);
+  else {
+    pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+    for(int i=0; i<jobs; ++i)
+      pthread_create(threads+i, 0, hash_index_match_worker, w);
+    for(int i=0; i<jobs; ++i)
+      pthread_join(threads[i], 0);
+    free(threads);
+  }
+  pthread_mutex_destroy(&w->join.out_lock);
+  pthread_mutex_destroy(&w->join.stats_lock);
+  if(stats){
+    stats->skipped += w->join.stats.skipped;
+    stats->accepted += w->join.stats.accepted;
+    stats->scanned += w->join.stats.scanned;
+  }
+  return atomic_load(&w->join.failed) ? -1 : atomic_load(&w->join.npairs);
+}
+
+/* Match every hash of @queries against @idx, tile by tile on @opts->jobs
+ * threads. Pairs within @opts->radius go to @out, if not 0, as
+ * <query>\t<index>\t<distance> lines with original indices, in no
+ * particular order, and @counts, if not 0, gets how many there are for
+ * each query, by original index. Return the number of pairs written, or -1
+ * if writing failed. @stats, if not 0, is added to.
+ */
+long hash_index_match(
+  const hash_index* idx,
+  const hash_index* queries,
+  const hash_index_opts* opts,
+  FILE* out,
+  size_t* counts,
+  hash_index_stats* stats)
+{
+  hash_index_match_work w = {{idx, opts, out}, queries, 0, counts};
+  return hash_index_match_run(&w, stats);
+}
+
+/* hash_index_match, but with the pairs within @opts->radius appended to
+ * @out, as query, index and distance, rather than written. Return the
+ * number of pairs, or -1 if memory ran out.
+ */
+long hash_index_match_pairs(
+  const hash_index* idx,
+  const hash_index* queries,
+  const hash_index_opts* opts,
+  hash_index_pairs* out,
+  hash_index_stats* stats)
+{
+  hash_index_match_work w = {{idx, opts}, queries};
+  w.join.pairs = out;
+  return hash_index_match_run(&w, stats);
+}
+
+/* Find the @k nearest hashes of @idx to every hash of @queries, as
+ * hash_index_nearest() does one at a time, tile by tile on @opts->jobs
+ * threads. Query q's are put at @out + q * @k and their number in @n[q],
+ * by original index. @stats, if not 0, is added to.
+ */
+void hash_index_match_nearest(
+  const hash_index* idx,
+  const hash_index* queries,
+  const hash_index_opts* opts,
+  size_t k,
+  hash_index_neighbour* out,
+  size_t* n,
+  hash_index_stats* stats)
+{
+  if(!k){
+    memset(n, 0, queries->n * sizeof(size_t));
+    return;
+  }
+  hash_index_match_work w = {{idx, opts}, queries, k, 0, out, n};
+  hash_index_match_run(&w, stats);
+}
+
+/* Print what fraction of the comparisons in @st each way settled.
+ */
+void hash_index_print_stats(FILE* fp, const hash_index_stats* st){
+  const uint64_t total = st->skipped + st->accepted + st->scanned;
+  const double d = total ? total / 100. : 1;
+  fprintf(fp, "%" PRIu64 " comparisons: %.2f%% skipped, %.2f%% accepted, "
+    "%.2f%% scanned\n", total, st->skipped / d, st->accepted / d,
+    st->scanned / d);
+}
+
+#ifdef TEST_HASH_INDEX
+static guint64 test_rand(guint64* s){
+  guint64 z = (*s += 0x9e3779b97f4a7c15u);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+  return z ^ (z >> 31);
+}
+
+#define TEST_N 2000
+
+typedef struct test_hits test_hits;
+struct test_hits {
+  guint dist[TEST_N];
+  size_t n;
+};
+
+static void test_hit(uint32_t id, guint dist, void* arg){
+  test_hits* h = (test_hits*) arg;
+  assert(h->dist[id] == G_MAXUINT);
+  h->dist[id] = dist;
+  ++h->n;
+}
+
+// Join output as a TEST_N x TEST_N matrix of distances + 1, 0 for none.
+static guint* test_join(const hash_index* idx, const hash_index_opts* opts){
+  FILE* fp = tmpfile();
+  const long npairs = hash_index_join(idx, opts, fp, 0);
+  assert(npairs >= 0);
+  rewind(fp);
+  guint* m = calloc((size_t) TEST_N * TEST_N, sizeof(guint));
+  unsigned a, b, d;
+  long n = 0;
+  while(fscanf(fp, "%u\t%u\t%u\n", &a, &b, &d) == 3){
+    assert(a < b && b < TEST_N && !m[(size_t) a * TEST_N + b]);
+    m[(size_t) a * TEST_N + b] = d + 1;
+    ++n;
+  }
+  assert(n == npairs);
+  fclose(fp);
+
+  // Kept in memory, the same pairs.
+  hash_index_pairs p = {0};
+  assert(hash_index_join_pairs(idx, opts, &p, 0) == npairs);
+  assert(p.n == (size_t) npairs);
+  for(size_t k=0; k<p.n; ++k)
+    assert(m[(size_t) p.pairs[k].a * TEST_N + p.pairs[k].b]
+      == p.pairs[k].dist + 1);
+  free(p.pairs);
+  return m;
+}
+
+int main(){
+  // Uniform hashes, flat ones with few bits of d set, strong gradients with
+  // most set, and near-duplicates of them all.
+  idhash_hash* h = calloc(TEST_N, sizeof(idhash_hash));
+  guint64 s = 1;
+  for(int i=0; i<TEST_N; ++i){
+    idhash_hash x = {test_rand(&s), test_rand(&s),
+      test_rand(&s) | test_rand(&s), test_rand(&s) | test_rand(&s)};
+    if(i % 4 == 1) x.dx &= test_rand(&s) & test_rand(&s) & test_rand(&s);
+    if(i % 4 == 1) x.dy &= test_rand(&s) & test_rand(&s);
+    if(i % 4 == 2) x.dx |= test_rand(&s) | test_rand(&s) | test_rand(&s);
+    if(i % 4 == 3 && i > 8){
+      x = h[i - 1 - test_rand(&s) % 8];
+      x.dx ^= 1ull << test_rand(&s) % 64;
+      x.dy ^= test_rand(&s) & test_rand(&s) & test_rand(&s) & test_rand(&s);
+    }
+    h[i] = x;
+  }
+  hash_index* idx = hash_index_create(h, TEST_N);
+  assert(idx->n == TEST_N && idx->nblocks == (TEST_N + 255) / 256);
+  for(size_t i=1; i<TEST_N; ++i)
+    assert(idx->summaries[i-1].p[0] <= idx->summaries[i].p[0]);
+
+  const guint radii[] = {0, 4, 10, 24, 40, 70};
+  test_hits* hits = malloc(sizeof(test_hits));
+  uint64_t* keys = malloc(TEST_N * sizeof(uint64_t));
+  hash_index_neighbour* nearest = malloc((TEST_N + 5) * sizeof *nearest);
+  for(size_t k=0; k<METRIC_COUNT; ++k){
+    hash_index_stats st = {0};
+    for(size_t r=0; r < sizeof radii / sizeof *radii; ++r){
+      hash_index_opts opts = {metric_registry + k, radii[r]};
+      for(int q=0; q<TEST_N; q+=37){
+        for(int i=0; i<TEST_N; ++i) hits->dist[i] = G_MAXUINT;
+        hits->n = 0;
+        const size_t n = hash_index_radius(idx, &opts, h + q, test_hit, hits,
+          &st);
+        assert(n == hits->n);
+        assert(n == hash_index_count(idx, &opts, h + q, &st));
+        for(int i=0; i<TEST_N; ++i){
+          const guint d = metric_registry[k].dist(h + q, h + i);
+          assert(hits->dist[i] == (d <= radii[r] ? d : G_MAXUINT));
+        }
+      }
+      if(radii[r] > 24) continue;
+      // The join finds the same pairs as all against all, for any number of
+      // threads, and with pruning off.
+      guint* joined = test_join(idx, &opts);
+      for(size_t a=0; a<TEST_N; ++a)
+        for(size_t b=a+1; b<TEST_N; ++b){
+          const guint d = metric_registry[k].dist(h + a, h + b);
+          assert(joined[a * TEST_N + b] == (d <= radii[r] ? d + 1 : 0));
+        }
+      opts.jobs = 3;
+      opts.no_prune = r & 1;
+      guint* again = test_join(idx, &opts);
+      assert(!memcmp(joined, again, (size_t) TEST_N * TEST_N * sizeof(guint)));
+      free(joined);
+      free(again);
+    }
+    printf("%s: ", metric_registry[k].name);
+    hash_index_print_stats(stdout, &st);
+    assert(st.skipped > 0);
+
+    // The k nearest are the first k of all by distance then index, on any
+    // number of threads, with or without pruning.
+    const size_t ks[] = {1, 7, 300, TEST_N + 5};
+    hash_index_stats kst = {0};
+    for(int q=0; q<TEST_N; q+=53){
+      for(int i=0; i<TEST_N; ++i)
+        keys[i] = (uint64_t) metric_registry[k].dist(h + q, h + i) << 32 | i;
+      qsort(keys, TEST_N, sizeof(uint64_t), hash_index_cmp_key);
+      for(size_t j=0; j < sizeof ks / sizeof *ks; ++j){
+        const hash_index_opts opts = {metric_registry + k, 0, q % 3 == 0,
+          1 + q % 4};
+        const size_t n = hash_index_nearest(idx, &opts, h + q, ks[j], nearest,
+          &kst);
+        assert(n == (ks[j] < TEST_N ? ks[j] : TEST_N));
+        for(size_t i=0; i<n; ++i){
+          assert(nearest[i].id == (keys[i] & 0xffffffff));
+          assert(nearest[i].dist == keys[i] >> 32);
+        }
+      }
+    }
+    assert(kst.skipped > 0);
+
+    // A batch finds the same as one query at a time. The queries are the
+    // table reordered, more than one tile of them.
+    const size_t nq = TEST_N;
+    idhash_hash* qh = malloc(nq * sizeof(idhash_hash));
+    for(size_t i=0; i<nq; ++i) qh[i] = h[(7*i + 1) % TEST_N];
+    hash_index* qidx = hash_index_create(qh, nq);
+    size_t* counts = malloc(nq * sizeof(size_t));
+    size_t* nn = malloc(nq * sizeof(size_t));
+    hash_index_neighbour* all = malloc(nq * 7 * sizeof *all);
+    for(int r=0; r<3; ++r){
+      const hash_index_opts opts = {metric_registry + k, radii[r+1], r == 2,
+        1 + r};
+      FILE* fp = tmpfile();
+      const long npairs = hash_index_match(idx, qidx, &opts, fp, counts, 0);
+      rewind(fp);
+      guint* m = calloc((size_t) nq * TEST_N, sizeof(guint));
+      unsigned a, b, d;
+      long got = 0;
+      while(fscanf(fp, "%u\t%u\t%u\n", &a, &b, &d) == 3){
+        assert(a < nq && b < TEST_N && !m[(size_t) a * TEST_N + b]);
+        m[(size_t) a * TEST_N + b] = d + 1;
+        ++got;
+      }
+      fclose(fp);
+      assert(got == npairs);
+      for(size_t a=0; a<nq; ++a){
+        size_t c = 0;
+        for(size_t b=0; b<TEST_N; ++b){
+          const guint d = metric_registry[k].dist(qh + a, h + b);
+          assert(m[a * TEST_N + b] == (d <= opts.radius ? d + 1 : 0));
+          c += d <= opts.radius;
+        }
+        assert(counts[a] == c);
+      }
+      hash_index_pairs p = {0};
+      assert(hash_index_match_pairs(idx, qidx, &opts, &p, 0) == npairs);
+      assert(p.n == (size_t) npairs);
+      for(size_t j=0; j<p.n; ++j)
+        assert(m[(size_t) p.pairs[j].a * TEST_N + p.pairs[j].b]
+          == p.pairs[j].dist + 1);
+      free(p.pairs);
+      free(m);
+      memset(counts, 0xff, nq * sizeof(size_t));
+      assert(hash_index_match(idx, qidx, &opts, 0, counts, 0) == 0);
+      for(size_t a=0; a<nq; a+=11)
+        assert(counts[a] == hash_index_count(idx, &opts, qh + a, 0));
+
+      hash_index_match_nearest(idx, qidx, &opts, 7, all, nn, 0);
+      for(size_t a=0; a<nq; a+=13){
+        assert(nn[a] == hash_index_nearest(idx, &opts, qh + a, 7, nearest,
+          0));
+        assert(!memcmp(all + a * 7, nearest, nn[a] * sizeof *nearest));
+      }
+    }
+    free(all);
+    free(nn);
+    free(counts);
+    hash_index_destroy(qidx);
+    free(qh);
+  }
+  free(nearest);
+  free(keys);
+  free(hits);
+  hash_index_destroy(idx);
+  free(h);
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#elif defined(CMD_HASH_INDEX)
+typedef struct query_print query_print;
+struct query_print {
+  size_t q;
+  FILE* out;
+};
+
+static void query_print_hit(uint32_t id, guint dist, void* arg){
+  query_print* p = (query_print*) arg;
+  fprintf(p->out, "%zu\t%" PRIu32 "\t%u\n", p->q, id, dist);
+}
+
+/* Hash the image files @paths into @out. Return 0, or -1 after printing
+ * why one failed.
+ */
+static int query_hash_images(char** paths, size_t n, idhash_hash* out){
+  // Allocated once: the result holds a whole path buffer.
+  idhash_result* res = calloc(1, sizeof(idhash_result));
+  for(size_t i=0; i<n; ++i){
+    if(idhash_file(paths[i], res)){
+      fprintf(stderr, "Failed to hash %s: %s", paths[i],
+        vips_error_buffer());
+      free(res);
+      return -1;
+    }
+    out[i] = idhash_hash_of(res);
+  }
+  free(res);
+  return 0;
+}
+
+/* Run the @nq queries @hashes against @idx as one batch, printing what a
+ * query at a time would, with the pairs in no particular order. Return 0,
+ * or 1 if indexing them or writing failed.
+ */
+static int query_batch(
+  const hash_index* idx,
+  const hash_index_opts* opts,
+  const idhash_hash* hashes,
+  size_t nq,
+  size_t k,
+  int count,
+  hash_index_stats* st)
+{
+  hash_index* queries = hash_index_create(hashes, nq);
+  if(!queries){
+    fprintf(stderr, "Failed to index %zu queries.\n", nq);
+    return 1;
+  }
+  int failed = 0;
+  size_t* n = malloc((nq ? nq : 1) * sizeof(size_t));
+  if(k){
+    hash_index_neighbour* nearest = malloc((nq ? nq : 1) * k
+      * sizeof *nearest);
+    hash_index_match_nearest(idx, queries, opts, k, nearest, n, st);
+    for(size_t q=0; q<nq; ++q)
+      for(size_t i=0; i<n[q]; ++i)
+        printf("%zu\t%" PRIu32 "\t%u\n", q, nearest[q * k + i].id,
+          nearest[q * k + i].dist);
+    free(nearest);
+  } else if(count){
+    hash_index_match(idx, queries, opts, 0, n, st);
+    for(size_t q=0; q<nq; ++q) printf("%zu\t%zu\n", q, n[q]);
+  } else
+    failed = hash_index_match(idx, queries, opts, stdout, 0, st) < 0;
+  free(n);
+  hash_index_destroy(queries);
+  return failed;
+}
+
+int main(int argc, char* argv[argc]){
+  hash_index_opts opts = {0, HASH_INDEX_DEFAULT_RADIUS};
+  int join = 0, count = 0, images = 0, batch = 0, stats = 0, usage = 0;
+  int nargs = 0;
+  size_t k = 0;
+  char** args = calloc(argc, sizeof(char*));
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--metric") && i+1 < argc){
+      opts.metric = metric_find(argv[++i]);
+      if(!opts.metric){
+        fprintf(stderr, "Unknown metric %s. Metrics:\n", argv[i]);
+        metric_print_list(stderr);
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if(!strcmp(argv[i], "--radius") && i+1 < argc)
+      opts.radius = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--jobs") && i+1 < argc)
+      opts.jobs = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--k") && i+1 < argc){
+      k = strtoul(argv[++i], 0, 10);
+      usage |= !k;
+    }
+    else if(!strcmp(argv[i], "--join")) join = 1;
+    else if(!strcmp(argv[i], "--count")) count = 1;
+    else if(!strcmp(argv[i], "--images")) images = 1;
+    else if(!strcmp(argv[i], "--batch")) batch = 1;
+    else if(!strcmp(argv[i], "--no-prune")) opts.no_prune = 1;
+    else if(!strcmp(argv[i], "--stats")) stats = 1;
+    else args[nargs++] = argv[i];
+  }
+  if(join) usage |= nargs != 1 || count || k || images || batch;
+  else usage |= images ? nargs < 2 : nargs != 2;
+  if(usage || (count && k)){
+    fprintf(stderr, "Usage: %s [--metric <NAME>] [--radius <R> | --count | "
+      "--k <K>] [--batch] [--jobs <N>] [--no-prune] [--stats] <DB> "
+      "<QUERIES>\n"
+      "       %s [...] --images <DB> <IMAGE>...\n"
+      "       %s --join [--metric <NAME>] [--radius <R>] [--jobs <N>] "
+      "[--no-prune] [--stats] <DB>\n", argv[0], argv[0], argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  hash_db* db = hash_db_open(args[0]);
+  if(!db) exit(EXIT_FAILURE);
+  const uint64_t t = timing_now();
+  hash_index* idx = hash_index_create(db->hashes, db->count);
+  if(!idx){
+    fprintf(stderr, "Failed to index %zu hashes.\n", db->count);
+    exit(EXIT_FAILURE);
+  }
+  if(stats)
+    fprintf(stderr, "indexed %zu hashes in %.3f s\n", db->count,
+      (timing_now() - t) / 1e9);
+  hash_index_stats st = {0};
+  int failed = 0;
+  if(join){
+    const long npairs = hash_index_join(idx, &opts, stdout, &st);
+    failed = npairs < 0;
+    if(!failed) fprintf(stderr, "%ld pairs\n", npairs);
+  } else {
+    hash_db* queries = 0;
+    const idhash_hash* hashes;
+    size_t nq;
+    if(images){
+      if(VIPS_INIT(argv[0]))
+        vips_error_exit(NULL);
+      nq = nargs - 1;
+      idhash_hash* h = malloc(nq * sizeof(idhash_hash));
+      if(query_hash_images(args + 1, nq, h)) exit(EXIT_FAILURE);
+      hashes = h;
+    } else {
+      queries = hash_db_open(args[1]);
+      if(!queries) exit(EXIT_FAILURE);
+      hashes = queries->hashes;
+      nq = queries->count;
+    }
+    if(batch)
+      failed = query_batch(idx, &opts, hashes, nq, k, count, &st);
+    hash_index_neighbour* nearest = malloc((k ? k : 1) * sizeof *nearest);
+    uint64_t* took = malloc((nq ? nq : 1) * sizeof(uint64_t));
+    query_print p = {batch ? nq : 0, stdout};
+    for(; p.q < nq; ++p.q){
+      const uint64_t start = timing_now();
+      if(k){
+        const size_t n = hash_index_nearest(idx, &opts, hashes + p.q, k,
+          nearest, &st);
+        took[p.q] = timing_now() - start;
+        for(size_t i=0; i<n; ++i)
+          printf("%zu\t%" PRIu32 "\t%u\n", p.q, nearest[i].id,
+            nearest[i].dist);
+      } else if(count){
+        const size_t n = hash_index_count(idx, &opts, hashes + p.q, &st);
+        took[p.q] = timing_now() - start;
+        printf("%zu\t%zu\n", p.q, n);
+      } else {
+        hash_index_radius(idx, &opts, hashes + p.q, query_print_hit, &p,
+          &st);
+        took[p.q] = timing_now() - start;
+      }
+    }
+    if(stats && nq && !batch){
+      qsort(took, nq, sizeof(uint64_t), hash_index_cmp_key);
+      fprintf(stderr, "per query: median %.3f ms, p99 %.3f ms\n",
+        took[nq / 2] / 1e6, took[(nq - 1) * 99 / 100] / 1e6);
+    }
+    free(took);
+    free(nearest);
+    if(queries) hash_db_close(queries);
+    else free((idhash_hash*) hashes);
+  }
+  failed |= fflush(stdout) != 0;
+  if(failed) fprintf(stderr, "Failed to write the results.\n");
+  if(stats){
+    fprintf(stderr, "%.3f s\n", (timing_now() - t) / 1e9);
+    hash_index_print_stats(stderr, &st);
+  }
+  hash_index_destroy(idx);
+  hash_db_close(db);
+  free(args);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,1269 @@
+/* hash_store.c
+ *
+ * A hash database that takes inserts and deletes as they come, without
+ * rewriting the whole file for each: a log-structured merge of immutable
+ * segments.
+ *
+ * A store is a directory of segment files and a manifest naming the live
+ * ones, oldest first. Each change, a batch of puts and deletes by 64-bit
+ * key (see hash_db_key), is written as a new segment: the hashes put, and a
+ * tombstone for each key deleted. A key's newest segment decides it:
+ *
+ *   put in a newer segment      an update; older copies don't count
+ *   tombstone in a newer one    deleted
+ *
+ * A query fans out across the segments, each indexed by hash_index.c, and
+ * drops matches whose key a newer segment mentions.
+ *
+ * Segments are merged, size-tiered: a segment is of tier t if it holds
+ * HASH_STORE_RATIO^t to HASH_STORE_RATIO^(t+1) records, and a run of
+ * HASH_STORE_FANIN adjacent segments of the same tier is merged into one,
+ * keeping the newest of each key. Tombstones are kept until the merge
+ * reaches the oldest segment, since older copies may be left below them
+ * until then. So a store of n records has O(log n) segments and each
+ * record is rewritten O(log n) times. hash_store_start_compactor merges in
+ * a background thread as changes come in; hash_store_compact merges now,
+ * and with @all, everything into one segment.
+ *
+ * Readers take a view, a reference-counted list of segments, and are never
+ * held up by writes or merges: a change makes a new view and swaps it in,
+ * and a merged-away segment is unmapped and deleted when its last view
+ * goes.
+ *
+ * On disk every change is a new file: a segment is written to a temporary
+ * file, synced and renamed, then the manifest is replaced the same way,
+ * and the directory synced. A crash leaves the old manifest or the new,
+ * and opening the store deletes the files neither names. One process may
+ * have a store open at a time: hash_store_open takes an flock on the
+ * directory, and fails while another holds it, before deleting anything.
+ * Only a store with a valid manifest is swept, and one is only created in
+ * an empty directory, so a wrong path loses no files.
+ *
+ * A segment file, in host byte order:
+ *
+ *   char    magic[8]         "IDHASHG1"
+ *   guint64 count            hashes
+ *   guint64 ntombs           tombstones
+ *   guint64 reserved[5]
+ *   idhash_hash hashes[count]
+ *   guint64 keys[count]      of each hash, ascending
+ *   guint64 tombs[ntombs]    ascending
+ *
+ * and the manifest is text: "IDHASHM1", then "next <N>", the number for
+ * the next segment, then the live segments' numbers, a line each. Segment
+ * N is the file seg-N.
+ *
+ * Compile test
+ *
+gcc hash_store.c -o test-hash-store -DTEST_HASH_STORE -O2 -g -Wall -pthread `pkg-config vips --cflags --libs`
+ *
+ * Compile
+ *
+gcc hash_store.c -o idhash-store -DCMD_HASH_STORE -O2 -g -Wall -pthread `pkg-config vips --cflags --libs`
+ *
+ * Usage: put the hashes of <DB> into <STORE>, created if need be, in
+ * changes of --batch hashes (default all); delete the keys of <DB>'s
+ * hashes; print each live hash within --radius of each hash of <QUERIES>,
+ * as <query>\t<key>\t<distance> lines; merge by the policy, or --all into
+ * one segment; list the segments as <number>\t<hashes>\t<tombstones>; or,
+ * with --ingest, put <DB> in as --batch changes with the background merge
+ * running while another thread runs <QUERIES> over and over, and print
+ * the query latency during the ingest and after
+ *
+ * ./idhash-store --add <DB> [--batch <N>] <STORE>
+ * ./idhash-store --delete <DB> <STORE>
+ * ./idhash-store [--metric <NAME>] [--radius <R>] --query <QUERIES> <STORE>
+ * ./idhash-store --compact [--all] <STORE>
+ * ./idhash-store --list <STORE>
+ * ./idhash-store --ingest <DB> [--batch <N>] [--metric <NAME>]
+ *   [--radius <R>] --query <QUERIES> <STORE>
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef ERRNO_H
+#  define ERRNO_H
+#  include <errno.h>
+#endif
+
+#ifndef INTTYPES_H
+#  define INTTYPES_H
+#  include <inttypes.h>
+#endif
+
+#ifndef PTHREAD_H
+#  define PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#ifndef STDATOMIC_H
+#  define STDATOMIC_H
+#  include <stdatomic.h>
+#endif
+
+#ifndef TIME_H
+#  define TIME_H
+#  include <time.h>
+#endif
+
+#ifndef SYS_RESOURCE_H
+#  define SYS_RESOURCE_H
+#  include <sys/resource.h>
+#endif
+
+#ifndef SYS_SYSCALL_H
+#  define SYS_SYSCALL_H
+#  include <sys/syscall.h>
+#endif
+
+#ifndef DIRENT_H
+#  define DIRENT_H
+#  include <dirent.h>
+#endif
+
+#ifndef SYS_FILE_H
+#  define SYS_FILE_H
+#  include <sys/file.h>
+#endif
+
+#ifndef HASH_INDEX_H
+#  define HASH_INDEX_H
+#  include "hash_index.c"
+#endif
+
+#define HASH_STORE_MAGIC "IDHASHG1"
+#define SZ_HASH_STORE_MAGIC 8
+#define HASH_STORE_MANIFEST_MAGIC "IDHASHM1"
+
+// Segments of a tier merged at once, and the ratio of sizes between tiers.
+#ifndef HASH_STORE_FANIN
+#  define HASH_STORE_FANIN 4
+#endif
+#ifndef HASH_STORE_RATIO
+#  define HASH_STORE_RATIO 4
+#endif
+
+// Niceness of the background merge.
+#ifndef HASH_STORE_NICE
+#  define HASH_STORE_NICE 10
+#endif
+
+typedef struct hash_store_header hash_store_header;
+struct hash_store_header {
+  char magic[SZ_HASH_STORE_MAGIC];
+  guint64 count;
+  guint64 ntombs;
+  guint64 reserved[5];
+};
+
+typedef struct hash_store_segment hash_store_segment;
+struct hash_store_segment {
+  guint64 number;
+  const idhash_hash* hashes;   // in key order
+  const guint64* keys;
+  size_t count;
+  const guint64* tombs;
+  size_t ntombs;
+  hash_index* index;
+  void* map;
+  size_t size;
+  char* fname;
+  atomic_int refs;             // views holding it
+  atomic_int obsolete;         // merged away: delete with the last view
+};
+
+/* The segments of a store at one time, oldest first.
+ */
+typedef struct hash_store_view hash_store_view;
+struct hash_store_view {
+  atomic_int refs;
+  size_t n;
+  hash_store_segment* segments[];
+};
+
+typedef struct hash_store hash_store;
+struct hash_store {
+  char* dir;
+  int lock_fd;                 // the directory, flocked while open
+  hash_store_view* current;    // changed under both locks
+  pthread_mutex_t lock;        // taking a reference to current
+  pthread_mutex_t write_lock;  // the manifest
+  pthread_mutex_t compact_lock;
+  atomic_uint_fast64_t next;   // number of the next segment
+  // The background merge.
+  pthread_t compactor;
+  int running;
+  pthread_mutex_t wake_lock;
+  pthread_cond_t wake;
+  int pending;
+  int stop;
+};
+
+/* Called with the key of each live hash within the radius, and its
+ * distance.
+ */
+typedef void (*hash_store_fn)(guint64 key, guint dist, void* arg);
+
+/* Where @key is in the @n ascending @keys, or @n if it isn't.
+ */
+static size_t hash_store_find(const guint64* keys, size_t n, guint64 key){
+  size_t lo = 0, hi = n;
+  while(lo < hi){
+    const size_t mid = lo + (hi - lo) / 2;
+    if(keys[mid] < key) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo < n && keys[lo] == key ? lo : n;
+}
+
+static int hash_store_sync_dir(const char* dir){
+  const int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if(fd < 0) return -1;
+  const int failed = fsync(fd);
+  close(fd);
+  return failed;
+}
+
+/* Map segment @number of the store in @dir and index it. Return 0 with a
+ * message if it can't be.
+ */
+static hash_store_segment* hash_store_segment_open(
+  const char* dir,
+  guint64 number)
+{
+  char* fname = g_strdup_printf("%s/seg-%" PRIu64, dir, number);
+  int fd = open(fname, O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st)){
+    fprintf(stderr, "Failed to open segment %s: %s\n", fname,
+      strerror(errno));
+    if(fd >= 0) close(fd);
+    g_free(fname);
+    return 0;
+  }
+  const size_t size = st.st_size;
+  void* map = size < sizeof(hash_store_header) ? MAP_FAILED
+    : mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  const hash_store_header* h = map;
+  const size_t record = sizeof(idhash_hash) + sizeof(guint64);
+  if(map == MAP_FAILED
+    || memcmp(h->magic, HASH_STORE_MAGIC, SZ_HASH_STORE_MAGIC)
+    || h->count > size / record
+    || h->ntombs > size / sizeof(guint64)
+    || size != sizeof *h + h->count * record + h->ntombs * sizeof(guint64)){
+    fprintf(stderr, "Not a store segment: %s\n", fname);
+    if(map != MAP_FAILED) munmap(map, size);
+    g_free(fname);
+    return 0;
+  }
+  hash_store_segment* s = calloc(1, sizeof *s);
+  s->number = number;
+  s->hashes = (const idhash_hash*) (h + 1);
+  s->count = h->count;
+  s->keys = (const guint64*) (s->hashes + s->count);
+  s->tombs = s->keys + s->count;
+  s->ntombs = h->ntombs;
+  s->map = map;
+  s->size = size;
+  s->fname = fname;
+  s->index = hash_index_create(s->hashes, s->count);
+  if(!s->index){
+    fprintf(stderr, "Failed to index segment %s\n", fname);
+    munmap(map, size);
+    g_free(fname);
+    free(s);
+    return 0;
+  }
+  atomic_init(&s->refs, 1);
+  atomic_init(&s->obsolete, 0);
+  return s;
+}
+
+static void hash_store_segment_release(hash_store_segment* s){
+  if(atomic_fetch_sub(&s->refs, 1) != 1) return;
+  if(atomic_load(&s->obsolete)) unlink(s->fname);
+  hash_index_destroy(s->index);
+  munmap(s->map, s->size);
+  g_free(s->fname);
+  free(s);
+}
+
+static hash_store_view* hash_store_view_new(size_t n){
+  hash_store_view* v = malloc(sizeof *v + (n + 1) * sizeof(void*));
+  atomic_init(&v->refs, 1);
+  v->n = n;
+  return v;
+}
+
+/* The store's segments as they are now, for queries, to be given back with
+ * hash_store_release. Later changes don't show in it.
+ */
+hash_store_view* hash_store_acquire(hash_store* st){
+  pthread_mutex_lock(&st->lock);
+  hash_store_view* v = st->current;
+  atomic_fetch_add(&v->refs, 1);
+  pthread_mutex_unlock(&st->lock);
+  return v;
+}
+
+void hash_store_release(hash_store_view* v){
+  if(atomic_fetch_sub(&v->refs, 1) != 1) return;
+  for(size_t i=0; i<v->n; ++i) hash_store_segment_release(v->segments[i]);
+  free(v);
+}
+
+/* A segment being written: the hashes go to the file as they come, the
+ * keys and tombstones after them.
+ */
+typedef struct hash_store_writer hash_store_writer;
+struct hash_store_writer {
+  FILE* fp;
+  char* tmp;
+  guint64* keys;
+  size_t count, cap;
+  guint64* tombs;
+  size_t ntombs, tcap;
+  int failed;
+};
+
+static int hash_store_writer_open(hash_store_writer* w, const char* dir){
+  *w = (hash_store_writer){0};
+  w->tmp = g_strdup_printf("%s/tmp.XXXXXX", dir);
+  const int fd = mkstemp(w->tmp);
+  w->fp = fd < 0 ? 0 : fdopen(fd, "w");
+  const hash_store_header h = {0};
+  if(!w->fp || 1 != fwrite(&h, sizeof h, 1, w->fp)){
+    fprintf(stderr, "Failed to create %s: %s\n", w->tmp, strerror(errno));
+    if(w->fp) fclose(w->fp);
+    else if(fd >= 0) close(fd);
+    if(fd >= 0) unlink(w->tmp);
+    g_free(w->tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/* Add hash @h under @key, which must be past every key added so far.
+ */
+static void hash_store_writer_put(
+  hash_store_writer* w,
+  guint64 key,
+  const idhash_hash* h)
+{
+  if(w->count == w->cap)
+    w->keys = realloc(w->keys, (w->cap = w->cap ? 2*w->cap : 1024)
+      * sizeof(guint64));
+  w->keys[w->count++] = key;
+  w->failed |= 1 != fwrite(h, sizeof *h, 1, w->fp);
+}
+
+static void hash_store_writer_tomb(hash_store_writer* w, guint64 key){
+  if(w->ntombs == w->tcap)
+    w->tombs = realloc(w->tombs, (w->tcap = w->tcap ? 2*w->tcap : 1024)
+      * sizeof(guint64));
+  w->tombs[w->ntombs++] = key;
+}
+
+/* Finish the segment, sync it and name it the next segment of @st. Return
+ * it, opened, or 0 with a message on a write error.
+ */
+static hash_store_segment* hash_store_writer_finish(
+  hash_store_writer* w,
+  hash_store* st)
+{
+  hash_store_header h = {.count = w->count, .ntombs = w->ntombs};
+  memcpy(h.magic, HASH_STORE_MAGIC, SZ_HASH_STORE_MAGIC);
+  int failed = w->failed
+    || (w->count
+      && w->count != fwrite(w->keys, sizeof(guint64), w->count, w->fp))
+    || (w->ntombs
+      && w->ntombs != fwrite(w->tombs, sizeof(guint64), w->ntombs, w->fp))
+    || fseek(w->fp, 0, SEEK_SET)
+    || 1 != fwrite(&h, sizeof h, 1, w->fp)
+    || fflush(w->fp) || fsync(fileno(w->fp));
+  failed |= fclose(w->fp);
+  free(w->keys);
+  free(w->tombs);
+  const guint64 number = atomic_fetch_add(&st->next, 1);
+  char* fname = g_strdup_printf("%s/seg-%" PRIu64, st->dir, number);
+  if(!failed) failed = rename(w->tmp, fname) || hash_store_sync_dir(st->dir);
+  if(failed){
+    fprintf(stderr, "Failed to write segment %s: %s\n", fname,
+      strerror(errno));
+    unlink(w->tmp);
+  }
+  g_free(w->tmp);
+  g_free(fname);
+  return failed ? 0 : hash_store_segment_open(st->dir, number);
+}
+
+/* Replace the manifest of @st with one naming the segments of @v. Under
+ * the write lock.
+ */
+static int hash_store_write_manifest(
+  hash_store* st,
+  const hash_store_view* v)
+{
+  char* tmp = g_strdup_printf("%s/MANIFEST.XXXXXX", st->dir);
+  char* fname = g_strdup_printf("%s/MANIFEST", st->dir);
+  const int fd = mkstemp(tmp);
+  FILE* fp = fd < 0 ? 0 : fdopen(fd, "w");
+  int failed = !fp;
+  if(fp){
+    fprintf(fp, "%s\nnext %" PRIu64 "\n", HASH_STORE_MANIFEST_MAGIC,
+      (guint64) atomic_load(&st->next));
+    for(size_t i=0; i<v->n; ++i)
+      fprintf(fp, "%" PRIu64 "\n", v->segments[i]->number);
+    failed = fflush(fp) || fsync(fileno(fp));
+    failed |= fclose(fp);
+  } else if(fd >= 0) close(fd);
+  if(!failed) failed = rename(tmp, fname) || hash_store_sync_dir(st->dir);
+  if(failed){
+    fprintf(stderr, "Failed to write %s: %s\n", fname, strerror(errno));
+    if(fd >= 0) unlink(tmp);
+  }
+  g_free(tmp);
+  g_free(fname);
+  return failed ? -1 : 0;
+}
+
+/* Make the @nold adjacent segments @old of @st, or none to add to the end,
+ * into the segment @seg, on disk and then for new views. Return 0 on
+ * success, -1 with a message if the manifest can't be written, in which
+ * case @seg is deleted.
+ */
+static int hash_store_install(
+  hash_store* st,
+  hash_store_segment* const* old,
+  size_t nold,
+  hash_store_segment* seg)
+{
+  pthread_mutex_lock(&st->write_lock);
+  hash_store_view* cur = st->current;
+  size_t first = cur->n;
+  if(nold)
+    for(first=0; cur->segments[first] != old[0]; ++first);
+  hash_store_view* v = hash_store_view_new(cur->n - nold + 1);
+  for(size_t i=0, j=0; i<cur->n; ++i){
+    if(i == first) v->segments[j++] = seg;
+    if(i >= first && i < first + nold){
+      assert(cur->segments[i] == old[i - first]);
+      continue;
+    }
+    v->segments[j++] = cur->segments[i];
+    atomic_fetch_add(&cur->segments[i]->refs, 1);
+  }
+  if(first == cur->n) v->segments[v->n - 1] = seg;
+  if(hash_store_write_manifest(st, v)){
+    pthread_mutex_unlock(&st->write_lock);
+    atomic_store(&seg->obsolete, 1);
+    hash_store_release(v);
+    return -1;
+  }
+  for(size_t i=0; i<nold; ++i) atomic_store(&old[i]->obsolete, 1);
+  pthread_mutex_lock(&st->lock);
+  st->current = v;
+  pthread_mutex_unlock(&st->lock);
+  pthread_mutex_unlock(&st->write_lock);
+  hash_store_release(cur);
+  return 0;
+}
+
+/* Open the store in @dir, creating it if @create and there is none, and
+ * delete any files a crash left. A store is only created in a new or empty
+ * directory. Return 0 with a message if it can't be opened, or is open
+ * already, here or in another process.
+ */
+hash_store* hash_store_open(const char* dir, int create){
+  if(create && mkdir(dir, 0755) && errno != EEXIST){
+    fprintf(stderr, "Failed to create store %s: %s\n", dir, strerror(errno));
+    return 0;
+  }
+  const int lock_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB)){
+    if(errno == EWOULDBLOCK)
+      fprintf(stderr, "Store %s is open already\n", dir);
+    else
+      fprintf(stderr, "Failed to open store %s: %s\n", dir, strerror(errno));
+    if(lock_fd >= 0) close(lock_fd);
+    return 0;
+  }
+  hash_store* st = calloc(1, sizeof *st);
+  st->dir = g_strdup(dir);
+  st->lock_fd = lock_fd;
+  pthread_mutex_init(&st->lock, 0);
+  pthread_mutex_init(&st->write_lock, 0);
+  pthread_mutex_init(&st->compact_lock, 0);
+  pthread_mutex_init(&st->wake_lock, 0);
+  pthread_cond_init(&st->wake, 0);
+  char* fname = g_strdup_printf("%s/MANIFEST", dir);
+  FILE* fp = fopen(fname, "r");
+  const int fresh = !fp;
+  guint64* numbers = 0;
+  size_t n = 0, cap = 0;
+  guint64 next = 0;
+  int failed = 0;
+  if(fp){
+    char line[64];
+    failed = !fgets(line, sizeof line, fp)
+      || strcmp(line, HASH_STORE_MANIFEST_MAGIC "\n")
+      || 1 != fscanf(fp, "next %" SCNu64 "\n", &next);
+    for(guint64 number; !failed && 1 == fscanf(fp, "%" SCNu64, &number); ){
+      if(n == cap)
+        numbers = realloc(numbers, (cap = cap ? 2*cap : 64) * sizeof *numbers);
+      numbers[n++] = number;
+      failed = number >= next;
+    }
+    failed |= !feof(fp);
+    fclose(fp);
+    if(failed) fprintf(stderr, "Malformed manifest %s\n", fname);
+  } else if(errno != ENOENT || !create){
+    fprintf(stderr, "Failed to open store %s: %s\n", fname, strerror(errno));
+    failed = 1;
+  } else {
+    // Without a manifest this isn't a store, so nothing in it is ours.
+    DIR* dp = opendir(dir);
+    struct dirent* e = 0;
+    while(dp && (e = readdir(dp))
+      && (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")))
+      ;
+    if(!dp || e){
+      fprintf(stderr, "Failed to create store %s: %s\n", dir,
+        dp ? "not empty, and has no MANIFEST" : strerror(errno));
+      failed = 1;
+    }
+    if(dp) closedir(dp);
+  }
+  g_free(fname);
+  atomic_init(&st->next, next);
+  st->current = hash_store_view_new(n);
+  st->current->n = 0;
+  for(size_t i=0; i<n && !failed; ++i){
+    hash_store_segment* seg = hash_store_segment_open(dir, numbers[i]);
+    if(seg) st->current->segments[st->current->n++] = seg;
+    else failed = 1;
+  }
+  DIR* dp = failed || fresh ? 0 : opendir(dir);
+  for(struct dirent* e; dp && (e = readdir(dp)); ){
+    guint64 number;
+    char end;
+    int orphan = !strncmp(e->d_name, "tmp.", 4)
+      || !strncmp(e->d_name, "MANIFEST.", 9);
+    if(1 == sscanf(e->d_name, "seg-%" SCNu64 "%c", &number, &end)){
+      orphan = 1;
+      for(size_t i=0; i<n; ++i) orphan &= numbers[i] != number;
+    }
+    if(orphan){
+      char* path = g_strdup_printf("%s/%s", dir, e->d_name);
+      unlink(path);
+      g_free(path);
+    }
+  }
+  if(dp) closedir(dp);
+  free(numbers);
+  if(!failed && fresh) failed = hash_store_write_manifest(st, st->current);
+  if(failed){
+    hash_store_release(st->current);
+    pthread_mutex_destroy(&st->lock);
+    pthread_mutex_destroy(&st->write_lock);
+    pthread_mutex_destroy(&st->compact_lock);
+    pthread_mutex_destroy(&st->wake_lock);
+    pthread_cond_destroy(&st->wake);
+    close(st->lock_fd);
+    g_free(st->dir);
+    free(st);
+    return 0;
+  }
+  return st;
+}
+
+typedef struct hash_store_change hash_store_change;
+struct hash_store_change {
+  guint64 key;
+  size_t order;    // deletes first, then puts in the order given
+};
+
+static int hash_store_change_cmp(const void* a, const void* b){
+  const hash_store_change* x = a;
+  const hash_store_change* y = b;
+  if(x->key != y->key) return (x->key > y->key) - (x->key < y->key);
+  return (x->order < y->order) - (x->order > y->order);
+}
+
+/* Put the @n @hashes under @keys and delete the @ndels keys @dels, as one
+ * segment. A key put twice keeps the later hash, and one both put and
+ * deleted is put. The change is on disk when this returns 0; -1 is a write
+ * error, with a message, and nothing changed.
+ */
+int hash_store_apply(
+  hash_store* st,
+  const guint64* keys,
+  const idhash_hash* hashes,
+  size_t n,
+  const guint64* dels,
+  size_t ndels)
+{
+  if(!n && !ndels) return 0;
+  hash_store_change* c = malloc((n + ndels) * sizeof *c);
+  for(size_t i=0; i<ndels; ++i) c[i] = (hash_store_change){dels[i], i};
+  for(size_t i=0; i<n; ++i)
+    c[ndels + i] = (hash_store_change){keys[i], ndels + i};
+  qsort(c, n + ndels, sizeof *c, hash_store_change_cmp);
+  hash_store_writer w;
+  if(hash_store_writer_open(&w, st->dir)){
+    free(c);
+    return -1;
+  }
+  for(size_t i=0; i<n + ndels; ++i){
+    if(i && c[i].key == c[i-1].key) continue;
+    if(c[i].order < ndels) hash_store_writer_tomb(&w, c[i].key);
+    else hash_store_writer_put(&w, c[i].key, hashes + c[i].order - ndels);
+  }
+  free(c);
+  hash_store_segment* seg = hash_store_writer_finish(&w, st);
+  if(!seg || hash_store_install(st, 0, 0, seg)) return -1;
+  pthread_mutex_lock(&st->wake_lock);
+  st->pending = 1;
+  pthread_cond_signal(&st->wake);
+  pthread_mutex_unlock(&st->wake_lock);
+  return 0;
+}
+
+/* Merge the @n adjacent segments @segs, oldest first, keeping the newest
+ * entry of each key, and tombstones unless @drop_tombs. Return the new
+ * segment, or 0 on a write error.
+ */
+static hash_store_segment* hash_store_merge(
+  hash_store* st,
+  hash_store_segment* const* segs,
+  size_t n,
+  int drop_tombs)
+{
+  hash_store_writer w;
+  if(hash_store_writer_open(&w, st->dir)) return 0;
+  size_t* at = calloc(2 * n, sizeof(size_t));   // next key, next tombstone
+  for(;;){
+    guint64 min = 0;
+    int any = 0;
+    for(size_t j=0; j<n; ++j){
+      const hash_store_segment* s = segs[j];
+      if(at[2*j] < s->count && (!any || s->keys[at[2*j]] < min))
+        min = s->keys[at[2*j]], any = 1;
+      if(at[2*j+1] < s->ntombs && (!any || s->tombs[at[2*j+1]] < min))
+        min = s->tombs[at[2*j+1]], any = 1;
+    }
+    if(!any) break;
+    // A key is put or deleted once in a segment: the newest decides.
+    int done = 0;
+    for(size_t j=n; j-- > 0; ){
+      const hash_store_segment* s = segs[j];
+      if(at[2*j] < s->count && s->keys[at[2*j]] == min){
+        if(!done) hash_store_writer_put(&w, min, s->hashes + at[2*j]);
+        ++at[2*j];
+        done = 1;
+      } else if(at[2*j+1] < s->ntombs && s->tombs[at[2*j+1]] == min){
+        if(!done && !drop_tombs) hash_store_writer_tomb(&w, min);
+        ++at[2*j+1];
+        done = 1;
+      }
+    }
+  }
+  free(at);
+  return hash_store_writer_finish(&w, st);
+}
+
+static int hash_store_tier(const hash_store_segment* s){
+  int t = 0;
+  for(guint64 x = s->count + s->ntombs; x >= HASH_STORE_RATIO;
+    x /= HASH_STORE_RATIO) ++t;
+  return t;
+}
+
+/* Set [@first, @end) to the newest run of HASH_STORE_FANIN or more
+ * adjacent segments of @v of the same tier, and return 1, or 0 if there is
+ * none.
+ */
+static int hash_store_pick(
+  const hash_store_view* v,
+  size_t* first,
+  size_t* end)
+{
+  for(size_t e=v->n; e > 0; ){
+    const int t = hash_store_tier(v->segments[e-1]);
+    size_t f = e - 1;
+    while(f > 0 && hash_store_tier(v->segments[f-1]) == t) --f;
+    if(e - f >= HASH_STORE_FANIN){
+      *first = f;
+      *end = e;
+      return 1;
+    }
+    e = f;
+  }
+  return 0;
+}
+
+/* Merge one run of segments of @st by the size-tiered policy, or with
+ * @all, every segment into one without tombstones. Return 1 if segments
+ * were merged, 0 if there were none to merge, or -1 on a write error.
+ */
+int hash_store_compact(hash_store* st, int all){
+  pthread_mutex_lock(&st->compact_lock);
+  hash_store_view* v = hash_store_acquire(st);
+  size_t first = 0, end = v->n;
+  const int found = all
+    ? v->n > 1 || (v->n == 1 && v->segments[0]->ntombs)
+    : hash_store_pick(v, &first, &end);
+  int merged = 0;
+  if(found){
+    hash_store_segment* seg = hash_store_merge(st, v->segments + first,
+      end - first, first == 0);
+    merged = seg && !hash_store_install(st, v->segments + first,
+      end - first, seg) ? 1 : -1;
+  }
+  hash_store_release(v);
+  pthread_mutex_unlock(&st->compact_lock);
+  return merged;
+}
+
+static void* hash_store_compactor(void* arg){
+  hash_store* st = (hash_store*) arg;
+  // Merging yields the CPU to queries; a thread's nice value is its own.
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), HASH_STORE_NICE);
+  for(;;){
+    pthread_mutex_lock(&st->wake_lock);
+    while(!st->pending && !st->stop)
+      pthread_cond_wait(&st->wake, &st->wake_lock);
+    const int stop = st->stop;
+    st->pending = 0;
+    pthread_mutex_unlock(&st->wake_lock);
+    if(stop) break;
+    while(hash_store_compact(st, 0) > 0);
+  }
+  return 0;
+}
+
+/* Merge segments in a background thread, after each change, until the
+ * store is closed.
+ */
+void hash_store_start_compactor(hash_store* st){
+  if(st->running) return;
+  st->running = !pthread_create(&st->compactor, 0, hash_store_compactor, st);
+}
+
+/* Close @st, once its views are released, waiting for a merge underway.
+ */
+void hash_store_close(hash_store* st){
+  if(!st) return;
+  if(st->running){
+    pthread_mutex_lock(&st->wake_lock);
+    st->stop = 1;
+    pthread_cond_signal(&st->wake);
+    pthread_mutex_unlock(&st->wake_lock);
+    pthread_join(st->compactor, 0);
+  }
+  hash_store_release(st->current);
+  pthread_mutex_destroy(&st->lock);
+  pthread_mutex_destroy(&st->write_lock);
+  pthread_mutex_destroy(&st->compact_lock);
+  pthread_mutex_destroy(&st->wake_lock);
+  pthread_cond_destroy(&st->wake);
+  close(st->lock_fd);
+  g_free(st->dir);
+  free(st);
+}
+
+/* Whether a segment of @v newer than segment @s puts or deletes @key.
+ */
+static int hash_store_shadowed(
+  const hash_store_view* v,
+  size_t s,
+  guint64 key)
+{
+  for(size_t j=s+1; j<v->n; ++j){
+    const hash_store_segment* seg = v->segments[j];
+    if(hash_store_find(seg->keys, seg->count, key) < seg->count
+      || hash_store_find(seg->tombs, seg->ntombs, key) < seg->ntombs)
+      return 1;
+  }
+  return 0;
+}
+
+/* Put the live hash of @key in @v into @out and return 1, or return 0 if
+ * there is none.
+ */
+int hash_store_get(const hash_store_view* v, guint64 key, idhash_hash* out){
+  for(size_t s=v->n; s-- > 0; ){
+    const hash_store_segment* seg = v->segments[s];
+    const size_t i = hash_store_find(seg->keys, seg->count, key);
+    if(i < seg->count){
+      *out = seg->hashes[i];
+      return 1;
+    }
+    if(hash_store_find(seg->tombs, seg->ntombs, key) < seg->ntombs) return 0;
+  }
+  return 0;
+}
+
+typedef struct hash_store_hits hash_store_hits;
+struct hash_store_hits {
+  const hash_store_view* v;
+  size_t s;
+  hash_store_fn fn;
+  void* arg;
+  size_t found;
+};
+
+static void hash_store_hit(uint32_t id, guint dist, void* arg){
+  hash_store_hits* h = (hash_store_hits*) arg;
+  const guint64 key = h->v->segments[h->s]->keys[id];
+  if(hash_store_shadowed(h->v, h->s, key)) return;
+  h->fn(key, dist, h->arg);
+  ++h->found;
+}
+
+/* Call @fn for every live hash of @v within @opts->radius of @q, segment by
+ * segment, and return how many there were. @stats, if not 0, is added to.
+ */
+size_t hash_store_radius(
+  const hash_store_view* v,
+  const hash_index_opts* opts,
+  const idhash_hash* q,
+  hash_store_fn fn,
+  void* arg,
+  hash_index_stats* stats)
+{
+  hash_store_hits h = {v, 0, fn, arg, 0};
+  for(h.s=v->n; h.s-- > 0; )
+    hash_index_radius(v->segments[h.s]->index, opts, q, hash_store_hit, &h,
+      stats);
+  return h.found;
+}
+
+#ifdef TEST_HASH_STORE
+static guint64 test_rand(guint64* s){
+  guint64 z = (*s += 0x9e3779b97f4a7c15u);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+  return z ^ (z >> 31);
+}
+
+#define TEST_KEYS 3000
+#define TEST_RADIUS 12
+
+// The store's contents as they should be: a hash per key, or none.
+typedef struct test_model test_model;
+struct test_model {
+  idhash_hash hashes[TEST_KEYS];
+  int live[TEST_KEYS];
+};
+
+typedef struct test_found test_found;
+struct test_found {
+  unsigned char seen[TEST_KEYS];
+};
+
+// Keys are multiplied out over the whole range, so they aren't in order.
+#define TEST_KEY(k) ((guint64) (k) * 0x9e3779b97f4a7c15u)
+#define TEST_UNKEY(key) ((key) * 0xf1de83e19937733du)
+
+static void test_hit(guint64 key, guint dist, void* arg){
+  test_found* f = (test_found*) arg;
+  key = TEST_UNKEY(key);
+  assert(key < TEST_KEYS && !f->seen[key]);
+  f->seen[key] = 1;
+}
+
+static void test_check(hash_store* st, const test_model* m, guint64* s){
+  const hash_index_opts opts = {.radius = TEST_RADIUS};
+  hash_store_view* v = hash_store_acquire(st);
+  for(int k=0; k<TEST_KEYS; ++k){
+    idhash_hash h;
+    const int got = hash_store_get(v, TEST_KEY(k), &h);
+    assert(got == m->live[k]);
+    assert(!got || !memcmp(&h, m->hashes + k, sizeof h));
+  }
+  for(int i=0; i<20; ++i){
+    const idhash_hash* q = m->hashes + test_rand(s) % TEST_KEYS;
+    test_found f = {{0}};
+    const size_t n = hash_store_radius(v, &opts, q, test_hit, &f, 0);
+    size_t expect = 0;
+    for(int k=0; k<TEST_KEYS; ++k){
+      const int within = m->live[k]
+        && idhash_hash_dist(q, m->hashes + k) <= TEST_RADIUS;
+      assert(f.seen[k] == within);
+      expect += within;
+    }
+    assert(n == expect);
+  }
+  hash_store_release(v);
+}
+
+// A random change to @m and @st: puts of new and old keys, and deletes.
+static void test_change(hash_store* st, test_model* m, guint64* s){
+  const size_t n = 1 + test_rand(s) % 200, ndels = test_rand(s) % 50;
+  guint64 keys[200], dels[50];
+  idhash_hash hashes[200];
+  for(size_t i=0; i<ndels; ++i){
+    const int k = test_rand(s) % TEST_KEYS;
+    dels[i] = TEST_KEY(k);
+    m->live[k] = 0;
+  }
+  for(size_t i=0; i<n; ++i){
+    const int k = test_rand(s) % TEST_KEYS;
+    keys[i] = TEST_KEY(k);
+    // Some near another, so queries find several.
+    hashes[i] = (idhash_hash){test_rand(s), test_rand(s), test_rand(s),
+      test_rand(s)};
+    if(i && test_rand(s) % 2){
+      hashes[i] = hashes[i-1];
+      hashes[i].dx ^= 1ull << test_rand(s) % 64;
+    }
+    m->hashes[k] = hashes[i];
+    m->live[k] = 1;
+  }
+  assert(!hash_store_apply(st, keys, hashes, n, dels, ndels));
+}
+
+typedef struct test_reader_work test_reader_work;
+struct test_reader_work {
+  hash_store* st;
+  atomic_int stop;
+  long queries;
+};
+
+// Queries while changes and merges run: each view stays whole.
+static void* test_reader(void* arg){
+  test_reader_work* w = (test_reader_work*) arg;
+  const hash_index_opts opts = {.radius = TEST_RADIUS};
+  guint64 s = 5;
+  while(!atomic_load(&w->stop)){
+    hash_store_view* v = hash_store_acquire(w->st);
+    const idhash_hash q = {test_rand(&s), test_rand(&s), test_rand(&s),
+      test_rand(&s)};
+    test_found f = {{0}};
+    hash_store_radius(v, &opts, &q, test_hit, &f, 0);
+    for(size_t i=0; i<v->n; ++i)
+      assert(v->segments[i]->count <= TEST_KEYS);
+    hash_store_release(v);
+    ++w->queries;
+  }
+  return 0;
+}
+
+static size_t test_nfiles(const char* dir){
+  DIR* dp = opendir(dir);
+  size_t n = 0;
+  for(struct dirent* e; (e = readdir(dp)); ) n += e->d_name[0] != '.';
+  closedir(dp);
+  return n;
+}
+
+int main(){
+  char dir[] = "/tmp/test-hash-store.XXXXXX";
+  assert(mkdtemp(dir));
+  assert(!hash_store_open(dir, 0));
+  // Not created over files that aren't a store, which are left alone.
+  char* user = g_strdup_printf("%s/seg-1", dir);
+  FILE* ufp = fopen(user, "w");
+  assert(ufp && !fclose(ufp));
+  assert(!hash_store_open(dir, 1));
+  assert(!access(user, F_OK) && test_nfiles(dir) == 1 && !unlink(user));
+  g_free(user);
+  hash_store* st = hash_store_open(dir, 1);
+  assert(st && st->current->n == 0);
+  test_model* m = calloc(1, sizeof *m);
+  guint64 s = 1;
+
+  // Changes alone, then merged by the policy: each merge keeps the
+  // contents, and the tiers bound the segment count.
+  for(int i=0; i<24; ++i) test_change(st, m, &s);
+  assert(st->current->n == 24);
+  test_check(st, m, &s);
+  int merges = 0;
+  for(int r; (r = hash_store_compact(st, 0)); ++merges) assert(r == 1);
+  size_t first, end;
+  assert(merges > 0 && !hash_store_pick(st->current, &first, &end));
+  test_check(st, m, &s);
+
+  // Reopened from disk, with the leftovers of a crash: a segment written
+  // but never in the manifest, and a manifest never renamed.
+  hash_store_close(st);
+  char* junk[2] = {g_strdup_printf("%s/seg-999999", dir),
+    g_strdup_printf("%s/MANIFEST.abcdef", dir)};
+  for(int i=0; i<2; ++i){
+    FILE* fp = fopen(junk[i], "w");
+    assert(fp && fputs("junk", fp) >= 0 && !fclose(fp));
+  }
+  st = hash_store_open(dir, 0);
+  assert(st);
+  // Open already: a second opener fails, and deletes nothing.
+  FILE* busy = fopen(junk[0], "w");
+  assert(busy && !fclose(busy));
+  assert(!hash_store_open(dir, 0));
+  assert(!access(junk[0], F_OK) && !unlink(junk[0]));
+  for(int i=0; i<2; ++i){
+    assert(access(junk[i], F_OK));
+    g_free(junk[i]);
+  }
+  test_check(st, m, &s);
+
+  // Changes with the background merge and a reader running.
+  hash_store_start_compactor(st);
+  test_reader_work w = {st};
+  atomic_init(&w.stop, 0);
+  pthread_t reader;
+  pthread_create(&reader, 0, test_reader, &w);
+  for(int i=0; i<60; ++i) test_change(st, m, &s);
+  atomic_store(&w.stop, 1);
+  pthread_join(reader, 0);
+  assert(w.queries > 0);
+  test_check(st, m, &s);
+
+  // Everything merged: no tombstones, one file per live segment.
+  hash_store_close(st);
+  st = hash_store_open(dir, 0);
+  assert(hash_store_compact(st, 1) == 1);
+  assert(st->current->n == 1 && !st->current->segments[0]->ntombs);
+  assert(hash_store_compact(st, 1) == 0);
+  size_t live = 0;
+  for(int k=0; k<TEST_KEYS; ++k) live += m->live[k];
+  assert(st->current->segments[0]->count == live);
+  test_check(st, m, &s);
+  assert(test_nfiles(dir) == 2);
+
+  // A view outlives the merge that replaces its segments.
+  test_change(st, m, &s);
+  hash_store_view* v = hash_store_acquire(st);
+  const char* fname = v->segments[0]->fname;
+  assert(hash_store_compact(st, 1) == 1);
+  assert(!access(fname, F_OK) && test_nfiles(dir) == 4);
+  idhash_hash h;
+  int k = 0;
+  while(!m->live[k]) ++k;
+  assert(hash_store_get(v, TEST_KEY(k), &h));
+  hash_store_release(v);
+  assert(test_nfiles(dir) == 2);
+  hash_store_close(st);
+
+  DIR* dp = opendir(dir);
+  for(struct dirent* e; (e = readdir(dp)); ){
+    if(e->d_name[0] == '.') continue;
+    char* path = g_strdup_printf("%s/%s", dir, e->d_name);
+    unlink(path);
+    g_free(path);
+  }
+  closedir(dp);
+  assert(!rmdir(dir));
+  free(m);
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#elif defined(CMD_HASH_STORE)
+typedef struct store_print store_print;
+struct store_print {
+  size_t q;
+};
+
+static void store_print_hit(guint64 key, guint dist, void* arg){
+  const store_print* p = (const store_print*) arg;
+  printf("%zu\t%" PRIu64 "\t%u\n", p->q, key, dist);
+}
+
+static void store_count_hit(guint64 key, guint dist, void* arg){
+}
+
+/* Put the hashes of @db into @st in changes of @batch.
+ */
+static int store_add(hash_store* st, const hash_db* db, size_t batch){
+  guint64* keys = malloc(batch * sizeof(guint64));
+  int failed = 0;
+  for(size_t i=0; i<db->count && !failed; i+=batch){
+    const size_t n = i + batch < db->count ? batch : db->count - i;
+    for(size_t j=0; j<n; ++j) keys[j] = hash_db_key(db, i + j);
+    failed = hash_store_apply(st, keys, db->hashes + i, n, 0, 0);
+  }
+  free(keys);
+  return failed;
+}
+
+typedef struct store_reader store_reader;
+struct store_reader {
+  hash_store* st;
+  const hash_db* queries;
+  const hash_index_opts* opts;
+  atomic_int stop;
+  uint64_t* took;
+  size_t n, cap;
+};
+
+// Runs the queries over and over until stopped, timing each.
+static void* store_reader_run(void* arg){
+  store_reader* r = (store_reader*) arg;
+  for(size_t i=0; !atomic_load(&r->stop); ++i){
+    const uint64_t t = timing_now();
+    hash_store_view* v = hash_store_acquire(r->st);
+    hash_store_radius(v, r->opts, r->queries->hashes
+      + i % r->queries->count, store_count_hit, 0, 0);
+    hash_store_release(v);
+    if(r->n == r->cap)
+      r->took = realloc(r->took, (r->cap = r->cap ? 2*r->cap : 1024)
+        * sizeof(uint64_t));
+    r->took[r->n++] = timing_now() - t;
+  }
+  return 0;
+}
+
+static int store_cmp_took(const void* a, const void* b){
+  const uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+  return (x > y) - (x < y);
+}
+
+static void store_print_took(const char* when, store_reader* r){
+  if(!r->n) return;
+  qsort(r->took, r->n, sizeof(uint64_t), store_cmp_took);
+  fprintf(stderr, "%s: %zu queries, median %.3f ms, p99 %.3f ms\n", when,
+    r->n, r->took[r->n / 2] / 1e6, r->took[(r->n - 1) * 99 / 100] / 1e6);
+  r->n = 0;
+}
+
+/* Time queries on another thread while @db goes in, then as long again
+ * after.
+ */
+static int store_ingest(
+  hash_store* st,
+  const hash_db* db,
+  size_t batch,
+  const hash_db* queries,
+  const hash_index_opts* opts)
+{
+  store_reader r = {st, queries, opts};
+  atomic_init(&r.stop, 0);
+  hash_store_start_compactor(st);
+  pthread_t reader;
+  pthread_create(&reader, 0, store_reader_run, &r);
+  const uint64_t t = timing_now();
+  const int failed = store_add(st, db, batch);
+  // Merges still underway count as ingest.
+  while(hash_store_compact(st, 0) > 0);
+  const double secs = (timing_now() - t) / 1e9;
+  atomic_store(&r.stop, 1);
+  pthread_join(reader, 0);
+  fprintf(stderr, "%zu hashes in %.3f s, %.0f per second\n", db->count, secs,
+    db->count / secs);
+  store_print_took("during ingest", &r);
+  atomic_store(&r.stop, 0);
+  pthread_create(&reader, 0, store_reader_run, &r);
+  const struct timespec wait = {(time_t) secs,
+    (long) ((secs - (time_t) secs) * 1e9)};
+  nanosleep(&wait, 0);
+  atomic_store(&r.stop, 1);
+  pthread_join(reader, 0);
+  store_print_took("idle", &r);
+  free(r.took);
+  return failed;
+}
+
+int main(int argc, char* argv[argc]){
+  const metric* metric = 0;
+  guint radius = HASH_INDEX_DEFAULT_RADIUS;
+  char* add = 0, *del = 0, *query = 0, *ingest = 0, *dir = 0;
+  size_t batch = 0;
+  int compact = 0, all = 0, list = 0, usage = 0;
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--metric") && i+1 < argc){
+      metric = metric_find(argv[++i]);
+      if(!metric){
+        fprintf(stderr, "Unknown metric %s. Metrics:\n", argv[i]);
+        metric_print_list(stderr);
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if(!strcmp(argv[i], "--radius") && i+1 < argc)
+      radius = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--batch") && i+1 < argc)
+      batch = strtoull(argv[++i], 0, 10);
+    else if(!strcmp(argv[i], "--add") && i+1 < argc) add = argv[++i];
+    else if(!strcmp(argv[i], "--delete") && i+1 < argc) del = argv[++i];
+    else if(!strcmp(argv[i], "--query") && i+1 < argc) query = argv[++i];
+    else if(!strcmp(argv[i], "--ingest") && i+1 < argc) ingest = argv[++i];
+    else if(!strcmp(argv[i], "--compact")) compact = 1;
+    else if(!strcmp(argv[i], "--all")) all = 1;
+    else if(!strcmp(argv[i], "--list")) list = 1;
+    else if(!dir) dir = argv[i];
+    else usage = 1;
+  }
+  const int modes = !!add + !!del + (query && !ingest) + !!ingest + compact
+    + list;
+  if(usage || !dir || modes != 1 || (ingest && !query)){
+    fprintf(stderr, "Usage: %s {--add <DB> [--batch <N>] | --delete <DB> "
+      "| [--metric <NAME>] [--radius <R>] --query <QUERIES> "
+      "| --compact [--all] | --list "
+      "| --ingest <DB> [--batch <N>] [--metric <NAME>] [--radius <R>] "
+      "--query <QUERIES>} <STORE>\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  hash_store* st = hash_store_open(dir, add || ingest);
+  if(!st) exit(EXIT_FAILURE);
+  const hash_index_opts opts = {metric, radius};
+  hash_db* db = add || del || ingest ? hash_db_open(add ? add
+    : del ? del : ingest) : 0;
+  hash_db* queries = query ? hash_db_open(query) : 0;
+  int failed = (add || del || ingest) && !db;
+  failed |= query && !queries;
+  if(ingest && queries && !queries->count){
+    fprintf(stderr, "%s holds no queries to time.\n", query);
+    failed = 1;
+  }
+  if(!batch && db) batch = db->count ? db->count : 1;
+  if(failed);
+  else if(add) failed = store_add(st, db, batch);
+  else if(del){
+    guint64* keys = malloc(db->count * sizeof(guint64) + 1);
+    for(size_t i=0; i<db->count; ++i) keys[i] = hash_db_key(db, i);
+    failed = hash_store_apply(st, 0, 0, 0, keys, db->count);
+    free(keys);
+  }
+  else if(ingest) failed = store_ingest(st, db, batch, queries, &opts);
+  else if(query){
+    hash_store_view* v = hash_store_acquire(st);
+    for(size_t q=0; q<queries->count; ++q){
+      store_print p = {q};
+      hash_store_radius(v, &opts, queries->hashes + q, store_print_hit, &p,
+        0);
+    }
+    hash_store_release(v);
+    failed = fflush(stdout) != 0;
+  }
+  else if(compact){
+    int r;
+    while((r = hash_store_compact(st, all)) > 0 && !all);
+    failed = r < 0;
+  }
+  else {
+    hash_store_view* v = hash_store_acquire(st);
+    for(size_t i=0; i<v->n; ++i)
+      printf("%" PRIu64 "\t%zu\t%zu\n", v->segments[i]->number,
+        v->segments[i]->count, v->segments[i]->ntombs);
+    hash_store_release(v);
+  }
+  hash_db_close(queries);
+  hash_db_close(db);
+  hash_store_close(st);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,506 @@
+/* hash_unique.c
+ *
+ * Joins and nearest-neighbour queries over the distinct hashes of a table
+ * only, for corpora where many images share one hash: resized copies,
+ * re-encodes, and above all blank and solid-colour images, which all hash
+ * alike and make a clique that a plain join compares pair by pair.
+ *
+ * hash_unique_create puts each hash of the table into an open-addressing
+ * table (linear probing, at most half full) keyed on all 32 bytes, and
+ * numbers the distinct ones in order of first appearance. The records of
+ * each are kept as a list of their original indices, ascending, so a
+ * distinct hash stands for its records with the first of them as its
+ * number. Searches index the distinct hashes with hash_index.c and turn
+ * their results back into records only when they are written:
+ *
+ *   join      each pair of distinct hashes within the radius becomes every
+ *             pair of their records, and each set of records with one hash
+ *             every pair among them, at the hash's distance to itself
+ *   nearest   the k nearest distinct hashes hold at least k records; those
+ *             nearer than the k-th record come whole, and ties at its
+ *             distance are settled by record index as hash_index_nearest
+ *             settles them
+ *
+ * The output is the same as idhash-query's, but the comparisons are those
+ * of the distinct hashes. --stats reports how many there are and the
+ * largest set.
+ *
+ * Building takes up to 60 bytes per record; what's kept is 4 per record
+ * and 36 per distinct hash.
+ *
+ * Compile test
+ *
+gcc hash_unique.c -o test-hash-unique -DTEST_HASH_UNIQUE -O2 -g -Wall -pthread `pkg-config vips --cflags --libs`
+ *
+ * Compile
+ *
+gcc hash_unique.c -o idhash-unique -DCMD_HASH_UNIQUE -O2 -g -Wall -pthread `pkg-config vips --cflags --libs`
+ *
+ * Usage: print every pair of <DB> within --radius as <a>\t<b>\t<distance>,
+ * a < b, or the --k nearest records of <DB> to each hash of <QUERIES> as
+ * <query>\t<index>\t<distance>, nearest first, as idhash-query does
+ *
+ * ./idhash-unique --join [--metric <NAME>] [--radius <R>] [--jobs <N>]
+ *   [--stats] <DB>
+ * ./idhash-unique --k <K> [--metric <NAME>] [--stats] <DB> <QUERIES>
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef STDINT_H
+#  define STDINT_H
+#  include <stdint.h>
+#endif
+
+#ifndef INTTYPES_H
+#  define INTTYPES_H
+#  include <inttypes.h>
+#endif
+
+#ifndef ASSERT_H
+#  define ASSERT_H
+#  include <assert.h>
+#endif
+
+#ifndef HASH_INDEX_H
+#  define HASH_INDEX_H
+#  include "hash_index.c"
+#endif
+
+typedef struct hash_unique hash_unique;
+struct hash_unique {
+  idhash_hash* hashes;   // distinct, in order of first appearance
+  size_t n;
+  // The records of distinct hash u are members[first[u]..first[u+1]),
+  // ascending.
+  uint32_t* first;
+  uint32_t* members;
+  size_t count;          // records
+  uint32_t largest;      // records of the most common hash
+};
+
+static inline uint64_t hash_unique_key(const idhash_hash* h){
+  uint64_t k = h->dx * 0x9e3779b97f4a7c15u;
+  k = (k ^ h->dy) * 0x9e3779b97f4a7c15u;
+  k = (k ^ h->ix) * 0x9e3779b97f4a7c15u;
+  k = (k ^ h->iy) * 0x9e3779b97f4a7c15u;
+  return k ^ k >> 32;
+}
+
+/* The distinct hashes of the @n hashes @hashes, which needn't outlive it.
+ * Return 0 if @n is too large or memory runs out.
+ */
+hash_unique* hash_unique_create(const idhash_hash* hashes, size_t n){
+  if(n >= UINT32_MAX) return 0;
+  size_t cap = 16;
+  while(cap < 2*n) cap *= 2;
+  // Each slot holds a distinct hash's number + 1, or 0 if empty.
+  uint32_t* slots = calloc(cap, sizeof(uint32_t));
+  uint32_t* of = malloc(n * sizeof(uint32_t) + 1);
+  hash_unique* u = calloc(1, sizeof *u);
+  u->hashes = malloc(n * sizeof(idhash_hash) + 1);
+  u->first = calloc(n + 2, sizeof(uint32_t));
+  u->members = malloc(n * sizeof(uint32_t) + 1);
+  if(!slots || !of || !u->hashes || !u->first || !u->members){
+    free(slots);
+    free(of);
+    free(u->hashes);
+    free(u->first);
+    free(u->members);
+    free(u);
+    return 0;
+  }
+  u->count = n;
+  for(size_t i=0; i<n; ++i){
+    const idhash_hash* h = hashes + i;
+    size_t s = hash_unique_key(h) & (cap - 1);
+    for(; slots[s]; s = (s + 1) & (cap - 1)){
+      const idhash_hash* o = u->hashes + slots[s] - 1;
+      if(o->dx == h->dx && o->dy == h->dy && o->ix == h->ix
+        && o->iy == h->iy) break;
+    }
+    if(!slots[s]){
+      u->hashes[u->n] = *h;
+      slots[s] = ++u->n;
+    }
+    of[i] = slots[s] - 1;
+    ++u->first[of[i] + 2];
+  }
+  free(slots);
+  idhash_hash* fit = realloc(u->hashes, u->n * sizeof(idhash_hash) + 1);
+  if(fit) u->hashes = fit;
+  // Counts to offsets, shifted by one so filling moves them into place.
+  for(size_t d=0; d<u->n; ++d){
+    if(u->first[d + 2] > u->largest) u->largest = u->first[d + 2];
+    u->first[d + 2] += u->first[d + 1];
+  }
+  for(size_t i=0; i<n; ++i) u->members[u->first[of[i] + 1]++] = i;
+  free(of);
+  return u;
+}
+
+void hash_unique_destroy(hash_unique* u){
+  if(!u) return;
+  free(u->hashes);
+  free(u->first);
+  free(u->members);
+  free(u);
+}
+
+/* Each pair of records of distinct hashes @a and @b, as join lines.
+ */
+static long hash_unique_emit(
+  hash_index_join_work* w,
+  hash_index_join_buffer* buf,
+  uint32_t a,
+  uint32_t b,
+  guint dist)
+{
+  const hash_unique* u = w->emit_arg;
+  for(uint32_t i=u->first[a]; i<u->first[a+1]; ++i)
+    for(uint32_t j=u->first[b]; j<u->first[b+1]; ++j){
+      uint32_t x = u->members[i], y = u->members[j];
+      if(x > y){ const uint32_t t = x; x = y; y = t; }
+      if(buf->len > HASH_INDEX_JOIN_BUFFER - 32)
+        hash_index_join_flush(w, buf);
+      buf->len += sprintf(buf->bytes + buf->len, "%" PRIu32 "\t%" PRIu32
+        "\t%u\n", x, y, dist);
+    }
+  return (long) (u->first[a+1] - u->first[a])
+    * (u->first[b+1] - u->first[b]);
+}
+
+/* Write every pair of records of @u within @opts->radius to @out, as
+ * hash_index_join does, @idx being the index of @u->hashes. Return the
+ * number of pairs, or -1 if writing failed. @stats, if not 0, is added to:
+ * only comparisons of distinct hashes are counted.
+ */
+long hash_unique_join(
+  const hash_unique* u,
+  const hash_index* idx,
+  const hash_index_opts* opts,
+  FILE* out,
+  hash_index_stats* stats)
+{
+  hash_index_join_work w = {idx, opts, out};
+  w.emit = hash_unique_emit;
+  w.emit_arg = u;
+  long npairs = hash_index_join_run(&w, stats);
+  if(npairs < 0) return -1;
+  // The records that share a hash, which the index doesn't pair, written
+  // here once its threads are done.
+  const metric* m = hash_index_metric(opts);
+  hash_index_join_buffer* buf = malloc(sizeof(hash_index_join_buffer));
+  int failed = 0;
+  buf->len = 0;
+  for(size_t d=0; d<u->n; ++d){
+    if(u->first[d+1] - u->first[d] < 2) continue;
+    const guint dist = m->dist(u->hashes + d, u->hashes + d);
+    if(dist > opts->radius) continue;
+    for(uint32_t i=u->first[d]; i<u->first[d+1]; ++i)
+      for(uint32_t j=i+1; j<u->first[d+1]; ++j){
+        if(buf->len > HASH_INDEX_JOIN_BUFFER - 32){
+          failed |= fwrite(buf->bytes, 1, buf->len, out) != buf->len;
+          buf->len = 0;
+        }
+        buf->len += sprintf(buf->bytes + buf->len, "%" PRIu32 "\t%" PRIu32
+          "\t%u\n", u->members[i], u->members[j], dist);
+        ++npairs;
+      }
+  }
+  if(buf->len) failed |= fwrite(buf->bytes, 1, buf->len, out) != buf->len;
+  free(buf);
+  return failed ? -1 : npairs;
+}
+
+typedef struct hash_unique_ties hash_unique_ties;
+struct hash_unique_ties {
+  guint dist;
+  uint32_t* ids;
+  size_t n, cap;
+};
+
+static void hash_unique_tie(uint32_t id, guint dist, void* arg){
+  hash_unique_ties* t = (hash_unique_ties*) arg;
+  if(dist != t->dist) return;
+  if(t->n == t->cap)
+    t->ids = realloc(t->ids, (t->cap = t->cap ? 2*t->cap : 64)
+      * sizeof(uint32_t));
+  t->ids[t->n++] = id;
+}
+
+/* Put the @k records of @u nearest @q into @out, nearest first, ties by
+ * record index, as hash_index_nearest does, @idx being the index of
+ * @u->hashes. Return how many there are: @k, or fewer if @u has fewer
+ * records. @stats, if not 0, is added to.
+ */
+size_t hash_unique_nearest(
+  const hash_unique* u,
+  const hash_index* idx,
+  const hash_index_opts* opts,
+  const idhash_hash* q,
+  size_t k,
+  hash_index_neighbour* out,
+  hash_index_stats* stats)
+{
+  if(k > u->count) k = u->count;
+  if(!k) return 0;
+  // As many distinct hashes as records are wanted hold enough records.
+  const size_t kd = k < u->n ? k : u->n;
+  hash_index_neighbour* near = malloc(kd * sizeof *near);
+  const size_t got = hash_index_nearest(idx, opts, q, kd, near, stats);
+  // The distance of the k-th record.
+  size_t seen = 0, last = 0;
+  while(seen < k){
+    seen += u->first[near[last].id + 1] - u->first[near[last].id];
+    ++last;
+  }
+  const guint cut = near[last - 1].dist;
+  // Every distinct hash nearer than the cut is among these, but those at
+  // it may not all be, if the last one fetched is at it.
+  hash_unique_ties ties = {cut};
+  size_t nkeep = 0;
+  for(size_t i=0; i<got && near[i].dist < cut; ++i) ++nkeep;
+  if(near[got - 1].dist == cut && got < u->n){
+    hash_index_opts at = *opts;
+    at.radius = cut;
+    hash_index_radius(idx, &at, q, hash_unique_tie, &ties, stats);
+  } else
+    for(size_t i=nkeep; i<got && near[i].dist == cut; ++i)
+      hash_unique_tie(near[i].id, cut, &ties);
+  // The records nearer than the cut all make it; those at it go by index.
+  size_t n = 0;
+  for(size_t i=0; i<nkeep; ++i)
+    n += u->first[near[i].id + 1] - u->first[near[i].id];
+  for(size_t i=0; i<ties.n; ++i)
+    n += u->first[ties.ids[i] + 1] - u->first[ties.ids[i]];
+  uint64_t* keys = malloc(n * sizeof(uint64_t));
+  n = 0;
+  for(size_t i=0; i<nkeep + ties.n; ++i){
+    const uint32_t d = i < nkeep ? near[i].id : ties.ids[i - nkeep];
+    const uint64_t dist = i < nkeep ? near[i].dist : cut;
+    for(uint32_t j=u->first[d]; j<u->first[d+1]; ++j)
+      keys[n++] = dist << 32 | u->members[j];
+  }
+  qsort(keys, n, sizeof(uint64_t), hash_index_cmp_key);
+  for(size_t i=0; i<k; ++i)
+    out[i] = (hash_index_neighbour){keys[i] & 0xffffffff, keys[i] >> 32};
+  free(keys);
+  free(ties.ids);
+  free(near);
+  return k;
+}
+
+void hash_unique_print_stats(FILE* fp, const hash_unique* u){
+  fprintf(fp, "%zu records, %zu distinct hashes (%.2f%%), the most common "
+    "held by %" PRIu32 "\n", u->count, u->n,
+    u->count ? 100. * u->n / u->count : 0., u->largest);
+}
+
+#ifdef TEST_HASH_UNIQUE
+static guint64 test_rand(guint64* s){
+  guint64 z = (*s += 0x9e3779b97f4a7c15u);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+  return z ^ (z >> 31);
+}
+
+#define TEST_N 3000
+#define TEST_RADIUS 10
+
+static int test_cmp_pair(const void* a, const void* b){
+  const uint32_t* x = a;
+  const uint32_t* y = b;
+  for(int i=0; i<3; ++i)
+    if(x[i] != y[i]) return (x[i] > y[i]) - (x[i] < y[i]);
+  return 0;
+}
+
+// The pairs in @fp, sorted, three numbers each.
+static uint32_t* test_read_pairs(FILE* fp, long n){
+  uint32_t* p = malloc(3 * (n + 1) * sizeof(uint32_t));
+  rewind(fp);
+  for(long i=0; i<n; ++i)
+    assert(3 == fscanf(fp, "%" SCNu32 "\t%" SCNu32 "\t%" SCNu32, p + 3*i,
+      p + 3*i + 1, p + 3*i + 2));
+  qsort(p, n, 3 * sizeof(uint32_t), test_cmp_pair);
+  return p;
+}
+
+int main(){
+  // A blank hash many times over, copies of a few others, near ones, and
+  // uniform ones.
+  idhash_hash* h = malloc(TEST_N * sizeof(idhash_hash));
+  guint64 s = 1;
+  for(int i=0; i<TEST_N; ++i){
+    const int kind = test_rand(&s) % 8;
+    if(kind == 0) h[i] = (idhash_hash){0, 0, 0, 0};
+    else if(kind < 3 && i) h[i] = h[test_rand(&s) % i];
+    else h[i] = (idhash_hash){test_rand(&s), test_rand(&s),
+      test_rand(&s) | test_rand(&s), test_rand(&s) | test_rand(&s)};
+    if(kind == 3 && i){
+      h[i] = h[test_rand(&s) % i];
+      h[i].dx ^= 1ull << test_rand(&s) % 64;
+    }
+  }
+  hash_unique* u = hash_unique_create(h, TEST_N);
+  assert(u && u->count == TEST_N && u->n < TEST_N * 3 / 4);
+  assert(u->largest > TEST_N / 16);
+  // Every record is listed once, under its own hash, ascending; distinct
+  // hashes are numbered by first appearance.
+  assert(u->first[0] == 0 && u->first[u->n] == TEST_N);
+  for(size_t d=0; d<u->n; ++d){
+    assert(u->first[d] < u->first[d+1]);
+    assert(!d || u->members[u->first[d]] > u->members[u->first[d-1]]);
+    for(uint32_t i=u->first[d]; i<u->first[d+1]; ++i){
+      assert(!memcmp(h + u->members[i], u->hashes + d, sizeof *h));
+      assert(i == u->first[d] || u->members[i] > u->members[i-1]);
+    }
+  }
+
+  for(int mi=0; mi<METRIC_COUNT; ++mi){
+    const hash_index_opts opts = {metric_registry + mi, TEST_RADIUS, 0, 2};
+    hash_index* all = hash_index_create(h, TEST_N);
+    hash_index* idx = hash_index_create(u->hashes, u->n);
+
+    // The same pairs as the plain join.
+    FILE* a = tmpfile(), * b = tmpfile();
+    const long na = hash_index_join(all, &opts, a, 0);
+    hash_index_stats st = {0};
+    const long nb = hash_unique_join(u, idx, &opts, b, &st);
+    assert(na == nb && na > TEST_N);
+    assert(st.skipped + st.accepted + st.scanned == u->n * (u->n - 1) / 2);
+    uint32_t* pa = test_read_pairs(a, na), * pb = test_read_pairs(b, nb);
+    assert(!memcmp(pa, pb, 3 * na * sizeof(uint32_t)));
+    free(pa);
+    free(pb);
+    fclose(a);
+    fclose(b);
+
+    // The same nearest records, ties and all.
+    hash_index_neighbour x[64], y[64];
+    for(int q=0; q<60; ++q){
+      const idhash_hash* qh = h + test_rand(&s) % TEST_N;
+      const size_t k = 1 + test_rand(&s) % 64;
+      assert(hash_index_nearest(all, &opts, qh, k, x, 0) == k);
+      assert(hash_unique_nearest(u, idx, &opts, qh, k, y, 0) == k);
+      for(size_t i=0; i<k; ++i)
+        assert(x[i].id == y[i].id && x[i].dist == y[i].dist);
+    }
+    hash_index_destroy(all);
+    hash_index_destroy(idx);
+  }
+
+  // All alike, and none.
+  for(int i=0; i<10; ++i) h[i] = h[0];
+  hash_unique* one = hash_unique_create(h, 10);
+  assert(one->n == 1 && one->largest == 10);
+  hash_index* idx = hash_index_create(one->hashes, one->n);
+  hash_index_neighbour y[20];
+  const hash_index_opts opts = {0, TEST_RADIUS};
+  assert(hash_unique_nearest(one, idx, &opts, h, 20, y, 0) == 10);
+  for(int i=0; i<10; ++i) assert(y[i].id == (uint32_t) i && !y[i].dist);
+  FILE* fp = tmpfile();
+  assert(hash_unique_join(one, idx, &opts, fp, 0) == 45);
+  fclose(fp);
+  hash_index_destroy(idx);
+  hash_unique_destroy(one);
+  hash_unique* none = hash_unique_create(h, 0);
+  assert(none && !none->n && !none->count);
+  hash_unique_destroy(none);
+
+  hash_unique_destroy(u);
+  free(h);
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#elif defined(CMD_HASH_UNIQUE)
+int main(int argc, char* argv[argc]){
+  hash_index_opts opts = {0, HASH_INDEX_DEFAULT_RADIUS};
+  size_t k = 0;
+  int join = 0, stats = 0, usage = 0, nargs = 0;
+  char* args[2] = {0};
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--metric") && i+1 < argc){
+      opts.metric = metric_find(argv[++i]);
+      if(!opts.metric){
+        fprintf(stderr, "Unknown metric %s. Metrics:\n", argv[i]);
+        metric_print_list(stderr);
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if(!strcmp(argv[i], "--radius") && i+1 < argc)
+      opts.radius = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--k") && i+1 < argc)
+      k = strtoull(argv[++i], 0, 10);
+    else if(!strcmp(argv[i], "--jobs") && i+1 < argc)
+      opts.jobs = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--join")) join = 1;
+    else if(!strcmp(argv[i], "--stats")) stats = 1;
+    else if(nargs < 2) args[nargs++] = argv[i];
+    else usage = 1;
+  }
+  if(usage || join == !!k || nargs != (join ? 1 : 2)){
+    fprintf(stderr, "Usage: %s --join [--metric <NAME>] [--radius <R>] "
+      "[--jobs <N>] [--stats] <DB>\n"
+      "       %s --k <K> [--metric <NAME>] [--stats] <DB> <QUERIES>\n",
+      argv[0], argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  hash_db* db = hash_db_open(args[0]);
+  hash_db* queries = join || !db ? 0 : hash_db_open(args[1]);
+  if(!db || (!join && !queries)) exit(EXIT_FAILURE);
+  const uint64_t t = timing_now();
+  hash_unique* u = hash_unique_create(db->hashes, db->count);
+  hash_index* idx = u ? hash_index_create(u->hashes, u->n) : 0;
+  if(!idx){
+    fprintf(stderr, "Failed to index %s\n", args[0]);
+    exit(EXIT_FAILURE);
+  }
+  if(stats){
+    hash_unique_print_stats(stderr, u);
+    fprintf(stderr, "indexed in %.3f s\n", (timing_now() - t) / 1e9);
+  }
+  hash_index_stats st = {0};
+  int failed = 0;
+  if(join){
+    const long npairs = hash_unique_join(u, idx, &opts, stdout, &st);
+    failed = npairs < 0 || fflush(stdout);
+    if(stats) fprintf(stderr, "%ld pairs\n", npairs);
+  } else {
+    hash_index_neighbour* near = malloc(k * sizeof *near);
+    for(size_t q=0; q<queries->count; ++q){
+      const size_t n = hash_unique_nearest(u, idx, &opts,
+        queries->hashes + q, k, near, &st);
+      for(size_t i=0; i<n; ++i)
+        printf("%zu\t%" PRIu32 "\t%u\n", q, near[i].id, near[i].dist);
+    }
+    free(near);
+    failed = fflush(stdout) != 0;
+  }
+  if(failed) fprintf(stderr, "Failed to write the results.\n");
+  if(stats){
+    hash_index_print_stats(stderr, &st);
+    fprintf(stderr, "%.3f s\n", (timing_now() - t) / 1e9);
+  }
+  hash_index_destroy(idx);
+  hash_unique_destroy(u);
+  hash_db_close(queries);
+  hash_db_close(db);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
@@ -20,6 +20,11 @@
    static void* histogram_thread_y(void* _arg);
 #endif
 
+#ifndef TIMING_H
+#  define TIMING_H
+#  include "timing.c"
+#endif
+
 #ifndef SZ_PATH
 #  define SZ_PATH 4096
 #endif
@@ -72,10 +77,8 @@ guint idhash_distance(
     + bit_array_sum((d1_y ^ d2_y) & (i1_y | i2_y));
 
 /*******************************************************************
- * Classic DHash would look like this instead:                     *
- *                                                                 *
- * return bit_array_sum(d1_x ^ d2_x) + bit_array_sum(d1_y ^ d2_y); *
- *                                                                 *  
+ * Classic DHash, and other variants, are in metric.c, with batch  *
+ * kernels for scoring many hashes at once.                        *
  *******************************************************************/
 }
 
@@ -87,6 +90,30 @@ guint idhash_dist(idhash_result res_1, idhash_result res_2) {
     res_2.dx, res_2.dy, res_2.ix, res_2.iy);
 }
 
+/* The four components of an IDHash without the path: 32 bytes, for tables of
+ * many hashes.
+ */
+typedef struct idhash_hash idhash_hash;
+struct idhash_hash {
+  guint64 dx;
+  guint64 dy;
+  guint64 ix;
+  guint64 iy;
+};
+
+/* The components of @res as an idhash_hash.
+ */
+idhash_hash idhash_hash_of(const idhash_result* res) {
+  return (idhash_hash){res->dx, res->dy, res->ix, res->iy};
+}
+
+/* Compute the IDHash Distance between two idhash_hash objects.
+ */
+guint idhash_hash_dist(const idhash_hash* h1, const idhash_hash* h2) {
+  return idhash_distance(h1->dx, h1->dy, h1->ix, h1->iy,
+    h2->dx, h2->dy, h2->ix, h2->iy);
+}
+
 /* Print the x-direction difference hash, y-direction difference hash,
  * x-direction importance, and y-direction importance, in that order,
  * for a given IDHash result.
@@ -129,6 +156,7 @@ void idhash_pixels(
   /* Compute the bit arrays (represented as 64-bit integers) for the difference
    * hash and the associated importance array, for both the x- and y-direction.
    */
+  TIMING_START(t);
   histogram hist_x = {0};
   histogram_thread_arg arg_x = {&hist_x, pixels};
   pthread_t thread_x = {0};
@@ -149,50 +177,47 @@ void idhash_pixels(
   res->dy = hist_y.hash;
   res->ix = hist_x.importance;
   res->iy = hist_y.importance;
+  TIMING_STOP(TIMING_HASH, t);
 }
 
-/* Write the the IDHash Components for the image at @filepath to standard 
- * output.
+/* Compute the IDHash of @in, an image already shrunk to 8x8 (e.g. by 
+ * vips_thumbnail), copying the results to @res. Takes ownership of @in. 
+ * Return 0 on success, or -1 with the reason in the vips error buffer.
  */
-void idhash_filepath(char filepath[static 1], idhash_result* res) {
-  strncpy(res->path, filepath, strlen(filepath));
-
-  VipsImage *in;
+int idhash_thumbnail(VipsImage* in, idhash_result* res) {
   PixelRGB *pixels;
   VipsImage *out;
 
-  /* Open the file, scaling down to a 8x8 image for IDHash. Note that
-   * JPEG shrink-on-load is used by vipsthumbnail if the source is a
-   * JPEG. In my near-duplicate detection test, this has actually 
-   * resulted in better matches than linear shrinking with vipsthumbnail.
-   */
-  const int width = 8;
-  if (vips_thumbnail(filepath, &in, width, 
-    "height", width, 
-    "size", VIPS_SIZE_FORCE, 
-    NULL))
-    vips_error_exit(NULL);
-
   /* Convert to 8-bit RGB grayscale, dropping the alpha channel, if any. 
    */
-  if (vips_colourspace(in, &out, VIPS_INTERPRETATION_B_W, NULL))
-    vips_error_exit(NULL);
+  TIMING_START(t);
+  if (vips_colourspace(in, &out, VIPS_INTERPRETATION_B_W, NULL)) {
+    g_object_unref(in);
+    return -1;
+  }
   g_object_unref(in);
   in = out;
 
   /* Extract the red band - they should all be the same after grayscale. 
    */
-  if(vips_extract_band(in, &out, 0, "n", 1, NULL))
-    vips_error_exit(NULL);
+  if(vips_extract_band(in, &out, 0, "n", 1, NULL)) {
+    g_object_unref(in);
+    return -1;
+  }
   g_object_unref(in);
   in = out;
 
-  /* Force image into memory.
+  TIMING_STOP(TIMING_COLOURSPACE, t);
+
+  /* Force image into memory. This is where the pixels are actually decoded
+   * and shrunk, since the operations above only build the pipeline.
    */ 
+  TIMING_STAMP(t);
   if(vips_image_wio_input(in)) {
-    vips_error_exit("In file difference_hash.c:  In function "
-      "main(): Error writing image into memory.");
+    g_object_unref(in);
+    return -1;
   }
+  TIMING_STOP(TIMING_DECODE, t);
 
   /* Get a pointer to an array of PixelRGB. Each PixelRGB is a length 3 array.
    */
@@ -204,5 +229,96 @@ void idhash_filepath(char filepath[static 1], idhash_result* res) {
   idhash_pixels(pixels, in->Xsize, in->Ysize, res);
 
   g_object_unref(in);
-}   
+  return 0;
+}
+
+/* Compute the IDHash Components for the image at @filepath, copying the
+ * results to @res. Return 0 on success, or -1 with the reason in the vips
+ * error buffer, so a caller hashing many files can skip a bad one.
+ */
+int idhash_file(char filepath[static 1], idhash_result* res) {
+  g_strlcpy(res->path, filepath, SZ_PATH);
+
+  VipsImage *in;
+
+  /* Open the file, scaling down to a 8x8 image for IDHash. Note that
+   * JPEG shrink-on-load is used by vipsthumbnail if the source is a
+   * JPEG. In my near-duplicate detection test, this has actually 
+   * resulted in better matches than linear shrinking with vipsthumbnail.
+   */
+  const int width = 8;
+  TIMING_START(t);
+  if (vips_thumbnail(filepath, &in, width, 
+    "height", width, 
+    "size", VIPS_SIZE_FORCE, 
+    NULL))
+    return -1;
+  TIMING_STOP(TIMING_OPEN, t);
+
+  return idhash_thumbnail(in, res);
+}
+
+/* Compute the IDHash Components for the encoded image in @buf, @n bytes
+ * long, e.g. a file read ahead by prefetch.c. The path in @res is set to
+ * @name. @buf is only needed until this returns. Return 0 on success, or -1
+ * with the reason in the vips error buffer.
+ */
+int idhash_buffer(
+  const void* buf,
+  size_t n,
+  const char name[static 1],
+  idhash_result* res)
+{
+  g_strlcpy(res->path, name, SZ_PATH);
+
+  VipsImage *in;
+
+  /* Same shrink as idhash_file. The loader is picked from the bytes instead
+   * of the file name.
+   */
+  const int width = 8;
+  TIMING_START(t);
+  if (vips_thumbnail_buffer((void*) buf, n, &in, width,
+    "height", width,
+    "size", VIPS_SIZE_FORCE,
+    NULL))
+    return -1;
+  TIMING_STOP(TIMING_OPEN, t);
+
+  return idhash_thumbnail(in, res);
+}
+
+/* Compute the IDHash Components for @in, an image of any size already in
+ * memory or in a pipeline, e.g. a transformed copy of a file (see
+ * synth_pairs.c). The path in @res is set to @name. Takes ownership of @in.
+ * Return 0 on success, or -1 with the reason in the vips error buffer.
+ */
+int idhash_image(VipsImage* in, const char name[static 1], idhash_result* res) {
+  g_strlcpy(res->path, name, SZ_PATH);
+
+  VipsImage *out;
+
+  /* Same shrink as idhash_file, without shrink-on-load.
+   */
+  const int width = 8;
+  TIMING_START(t);
+  if (vips_thumbnail_image(in, &out, width,
+    "height", width,
+    "size", VIPS_SIZE_FORCE,
+    NULL)) {
+    g_object_unref(in);
+    return -1;
+  }
+  g_object_unref(in);
+  TIMING_STOP(TIMING_OPEN, t);
+
+  return idhash_thumbnail(out, res);
+}
 
+/* Write the the IDHash Components for the image at @filepath to standard
+ * output. Exit on a vips error.
+ */
+void idhash_filepath(char filepath[static 1], idhash_result* res) {
+  if (idhash_file(filepath, res))
+    vips_error_exit(NULL);
+}
@@ -16,11 +16,21 @@
  *
  * COMPILE
  * 
-gcc -o idhash-directory -DCMD_IDHASH_DIRECTORY -g -Wall idhash.h bit_array.h histogram.h idhash_directory.c `pkg-config vips --cflags --libs` -luuid -lm
+gcc -o idhash-directory -DCMD_IDHASH_DIRECTORY -g -Wall -pthread idhash.h bit_array.h histogram.h idhash_directory.c `pkg-config vips --cflags --libs` -luuid -lm
  *
  * RUN
  *
- * ./idhash-directory <TARGET_DIR> <DATA_FILE> <N_FILES> <N_DATA>
+ * ./idhash-directory [--profile <NAME>] <TARGET_DIR> <DATA_FILE> <N_FILES> <N_DATA>
+ * ./idhash-directory [--profile <NAME>] --manifest <MANIFEST> <DUP_DATA_FILE> <NONDUP_DATA_FILE> [--jobs <N>]
+ *
+ * With --manifest, the pairs come from a pair manifest (see pair_manifest.c)
+ * instead of numbered copies, each distinct image is hashed once (see
+ * idhash_pairs.c), and the duplicate and non-duplicate pairs are written to
+ * separate data files, one trial each, ready for roc_point.
+ *
+ * The "bulk" vips profile is used unless another is given (see vips_profile.c).
+ * Pairs with a file that isn't a JPEG/PNG/WebP/HEIF/GIF/TIFF by content (see
+ * sniff.c) are reported on stderr and skipped.
  *
  */
 
@@ -69,6 +79,21 @@ gcc -o idhash-directory -DCMD_IDHASH_DIRECTORY -g -Wall idhash.h bit_array.h his
 #  include "idhash_stats.c"
 #endif
 
+#ifndef VIPS_PROFILE_H
+#  define VIPS_PROFILE_H
+#  include "vips_profile.c"
+#endif
+
+#ifndef SNIFF_H
+#  define SNIFF_H
+#  include "sniff.c"
+#endif
+
+#ifndef IDHASH_PAIRS_H
+#  define IDHASH_PAIRS_H
+#  include "idhash_pairs.c"
+#endif
+
 #ifndef SZ_PATH
 #  define SZ_PATH 4096
 #endif
@@ -97,6 +122,14 @@ void idhash_directory(
     char* slash = dir[strlen(dir)-1] == '/' ? "" : "/";
     snprintf(path_a, SZ_PATH, "%s%s%d_a.jpg", dir, slash, i);
     snprintf(path_b, SZ_PATH, "%s%s%d_b.jpg", dir, slash, i);
+    // Skip the pair if either file isn't an image type libvips is used for
+    // here, instead of exiting on a failed decode halfway through the run.
+    int type_a = sniff_path(path_a), type_b = sniff_path(path_b);
+    if(type_a <= SNIFF_UNKNOWN || type_b <= SNIFF_UNKNOWN){
+      fprintf(stderr, "Skipping pair %d: %s is %s, %s is %s.\n", i,
+        path_a, sniff_type_name(type_a), path_b, sniff_type_name(type_b));
+      continue;
+    }
     idhash_stats_init(stats, path_a, path_b);
     // print stats to file
     idhash_stats_print(stats, fp, 0); // 0 => don't print data
@@ -105,15 +138,66 @@ void idhash_directory(
   fclose(fp);
 }
 
+/* Hash the pairs in the manifest @fname on @jobs threads (0 for one per
+ * CPU) and write the duplicate pairs to @dupfile and the non-duplicate pairs
+ * to @nondupfile. Pairs with an image that failed to hash are left out.
+ * Return the number of images that failed.
+ */
+size_t idhash_directory_manifest(
+  char fname[static 1],
+  char dupfile[static 1],
+  char nondupfile[static 1],
+  int jobs)
+{
+  pair_manifest* m = pair_manifest_read(fname);
+  if(!m) exit(EXIT_FAILURE);
+  idhash_pairs_opts opts = {jobs};
+  idhash_pairs* p = idhash_pairs_run(m, &opts);
+  char* datafile[2] = {nondupfile, dupfile};  // by pair_label
+  for(int label=PAIR_NONDUP; label<=PAIR_DUP; ++label){
+    FILE* fp;
+    if(!(fp = fopen(datafile[label], "w"))){
+      fprintf(stderr, "Failed to open data file %s\n", datafile[label]);
+      exit(EXIT_FAILURE);
+    }
+    idhash_pairs_print_stats(p, label, fp);
+    fclose(fp);
+  }
+  const size_t nfailed = p->nfailed;
+  idhash_pairs_destroy(p);
+  pair_manifest_destroy(m);
+  return nfailed;
+}
+
 #ifdef CMD_IDHASH_DIRECTORY
 int main(int argc, char* argv[argc]){
+  vips_profile profile={0};
+  vips_profile_parse_args(&profile, DEFAULT_VIPS_PROFILE, &argc, argv);
+  if(argc > 1 && !strcmp(argv[1], "--manifest")){
+    int jobs=0;
+    if(argc==7 && !strcmp(argv[5], "--jobs")) jobs = atoi(argv[6]);
+    else if(argc!=5){
+      fprintf(stderr, "Usage: %s [--profile <NAME>] --manifest <MANIFEST> "
+        "<DUP_DATA_FILE> <NONDUP_DATA_FILE> [--jobs <N>]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    if(VIPS_INIT(argv[0]))
+      vips_error_exit(NULL);
+    vips_profile_apply(&profile);
+    size_t nfailed = idhash_directory_manifest(argv[2], argv[3], argv[4], jobs);
+    vips_profile_print_stats(stderr);
+    return nfailed ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
   if(!(argc==5 && *argv[1] && *argv[2] && *argv[3] && *argv[4])){
-    fprintf(stderr, "Usage: %s <TARGET_DIR> <DATA_FILE> <N_MAX> <N_DATA>\n", argv[0]);
+    fprintf(stderr, "Usage: %s [--profile <NAME>] <TARGET_DIR> <DATA_FILE> "
+      "<N_MAX> <N_DATA>\n", argv[0]);
     exit(EXIT_FAILURE);
   } 
   if(VIPS_INIT(argv[0]))
     vips_error_exit(NULL);
+  vips_profile_apply(&profile);
   idhash_directory(argv[1], argv[2], atoi(argv[3]), atoi(argv[4]));
+  vips_profile_print_stats(stderr);
   return EXIT_SUCCESS;
 }
 #endif
@@ -0,0 +1,611 @@
+/* idhash_online.c
+ *
+ * An index that grows one hash at a time, for checking each upload against
+ * everything seen before it as it arrives rather than in a nightly join.
+ *
+ * idhash_online_check_and_insert reports the hashes within the radius of a
+ * new one, then adds it. Any number of threads may call it, and
+ * idhash_online_check, at once:
+ *
+ *   - Hashes are appended to segments of IDHASH_ONLINE_SEGMENT, which never
+ *     move, and published by a count stored with release order. A reader
+ *     loads the count and scans that many without taking a lock; nothing it
+ *     reads is written again.
+ *   - Each full block of IDHASH_ONLINE_BLOCK hashes gets the range of its
+ *     summaries (see metric.c) before the count passes it, so a scan skips
+ *     blocks the metric's lower bound rules out, as hash_index.c does.
+ *     Blocks are in arrival order, not sorted, so the ranges are wider.
+ *   - Writers take a lock only to append: a new hash is first checked
+ *     against what was published when it arrived, lock-free, then, under
+ *     the lock, against what came in meanwhile, and appended. No pair of
+ *     concurrent inserts misses the other, and each matching pair is
+ *     reported once, by whichever came second.
+ *   - The directory of segments doubles when full. The old one may still
+ *     be in a reader's hands, so it is freed by epochs: a reader announces
+ *     the global epoch in a slot while it holds the directory, the writer
+ *     that replaces it advances the epoch and frees the old directory once
+ *     no slot shows an older epoch than that.
+ *
+ * Each hash carries a caller's key, a database index or upload id, which is
+ * what matches are reported by.
+ *
+ * Compile test
+ *
+gcc idhash_online.c -o test-idhash-online -DTEST_IDHASH_ONLINE -O2 -g -Wall -pthread `pkg-config vips --cflags --libs`
+ *
+ * Compile
+ *
+gcc idhash_online.c -o idhash-online -DCMD_IDHASH_ONLINE -O2 -g -Wall -pthread `pkg-config vips --cflags --libs`
+ *
+ * Usage: feed the hashes of <DB> in order through an online index, as
+ * --jobs uploaders would, printing each match as <index>\t<index added
+ * before it>\t<distance>, each pair once; --stats prints the rate and the
+ * time per check
+ *
+ * ./idhash-online [--metric <NAME>] [--radius <R>] [--jobs <N>] [--stats]
+ *   <DB>
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef STDINT_H
+#  define STDINT_H
+#  include <stdint.h>
+#endif
+
+#ifndef INTTYPES_H
+#  define INTTYPES_H
+#  include <inttypes.h>
+#endif
+
+#ifndef PTHREAD_H
+#  define PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#ifndef STDATOMIC_H
+#  define STDATOMIC_H
+#  include <stdatomic.h>
+#endif
+
+#ifndef METRIC_H
+#  define METRIC_H
+#  include "metric.c"
+#endif
+
+#ifndef HASH_DB_H
+#  define HASH_DB_H
+#  include "hash_db.c"
+#endif
+
+#ifndef DIR_WALK_H
+#  define DIR_WALK_H
+#  include "dir_walk.c"
+#endif
+
+#define IDHASH_ONLINE_BLOCK 256
+
+#ifndef IDHASH_ONLINE_SEGMENT
+#  ifdef TEST_IDHASH_ONLINE
+#    define IDHASH_ONLINE_SEGMENT 1024
+#  else
+#    define IDHASH_ONLINE_SEGMENT (1 << 16)
+#  endif
+#endif
+
+// Threads that can hold the directory at once; more wait for a slot.
+#define IDHASH_ONLINE_SLOTS 128
+
+#ifndef IDHASH_ONLINE_DEFAULT_RADIUS
+#  define IDHASH_ONLINE_DEFAULT_RADIUS 10
+#endif
+
+typedef struct idhash_online_segment idhash_online_segment;
+struct idhash_online_segment {
+  idhash_hash hashes[IDHASH_ONLINE_SEGMENT];
+  metric_summary summaries[IDHASH_ONLINE_SEGMENT];
+  uint64_t keys[IDHASH_ONLINE_SEGMENT];
+  metric_range blocks[IDHASH_ONLINE_SEGMENT / IDHASH_ONLINE_BLOCK];
+};
+
+typedef struct idhash_online_dir idhash_online_dir;
+struct idhash_online_dir {
+  size_t cap;
+  idhash_online_segment* segments[];
+};
+
+// A directory replaced at @epoch, to be freed when no reader is older.
+typedef struct idhash_online_retired idhash_online_retired;
+struct idhash_online_retired {
+  idhash_online_dir* dir;
+  uint64_t epoch;
+  idhash_online_retired* next;
+};
+
+typedef struct idhash_online idhash_online;
+struct idhash_online {
+  const metric* metric;
+  guint radius;
+  _Atomic(idhash_online_dir*) dir;
+  atomic_size_t count;                  // hashes published
+  atomic_uint_fast64_t epoch;
+  // The epoch each reader came in at, or 0 for a free slot.
+  atomic_uint_fast64_t slots[IDHASH_ONLINE_SLOTS];
+  pthread_mutex_t write_lock;
+  idhash_online_retired* retired;       // under write_lock
+};
+
+typedef struct idhash_online_match idhash_online_match;
+struct idhash_online_match {
+  uint64_t key;
+  guint dist;
+};
+
+/* An empty index matching within @radius by @metric, or the default if 0.
+ */
+idhash_online* idhash_online_create(const metric* metric, guint radius){
+  idhash_online* o = calloc(1, sizeof *o);
+  o->metric = metric ? metric : metric_registry;
+  o->radius = radius;
+  idhash_online_dir* dir = calloc(1, sizeof *dir
+    + 4 * sizeof(idhash_online_segment*));
+  dir->cap = 4;
+  atomic_init(&o->dir, dir);
+  atomic_init(&o->count, 0);
+  atomic_init(&o->epoch, 1);
+  for(int i=0; i<IDHASH_ONLINE_SLOTS; ++i) atomic_init(o->slots + i, 0);
+  pthread_mutex_init(&o->write_lock, 0);
+  return o;
+}
+
+/* Free @o, which no thread may be using.
+ */
+void idhash_online_destroy(idhash_online* o){
+  if(!o) return;
+  idhash_online_dir* dir = atomic_load(&o->dir);
+  for(size_t i=0; i<dir->cap && dir->segments[i]; ++i)
+    free(dir->segments[i]);
+  free(dir);
+  while(o->retired){
+    idhash_online_retired* r = o->retired;
+    o->retired = r->next;
+    free(r->dir);
+    free(r);
+  }
+  pthread_mutex_destroy(&o->write_lock);
+  free(o);
+}
+
+static _Thread_local unsigned idhash_online_hint;
+
+/* Take a reader slot at the current epoch, and return it.
+ */
+static int idhash_online_enter(idhash_online* o){
+  for(unsigned i=idhash_online_hint; ; ++i){
+    const int slot = i % IDHASH_ONLINE_SLOTS;
+    uint_fast64_t idle = 0;
+    if(atomic_compare_exchange_weak(o->slots + slot, &idle,
+      atomic_load(&o->epoch))){
+      idhash_online_hint = slot;
+      return slot;
+    }
+  }
+}
+
+static void idhash_online_exit(idhash_online* o, int slot){
+  atomic_store(o->slots + slot, 0);
+}
+
+/* Free the retired directories no reader can still hold. Under the write
+ * lock.
+ */
+static void idhash_online_reclaim(idhash_online* o){
+  uint_fast64_t oldest = UINT64_MAX;
+  for(int i=0; i<IDHASH_ONLINE_SLOTS; ++i){
+    const uint_fast64_t e = atomic_load(o->slots + i);
+    if(e && e < oldest) oldest = e;
+  }
+  for(idhash_online_retired** r = &o->retired; *r; ){
+    if((*r)->epoch > oldest){
+      r = &(*r)->next;
+      continue;
+    }
+    idhash_online_retired* done = *r;
+    *r = done->next;
+    free(done->dir);
+    free(done);
+  }
+}
+
+/* Append @h with @key. Under the write lock.
+ */
+static void idhash_online_append(
+  idhash_online* o,
+  const idhash_hash* h,
+  uint64_t key)
+{
+  const size_t n = atomic_load_explicit(&o->count, memory_order_relaxed);
+  const size_t s = n / IDHASH_ONLINE_SEGMENT, i = n % IDHASH_ONLINE_SEGMENT;
+  idhash_online_dir* dir = atomic_load(&o->dir);
+  if(s == dir->cap){
+    // Readers may still be in the old directory: retire it, don't free it.
+    idhash_online_dir* bigger = calloc(1, sizeof *bigger
+      + 2 * dir->cap * sizeof(idhash_online_segment*));
+    bigger->cap = 2 * dir->cap;
+    memcpy(bigger->segments, dir->segments,
+      dir->cap * sizeof(idhash_online_segment*));
+    atomic_store(&o->dir, bigger);
+    idhash_online_retired* r = malloc(sizeof *r);
+    *r = (idhash_online_retired){dir, atomic_fetch_add(&o->epoch, 1) + 1,
+      o->retired};
+    o->retired = r;
+    idhash_online_reclaim(o);
+    dir = bigger;
+  }
+  if(!i) dir->segments[s] = malloc(sizeof(idhash_online_segment));
+  idhash_online_segment* seg = dir->segments[s];
+  seg->hashes[i] = *h;
+  seg->summaries[i] = metric_summary_of(h);
+  seg->keys[i] = key;
+  if(i % IDHASH_ONLINE_BLOCK == IDHASH_ONLINE_BLOCK - 1){
+    metric_range* r = seg->blocks + i / IDHASH_ONLINE_BLOCK;
+    *r = metric_range_empty();
+    for(size_t j=i + 1 - IDHASH_ONLINE_BLOCK; j<=i; ++j)
+      metric_range_add(r, seg->summaries + j);
+  }
+  atomic_store_explicit(&o->count, n + 1, memory_order_release);
+}
+
+/* Compare @q with hashes @from..@to, which are published, adding matches
+ * to @out up to @max. Return how many there were, stored or not.
+ */
+static size_t idhash_online_scan(
+  idhash_online* o,
+  const idhash_hash* q,
+  size_t from,
+  size_t to,
+  idhash_online_match* out,
+  size_t max,
+  size_t found)
+{
+  const metric* m = o->metric;
+  const metric_summary s = metric_summary_of(q);
+  const metric_range qr = metric_range_of(&s);
+  const int slot = idhash_online_enter(o);
+  const idhash_online_dir* dir = atomic_load(&o->dir);
+  guint dist[IDHASH_ONLINE_BLOCK];
+  for(size_t b = from / IDHASH_ONLINE_BLOCK * IDHASH_ONLINE_BLOCK; b < to;
+    b += IDHASH_ONLINE_BLOCK){
+    const idhash_online_segment* seg =
+      dir->segments[b / IDHASH_ONLINE_SEGMENT];
+    const size_t first = b > from ? b : from;
+    const size_t end = b + IDHASH_ONLINE_BLOCK < to ? b + IDHASH_ONLINE_BLOCK
+      : to;
+    const size_t i = first % IDHASH_ONLINE_SEGMENT;
+    // Only a whole block has its range.
+    if(end == b + IDHASH_ONLINE_BLOCK){
+      guint lo, hi;
+      m->bound(&qr, seg->blocks + i / IDHASH_ONLINE_BLOCK, &lo, &hi);
+      if(lo > o->radius) continue;
+    }
+    m->batch(q, seg->hashes + i, end - first, dist);
+    for(size_t j=0; j<end - first; ++j){
+      if(dist[j] > o->radius) continue;
+      if(found < max) out[found] = (idhash_online_match){seg->keys[i + j],
+        dist[j]};
+      ++found;
+    }
+  }
+  idhash_online_exit(o, slot);
+  return found;
+}
+
+/* Put the hashes within the radius of @q into @out, up to @max of them, and
+ * return how many there are, without adding @q. Never blocks.
+ */
+size_t idhash_online_check(
+  idhash_online* o,
+  const idhash_hash* q,
+  idhash_online_match* out,
+  size_t max)
+{
+  const size_t n = atomic_load_explicit(&o->count, memory_order_acquire);
+  return idhash_online_scan(o, q, 0, n, out, max, 0);
+}
+
+/* As idhash_online_check, but against only the first @before hashes added,
+ * which must all be in: those a call to idhash_online_check_and_insert_at
+ * compared its hash with, if @before is what it set *@at to.
+ */
+size_t idhash_online_check_before(
+  idhash_online* o,
+  const idhash_hash* q,
+  size_t before,
+  idhash_online_match* out,
+  size_t max)
+{
+  return idhash_online_scan(o, q, 0, before, out, max, 0);
+}
+
+/* Put the hashes within the radius of @q into @out, up to @max of them, add
+ * @q with @key, and return how many matches there are. @q is checked
+ * against every hash added before it, including by other threads at the
+ * same time. If @at is not 0, *@at is set to how many that was, so the
+ * matches past @max can be had from idhash_online_check_before.
+ */
+size_t idhash_online_check_and_insert_at(
+  idhash_online* o,
+  const idhash_hash* q,
+  uint64_t key,
+  idhash_online_match* out,
+  size_t max,
+  size_t* at)
+{
+  const size_t seen = atomic_load_explicit(&o->count, memory_order_acquire);
+  size_t found = idhash_online_scan(o, q, 0, seen, out, max, 0);
+  pthread_mutex_lock(&o->write_lock);
+  const size_t now = atomic_load_explicit(&o->count, memory_order_relaxed);
+  found = idhash_online_scan(o, q, seen, now, out, max, found);
+  idhash_online_append(o, q, key);
+  pthread_mutex_unlock(&o->write_lock);
+  if(at) *at = now;
+  return found;
+}
+
+size_t idhash_online_check_and_insert(
+  idhash_online* o,
+  const idhash_hash* q,
+  uint64_t key,
+  idhash_online_match* out,
+  size_t max)
+{
+  return idhash_online_check_and_insert_at(o, q, key, out, max, 0);
+}
+
+/* How many hashes @o holds.
+ */
+static inline size_t idhash_online_count(idhash_online* o){
+  return atomic_load_explicit(&o->count, memory_order_acquire);
+}
+
+#ifdef TEST_IDHASH_ONLINE
+static guint64 test_rand(guint64* s){
+  guint64 z = (*s += 0x9e3779b97f4a7c15u);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+  return z ^ (z >> 31);
+}
+
+#define TEST_N 6000
+#define TEST_THREADS 4
+#define TEST_RADIUS 12
+
+typedef struct test_work test_work;
+struct test_work {
+  idhash_online* o;
+  const idhash_hash* h;
+  atomic_int next;
+  atomic_int done;
+  // Each matching pair by the later key: count[a * TEST_N + b], a later.
+  _Atomic unsigned char* count;
+  atomic_long checks;
+};
+
+static void* test_writer(void* arg){
+  test_work* w = (test_work*) arg;
+  idhash_online_match m[64];
+  for(int i; (i = atomic_fetch_add(&w->next, 1)) < TEST_N; ){
+    const size_t n = idhash_online_check_and_insert(w->o, w->h + i, i, m,
+      64);
+    assert(n <= 64);
+    for(size_t j=0; j<n; ++j){
+      assert(m[j].key < TEST_N && m[j].key != (uint64_t) i);
+      assert(m[j].dist == idhash_hash_dist(w->h + i, w->h + m[j].key));
+      atomic_fetch_add(w->count + (size_t) i * TEST_N + m[j].key, 1);
+    }
+  }
+  return 0;
+}
+
+// Checks while the writers run: every match is real.
+static void* test_reader(void* arg){
+  test_work* w = (test_work*) arg;
+  idhash_online_match m[64];
+  guint64 s = 99;
+  while(!atomic_load(&w->done)){
+    const int q = test_rand(&s) % TEST_N;
+    const size_t n = idhash_online_check(w->o, w->h + q, m, 64);
+    assert(n <= 64);
+    for(size_t j=0; j<n; ++j)
+      assert(m[j].dist == idhash_hash_dist(w->h + q, w->h + m[j].key));
+    atomic_fetch_add(&w->checks, 1);
+  }
+  return 0;
+}
+
+int main(){
+  // Clusters of near-duplicates among uniform hashes.
+  idhash_hash* h = malloc(TEST_N * sizeof(idhash_hash));
+  guint64 s = 1;
+  for(int i=0; i<TEST_N; ++i){
+    h[i] = (idhash_hash){test_rand(&s), test_rand(&s),
+      test_rand(&s) | test_rand(&s), test_rand(&s) | test_rand(&s)};
+    if(i % 4 == 3){
+      h[i] = h[i - 1 - test_rand(&s) % 3];
+      h[i].dx ^= test_rand(&s) & test_rand(&s) & test_rand(&s);
+    }
+  }
+  test_work w = {idhash_online_create(0, TEST_RADIUS), h};
+  atomic_init(&w.next, 0);
+  atomic_init(&w.done, 0);
+  atomic_init(&w.checks, 0);
+  w.count = calloc((size_t) TEST_N * TEST_N, 1);
+  pthread_t writers[TEST_THREADS], reader;
+  pthread_create(&reader, 0, test_reader, &w);
+  for(int i=0; i<TEST_THREADS; ++i)
+    pthread_create(writers + i, 0, test_writer, &w);
+  for(int i=0; i<TEST_THREADS; ++i) pthread_join(writers[i], 0);
+  atomic_store(&w.done, 1);
+  pthread_join(reader, 0);
+  assert(idhash_online_count(w.o) == TEST_N);
+
+  // Every pair within the radius was reported exactly once, by one side.
+  size_t pairs = 0;
+  for(size_t a=0; a<TEST_N; ++a)
+    for(size_t b=a+1; b<TEST_N; ++b){
+      const int n = atomic_load(w.count + a * TEST_N + b)
+        + atomic_load(w.count + b * TEST_N + a);
+      assert(n == (idhash_hash_dist(h + a, h + b) <= TEST_RADIUS));
+      pairs += n;
+    }
+  assert(pairs > TEST_N / 8);
+
+  // Once all are in, a check finds each one's whole cluster.
+  idhash_online_match m[64];
+  for(int q=0; q<TEST_N; q+=7){
+    const size_t n = idhash_online_check(w.o, h + q, m, 64);
+    size_t expect = 0;
+    for(int i=0; i<TEST_N; ++i)
+      expect += idhash_hash_dist(h + q, h + i) <= TEST_RADIUS;
+    assert(n == expect);
+  }
+  printf("%zu pairs, %ld checks alongside\n", pairs, atomic_load(&w.checks));
+  idhash_online_destroy(w.o);
+
+  // More matches than fit: a check of those before finds the rest, and
+  // nothing added after.
+  idhash_online* o = idhash_online_create(0, 0);
+  idhash_online_match many[400];
+  for(int i=0; i<300; ++i)
+    assert(idhash_online_check_and_insert(o, h, i, m, 64) == (size_t) i);
+  size_t before;
+  assert(idhash_online_check_and_insert_at(o, h, 300, m, 64, &before) == 300);
+  assert(before == 300);
+  assert(idhash_online_check_and_insert(o, h, 301, m, 64) == 301);
+  assert(idhash_online_check_before(o, h, before, many, 400) == 300);
+  for(int i=0; i<300; ++i) assert(many[i].key == (uint64_t) i);
+  idhash_online_destroy(o);
+  free((void*) w.count);
+  free(h);
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#elif defined(CMD_IDHASH_ONLINE)
+typedef struct online_work online_work;
+struct online_work {
+  idhash_online* o;
+  const hash_db* db;
+  atomic_size_t next;
+  uint64_t* took;          // ns per check, by index
+  pthread_mutex_t out_lock;
+  atomic_long matches;
+};
+
+static void* online_worker(void* arg){
+  online_work* w = (online_work*) arg;
+  size_t max = 256;
+  idhash_online_match* m = malloc(max * sizeof *m);
+  for(size_t i; (i = atomic_fetch_add(&w->next, 1)) < w->db->count; ){
+    const uint64_t t = timing_now();
+    size_t before;
+    size_t n = idhash_online_check_and_insert_at(w->o, w->db->hashes + i, i,
+      m, max, &before);
+    w->took[i] = timing_now() - t;
+    if(n > max){
+      // Those it was checked against are all in, so checking them again
+      // finds the same matches, and none added since.
+      max = n;
+      m = realloc(m, max * sizeof *m);
+      n = idhash_online_check_before(w->o, w->db->hashes + i, before, m,
+        max);
+      if(n > max) n = max;
+    }
+    atomic_fetch_add(&w->matches, n);
+    pthread_mutex_lock(&w->out_lock);
+    for(size_t j=0; j<n; ++j)
+      printf("%zu\t%" PRIu64 "\t%u\n", i, m[j].key, m[j].dist);
+    pthread_mutex_unlock(&w->out_lock);
+  }
+  free(m);
+  return 0;
+}
+
+static int online_cmp_took(const void* a, const void* b){
+  const uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[argc]){
+  const metric* metric = 0;
+  guint radius = IDHASH_ONLINE_DEFAULT_RADIUS;
+  int jobs = 0, stats = 0, usage = 0, nargs = 0;
+  char* args[1] = {0};
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--metric") && i+1 < argc){
+      metric = metric_find(argv[++i]);
+      if(!metric){
+        fprintf(stderr, "Unknown metric %s. Metrics:\n", argv[i]);
+        metric_print_list(stderr);
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if(!strcmp(argv[i], "--radius") && i+1 < argc)
+      radius = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--jobs") && i+1 < argc)
+      jobs = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--stats")) stats = 1;
+    else if(nargs < 1) args[nargs++] = argv[i];
+    else usage = 1;
+  }
+  if(usage || nargs != 1){
+    fprintf(stderr, "Usage: %s [--metric <NAME>] [--radius <R>] "
+      "[--jobs <N>] [--stats] <DB>\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  hash_db* db = hash_db_open(args[0]);
+  if(!db) exit(EXIT_FAILURE);
+  if(jobs <= 0) jobs = dir_walk_ncpus();
+  online_work w = {idhash_online_create(metric, radius), db};
+  atomic_init(&w.next, 0);
+  atomic_init(&w.matches, 0);
+  w.took = malloc((db->count + 1) * sizeof(uint64_t));
+  pthread_mutex_init(&w.out_lock, 0);
+  const uint64_t t = timing_now();
+  pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+  for(int i=0; i<jobs; ++i)
+    pthread_create(threads + i, 0, online_worker, &w);
+  for(int i=0; i<jobs; ++i)
+    pthread_join(threads[i], 0);
+  free(threads);
+  const double secs = (timing_now() - t) / 1e9;
+  const int failed = fflush(stdout) != 0;
+  if(failed) fprintf(stderr, "Failed to write the matches.\n");
+  if(stats && db->count){
+    qsort(w.took, db->count, sizeof(uint64_t), online_cmp_took);
+    fprintf(stderr, "%zu hashes in %.3f s, %.0f per second, %ld matches\n"
+      "per check: median %.3f ms, p99 %.3f ms, max %.3f ms\n", db->count,
+      secs, db->count / secs, atomic_load(&w.matches),
+      w.took[db->count / 2] / 1e6, w.took[(db->count - 1) * 99 / 100] / 1e6,
+      w.took[db->count - 1] / 1e6);
+  }
+  pthread_mutex_destroy(&w.out_lock);
+  free(w.took);
+  idhash_online_destroy(w.o);
+  hash_db_close(db);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,575 @@
+/* idhash_pairs.c
+ *
+ * Score every pair in a pair manifest (see pair_manifest.c), hashing each
+ * distinct image once.
+ *
+ * An image is a path plus the transform applied before hashing; the first
+ * image of a pair never has one. The distinct images are collected, sorted,
+ * and hashed in parallel into a table, and each pair's distance is then two
+ * lookups and an idhash_hash_dist. A directory of n files scored as n
+ * duplicate and n non-duplicate pairs costs n decodes instead of 4n.
+ *
+ * The same table scores the pairs under any of the metrics of metric.c:
+ * idhash_pairs_score_metrics gathers a block of pairs' hashes at a time and
+ * runs every metric's pairs kernel over the block, on several threads, so
+ * comparing metrics costs one decode per image and one pass over the pairs.
+ *
+ * Images are hashed through an idhash_pairs_hash_fn, so a caller can decode
+ * and transform them any way it likes. The default, idhash_pairs_hash_file,
+ * checks the type with sniff.c and hashes the file with idhash_file; it
+ * fails images that have a transform (see synth_pairs.c for one that
+ * applies them). An idhash_pairs_hash_all_fn is given every transform of a
+ * path at once instead, so it can decode the original once for all of
+ * them: the images are sorted by path, so a thread takes each path's run.
+ *
+ * Compile test
+ *
+gcc idhash_pairs.c -o test-idhash-pairs -DTEST_IDHASH_PAIRS -g -Wall -pthread `pkg-config vips --cflags --libs`
+ *
+ * Run test
+ *
+ * ./test-idhash-pairs <MANIFEST>
+ *
+ * Compile
+ *
+gcc idhash_pairs.c -o idhash-pairs -DCMD_IDHASH_PAIRS -g -Wall -pthread `pkg-config vips --cflags --libs` -lm
+ *
+ * Usage: print the threshold closest to the top left corner of the ROC
+ * curve of the manifest's pairs, and with --curve the whole curve. With
+ * --metric, do so for each of a comma-separated list of metrics (see
+ * metric.c), one block each, headed by its name
+ *
+ * ./idhash-pairs [--profile <NAME>] [--jobs <N>] [--curve]
+ *   [--metric <NAME>[,<NAME>...]] <MANIFEST>
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef ERRNO_H
+#  define ERRNO_H
+#  include <errno.h>
+#endif
+
+#ifndef PTHREAD_H
+#  define PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#ifndef STDATOMIC_H
+#  define STDATOMIC_H
+#  include <stdatomic.h>
+#endif
+
+#ifndef IDHASH_H
+#  define IDHASH_H
+#  include "idhash.h"
+#endif
+
+#ifndef IDHASH_STATS_H
+#  define IDHASH_STATS_H
+#  include "idhash_stats.c"
+#endif
+
+#ifndef SNIFF_H
+#  define SNIFF_H
+#  include "sniff.c"
+#endif
+
+#ifndef ROC_POINT_H
+#  define ROC_POINT_H
+#  include "roc_point.c"
+#endif
+
+#ifndef VIPS_PROFILE_H
+#  define VIPS_PROFILE_H
+#  include "vips_profile.c"
+#endif
+
+#ifndef PAIR_MANIFEST_H
+#  define PAIR_MANIFEST_H
+#  include "pair_manifest.c"
+#endif
+
+#ifndef METRIC_H
+#  define METRIC_H
+#  include "metric.c"
+#endif
+
+// Distance of a pair with an image that failed to hash. Real distances are
+// at most 128.
+#define IDHASH_PAIRS_FAILED ((guint) -1)
+
+// Pairs per block of idhash_pairs_score_metrics: two tables of hashes that
+// fit in L1.
+#define IDHASH_PAIRS_BLOCK 256
+
+/* Hash the image at @path, after applying @transform ("" for none), into
+ * @out. Return 0 on success, or -1 with the reason in the vips error buffer.
+ * Called from several threads at once.
+ */
+typedef int (*idhash_pairs_hash_fn)(
+  const char* path,
+  const char* transform,
+  idhash_hash* out,
+  void* arg);
+
+/* Hash the image at @path under each of the @n @transforms into @out[i],
+ * setting @failed[i] for those that fail, with the reasons in the vips
+ * error buffer. Return the number that failed. Called from several threads
+ * at once, for different paths.
+ */
+typedef int (*idhash_pairs_hash_all_fn)(
+  const char* path,
+  const char* const* transforms,
+  int n,
+  idhash_hash* out,
+  char* failed,
+  void* arg);
+
+typedef struct idhash_pairs_opts idhash_pairs_opts;
+struct idhash_pairs_opts {
+  int jobs;                  // hashing threads, or 0 for one per online CPU
+  idhash_pairs_hash_fn hash; // or 0 for idhash_pairs_hash_file
+  void* arg;                 // passed to @hash and @hash_all
+  idhash_pairs_hash_all_fn hash_all;  // if not 0, used instead of @hash
+};
+
+typedef struct idhash_pairs idhash_pairs;
+struct idhash_pairs {
+  const pair_manifest* manifest;
+  uint64_t* images;     // sorted, distinct: path index << 32 | transform index
+  idhash_hash* hashes;  // hash of each image
+  char* failed;         // nonzero if the image failed to hash
+  size_t nimages;
+  size_t nfailed;
+  int jobs;             // threads for scoring
+  guint* dist;          // per pair: distance, or IDHASH_PAIRS_FAILED
+};
+
+/* The default hash: sniff, then idhash_file. Transforms aren't supported.
+ */
+int idhash_pairs_hash_file(
+  const char* path,
+  const char* transform,
+  idhash_hash* out,
+  void* arg)
+{
+  if(*transform){
+    vips_error("idhash", "no hash function for transform %s", transform);
+    return -1;
+  }
+  int type = sniff_path(path);
+  if(type <= SNIFF_UNKNOWN){
+    vips_error("idhash", "%s", type ? strerror(errno)
+      : "not a known image type");
+    return -1;
+  }
+  // Allocated per call: the result holds a whole path buffer.
+  idhash_result* res = calloc(1, sizeof(idhash_result));
+  int z = idhash_file((char*) path, res);
+  *out = idhash_hash_of(res);
+  free(res);
+  return z;
+}
+
+static int idhash_pairs_cmp_image(const void* a, const void* b){
+  const uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+  return (x > y) - (x < y);
+}
+
+static size_t idhash_pairs_find(
+  const idhash_pairs* p,
+  uint32_t path,
+  uint32_t transform)
+{
+  const uint64_t key = (uint64_t) path << 32 | transform;
+  const uint64_t* found = bsearch(&key, p->images, p->nimages,
+    sizeof(uint64_t), idhash_pairs_cmp_image);
+  return found - p->images;
+}
+
+typedef struct idhash_pairs_work idhash_pairs_work;
+struct idhash_pairs_work {
+  idhash_pairs* pairs;
+  const idhash_pairs_opts* opts;
+  atomic_size_t next;
+  atomic_size_t nfailed;
+  pthread_mutex_t err_lock;
+  // With @opts->hash_all: where each path's run of images starts, and
+  // ends, at @runs[nruns], and the transform of each image.
+  size_t* runs;
+  size_t nruns;
+  const char** transforms;
+};
+
+// Hash each path's run of images at once, through @opts->hash_all.
+static void idhash_pairs_hash_runs(idhash_pairs_work* w){
+  idhash_pairs* p = w->pairs;
+  const pair_manifest* m = p->manifest;
+  for(size_t r; (r = atomic_fetch_add(&w->next, 1)) < w->nruns; ){
+    const size_t first = w->runs[r], n = w->runs[r+1] - first;
+    const char** transforms = w->transforms + first;
+    const char* path = m->paths.strs[p->images[first] >> 32];
+    TIMING_START(t);
+    const int nfailed = w->opts->hash_all(path, transforms, n,
+      p->hashes + first, p->failed + first, w->opts->arg);
+    TIMING_STOP(TIMING_IMAGE, t);
+    if(!nfailed) continue;
+    atomic_fetch_add(&w->nfailed, nfailed);
+    pthread_mutex_lock(&w->err_lock);
+    for(size_t i=0; i<n; ++i)
+      if(p->failed[first + i])
+        fprintf(stderr, "Failed to hash %s%s%s\n", path,
+          *transforms[i] ? " with " : "", transforms[i]);
+    fprintf(stderr, "%s", vips_error_buffer());
+    vips_error_clear();
+    pthread_mutex_unlock(&w->err_lock);
+  }
+}
+
+static void* idhash_pairs_worker(void* _arg){
+  idhash_pairs_work* w = (idhash_pairs_work*) _arg;
+  idhash_pairs* p = w->pairs;
+  const pair_manifest* m = p->manifest;
+  idhash_pairs_hash_fn hash = w->opts->hash ? w->opts->hash
+    : idhash_pairs_hash_file;
+  if(w->opts->hash_all){
+    idhash_pairs_hash_runs(w);
+    vips_thread_shutdown();
+    return 0;
+  }
+  for(size_t i; (i = atomic_fetch_add(&w->next, 1)) < p->nimages; ){
+    const char* path = m->paths.strs[p->images[i] >> 32];
+    const char* transform = m->transforms.strs[p->images[i] & 0xffffffff];
+    TIMING_START(t);
+    const int failed = hash(path, transform, p->hashes + i, w->opts->arg);
+    TIMING_STOP(TIMING_IMAGE, t);
+    if(failed){
+      p->failed[i] = 1;
+      atomic_fetch_add(&w->nfailed, 1);
+      // The vips error buffer is shared: print and clear it together.
+      pthread_mutex_lock(&w->err_lock);
+      fprintf(stderr, "Failed to hash %s%s%s: %s", path,
+        *transform ? " with " : "", transform, vips_error_buffer());
+      vips_error_clear();
+      pthread_mutex_unlock(&w->err_lock);
+    }
+  }
+  vips_thread_shutdown();
+  return 0;
+}
+
+typedef struct idhash_pairs_score_work idhash_pairs_score_work;
+struct idhash_pairs_score_work {
+  const idhash_pairs* pairs;
+  const metric* const* metrics;
+  int nmetrics;
+  guint** dist;
+  atomic_size_t next;   // next block
+};
+
+static void* idhash_pairs_score_worker(void* _arg){
+  idhash_pairs_score_work* w = (idhash_pairs_score_work*) _arg;
+  const idhash_pairs* p = w->pairs;
+  const pair_manifest* m = p->manifest;
+  idhash_hash a[IDHASH_PAIRS_BLOCK], b[IDHASH_PAIRS_BLOCK];
+  char failed[IDHASH_PAIRS_BLOCK];
+  for(size_t k; (k = atomic_fetch_add(&w->next, 1) * IDHASH_PAIRS_BLOCK)
+    < m->npairs; ){
+    const size_t n = m->npairs - k < IDHASH_PAIRS_BLOCK ? m->npairs - k
+      : IDHASH_PAIRS_BLOCK;
+    for(size_t i=0; i<n; ++i){
+      const pair_manifest_pair* q = m->pairs + k + i;
+      const size_t ia = idhash_pairs_find(p, q->a, 0);
+      const size_t ib = idhash_pairs_find(p, q->b, q->transform);
+      a[i] = p->hashes[ia];
+      b[i] = p->hashes[ib];
+      failed[i] = p->failed[ia] || p->failed[ib];
+    }
+    for(int j=0; j<w->nmetrics; ++j){
+      guint* dist = w->dist[j] + k;
+      w->metrics[j]->pairs(a, b, n, dist);
+      for(size_t i=0; i<n; ++i)
+        if(failed[i]) dist[i] = IDHASH_PAIRS_FAILED;
+    }
+  }
+  return 0;
+}
+
+/* Score every pair of @p under each of the @nmetrics @metrics, into
+ * @dist[j][i] for metric j and pair i, or IDHASH_PAIRS_FAILED; each @dist[j]
+ * holds one guint per pair. Each block of pairs has its hashes gathered once
+ * for all the metrics. Runs on @p->jobs threads.
+ */
+void idhash_pairs_score_metrics(
+  const idhash_pairs* p,
+  const metric* const* metrics,
+  int nmetrics,
+  guint** dist)
+{
+  TIMING_START(t);
+  idhash_pairs_score_work w = {p, metrics, nmetrics, dist};
+  atomic_init(&w.next, 0);
+  const size_t nblocks = (p->manifest->npairs + IDHASH_PAIRS_BLOCK - 1)
+    / IDHASH_PAIRS_BLOCK;
+  int jobs = p->jobs;
+  if((size_t) jobs > nblocks) jobs = nblocks ? nblocks : 1;
+  pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+  for(int i=0; i<jobs; ++i)
+    pthread_create(threads+i, 0, idhash_pairs_score_worker, &w);
+  for(int i=0; i<jobs; ++i)
+    pthread_join(threads[i], 0);
+  free(threads);
+  TIMING_STOP(TIMING_DISTANCE, t);
+}
+
+/* Hash the distinct images of @m on @opts->jobs threads and compute the
+ * distance of every pair. @m must outlive the result. Images that fail are
+ * reported on stderr and their pairs get IDHASH_PAIRS_FAILED.
+ */
+idhash_pairs* idhash_pairs_run(
+  const pair_manifest* m,
+  const idhash_pairs_opts* opts)
+{
+  idhash_pairs* p = calloc(1, sizeof(idhash_pairs));
+  p->manifest = m;
+  p->images = calloc(2*m->npairs + 1, sizeof(uint64_t));
+  for(size_t i=0; i<m->npairs; ++i){
+    p->images[2*i] = (uint64_t) m->pairs[i].a << 32;
+    p->images[2*i+1] = (uint64_t) m->pairs[i].b << 32 | m->pairs[i].transform;
+  }
+  qsort(p->images, 2*m->npairs, sizeof(uint64_t), idhash_pairs_cmp_image);
+  for(size_t i=0; i<2*m->npairs; ++i)
+    if(!p->nimages || p->images[p->nimages-1] != p->images[i])
+      p->images[p->nimages++] = p->images[i];
+  p->hashes = calloc(p->nimages + 1, sizeof(idhash_hash));
+  p->failed = calloc(p->nimages + 1, 1);
+
+  idhash_pairs_work w = {p, opts};
+  atomic_init(&w.next, 0);
+  atomic_init(&w.nfailed, 0);
+  pthread_mutex_init(&w.err_lock, 0);
+  size_t units = p->nimages;
+  if(opts->hash_all){
+    w.runs = malloc((p->nimages + 1) * sizeof(size_t));
+    w.transforms = malloc((p->nimages + 1) * sizeof(char*));
+    for(size_t i=0; i<p->nimages; ++i){
+      if(!i || p->images[i] >> 32 != p->images[i-1] >> 32)
+        w.runs[w.nruns++] = i;
+      w.transforms[i] = m->transforms.strs[p->images[i] & 0xffffffff];
+    }
+    w.runs[w.nruns] = p->nimages;
+    units = w.nruns;
+  }
+  int jobs = p->jobs = opts->jobs > 0 ? opts->jobs : dir_walk_ncpus();
+  if((size_t) jobs > units) jobs = units ? units : 1;
+  pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+  for(int i=0; i<jobs; ++i)
+    pthread_create(threads+i, 0, idhash_pairs_worker, &w);
+  for(int i=0; i<jobs; ++i)
+    pthread_join(threads[i], 0);
+  free(threads);
+  free(w.runs);
+  free(w.transforms);
+  pthread_mutex_destroy(&w.err_lock);
+  p->nfailed = atomic_load(&w.nfailed);
+
+  p->dist = calloc(m->npairs + 1, sizeof(guint));
+  const metric* idhash = metric_registry;
+  idhash_pairs_score_metrics(p, &idhash, 1, &p->dist);
+  return p;
+}
+
+void idhash_pairs_destroy(idhash_pairs* p){
+  free(p->images);
+  free(p->hashes);
+  free(p->failed);
+  free(p->dist);
+  free(p);
+}
+
+/* Copy the distances in @dist (one per pair, as from
+ * idhash_pairs_score_metrics) of the pairs labeled @label that didn't fail
+ * into a new array, setting @n to its length.
+ */
+guint* idhash_pairs_select(
+  const idhash_pairs* p,
+  const guint* dist,
+  pair_label label,
+  size_t* n)
+{
+  const pair_manifest* m = p->manifest;
+  guint* scores = calloc(m->npairs + 1, sizeof(guint));
+  *n = 0;
+  for(size_t i=0; i<m->npairs; ++i)
+    if(m->pairs[i].label == label && dist[i] != IDHASH_PAIRS_FAILED)
+      scores[(*n)++] = dist[i];
+  return scores;
+}
+
+/* Copy the distances of the pairs labeled @label that didn't fail into a new
+ * array, setting @n to its length.
+ */
+guint* idhash_pairs_scores(const idhash_pairs* p, pair_label label, size_t* n){
+  return idhash_pairs_select(p, p->dist, label, n);
+}
+
+/* Write the pairs labeled @label that didn't fail to @fp in the data file
+ * format of idhash_directory (see idhash_stats.c), as one trial each, so
+ * roc_point can read them.
+ */
+void idhash_pairs_print_stats(
+  const idhash_pairs* p,
+  pair_label label,
+  FILE* fp)
+{
+  const pair_manifest* m = p->manifest;
+  size_t n=0;
+  for(size_t i=0; i<m->npairs; ++i)
+    n += m->pairs[i].label == label && p->dist[i] != IDHASH_PAIRS_FAILED;
+  fprintf(fp, "files: %zu\ntrials: %d\n", n, 1);
+  idhash_stats_print_header(fp);
+  for(size_t i=0; i<m->npairs; ++i){
+    const pair_manifest_pair* q = m->pairs + i;
+    if(q->label != label || p->dist[i] == IDHASH_PAIRS_FAILED) continue;
+    fprintf(fp, "%s %s %u %u %.2f %.2f %.2f %.2f\n", m->paths.strs[q->a],
+      m->paths.strs[q->b], p->dist[i], p->dist[i], (double) p->dist[i],
+      0., 0., p->dist[i] ? 0. : -1.);
+  }
+}
+
+#ifdef TEST_IDHASH_PAIRS
+int main(int argc, char* argv[argc]){
+  if(argc != 2){
+    fprintf(stderr, "Usage: %s <MANIFEST>\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if(VIPS_INIT(argv[0]))
+    vips_error_exit(NULL);
+  pair_manifest* m = pair_manifest_read(argv[1]);
+  if(!m) exit(EXIT_FAILURE);
+  idhash_pairs_opts opts={0};
+  idhash_pairs* p = idhash_pairs_run(m, &opts);
+  assert(p->nimages <= m->paths.n * m->transforms.n);
+  for(size_t i=0; i<m->npairs; ++i){
+    const pair_manifest_pair* q = m->pairs + i;
+    if(p->dist[i] == IDHASH_PAIRS_FAILED) continue;
+    assert(p->dist[i] <= 128);
+    if(q->a == q->b && !q->transform) assert(!p->dist[i]);
+    printf("%s\t%s\t%s\t%u\n", m->paths.strs[q->a], m->paths.strs[q->b],
+      pair_label_name(q->label), p->dist[i]);
+  }
+  // Every metric in one pass; the first, idhash, as idhash_pairs_run had it.
+  const metric* metrics[METRIC_COUNT];
+  guint* dist[METRIC_COUNT];
+  for(size_t j=0; j<METRIC_COUNT; ++j){
+    metrics[j] = metric_registry + j;
+    dist[j] = calloc(m->npairs + 1, sizeof(guint));
+  }
+  idhash_pairs_score_metrics(p, metrics, METRIC_COUNT, dist);
+  for(size_t i=0; i<m->npairs; ++i){
+    const pair_manifest_pair* q = m->pairs + i;
+    assert(dist[0][i] == p->dist[i]);
+    for(size_t j=0; j<METRIC_COUNT; ++j){
+      assert((dist[j][i] == IDHASH_PAIRS_FAILED)
+        == (p->dist[i] == IDHASH_PAIRS_FAILED));
+      if(q->a == q->b && !q->transform) assert(!dist[j][i]);
+    }
+  }
+  for(size_t j=0; j<METRIC_COUNT; ++j) free(dist[j]);
+  fprintf(stderr, "%zu pairs, %zu images hashed, %zu failed\n", m->npairs,
+    p->nimages, p->nfailed);
+  idhash_pairs_destroy(p);
+  pair_manifest_destroy(m);
+  vips_shutdown();
+  return EXIT_SUCCESS;
+}
+#elif defined(CMD_IDHASH_PAIRS)
+int main(int argc, char* argv[argc]){
+  vips_profile profile={0};
+  vips_profile_parse_args(&profile, DEFAULT_VIPS_PROFILE, &argc, argv);
+  idhash_pairs_opts opts={0};
+  int curve=0, nmetrics=1, named=0;
+  const metric* metrics[METRIC_COUNT] = {metric_registry};
+  char* fname=0;
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--jobs") && i+1 < argc) opts.jobs = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--curve")) curve = 1;
+    else if(!strcmp(argv[i], "--metric") && i+1 < argc){
+      nmetrics = metric_parse_list(argv[++i], metrics, METRIC_COUNT);
+      if(nmetrics < 0) exit(EXIT_FAILURE);
+      named = 1;
+    }
+    else if(!fname) fname = argv[i];
+    else fname = 0, i = argc;
+  }
+  if(!fname){
+    fprintf(stderr, "Usage: %s [--profile <NAME>] [--jobs <N>] [--curve] "
+      "[--metric <NAME>[,<NAME>...]] <MANIFEST>\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if(VIPS_INIT(argv[0]))
+    vips_error_exit(NULL);
+  vips_profile_apply(&profile);
+  pair_manifest* m = pair_manifest_read(fname);
+  if(!m) exit(EXIT_FAILURE);
+  idhash_pairs* p = idhash_pairs_run(m, &opts);
+  fprintf(stderr, "%zu pairs, %zu images hashed, %zu failed\n", m->npairs,
+    p->nimages, p->nfailed);
+
+  // idhash_pairs_run scored every pair under idhash already: score only
+  // the other metrics.
+  guint* dist[METRIC_COUNT];
+  guint* other_dist[METRIC_COUNT];
+  const metric* others[METRIC_COUNT];
+  int nothers = 0;
+  for(int j=0; j<nmetrics; ++j){
+    if(metrics[j] == metric_registry){
+      dist[j] = p->dist;
+      continue;
+    }
+    dist[j] = calloc(m->npairs + 1, sizeof(guint));
+    others[nothers] = metrics[j];
+    other_dist[nothers++] = dist[j];
+  }
+  if(nothers) idhash_pairs_score_metrics(p, others, nothers, other_dist);
+  for(int j=0; j<nmetrics; ++j){
+    // Blocks are gnuplot data sets: two blank lines apart.
+    if(named) printf("%s# metric: %s\n", j ? "\n\n" : "", metrics[j]->name);
+    size_t ndup, nnondup;
+    guint* dup = idhash_pairs_select(p, dist[j], PAIR_DUP, &ndup);
+    guint* nondup = idhash_pairs_select(p, dist[j], PAIR_NONDUP, &nnondup);
+    roc_source* source = roc_source_create();
+    roc_source_init_scores(source, dup, ndup, nondup, nnondup);
+    guint range[2] = {0, METRIC_MAX + 1}, threshold=0;
+    if(curve) roc_curve_print(source, stdout, range);
+    roc_optimal_threshold(&threshold, source, range);
+    roc_point point={0};
+    roc_point_init(&point, source, threshold);
+    printf("# threshold: %u    fpr: %f    tpr: %f\n", threshold, point.fpr,
+      point.tpr);
+    roc_source_destroy(source);
+    if(dist[j] != p->dist) free(dist[j]);
+  }
+
+  const size_t nfailed = p->nfailed;
+  idhash_pairs_destroy(p);
+  pair_manifest_destroy(m);
+  vips_profile_print_stats(stderr);
+  return nfailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,163 @@
+/* idhash_record.c
+ *
+ * Text and binary records for streaming IDHash results out of a process.
+ *
+ * Text records extend the idhash-components output with the path, one
+ * record per line:
+ *
+ *   <dx> <dy> <ix> <iy> <path>
+ *
+ * Binary records start with the 8-byte magic "IDHASHR1", followed by one
+ * record per result, in host byte order:
+ *
+ *   guint64 seq           position of the path in the input list
+ *   guint64 dx, dy, ix, iy
+ *   guint32 n             length of the path, without a terminating '\0'
+ *   char    path[n]
+ *
+ * Results can finish out of order when several images are hashed at once,
+ * so each record carries the position of its path in the input.
+ *
+ * Compile test
+ *
+gcc idhash_record.c -o test-idhash-record -DTEST_IDHASH_RECORD -g -Wall `pkg-config vips --cflags --libs`
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef ASSERT_H
+#  define ASSERT_H
+#  include <assert.h>
+#endif
+
+#ifndef IDHASH_H
+#  define IDHASH_H
+#  include "idhash.h"
+#endif
+
+#define IDHASH_RECORD_MAGIC "IDHASHR1"
+#define SZ_IDHASH_RECORD_MAGIC 8
+
+/* Write @res as a text record to @fp.
+ */
+void idhash_record_print(FILE* fp, const idhash_result* res){
+  fprintf(fp, "%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+    " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %s\n",
+    res->dx, res->dy, res->ix, res->iy, res->path);
+}
+
+/* Parse a text record from @line into @res. Return 0 on success, -1 if the
+ * line is malformed. A trailing newline is not copied into the path.
+ */
+int idhash_record_parse(idhash_result* res, const char* line){
+  int n=0;
+  if(4 != sscanf(line, "%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+    " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %n",
+    &res->dx, &res->dy, &res->ix, &res->iy, &n) || !line[n])
+    return -1;
+  size_t len = strcspn(line + n, "\n");
+  if(len >= SZ_PATH) return -1;
+  memcpy(res->path, line + n, len);
+  res->path[len] = 0;
+  return 0;
+}
+
+/* Write the magic that starts a binary record stream to @fp.
+ */
+int idhash_record_write_magic(FILE* fp){
+  return 1 == fwrite(IDHASH_RECORD_MAGIC, SZ_IDHASH_RECORD_MAGIC, 1, fp) ? 0
+    : -1;
+}
+
+/* Read and check the magic that starts a binary record stream from @fp.
+ * Return 0 if it matches, else -1.
+ */
+int idhash_record_read_magic(FILE* fp){
+  char magic[SZ_IDHASH_RECORD_MAGIC]={0};
+  if(1 != fread(magic, SZ_IDHASH_RECORD_MAGIC, 1, fp)) return -1;
+  return memcmp(magic, IDHASH_RECORD_MAGIC, SZ_IDHASH_RECORD_MAGIC) ? -1 : 0;
+}
+
+/* Write @res as a binary record with input position @seq to @fp. Return 0
+ * on success, -1 on a write error.
+ */
+int idhash_record_write(FILE* fp, guint64 seq, const idhash_result* res){
+  const guint64 head[5] = {seq, res->dx, res->dy, res->ix, res->iy};
+  const guint32 n = strnlen(res->path, SZ_PATH);
+  if(1 != fwrite(head, sizeof head, 1, fp)
+    || 1 != fwrite(&n, sizeof n, 1, fp)
+    || (n && 1 != fwrite(res->path, n, 1, fp)))
+    return -1;
+  return 0;
+}
+
+/* Read a binary record from @fp into @seq and @res. Return 1 if a record
+ * was read, 0 at end of file, and -1 on a short or malformed record.
+ */
+int idhash_record_read(FILE* fp, guint64* seq, idhash_result* res){
+  guint64 head[5]={0};
+  guint32 n=0;
+  size_t z = fread(head, 1, sizeof head, fp);
+  if(!z) return 0;
+  if(z != sizeof head || 1 != fread(&n, sizeof n, 1, fp) || n >= SZ_PATH)
+    return -1;
+  if(n && 1 != fread(res->path, n, 1, fp)) return -1;
+  res->path[n] = 0;
+  *seq = head[0];
+  res->dx = head[1];
+  res->dy = head[2];
+  res->ix = head[3];
+  res->iy = head[4];
+  return 1;
+}
+
+#ifdef TEST_IDHASH_RECORD
+int main(){
+  idhash_result a={"foo/1_a.jpg", 1, 2, 3, G_MAXUINT64}, b={{0}};
+  guint64 seq=0;
+
+  // Binary round trip.
+  FILE* fp = tmpfile();
+  assert(fp);
+  assert(!idhash_record_write_magic(fp));
+  assert(!idhash_record_write(fp, 7, &a));
+  rewind(fp);
+  assert(!idhash_record_read_magic(fp));
+  assert(1 == idhash_record_read(fp, &seq, &b));
+  assert(seq == 7);
+  assert(!strcmp(a.path, b.path));
+  assert(a.dx == b.dx && a.dy == b.dy && a.ix == b.ix && a.iy == b.iy);
+  assert(0 == idhash_record_read(fp, &seq, &b));
+  fclose(fp);
+
+  // Text round trip, with a space in the path.
+  char line[SZ_PATH+128]={0};
+  strcpy(a.path, "foo bar/1_a.jpg");
+  fp = tmpfile();
+  idhash_record_print(fp, &a);
+  rewind(fp);
+  assert(fgets(line, sizeof line, fp));
+  fclose(fp);
+  memset(&b, 0, sizeof b);
+  assert(!idhash_record_parse(&b, line));
+  assert(!strcmp(a.path, b.path) && a.iy == b.iy);
+  assert(-1 == idhash_record_parse(&b, "1 2 3\n"));
+
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#endif
@@ -104,8 +104,9 @@ idhash_stats* idhash_stats_init(
   for(int i=0; i < stats->ndata; ++i){
     idhash_filepath(path_a, &res_a);
     idhash_filepath(path_b, &res_b);
-      
-    // TODO collect timing info here
+
+    // Stage timings are recorded inside idhash_file with IDHASH_TIMING (see
+    // timing.c).
 
     stats->data[i] = idhash_dist(res_a, res_b);
 
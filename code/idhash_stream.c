@@ -0,0 +1,398 @@
+/* idhash_stream.c
+ *
+ * Hash a stream of image paths with a pool of worker threads, writing one
+ * record per image as soon as it is ready.
+ *
+ * Paths are read from a FILE (usually stdin), separated by newlines, or by
+ * '\0' to match `find -print0`. The reading thread feeds a bounded queue,
+ * and each worker pops a path, hashes it with idhash_file, and writes a text
+ * or binary record (see idhash_record.c) under a lock. Records come out in
+ * completion order, not input order. Images that fail to load are reported
+ * on stderr and skipped, instead of ending the run.
+ *
+ * Process startup and VIPS_INIT are paid once per run instead of once per
+ * image, which is what a shell loop around idhash-components costs.
+ *
+ * With opts.prefetch set, the reading thread also reads the files into
+ * memory through prefetch.c, keeping that many files in flight, and the
+ * workers decode from the buffers with idhash_buffer. Workers then never
+ * wait on the disk themselves, which pays off on cold caches and network
+ * storage.
+ *
+ * With opts.sniff set, each file's first bytes are checked (see sniff.c)
+ * and anything that isn't a JPEG/PNG/WebP/HEIF/GIF/TIFF fails without a
+ * libvips open.
+ *
+ * With opts.exact set, the whole list is read first and byte-identical
+ * files are found with exact_dupes.c. Only the first file of each set of
+ * copies is decoded, and its record is repeated for the others, under
+ * their own paths and sequence numbers, right after it. What the search
+ * found goes to opts.exact_stats, if set.
+ *
+ * Compile test
+ *
+gcc idhash_stream.c -o test-idhash-stream -DTEST_IDHASH_STREAM -g -Wall -pthread `pkg-config vips --cflags --libs`
+ *
+ * Run test, optionally reading up to <WINDOW> files ahead
+ *
+ * find <DIR> -name '*.jpg' -print0 | ./test-idhash-stream [<WINDOW>]
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef UNISTD_H
+#  define UNISTD_H
+#  include <unistd.h>
+#endif
+
+#ifndef PTHREAD_H
+#  define PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#ifndef IDHASH_H
+#  define IDHASH_H
+#  include "idhash.h"
+#endif
+
+#ifndef IDHASH_RECORD_H
+#  define IDHASH_RECORD_H
+#  include "idhash_record.c"
+#endif
+
+#ifndef PREFETCH_H
+#  define PREFETCH_H
+#  include "prefetch.c"
+#endif
+
+#ifndef SNIFF_H
+#  define SNIFF_H
+#  include "sniff.c"
+#endif
+
+#ifndef EXACT_DUPES_H
+#  define EXACT_DUPES_H
+#  include "exact_dupes.c"
+#endif
+
+// Paths waiting in the queue, per worker.
+#ifndef IDHASH_STREAM_QUEUE_PER_JOB
+#  define IDHASH_STREAM_QUEUE_PER_JOB 4
+#endif
+
+typedef struct idhash_stream_opts idhash_stream_opts;
+struct idhash_stream_opts {
+  int delim;   // '\n' or '\0'
+  int binary;  // write binary records instead of text
+  int jobs;    // worker threads, or 0 for one per online CPU
+  int flush;   // flush the output after every record
+  int prefetch;        // files read ahead by the reading thread, 0 for none
+  int prefetch_uring;  // read ahead with io_uring where available
+  int sniff;           // fail files of unknown type before decoding them
+  int exact;           // decode byte-identical files once
+  exact_dupes_stats* exact_stats;  // if not 0, gets what @exact found
+};
+
+typedef struct idhash_stream_item idhash_stream_item;
+struct idhash_stream_item {
+  guint64 seq;
+  char* path;
+  prefetch_item* file;  // the file contents, if read ahead
+};
+
+// A bounded queue of paths between the reading thread and the workers, and
+// the output shared by the workers.
+typedef struct idhash_stream idhash_stream;
+struct idhash_stream {
+  idhash_stream_item* items;
+  size_t cap;
+  size_t head;
+  size_t count;
+  int done;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+
+  FILE* out;
+  pthread_mutex_t out_lock;
+  const idhash_stream_opts* opts;
+  prefetch* prefetch;
+  guint64 nhashed;
+  guint64 nfailed;
+  // With opts->exact, the paths by sequence number, and each file's next
+  // copy, or SIZE_MAX after the last.
+  char** paths;
+  size_t npaths;
+  size_t* next_copy;
+};
+
+/* Number of online CPUs, or 1 if that can't be determined.
+ */
+int idhash_stream_ncpus(){
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int) n : 1;
+}
+
+/* Push a path into the queue, blocking while it is full. Takes ownership of
+ * @path, or of @file (which holds the path) if it was read ahead.
+ */
+static void idhash_stream_push(
+  idhash_stream* s,
+  guint64 seq,
+  char* path,
+  prefetch_item* file)
+{
+  pthread_mutex_lock(&s->lock);
+  while(s->count == s->cap)
+    pthread_cond_wait(&s->not_full, &s->lock);
+  s->items[(s->head + s->count++) % s->cap] =
+    (idhash_stream_item){seq, path, file};
+  pthread_cond_signal(&s->not_empty);
+  pthread_mutex_unlock(&s->lock);
+}
+
+/* Pop a path from the queue into @item, blocking while it is empty. Return 0
+ * once the queue is empty and no more paths will come.
+ */
+static int idhash_stream_pop(idhash_stream* s, idhash_stream_item* item){
+  pthread_mutex_lock(&s->lock);
+  while(!s->count && !s->done)
+    pthread_cond_wait(&s->not_empty, &s->lock);
+  if(!s->count){
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+  }
+  *item = s->items[s->head];
+  s->head = (s->head + 1) % s->cap;
+  --s->count;
+  pthread_cond_signal(&s->not_full);
+  pthread_mutex_unlock(&s->lock);
+  return 1;
+}
+
+/* Write the record for @res, or report the failure to hash @path for the
+ * reason @err, if not 0, and the same for each copy of it.
+ */
+static void idhash_stream_emit(
+  idhash_stream* s,
+  idhash_stream_item* item,
+  idhash_result* res,
+  const char* err)
+{
+  const int failed = err != 0;
+  pthread_mutex_lock(&s->out_lock);
+  if(failed){
+    ++s->nfailed;
+    fprintf(stderr, "Failed to hash %s: %s\n", item->path, err);
+  } else {
+    ++s->nhashed;
+    TIMING_START(t);
+    if(s->opts->binary) idhash_record_write(s->out, item->seq, res);
+    else idhash_record_print(s->out, res);
+    if(s->opts->flush) fflush(s->out);
+    TIMING_STOP(TIMING_WRITE, t);
+  }
+  for(size_t j = s->next_copy ? s->next_copy[item->seq] : SIZE_MAX;
+    j != SIZE_MAX; j = s->next_copy[j]){
+    if(failed){
+      ++s->nfailed;
+      fprintf(stderr, "Failed to hash %s: a copy of %s\n", s->paths[j],
+        item->path);
+      continue;
+    }
+    ++s->nhashed;
+    g_strlcpy(res->path, s->paths[j], SZ_PATH);
+    if(s->opts->binary) idhash_record_write(s->out, j, res);
+    else idhash_record_print(s->out, res);
+  }
+  if(s->next_copy && s->opts->flush) fflush(s->out);
+  pthread_mutex_unlock(&s->out_lock);
+}
+
+static void* idhash_stream_worker(void* _arg){
+  idhash_stream* s = (idhash_stream*) _arg;
+  idhash_stream_item item={0};
+  // Allocated once per worker: the result holds a whole path buffer.
+  idhash_result* res = calloc(1, sizeof(idhash_result));
+  while(idhash_stream_pop(s, &item)){
+    TIMING_START(t);
+    memset(res, 0, sizeof(idhash_result));
+    int type = SNIFF_JPEG;
+    const char* err = 0;
+    if(s->opts->sniff && !(item.file && item.file->err)){
+      type = item.file && item.file->data
+        ? (int) sniff_bytes((unsigned char*) item.file->data, item.file->size)
+        : sniff_path(item.path);
+    }
+    // The vips error buffer is one for the whole process, written and
+    // cleared by every worker at once, so its text can't be tied to a
+    // file: a decoding failure gets a fixed reason instead.
+    if(type <= SNIFF_UNKNOWN){
+      err = type ? strerror(errno) : "not a known image type";
+    } else if(item.file && item.file->err){
+      err = strerror(item.file->err);
+    } else if(item.file && item.file->data
+      ? idhash_buffer(item.file->data, item.file->size, item.path, res)
+      // Not read ahead, or too large to be.
+      : idhash_file(item.path, res)){
+      err = "libvips could not decode it";
+      vips_error_clear();
+    }
+    idhash_stream_emit(s, &item, res, err);
+    TIMING_STOP(TIMING_IMAGE, t);
+    if(item.file) prefetch_release(s->prefetch, item.file);
+    else free(item.path);
+  }
+  free(res);
+  vips_thread_shutdown();
+  return 0;
+}
+
+/* Queue @path, which is taken, as number @seq, reading it ahead if
+ * prefetching.
+ */
+static void idhash_stream_feed(idhash_stream* s, guint64 seq, char* path){
+  if(!s->prefetch){
+    idhash_stream_push(s, seq, path, 0);
+    return;
+  }
+  prefetch_item* file;
+  while(prefetch_full(s->prefetch)){
+    file = prefetch_next(s->prefetch, 1);
+    idhash_stream_push(s, file->seq, file->path, file);
+  }
+  prefetch_submit(s->prefetch, seq, path);
+  while((file = prefetch_next(s->prefetch, 0)))
+    idhash_stream_push(s, file->seq, file->path, file);
+}
+
+/* Decode only the first of each set of byte-identical files among the
+ * paths in @in, queueing them by their number in the list.
+ */
+static void idhash_stream_feed_exact(idhash_stream* s, FILE* in){
+  size_t n, kept = 0;
+  char** paths = exact_dupes_read_paths(in, s->opts->delim, &n);
+  for(size_t i=0; i<n; ++i){
+    if(strlen(paths[i]) < SZ_PATH) paths[kept++] = paths[i];
+    else {
+      fprintf(stderr, "Path too long, skipping: %.64s...\n", paths[i]);
+      free(paths[i]);
+    }
+  }
+  n = s->npaths = kept;
+  size_t* leader = malloc((n + 1) * sizeof(size_t));
+  s->next_copy = malloc((n + 1) * sizeof(size_t));
+  s->paths = paths;
+  const exact_dupes_opts opts = {s->opts->jobs};
+  exact_dupes_stats st;
+  exact_dupes_find(paths, n, &opts, leader, &st);
+  if(s->opts->exact_stats) *s->opts->exact_stats = st;
+  // Going backwards, each copy goes at the front of its leader's list.
+  for(size_t i=0; i<n; ++i) s->next_copy[i] = SIZE_MAX;
+  for(size_t i=n; i-- > 0; ){
+    if(leader[i] == i) continue;
+    s->next_copy[i] = s->next_copy[leader[i]];
+    s->next_copy[leader[i]] = i;
+  }
+  for(size_t i=0; i<n; ++i)
+    if(leader[i] == i) idhash_stream_feed(s, i, strdup(paths[i]));
+  free(leader);
+}
+
+/* Read paths separated by @opts->delim from @in, hash them on @opts->jobs
+ * worker threads, and write a record for each to @out. Empty paths are
+ * skipped. Return the number of paths that failed to hash.
+ */
+guint64 idhash_stream_run(FILE* in, FILE* out, const idhash_stream_opts* opts){
+  const int jobs = opts->jobs > 0 ? opts->jobs : idhash_stream_ncpus();
+  idhash_stream s={0};
+  s.cap = IDHASH_STREAM_QUEUE_PER_JOB * jobs;
+  s.items = calloc(s.cap, sizeof(idhash_stream_item));
+  s.out = out;
+  s.opts = opts;
+  if(opts->prefetch > 0){
+    prefetch_opts popts = {opts->prefetch, 0, opts->prefetch_uring, 0};
+    s.prefetch = prefetch_create(&popts);
+  }
+  pthread_mutex_init(&s.lock, 0);
+  pthread_cond_init(&s.not_empty, 0);
+  pthread_cond_init(&s.not_full, 0);
+  pthread_mutex_init(&s.out_lock, 0);
+
+  if(opts->binary && idhash_record_write_magic(out)){
+    fprintf(stderr, "Failed to write binary record header.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+  for(int i=0; i<jobs; ++i)
+    pthread_create(threads+i, 0, idhash_stream_worker, &s);
+
+  if(opts->exact) idhash_stream_feed_exact(&s, in);
+  char* line=0;
+  size_t n=0;
+  ssize_t z=0;
+  guint64 seq=0;
+  while(!opts->exact && 0<(z = getdelim(&line, &n, opts->delim, in))){
+    if(line[z-1] == opts->delim) line[--z] = 0;
+    if(!z) continue;
+    if(z >= SZ_PATH){
+      fprintf(stderr, "Path too long, skipping: %.64s...\n", line);
+      continue;
+    }
+    idhash_stream_feed(&s, seq++, strdup(line));
+  }
+  free(line);
+  if(s.prefetch){
+    prefetch_item* file;
+    while((file = prefetch_next(s.prefetch, 1)))
+      idhash_stream_push(&s, file->seq, file->path, file);
+  }
+
+  pthread_mutex_lock(&s.lock);
+  s.done = 1;
+  pthread_cond_broadcast(&s.not_empty);
+  pthread_mutex_unlock(&s.lock);
+
+  for(int i=0; i<jobs; ++i)
+    pthread_join(threads[i], 0);
+  fflush(out);
+
+  if(s.prefetch) prefetch_destroy(s.prefetch);
+  for(size_t i=0; i<s.npaths; ++i) free(s.paths[i]);
+  free(s.paths);
+  free(s.next_copy);
+  free(threads);
+  free(s.items);
+  pthread_mutex_destroy(&s.lock);
+  pthread_cond_destroy(&s.not_empty);
+  pthread_cond_destroy(&s.not_full);
+  pthread_mutex_destroy(&s.out_lock);
+  return s.nfailed;
+}
+
+#ifdef TEST_IDHASH_STREAM
+int main(int argc, char* argv[argc]){
+  if(VIPS_INIT(argv[0]))
+    vips_error_exit(NULL);
+  idhash_stream_opts opts = {'\0', 0, 0, 1, 0, 1, 1};
+  if(argc > 1) opts.prefetch = atoi(argv[1]);
+  guint64 nfailed = idhash_stream_run(stdin, stdout, &opts);
+  fprintf(stderr, "failed: %" G_GUINT64_FORMAT "\n", nfailed);
+  return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,671 @@
+/* join_update.c
+ *
+ * Keep the all-pairs join of a hash database up to date as the database
+ * changes, scoring only the pairs that involve new or changed records.
+ *
+ * Each run leaves its result next to the database, in <DB>.join by
+ * default: the metric and radius, a key and the hash of every record, and
+ * the pairs. The next run matches the database's records to the saved
+ * ones by key, which is a 64-bit FNV-1a hash of the path, or the index for
+ * a database without paths:
+ *
+ *   same key, same hash        kept: its old pairs still hold, renumbered
+ *   same key, other hash       changed: its old pairs go, it is scored anew
+ *   key not saved              added: scored
+ *   saved key not in the DB    deleted: its pairs go
+ *
+ * The new records are scored against the whole database with
+ * hash_index_match_pairs (hash_index.c), the database as queries and the
+ * new records as the index, so a pair of two new records turns up twice
+ * and is kept once. With 1% of a corpus new that is about 1% of the work
+ * of a whole join, plus indexing the database. A run with no saved join, or
+ * one made with another metric or radius, joins the whole database with
+ * hash_index_join_pairs. Either way the pairs stay in memory.
+ *
+ * The updated pairs are written as the join writes them, <a>\t<b>\t<dist>
+ * with a < b, but sorted, for idhash-groups; --groups also writes the
+ * groups they make, as <group>\t<index> lines, the group being its
+ * smallest index (see union_find.c).
+ *
+ * The saved join, in host byte order:
+ *
+ *   char    magic[8]         "IDHASHJ1"
+ *   guint64 count            records
+ *   guint64 npairs
+ *   guint32 radius
+ *   guint32 reserved
+ *   char    metric[32]       name, '\0'-padded
+ *   join_record records[count]
+ *   join_pair pairs[npairs]
+ *
+ * It is written to a temporary file and renamed over the old one, so a
+ * crash leaves one or the other.
+ *
+ * Compile test
+ *
+gcc join_update.c -o test-join-update -DTEST_JOIN_UPDATE -O2 -g -Wall -pthread `pkg-config vips --cflags --libs`
+ *
+ * Compile
+ *
+gcc join_update.c -o idhash-join-update -DCMD_JOIN_UPDATE -O2 -g -Wall -pthread `pkg-config vips --cflags --libs`
+ *
+ * Usage
+ *
+ * ./idhash-join-update [--metric <NAME>] [--radius <R>] [--jobs <N>]
+ *   [--state <FILE>] [--groups <FILE>] [--stats] <DB>
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef STDINT_H
+#  define STDINT_H
+#  include <stdint.h>
+#endif
+
+#ifndef INTTYPES_H
+#  define INTTYPES_H
+#  include <inttypes.h>
+#endif
+
+#ifndef HASH_INDEX_H
+#  define HASH_INDEX_H
+#  include "hash_index.c"
+#endif
+
+#ifndef UNION_FIND_H
+#  define UNION_FIND_H
+#  include "union_find.c"
+#endif
+
+#define JOIN_STATE_MAGIC "IDHASHJ1"
+#define SZ_JOIN_STATE_MAGIC 8
+#define SZ_JOIN_STATE_METRIC 32
+
+typedef struct join_state_header join_state_header;
+struct join_state_header {
+  char magic[SZ_JOIN_STATE_MAGIC];
+  guint64 count;
+  guint64 npairs;
+  guint32 radius;
+  guint32 reserved;
+  char metric[SZ_JOIN_STATE_METRIC];
+};
+
+typedef struct join_record join_record;
+struct join_record {
+  guint64 key;
+  idhash_hash hash;
+};
+
+typedef struct join_pair join_pair;
+struct join_pair {
+  uint32_t a;
+  uint32_t b;
+  uint32_t dist;
+};
+
+// A saved join, mapped.
+typedef struct join_state join_state;
+struct join_state {
+  const join_state_header* header;
+  const join_record* records;
+  const join_pair* pairs;
+  void* map;
+  size_t size;
+};
+
+typedef struct join_update_stats join_update_stats;
+struct join_update_stats {
+  size_t kept;           // records
+  size_t scored;         // added or changed
+  size_t deleted;        // or changed
+  size_t pairs_kept;
+  size_t pairs_dropped;
+  size_t pairs_new;
+  hash_index_stats index;
+};
+
+/* Map the saved join @fname. Return 0, quietly, if there is none, or with
+ * a message if it isn't one.
+ */
+join_state* join_state_open(const char* fname){
+  int fd = open(fname, O_RDONLY);
+  struct stat st;
+  if(fd < 0) return 0;
+  if(fstat(fd, &st)){
+    close(fd);
+    return 0;
+  }
+  const size_t size = st.st_size;
+  void* map = size < sizeof(join_state_header) ? MAP_FAILED
+    : mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  const join_state_header* h = map;
+  if(map == MAP_FAILED
+    || memcmp(h->magic, JOIN_STATE_MAGIC, SZ_JOIN_STATE_MAGIC)
+    || h->count > size / sizeof(join_record)
+    || h->npairs > size / sizeof(join_pair)
+    || size != sizeof *h + h->count * sizeof(join_record)
+      + h->npairs * sizeof(join_pair)
+    || !memchr(h->metric, 0, SZ_JOIN_STATE_METRIC)){
+    fprintf(stderr, "Not a saved join: %s\n", fname);
+    if(map != MAP_FAILED) munmap(map, size);
+    return 0;
+  }
+  join_state* s = calloc(1, sizeof *s);
+  s->header = h;
+  s->records = (const join_record*) (h + 1);
+  s->pairs = (const join_pair*) (s->records + h->count);
+  s->map = map;
+  s->size = size;
+  return s;
+}
+
+void join_state_close(join_state* s){
+  if(!s) return;
+  munmap(s->map, s->size);
+  free(s);
+}
+
+/* Save the join of @db, its @npairs @pairs under @opts, as @fname, by way
+ * of a temporary file renamed over it. Return 0 on success, -1 with a
+ * message if not.
+ */
+int join_state_write(
+  const char* fname,
+  const hash_db* db,
+  const hash_index_opts* opts,
+  const join_pair* pairs,
+  size_t npairs)
+{
+  const size_t len = strlen(fname);
+  char* tmp = malloc(len + 8);
+  memcpy(tmp, fname, len);
+  memcpy(tmp + len, ".XXXXXX", 8);
+  int fd = mkstemp(tmp);
+  FILE* fp = fd < 0 ? 0 : fdopen(fd, "w");
+  if(!fp){
+    fprintf(stderr, "Failed to create %s: %s\n", tmp, strerror(errno));
+    if(fd >= 0) close(fd);
+    free(tmp);
+    return -1;
+  }
+  join_state_header h = {.count = db->count, .npairs = npairs,
+    .radius = opts->radius};
+  memcpy(h.magic, JOIN_STATE_MAGIC, SZ_JOIN_STATE_MAGIC);
+  g_strlcpy(h.metric, hash_index_metric(opts)->name, SZ_JOIN_STATE_METRIC);
+  int failed = 1 != fwrite(&h, sizeof h, 1, fp);
+  for(size_t i=0; i<db->count && !failed; ++i){
+    const join_record r = {hash_db_key(db, i), db->hashes[i]};
+    failed = 1 != fwrite(&r, sizeof r, 1, fp);
+  }
+  if(!failed && npairs)
+    failed = npairs != fwrite(pairs, sizeof *pairs, npairs, fp);
+  failed |= fflush(fp) || fsync(fileno(fp));
+  failed |= fclose(fp);
+  if(!failed && rename(tmp, fname)) failed = 1;
+  if(failed){
+    fprintf(stderr, "Failed to save the join to %s: %s\n", fname,
+      strerror(errno));
+    unlink(tmp);
+  }
+  free(tmp);
+  return failed ? -1 : 0;
+}
+
+static int join_pair_cmp(const void* a, const void* b){
+  const join_pair* x = a;
+  const join_pair* y = b;
+  if(x->a != y->a) return (x->a > y->a) - (x->a < y->a);
+  return (x->b > y->b) - (x->b < y->b);
+}
+
+typedef struct join_pairs join_pairs;
+struct join_pairs {
+  join_pair* pairs;
+  size_t n;
+  size_t cap;
+};
+
+// Return 0, or -1 if memory runs out.
+static int join_pairs_add(join_pairs* p, uint32_t a, uint32_t b,
+  uint32_t dist)
+{
+  if(p->n == p->cap){
+    const size_t cap = p->cap ? 2*p->cap : 1024;
+    join_pair* pairs = realloc(p->pairs, cap * sizeof *pairs);
+    if(!pairs) return -1;
+    p->pairs = pairs;
+    p->cap = cap;
+  }
+  p->pairs[p->n++] = a < b ? (join_pair){a, b, dist} : (join_pair){b, a, dist};
+  return 0;
+}
+
+/* Add the pairs @from hash_index_join_pairs or hash_index_match_pairs to
+ * @p. @fresh, if not 0, maps the second of each to a record number, and
+ * @kept then says which records weren't scored. Return 0, or -1 if memory
+ * runs out.
+ */
+static int join_add_pairs(
+  const hash_index_pairs* from,
+  const uint32_t* fresh,
+  const char* kept,
+  join_pairs* p,
+  join_update_stats* st)
+{
+  for(size_t k=0; k<from->n; ++k){
+    const uint32_t a = from->pairs[k].a;
+    uint32_t b = from->pairs[k].b;
+    if(fresh){
+      b = fresh[b];
+      // Two scored records meet twice, and each meets itself.
+      if(a == b || (!kept[a] && a > b)) continue;
+    }
+    if(join_pairs_add(p, a, b, from->pairs[k].dist)) return -1;
+    ++st->pairs_new;
+  }
+  return 0;
+}
+
+typedef struct join_slot join_slot;
+struct join_slot {
+  guint64 key;
+  uint32_t i;
+};
+
+static int join_slot_cmp(const void* a, const void* b){
+  const join_slot* x = a;
+  const join_slot* y = b;
+  if(x->key != y->key) return (x->key > y->key) - (x->key < y->key);
+  return (x->i > y->i) - (x->i < y->i);
+}
+
+/* The join of @db under @opts, sorted, reusing what it can of @old, which
+ * may be 0. Return the pairs and set @npairs, or return 0 if memory runs
+ * out. @st is filled in.
+ */
+join_pair* join_update(
+  const hash_db* db,
+  const join_state* old,
+  const hash_index_opts* opts,
+  size_t* npairs,
+  join_update_stats* st)
+{
+  memset(st, 0, sizeof *st);
+  const size_t n = db->count;
+  if(n >= UINT32_MAX) return 0;
+  if(old && (old->header->radius != opts->radius
+    || strcmp(old->header->metric, hash_index_metric(opts)->name)))
+    old = 0;
+  const size_t nold = old ? old->header->count : 0;
+
+  // Match the records to the saved ones by key, then hash.
+  join_slot* slots = malloc(nold * sizeof *slots + 1);
+  uint32_t* renumber = malloc(nold * sizeof(uint32_t) + 1);
+  for(size_t i=0; i<nold; ++i){
+    slots[i] = (join_slot){old->records[i].key, i};
+    renumber[i] = UINT32_MAX;
+  }
+  qsort(slots, nold, sizeof *slots, join_slot_cmp);
+  char* kept = calloc(n + 1, 1);
+  uint32_t* fresh = malloc(n * sizeof(uint32_t) + 1);
+  size_t nfresh = 0;
+  for(size_t j=0; j<n; ++j){
+    const guint64 key = hash_db_key(db, j);
+    size_t lo = 0, hi = nold;
+    while(lo < hi){
+      const size_t mid = lo + (hi - lo) / 2;
+      if(slots[mid].key < key) lo = mid + 1;
+      else hi = mid;
+    }
+    for(; lo < nold && slots[lo].key == key; ++lo){
+      const uint32_t i = slots[lo].i;
+      if(renumber[i] == UINT32_MAX && !memcmp(&old->records[i].hash,
+        db->hashes + j, sizeof(idhash_hash))){
+        renumber[i] = j;
+        kept[j] = 1;
+        break;
+      }
+    }
+    if(!kept[j]) fresh[nfresh++] = j;
+  }
+  free(slots);
+  st->kept = n - nfresh;
+  st->scored = nfresh;
+  st->deleted = nold - st->kept;
+
+  join_pairs p = {0};
+  int failed = 0;
+  for(size_t k=0; old && k<old->header->npairs && !failed; ++k){
+    const join_pair* q = old->pairs + k;
+    const uint32_t a = q->a < nold ? renumber[q->a] : UINT32_MAX;
+    const uint32_t b = q->b < nold ? renumber[q->b] : UINT32_MAX;
+    if(a == UINT32_MAX || b == UINT32_MAX) ++st->pairs_dropped;
+    else {
+      failed = join_pairs_add(&p, a, b, q->dist);
+      ++st->pairs_kept;
+    }
+  }
+  free(renumber);
+
+  hash_index_pairs found = {0};
+  hash_index* idx = 0;
+  hash_index* scored = 0;
+  if(nfresh && !failed){
+    idx = hash_index_create(db->hashes, n);
+    failed = !idx;
+  }
+  if(nfresh == n && !failed){
+    failed = hash_index_join_pairs(idx, opts, &found, &st->index) < 0;
+    if(!failed) failed = join_add_pairs(&found, 0, 0, &p, st);
+  } else if(nfresh && !failed){
+    idhash_hash* h = malloc(nfresh * sizeof(idhash_hash));
+    for(size_t k=0; h && k<nfresh; ++k) h[k] = db->hashes[fresh[k]];
+    scored = h ? hash_index_create(h, nfresh) : 0;
+    free(h);
+    failed = !scored
+      || hash_index_match_pairs(scored, idx, opts, &found, &st->index) < 0;
+    if(!failed) failed = join_add_pairs(&found, fresh, kept, &p, st);
+  }
+  free(found.pairs);
+  hash_index_destroy(scored);
+  hash_index_destroy(idx);
+  free(fresh);
+  free(kept);
+  if(failed){
+    free(p.pairs);
+    return 0;
+  }
+  qsort(p.pairs, p.n, sizeof *p.pairs, join_pair_cmp);
+  *npairs = p.n;
+  return p.pairs ? p.pairs : malloc(1);
+}
+
+/* Write the groups the @npairs @pairs make among @n records to @fp, as
+ * <group>\t<index> lines, the group being its smallest index, in order.
+ * Return the number of groups, or -1 on failure.
+ */
+long join_write_groups(
+  FILE* fp,
+  const join_pair* pairs,
+  size_t npairs,
+  size_t n)
+{
+  union_find* uf = union_find_create(n);
+  if(!uf) return -1;
+  for(size_t k=0; k<npairs; ++k)
+    union_find_union(uf, pairs[k].a, pairs[k].b);
+  long ngroups = -1;
+  if(!union_find_groups(uf)){
+    ngroups = 0;
+    for(size_t i=0; i<n; ++i){
+      if(!union_find_is_group(uf, i)) continue;
+      ++ngroups;
+      for(uint32_t j=i; j != UNION_FIND_NONE; j = uf->next[j])
+        fprintf(fp, "%zu\t%" PRIu32 "\n", i, j);
+    }
+    if(ferror(fp)) ngroups = -1;
+  }
+  union_find_destroy(uf);
+  return ngroups;
+}
+
+#ifdef TEST_JOIN_UPDATE
+static guint64 test_rand(guint64* s){
+  guint64 z = (*s += 0x9e3779b97f4a7c15u);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+  return z ^ (z >> 31);
+}
+
+#define TEST_N 1500
+
+static idhash_hash test_hash(guint64* s, const idhash_hash* near){
+  if(near){
+    idhash_hash x = *near;
+    x.dx ^= (test_rand(s) & test_rand(s) & test_rand(s) & test_rand(s))
+      | 1ull << test_rand(s) % 64;
+    return x;
+  }
+  return (idhash_hash){test_rand(s), test_rand(s),
+    test_rand(s) | test_rand(s), test_rand(s) | test_rand(s)};
+}
+
+static hash_db* test_db(
+  const char* fname,
+  const idhash_hash* h,
+  size_t n,
+  char** paths)
+{
+  FILE* fp = fopen(fname, "w");
+  assert(fp && !hash_db_write(fp, h, n, (const char* const*) paths));
+  fclose(fp);
+  hash_db* db = hash_db_open(fname);
+  assert(db && db->count == n);
+  return db;
+}
+
+// The pairs are every pair within the radius, in order.
+static void test_check(
+  const hash_db* db,
+  const hash_index_opts* opts,
+  const join_pair* pairs,
+  size_t npairs)
+{
+  size_t k = 0;
+  for(size_t a=0; a<db->count; ++a)
+    for(size_t b=a+1; b<db->count; ++b){
+      const guint d = hash_index_metric(opts)->dist(db->hashes + a,
+        db->hashes + b);
+      if(d > opts->radius) continue;
+      assert(k < npairs);
+      assert(pairs[k].a == a && pairs[k].b == b && pairs[k].dist == d);
+      ++k;
+    }
+  assert(k == npairs);
+}
+
+int main(){
+  char dname[] = "/tmp/test-join-update.XXXXXX";
+  assert(mkdtemp(dname));
+  char fname[64], sname[64];
+  snprintf(fname, sizeof fname, "%s/db", dname);
+  snprintf(sname, sizeof sname, "%s/db.join", dname);
+
+  idhash_hash* h = malloc(2 * TEST_N * sizeof(idhash_hash));
+  char** paths = malloc(2 * TEST_N * sizeof(char*));
+  guint64 s = 1;
+  for(int i=0; i<TEST_N; ++i){
+    h[i] = test_hash(&s, i % 3 == 2 ? h + i - 1 - test_rand(&s) % 2 : 0);
+    paths[i] = g_strdup_printf("img/%d.jpg", i);
+  }
+  const hash_index_opts opts = {0, 12};
+  hash_db* db = test_db(fname, h, TEST_N, paths);
+  assert(!join_state_open(sname));
+  join_update_stats st;
+  size_t npairs;
+  join_pair* pairs = join_update(db, 0, &opts, &npairs, &st);
+  assert(pairs && st.scored == TEST_N && !st.kept && !st.deleted);
+  assert(st.pairs_new == npairs && npairs > TEST_N / 4);
+  test_check(db, &opts, pairs, npairs);
+  assert(!join_state_write(sname, db, &opts, pairs, npairs));
+  free(pairs);
+  hash_db_close(db);
+
+  // Delete every 10th record, change every 17th, add new ones near old
+  // ones, and reverse the order, so nothing keeps its index.
+  idhash_hash* h2 = malloc(2 * TEST_N * sizeof(idhash_hash));
+  char** paths2 = malloc(2 * TEST_N * sizeof(char*));
+  size_t n = 0, changed = 0, deleted = 0;
+  for(int i=TEST_N; i-- > 0; ){
+    if(i % 10 == 0){
+      ++deleted;
+      continue;
+    }
+    h2[n] = h[i];
+    if(i % 17 == 0){
+      h2[n] = test_hash(&s, h + i);
+      ++changed;
+    }
+    paths2[n++] = paths[i];
+  }
+  for(int i=0; i<TEST_N / 20; ++i){
+    h2[n] = test_hash(&s, h + test_rand(&s) % TEST_N);
+    paths2[n++] = g_strdup_printf("new/%d.jpg", i);
+  }
+  db = test_db(fname, h2, n, paths2);
+  join_state* old = join_state_open(sname);
+  assert(old && old->header->count == TEST_N);
+  pairs = join_update(db, old, &opts, &npairs, &st);
+  assert(pairs);
+  test_check(db, &opts, pairs, npairs);
+  assert(st.kept == TEST_N - deleted - changed);
+  assert(st.scored == changed + TEST_N / 20);
+  assert(st.deleted == deleted + changed);
+  assert(st.pairs_kept > 0 && st.pairs_dropped > 0 && st.pairs_new > 0);
+  assert(st.pairs_kept + st.pairs_new == npairs);
+  printf("%zu kept, %zu scored, %zu deleted; pairs %zu kept, %zu dropped, "
+    "%zu new\n", st.kept, st.scored, st.deleted, st.pairs_kept,
+    st.pairs_dropped, st.pairs_new);
+
+  // The same again changes nothing. Another radius starts over.
+  assert(!join_state_write(sname, db, &opts, pairs, npairs));
+  join_state_close(old);
+  old = join_state_open(sname);
+  size_t again;
+  join_pair* same = join_update(db, old, &opts, &again, &st);
+  assert(again == npairs && !memcmp(same, pairs, npairs * sizeof *pairs));
+  assert(st.kept == n && !st.scored && !st.deleted && !st.pairs_new);
+  free(same);
+  const hash_index_opts wider = {0, 16};
+  same = join_update(db, old, &wider, &again, &st);
+  assert(st.scored == n && !st.pairs_kept);
+  test_check(db, &wider, same, again);
+  free(same);
+
+  // Groups come out by smallest index, every paired record in one.
+  FILE* fp = tmpfile();
+  const long ngroups = join_write_groups(fp, pairs, npairs, n);
+  assert(ngroups > 0);
+  rewind(fp);
+  unsigned g, i, prev = 0;
+  long groups = 0;
+  char* grouped = calloc(n, 1);
+  while(fscanf(fp, "%u\t%u\n", &g, &i) == 2){
+    assert(g <= i && i < n && !grouped[i]);
+    groups += g == i;
+    assert(g >= prev);
+    prev = g;
+    grouped[i] = 1;
+  }
+  assert(groups == ngroups);
+  for(size_t k=0; k<npairs; ++k)
+    assert(grouped[pairs[k].a] && grouped[pairs[k].b]);
+  fclose(fp);
+  free(grouped);
+
+  join_state_close(old);
+  free(pairs);
+  hash_db_close(db);
+  unlink(fname);
+  unlink(sname);
+  rmdir(dname);
+  for(int i=0; i<TEST_N; ++i) g_free(paths[i]);
+  for(size_t k=TEST_N - deleted; k<n; ++k) g_free(paths2[k]);
+  free(paths);
+  free(paths2);
+  free(h);
+  free(h2);
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#elif defined(CMD_JOIN_UPDATE)
+int main(int argc, char* argv[argc]){
+  hash_index_opts opts = {0, HASH_INDEX_DEFAULT_RADIUS};
+  const char* state = 0;
+  const char* groups = 0;
+  int stats = 0, usage = 0, nargs = 0;
+  char* args[1] = {0};
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--metric") && i+1 < argc){
+      opts.metric = metric_find(argv[++i]);
+      if(!opts.metric){
+        fprintf(stderr, "Unknown metric %s. Metrics:\n", argv[i]);
+        metric_print_list(stderr);
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if(!strcmp(argv[i], "--radius") && i+1 < argc)
+      opts.radius = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--jobs") && i+1 < argc)
+      opts.jobs = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--state") && i+1 < argc) state = argv[++i];
+    else if(!strcmp(argv[i], "--groups") && i+1 < argc) groups = argv[++i];
+    else if(!strcmp(argv[i], "--stats")) stats = 1;
+    else if(nargs < 1) args[nargs++] = argv[i];
+    else usage = 1;
+  }
+  if(usage || nargs != 1){
+    fprintf(stderr, "Usage: %s [--metric <NAME>] [--radius <R>] "
+      "[--jobs <N>] [--state <FILE>] [--groups <FILE>] [--stats] <DB>\n",
+      argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  hash_db* db = hash_db_open(args[0]);
+  if(!db) exit(EXIT_FAILURE);
+  char* fname = state ? g_strdup(state) : g_strdup_printf("%s.join", args[0]);
+  join_state* old = join_state_open(fname);
+  const uint64_t t = timing_now();
+  join_update_stats st;
+  size_t npairs;
+  join_pair* pairs = join_update(db, old, &opts, &npairs, &st);
+  if(!pairs){
+    fprintf(stderr, "Failed to join %s.\n", args[0]);
+    exit(EXIT_FAILURE);
+  }
+  join_state_close(old);
+  for(size_t k=0; k<npairs; ++k)
+    printf("%" PRIu32 "\t%" PRIu32 "\t%" PRIu32 "\n", pairs[k].a, pairs[k].b,
+      pairs[k].dist);
+  int failed = fflush(stdout) != 0;
+  if(failed) fprintf(stderr, "Failed to write the pairs.\n");
+  // The saved join only moves on once the pairs are out.
+  else failed = join_state_write(fname, db, &opts, pairs, npairs) != 0;
+  if(groups && !failed){
+    FILE* fp = fopen(groups, "w");
+    const long ngroups = fp ? join_write_groups(fp, pairs, npairs,
+      db->count) : -1;
+    if(ngroups < 0 || (fp && fclose(fp))){
+      fprintf(stderr, "Failed to write the groups to %s.\n", groups);
+      failed = 1;
+    }
+    else fprintf(stderr, "%ld groups\n", ngroups);
+  }
+  fprintf(stderr, "%zu records kept, %zu scored, %zu deleted or changed; "
+    "%zu pairs kept, %zu dropped, %zu new\n", st.kept, st.scored, st.deleted,
+    st.pairs_kept, st.pairs_dropped, st.pairs_new);
+  if(stats){
+    fprintf(stderr, "%.3f s\n", (timing_now() - t) / 1e9);
+    hash_index_print_stats(stderr, &st.index);
+  }
+  free(pairs);
+  g_free(fname);
+  hash_db_close(db);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
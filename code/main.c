@@ -1,44 +1,171 @@
 /* main.c
  *
+ * idhash-components <IMAGE>
+ *
+ *   Print <dx> <dy> <ix> <iy> for a single image.
+ *
+ * idhash-components [-0] [--binary] [--jobs <N>] [--exact] [--profile <NAME>] -
+ * idhash-components [-0] [--binary] [--jobs <N>] [--exact] [--profile <NAME>] --from <LIST>
+ *
+ *   Hash every path read from stdin (or from the file LIST), separated by
+ *   newlines, or by '\0' with -0 (as written by `find -print0`). Print one
+ *   record per image as soon as it is ready, "<dx> <dy> <ix> <iy> <path>", or
+ *   a binary record with --binary (see idhash_record.c). Images are hashed on
+ *   N worker threads, one per CPU by default. With --exact, the whole list
+ *   is read first, and each set of byte-identical files is decoded once
+ *   (see exact_dupes.c), its record repeated for every copy; --stats then
+ *   prints how many copies were found, and how, on stderr.
+ *
+ *   Built with -DIDHASH_TIMING (make CPPFLAGS=-DIDHASH_TIMING), --timing
+ *   prints a table of per-stage latencies on stderr at exit (see timing.c),
+ *   --timing-json <FILE> writes them as JSON, and --meter keeps a progress
+ *   line with throughput on stderr while running.
+ *
+ * idhash-distance <IMAGE_A> <IMAGE_B>
+ *
+ *   Print the IDHash distance between two images.
  */
 
-#ifndef GUARD_BIT_ARRAY
-#define GUARD_BIT_ARRAY
+#ifndef BIT_ARRAY_H
+#define BIT_ARRAY_H
 #include "bit_array.h"
 #endif
 
-#ifndef GUARD_HISTOGRAM
-#define GUARD_HISTOGRAM
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
 #include "histogram.h"
 static void* histogram_thread_x(void* _arg);
 static void* histogram_thread_y(void* _arg);
 #endif
 
-#ifndef GUARD_IDHASH
-#define GUARD_IDHASH
+#ifndef IDHASH_H
+#define IDHASH_H
 #include "idhash.h"
 #endif
 
-#ifndef GUARD_STDIO
-#define GUARD_STDIO
+#ifndef IDHASH_STREAM_H
+#define IDHASH_STREAM_H
+#include "idhash_stream.c"
+#endif
+
+#ifndef VIPS_PROFILE_H
+#define VIPS_PROFILE_H
+#include "vips_profile.c"
+#endif
+
+#ifndef STDIO_H
+#define STDIO_H
 #include <stdio.h>
 #endif
 
-#ifndef GUARD_GLIB
-#define GUARD_GLIB 
+#ifndef STRING_H
+#define STRING_H
+#include <string.h>
+#endif
+
+#ifndef STAT_H
+#define STAT_H
+#include <sys/stat.h>
+#endif
+
+#ifndef GLIB_H
+#define GLIB_H 
 #include <glib.h>
 #endif
 
 #ifdef PRINT_RESULT_TO_STDOUT
+static void usage(char* prog) {
+  fprintf(stderr, "Usage: %s <IMAGE>\n"
+    "       %s [-0] [--binary] [--jobs <N>] [--prefetch <N> [--no-uring]]\n"
+    "          [--no-sniff] [--exact [--stats]] [--profile <NAME>] [--timing]\n"
+    "          [--timing-json <FILE>] [--meter] {- | --from <LIST>}\n",
+    prog, prog);
+  exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv) {
+  vips_profile profile={0};
+  vips_profile_parse_args(&profile, DEFAULT_VIPS_PROFILE, &argc, argv);
+
+  /* Parse the streaming options. Anything else is the single image path.
+   */
+  idhash_stream_opts opts = {'\n', 0, 0, 1, 0, 1, 1};
+  char* image=0, * list=0, * timing_json=0;
+  int stream=0, timing=0, meter=0, stats=0;
+  exact_dupes_stats exact_stats={0};
+  for (int i=1; i<argc; ++i) {
+    if (!strcmp(argv[i], "-0")) opts.delim = '\0';
+    else if (!strcmp(argv[i], "--binary")) opts.binary = 1;
+    else if (!strcmp(argv[i], "--jobs") && i+1 < argc)
+      opts.jobs = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--prefetch") && i+1 < argc)
+      opts.prefetch = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--no-uring")) opts.prefetch_uring = 0;
+    else if (!strcmp(argv[i], "--no-sniff")) opts.sniff = 0;
+    else if (!strcmp(argv[i], "--exact")) opts.exact = 1;
+    else if (!strcmp(argv[i], "--stats")) stats = 1;
+    else if (!strcmp(argv[i], "--timing")) timing = 1;
+    else if (!strcmp(argv[i], "--timing-json") && i+1 < argc)
+      timing_json = argv[++i];
+    else if (!strcmp(argv[i], "--meter")) meter = 1;
+    else if (!strcmp(argv[i], "--from") && i+1 < argc) {
+      list = argv[++i];
+      stream = 1;
+    }
+    else if (!strcmp(argv[i], "-")) stream = 1;
+    else if (!image && *argv[i] && *argv[i] != '-') image = argv[i];
+    else usage(argv[0]);
+  }
+  if (stream == !!image || (stats && !opts.exact))
+    usage(argv[0]);
+  if (stats) opts.exact_stats = &exact_stats;
+#ifndef IDHASH_TIMING
+  if (timing || timing_json || meter) {
+    fprintf(stderr, "%s: built without timing; rebuild with "
+      "-DIDHASH_TIMING for --timing, --timing-json and --meter.\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+#endif
+
   if (VIPS_INIT(argv[0]))
     vips_error_exit(NULL);
+  vips_profile_apply(&profile);
+
+  if (stream) {
+    FILE* in = stdin;
+    if (list && !(in = fopen(list, "r"))) {
+      fprintf(stderr, "Failed to open path list %s.\n", list);
+      exit(EXIT_FAILURE);
+    }
+    /* Flush every record only when something may be reading them as they
+     * arrive, i.e. when the output is not a regular file.
+     */
+    struct stat st={0};
+    if (!fstat(STDOUT_FILENO, &st) && S_ISREG(st.st_mode))
+      opts.flush = 0;
+    if (meter) timing_meter_start(STDERR_FILENO, 1000);
+    guint64 nfailed = idhash_stream_run(in, stdout, &opts);
+    if (meter) timing_meter_stop();
+    if (in != stdin) fclose(in);
+    vips_profile_print_stats(stderr);
+    if (stats) exact_dupes_print_stats(stderr, &exact_stats);
+    if (timing) timing_print_table(stderr);
+    FILE* fp;
+    if (timing_json && (fp = fopen(timing_json, "w"))) {
+      timing_print_json(fp);
+      fclose(fp);
+    } else if (timing_json) {
+      fprintf(stderr, "Failed to open %s.\n", timing_json);
+    }
+    return nfailed ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
 
   /* Compute the IDHash of the image at the given filepath (@argv[1]), and save
    * it to @result.
    */
   idhash_result res = {0};
-  idhash_filepath(argv[1], &res);
+  idhash_filepath(image, &res);
+  if (timing) timing_print_table(stderr);
 
   /* Print the result, formatted like this: 
    * <dhash_x> <dhash_y> <importance_x> <importance_y>
@@ -59,7 +186,9 @@ int main (int argc, char **argv) {
   idhash_result res_2 = {0};
   idhash_filepath(filepath_1, &res_1);
   idhash_filepath(filepath_2, &res_2);
+  TIMING_START(t);
   const guint d = idhash_dist(res_1, res_2);
+  TIMING_STOP(TIMING_DISTANCE, t);
   printf("%i", d);
 }
 #endif
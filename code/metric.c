@@ -0,0 +1,528 @@
+/* metric.c
+ *
+ * Distance metrics between idhash_hash records, looked up by name, so the
+ * same table of hashes can be scored several ways in one run.
+ *
+ *   idhash    the IDHash distance (see idhash_distance in idhash.h): bits
+ *             that differ where either image finds them important
+ *   dhash     classic DHash: every bit that differs, importance ignored
+ *   weighted  bits that differ where both images find them important count
+ *             twice as much as where only one does, halved and rounded up
+ *
+ * Every metric is an integer in [0, METRIC_MAX], 0 for identical hashes, so
+ * the ROC tooling (roc_point.c, roc_bootstrap.c) takes any of them as it is.
+ *
+ * Each metric has three kernels over the same formula:
+ *
+ *   dist   two hashes
+ *   batch  one hash against a table of n, into n distances
+ *   pairs  a[i] against b[i] for i < n, into n distances
+ *
+ * The batch kernels take four records at a time into vectors of four 64-bit
+ * lanes (GCC vector extensions) and count bits with the SWAR popcount, which
+ * has no multiply and so maps onto any SIMD unit. They're compiled twice,
+ * for AVX2 and for the baseline, and pick one for the CPU they run on. The
+ * scalar kernel uses __builtin_popcountll, and all three give the same
+ * distances.
+ *
+ * A hash also has a summary of 8 bytes: in each direction, how many bits of
+ * d are set (p), how many important bits are set (w) and clear (z), and how
+ * many are important (k). From the summaries alone each metric bounds the
+ * distance between two hashes, or between any hash of one range of
+ * summaries and any of another (see hash_index.c), from below and above.
+ * For one direction, with masks I1, I2 and d's a, b:
+ *
+ *   (a ^ b) & (I1 | I2) has at least |w1 - pc(b & I1)| bits, and
+ *   pc(b & I1) is between pb + k1 - 64 and pb, so
+ *
+ *   idhash >= max(0, w1 - pb, z1 - (64 - pb), and the same from b)
+ *   idhash <= min(64, k1 + k2, pa + pb, 128 - pa - pb)
+ *   dhash  >= |pa - pb|, and <= min(64, pa + pb, 128 - pa - pb)
+ *
+ * and weighted is between half the idhash bounds, rounded up, and the upper
+ * one. Importance masks have at least 32 bits each, so the upper bounds
+ * rarely fall below 64 except for flat images, whose d have few bits set.
+ *
+ * Compile test
+ *
+gcc metric.c -o test-metric -DTEST_METRIC -O2 -g -Wall `pkg-config vips --cflags --libs`
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef IDHASH_H
+#  define IDHASH_H
+#  include "idhash.h"
+#endif
+
+// The largest distance of any metric: the number of bits in dx and dy.
+#define METRIC_MAX 128
+
+typedef guint (*metric_dist_fn)(const idhash_hash* a, const idhash_hash* b);
+
+/* Write the distance from @q to each of the @n hashes of @table to @out.
+ */
+typedef void (*metric_batch_fn)(
+  const idhash_hash* q,
+  const idhash_hash* table,
+  size_t n,
+  guint* out);
+
+/* Write the distance from @a[i] to @b[i] to @out[i], for each i < @n.
+ */
+typedef void (*metric_pairs_fn)(
+  const idhash_hash* a,
+  const idhash_hash* b,
+  size_t n,
+  guint* out);
+
+/* Bit counts of a hash, per direction (0 for x, 1 for y): set bits of d,
+ * important set bits, important clear bits, and important bits.
+ */
+typedef struct metric_summary metric_summary;
+struct metric_summary {
+  guint8 p[2];
+  guint8 w[2];
+  guint8 z[2];
+  guint8 k[2];
+};
+
+// Fieldwise smallest and largest of some summaries.
+typedef struct metric_range metric_range;
+struct metric_range {
+  metric_summary lo;
+  metric_summary hi;
+};
+
+/* Set @lo and @hi to bounds on the distance between any hash with a summary
+ * in @a and any with one in @b.
+ */
+typedef void (*metric_bound_fn)(
+  const metric_range* a,
+  const metric_range* b,
+  guint* lo,
+  guint* hi);
+
+typedef struct metric metric;
+struct metric {
+  const char* name;
+  const char* description;
+  metric_dist_fn dist;
+  metric_batch_fn batch;
+  metric_pairs_fn pairs;
+  metric_bound_fn bound;
+};
+
+// Four 64-bit lanes, and the four components of four hashes.
+typedef guint64 metric_v4 __attribute__((vector_size(32)));
+
+typedef struct metric_hash4 metric_hash4;
+struct metric_hash4 {
+  metric_v4 dx;
+  metric_v4 dy;
+  metric_v4 ix;
+  metric_v4 iy;
+};
+
+static inline guint metric_popcount(guint64 z){
+  return __builtin_popcountll(z);
+}
+
+// The bits set in each lane. A macro, so the vectors stay in registers
+// whichever instruction set the caller was compiled for.
+#define METRIC_POPCOUNT_V4(x) ({ \
+  metric_v4 z_ = (x); \
+  z_ = z_ - ((z_ >> 1) & 0x5555555555555555u); \
+  z_ = (z_ & 0x3333333333333333u) + ((z_ >> 2) & 0x3333333333333333u); \
+  z_ = (z_ + (z_ >> 4)) & 0x0f0f0f0f0f0f0f0fu; \
+  z_ += z_ >> 8; \
+  z_ += z_ >> 16; \
+  z_ += z_ >> 32; \
+  z_ & 0xff; })
+
+#define METRIC_BROADCAST(h) (metric_hash4){ \
+  {(h)->dx, (h)->dx, (h)->dx, (h)->dx}, \
+  {(h)->dy, (h)->dy, (h)->dy, (h)->dy}, \
+  {(h)->ix, (h)->ix, (h)->ix, (h)->ix}, \
+  {(h)->iy, (h)->iy, (h)->iy, (h)->iy}}
+
+// Four records, each one vector of {dx, dy, ix, iy}, transposed into a
+// vector per component. Building the vectors lane by lane instead stores to
+// the stack and reloads, which is slower than the scalar kernel.
+#define METRIC_LOAD(h) ({ \
+  metric_v4 r0_, r1_, r2_, r3_; \
+  memcpy(&r0_, (h), sizeof r0_); \
+  memcpy(&r1_, (h) + 1, sizeof r1_); \
+  memcpy(&r2_, (h) + 2, sizeof r2_); \
+  memcpy(&r3_, (h) + 3, sizeof r3_); \
+  const metric_v4 lo_ = {0, 4, 2, 6}, hi_ = {1, 5, 3, 7}; \
+  const metric_v4 t0_ = __builtin_shuffle(r0_, r1_, lo_); \
+  const metric_v4 t1_ = __builtin_shuffle(r0_, r1_, hi_); \
+  const metric_v4 t2_ = __builtin_shuffle(r2_, r3_, lo_); \
+  const metric_v4 t3_ = __builtin_shuffle(r2_, r3_, hi_); \
+  const metric_v4 first_ = {0, 1, 4, 5}, second_ = {2, 3, 6, 7}; \
+  (metric_hash4){__builtin_shuffle(t0_, t2_, first_), \
+    __builtin_shuffle(t1_, t3_, first_), \
+    __builtin_shuffle(t0_, t2_, second_), \
+    __builtin_shuffle(t1_, t3_, second_)}; })
+
+/* The formulas, over scalars (P = metric_popcount, on idhash_hash) or
+ * vectors (P = METRIC_POPCOUNT_V4, on metric_hash4) alike.
+ */
+#define METRIC_IDHASH(P, a, b) \
+  (P(((a).dx ^ (b).dx) & ((a).ix | (b).ix)) \
+    + P(((a).dy ^ (b).dy) & ((a).iy | (b).iy)))
+
+#define METRIC_DHASH(P, a, b) \
+  (P((a).dx ^ (b).dx) + P((a).dy ^ (b).dy))
+
+#define METRIC_WEIGHTED(P, a, b) \
+  ((P(((a).dx ^ (b).dx) & (a).ix & (b).ix) \
+    + P(((a).dx ^ (b).dx) & ((a).ix | (b).ix)) \
+    + P(((a).dy ^ (b).dy) & (a).iy & (b).iy) \
+    + P(((a).dy ^ (b).dy) & ((a).iy | (b).iy)) + 1) >> 1)
+
+/* The batch kernels of FORMULA, as metric_NAME_batchSUFFIX and
+ * metric_NAME_pairsSUFFIX, built with the function attributes TARGET.
+ */
+#define METRIC_BATCH_KERNELS(NAME, FORMULA, SUFFIX, TARGET) \
+TARGET static void metric_##NAME##_batch##SUFFIX( \
+  const idhash_hash* q, \
+  const idhash_hash* table, \
+  size_t n, \
+  guint* out) \
+{ \
+  const metric_hash4 qv = METRIC_BROADCAST(q); \
+  size_t i=0; \
+  for(; i+4 <= n; i+=4){ \
+    const metric_hash4 tv = METRIC_LOAD(table + i); \
+    const metric_v4 d = FORMULA(METRIC_POPCOUNT_V4, qv, tv); \
+    for(int k=0; k<4; ++k) out[i+k] = d[k]; \
+  } \
+  for(; i<n; ++i) out[i] = FORMULA(metric_popcount, *q, table[i]); \
+} \
+\
+TARGET static void metric_##NAME##_pairs##SUFFIX( \
+  const idhash_hash* a, \
+  const idhash_hash* b, \
+  size_t n, \
+  guint* out) \
+{ \
+  size_t i=0; \
+  for(; i+4 <= n; i+=4){ \
+    const metric_hash4 av = METRIC_LOAD(a + i), bv = METRIC_LOAD(b + i); \
+    const metric_v4 d = FORMULA(METRIC_POPCOUNT_V4, av, bv); \
+    for(int k=0; k<4; ++k) out[i+k] = d[k]; \
+  } \
+  for(; i<n; ++i) out[i] = FORMULA(metric_popcount, a[i], b[i]); \
+}
+
+/* Define metric_NAME, metric_NAME_batch and metric_NAME_pairs from FORMULA.
+ * The batch kernels check for AVX2 on each call, which costs nothing next
+ * to a batch, rather than through an ifunc, which runs before sanitizers
+ * are set up.
+ */
+#define METRIC_KERNELS(NAME, FORMULA) \
+static guint metric_##NAME(const idhash_hash* a, const idhash_hash* b){ \
+  return FORMULA(metric_popcount, *a, *b); \
+} \
+\
+METRIC_BATCH_KERNELS(NAME, FORMULA, _avx2, __attribute__((target("avx2")))) \
+METRIC_BATCH_KERNELS(NAME, FORMULA, _base, ) \
+\
+static void metric_##NAME##_batch( \
+  const idhash_hash* q, \
+  const idhash_hash* table, \
+  size_t n, \
+  guint* out) \
+{ \
+  if(__builtin_cpu_supports("avx2")) \
+    metric_##NAME##_batch_avx2(q, table, n, out); \
+  else metric_##NAME##_batch_base(q, table, n, out); \
+} \
+\
+static void metric_##NAME##_pairs( \
+  const idhash_hash* a, \
+  const idhash_hash* b, \
+  size_t n, \
+  guint* out) \
+{ \
+  if(__builtin_cpu_supports("avx2")) \
+    metric_##NAME##_pairs_avx2(a, b, n, out); \
+  else metric_##NAME##_pairs_base(a, b, n, out); \
+}
+
+METRIC_KERNELS(idhash, METRIC_IDHASH)
+METRIC_KERNELS(dhash, METRIC_DHASH)
+METRIC_KERNELS(weighted, METRIC_WEIGHTED)
+
+metric_summary metric_summary_of(const idhash_hash* h){
+  const guint64 d[2] = {h->dx, h->dy}, i[2] = {h->ix, h->iy};
+  metric_summary s;
+  for(int c=0; c<2; ++c){
+    s.p[c] = metric_popcount(d[c]);
+    s.w[c] = metric_popcount(d[c] & i[c]);
+    s.z[c] = metric_popcount(~d[c] & i[c]);
+    s.k[c] = metric_popcount(i[c]);
+  }
+  return s;
+}
+
+/* The range of the single summary @s.
+ */
+metric_range metric_range_of(const metric_summary* s){
+  return (metric_range){*s, *s};
+}
+
+/* A range with nothing in it yet, to metric_range_add to.
+ */
+metric_range metric_range_empty(void){
+  metric_range r;
+  memset(&r.lo, 255, sizeof r.lo);
+  memset(&r.hi, 0, sizeof r.hi);
+  return r;
+}
+
+/* Widen @r to take in @s.
+ */
+void metric_range_add(metric_range* r, const metric_summary* s){
+  guint8* lo = (guint8*) &r->lo, * hi = (guint8*) &r->hi;
+  const guint8* x = (const guint8*) s;
+  for(size_t j=0; j<sizeof(metric_summary); ++j){
+    if(x[j] < lo[j]) lo[j] = x[j];
+    if(x[j] > hi[j]) hi[j] = x[j];
+  }
+}
+
+static inline int metric_max(int a, int b){ return a > b ? a : b; }
+static inline int metric_min(int a, int b){ return a < b ? a : b; }
+
+/* Upper bound on the bits that differ in direction @c: at most the bits set
+ * in either d, and at most the bits clear in either.
+ */
+static inline int metric_bound_differ(
+  const metric_range* a,
+  const metric_range* b,
+  int c)
+{
+  return metric_min(metric_min(64, a->hi.p[c] + b->hi.p[c]),
+    128 - a->lo.p[c] - b->lo.p[c]);
+}
+
+static void metric_idhash_bound(
+  const metric_range* a,
+  const metric_range* b,
+  guint* lo,
+  guint* hi)
+{
+  *lo = *hi = 0;
+  for(int c=0; c<2; ++c){
+    int l = 0;
+    l = metric_max(l, a->lo.w[c] - b->hi.p[c]);
+    l = metric_max(l, b->lo.w[c] - a->hi.p[c]);
+    l = metric_max(l, a->lo.z[c] - (64 - b->lo.p[c]));
+    l = metric_max(l, b->lo.z[c] - (64 - a->lo.p[c]));
+    *lo += l;
+    *hi += metric_min(a->hi.k[c] + b->hi.k[c], metric_bound_differ(a, b, c));
+  }
+}
+
+static void metric_dhash_bound(
+  const metric_range* a,
+  const metric_range* b,
+  guint* lo,
+  guint* hi)
+{
+  *lo = *hi = 0;
+  for(int c=0; c<2; ++c){
+    *lo += metric_max(0, metric_max(a->lo.p[c] - b->hi.p[c],
+      b->lo.p[c] - a->hi.p[c]));
+    *hi += metric_bound_differ(a, b, c);
+  }
+}
+
+static void metric_weighted_bound(
+  const metric_range* a,
+  const metric_range* b,
+  guint* lo,
+  guint* hi)
+{
+  metric_idhash_bound(a, b, lo, hi);
+  *lo = (*lo + 1) >> 1;
+}
+
+// The first is the default.
+const metric metric_registry[] = {
+  {"idhash", "differing bits important in either image",
+    metric_idhash, metric_idhash_batch, metric_idhash_pairs,
+    metric_idhash_bound},
+  {"dhash", "all differing bits (classic DHash)",
+    metric_dhash, metric_dhash_batch, metric_dhash_pairs,
+    metric_dhash_bound},
+  {"weighted", "differing bits, important in both images counting double",
+    metric_weighted, metric_weighted_batch, metric_weighted_pairs,
+    metric_weighted_bound},
+};
+#define METRIC_COUNT (sizeof metric_registry / sizeof *metric_registry)
+
+/* The metric called @name, or 0 if there isn't one.
+ */
+const metric* metric_find(const char* name){
+  for(size_t i=0; i<METRIC_COUNT; ++i)
+    if(!strcmp(metric_registry[i].name, name)) return metric_registry + i;
+  return 0;
+}
+
+/* Print the metrics, one per line, to @fp.
+ */
+void metric_print_list(FILE* fp){
+  for(size_t i=0; i<METRIC_COUNT; ++i)
+    fprintf(fp, "  %-10s %s\n", metric_registry[i].name,
+      metric_registry[i].description);
+}
+
+/* Parse @list, comma-separated metric names, into @out, at most @max of
+ * them. Return how many, or -1 with a message on stderr if a name is
+ * unknown or there are too many.
+ */
+int metric_parse_list(const char* list, const metric** out, int max){
+  int n=0;
+  for(const char* s=list; ; s++){
+    const size_t len = strcspn(s, ",");
+    char name[64];
+    snprintf(name, sizeof name, "%.*s", (int) len, s);
+    const metric* m = metric_find(name);
+    if(!m){
+      fprintf(stderr, "Unknown metric %s. Metrics:\n", name);
+      metric_print_list(stderr);
+      return -1;
+    }
+    if(n == max){
+      fprintf(stderr, "At most %d metrics\n", max);
+      return -1;
+    }
+    out[n++] = m;
+    s += len;
+    if(!*s) return n;
+  }
+}
+
+#ifdef TEST_METRIC
+#ifndef ASSERT_H
+#  define ASSERT_H
+#  include <assert.h>
+#endif
+
+static guint64 test_rand(guint64* s){
+  guint64 z = (*s += 0x9e3779b97f4a7c15u);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+  return z ^ (z >> 31);
+}
+
+#define TEST_N 1003
+
+int main(){
+  idhash_hash* a = calloc(TEST_N, sizeof(idhash_hash));
+  idhash_hash* b = calloc(TEST_N, sizeof(idhash_hash));
+  guint* batch = calloc(TEST_N, sizeof(guint));
+  guint* pairs = calloc(TEST_N, sizeof(guint));
+  guint64 s = 1;
+  for(int i=0; i<TEST_N; ++i){
+    a[i] = (idhash_hash){test_rand(&s), test_rand(&s), test_rand(&s),
+      test_rand(&s)};
+    // Sparse and dense masks and differences, and some identical hashes.
+    b[i] = a[i];
+    if(i % 7) b[i].dx ^= test_rand(&s) & test_rand(&s);
+    if(i % 5) b[i].dy ^= i % 3 ? test_rand(&s) : ~(guint64) 0;
+    if(i % 11) b[i].ix = test_rand(&s) | test_rand(&s);
+    // Flat images: few bits of d set.
+    if(i % 13 == 0) b[i].dx &= test_rand(&s) & test_rand(&s) & test_rand(&s);
+  }
+  assert(metric_find("idhash") == metric_registry);
+  assert(!metric_find("nope"));
+  const metric* list[METRIC_COUNT];
+  assert(metric_parse_list("dhash,weighted", list, METRIC_COUNT) == 2);
+  assert(list[0] == metric_find("dhash") && list[1] == metric_find("weighted"));
+  assert(metric_parse_list("idhash,nope", list, METRIC_COUNT) == -1);
+  assert(metric_parse_list("idhash,idhash", list, 1) == -1);
+
+  for(size_t k=0; k<METRIC_COUNT; ++k){
+    const metric* m = metric_registry + k;
+    m->batch(a, b, TEST_N, batch);
+    m->pairs(a, b, TEST_N, pairs);
+    for(int i=0; i<TEST_N; ++i){
+      const guint d = m->dist(a + i, b + i);
+      assert(d <= METRIC_MAX);
+      assert(m->dist(a + i, a + i) == 0);
+      assert(m->dist(b + i, a + i) == d);
+      assert(pairs[i] == d);
+      assert(batch[i] == m->dist(a, b + i));
+      if(m->dist == metric_idhash) assert(d == idhash_hash_dist(a + i, b + i));
+    }
+    // The bounds hold for single hashes, and for ranges around them.
+    metric_range all = metric_range_empty();
+    for(int i=0; i<TEST_N; ++i){
+      const metric_summary sa = metric_summary_of(a + i);
+      const metric_summary sb = metric_summary_of(b + i);
+      metric_range ra = metric_range_of(&sa), rb = metric_range_of(&sb);
+      guint lo, hi;
+      const guint d = m->dist(a + i, b + i);
+      m->bound(&ra, &rb, &lo, &hi);
+      assert(lo <= d && d <= hi && hi <= METRIC_MAX);
+      metric_range_add(&all, &sb);
+      if(i % 64 == 63){
+        for(int j=i-63; j<=i; ++j){
+          const metric_summary sj = metric_summary_of(b + j);
+          metric_range rj = metric_range_of(&sj);
+          guint lj, hj;
+          m->bound(&rj, &all, &lo, &hi);
+          m->bound(&rj, &rj, &lj, &hj);
+          assert(lo <= lj && hj <= hi);
+          for(int k=i-63; k<=i; ++k){
+            const guint dk = m->dist(b + j, b + k);
+            assert(lo <= dk && dk <= hi);
+          }
+        }
+        all = metric_range_empty();
+      }
+    }
+    printf("%s: %s\n", m->name, m->description);
+  }
+  // The baseline build gives the same distances, whatever this CPU picks.
+  guint* base = calloc(TEST_N, sizeof(guint));
+  metric_weighted_batch(a, b, TEST_N, batch);
+  metric_weighted_batch_base(a, b, TEST_N, base);
+  assert(!memcmp(batch, base, TEST_N * sizeof(guint)));
+  metric_idhash_pairs(a, b, TEST_N, pairs);
+  metric_idhash_pairs_base(a, b, TEST_N, base);
+  assert(!memcmp(pairs, base, TEST_N * sizeof(guint)));
+  free(base);
+
+  // Identical up to importance, the metrics disagree as they should.
+  idhash_hash x = {~(guint64) 0, 0, 0xff, 0}, y = {0, 0, 0x0f, 0};
+  assert(metric_dhash(&x, &y) == 64);
+  assert(metric_idhash(&x, &y) == 8);
+  assert(metric_weighted(&x, &y) == (4*2 + 4 + 1) / 2);
+  free(a);
+  free(b);
+  free(batch);
+  free(pairs);
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,581 @@
+/* pair_manifest.c
+ *
+ * A list of labeled image pairs for evaluation, in place of directories of
+ * i_a.jpg/i_b.jpg copies.
+ *
+ * Each pair names two images, a label (duplicate or non-duplicate), and an
+ * optional transform applied to the second image before hashing (see
+ * synth_pairs.c). Paths and transforms are interned, so millions of pairs
+ * over the same images cost 12 bytes each, and tools can hash each distinct
+ * image once and score the pairs from a table.
+ *
+ * TSV, one pair per line, '#' starts a comment line:
+ *
+ *   <path_a> TAB <path_b> TAB dup|nondup [TAB <transform>]
+ *
+ * Binary, in host byte order:
+ *
+ *   "IDHPAIR1"
+ *   guint32 npaths,      npaths * (guint32 n, char path[n])
+ *   guint32 ntransforms, ntransforms * (guint32 n, char transform[n])
+ *   guint64 npairs,      npairs * (guint32 a, b, transform, label)
+ *
+ * Transform 0 is always the empty transform.
+ *
+ * pair_manifest_read tells the formats apart by the magic.
+ *
+ * Compile test
+ *
+gcc pair_manifest.c -o test-pair-manifest -DTEST_PAIR_MANIFEST -g -Wall -pthread
+ *
+ * Compile
+ *
+gcc pair_manifest.c -o pair-manifest -DCMD_PAIR_MANIFEST -g -Wall -pthread
+ *
+ * Usage
+ *
+ * ./pair-manifest [--binary] <SOURCE_DIR>      pairs like generate_duplicates
+ *                                              and generate_nonduplicates
+ * ./pair-manifest [--binary] --from <MANIFEST> convert
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef STDINT_H
+#  define STDINT_H
+#  include <stdint.h>
+#endif
+
+#ifndef ASSERT_H
+#  define ASSERT_H
+#  include <assert.h>
+#endif
+
+#ifndef DIR_WALK_H
+#  define DIR_WALK_H
+#  include "dir_walk.c"
+#endif
+
+#define PAIR_MANIFEST_MAGIC "IDHPAIR1"
+#define SZ_PAIR_MANIFEST_MAGIC 8
+
+typedef enum pair_label {
+  PAIR_NONDUP,
+  PAIR_DUP,
+} pair_label;
+
+typedef struct pair_manifest_pair pair_manifest_pair;
+struct pair_manifest_pair {
+  uint32_t a;          // index into pair_manifest::paths.strs
+  uint32_t b;
+  uint32_t transform;  // index into pair_manifest::transforms.strs
+  uint32_t label;      // pair_label
+};
+
+// Interned strings: each distinct string is stored once and has an index.
+// Lookups go through an open-addressing table of indices.
+typedef struct pair_manifest_strings pair_manifest_strings;
+struct pair_manifest_strings {
+  char** strs;
+  uint32_t n;
+  uint32_t cap;
+  uint32_t* table;  // index + 1, or 0 for an empty slot
+  uint32_t table_cap;
+};
+
+typedef struct pair_manifest pair_manifest;
+struct pair_manifest {
+  pair_manifest_strings paths;
+  pair_manifest_strings transforms;
+  pair_manifest_pair* pairs;
+  size_t npairs;
+  size_t cap;
+};
+
+static uint64_t pair_manifest_hash_str(const char* s){
+  uint64_t h = 14695981039346656037ull;  // FNV-1a
+  for(; *s; ++s) h = (h ^ (unsigned char) *s) * 1099511628211ull;
+  return h;
+}
+
+static void pair_manifest_strings_grow(pair_manifest_strings* ss){
+  uint32_t cap = ss->table_cap ? 2*ss->table_cap : 64;
+  uint32_t* table = calloc(cap, sizeof(uint32_t));
+  for(uint32_t i=0; i<ss->n; ++i){
+    uint64_t h = pair_manifest_hash_str(ss->strs[i]);
+    while(table[h & (cap-1)]) ++h;
+    table[h & (cap-1)] = i+1;
+  }
+  free(ss->table);
+  ss->table = table;
+  ss->table_cap = cap;
+}
+
+/* Return the index of @s in @ss, adding a copy of it if it's new.
+ */
+static uint32_t pair_manifest_strings_intern(
+  pair_manifest_strings* ss,
+  const char* s)
+{
+  // Keep the table at most half full.
+  if(2*(ss->n + 1) > ss->table_cap) pair_manifest_strings_grow(ss);
+  uint64_t h = pair_manifest_hash_str(s);
+  uint32_t* slot;
+  for(; *(slot = ss->table + (h & (ss->table_cap-1))); ++h)
+    if(!strcmp(ss->strs[*slot - 1], s)) return *slot - 1;
+  if(ss->n == ss->cap){
+    ss->cap = ss->cap ? 2*ss->cap : 64;
+    ss->strs = realloc(ss->strs, ss->cap * sizeof(char*));
+  }
+  ss->strs[ss->n] = strdup(s);
+  *slot = ++ss->n;
+  return ss->n - 1;
+}
+
+static void pair_manifest_strings_free(pair_manifest_strings* ss){
+  for(uint32_t i=0; i<ss->n; ++i) free(ss->strs[i]);
+  free(ss->strs);
+  free(ss->table);
+}
+
+/* Create an empty manifest.
+ */
+pair_manifest* pair_manifest_create(){
+  pair_manifest* m = calloc(1, sizeof(pair_manifest));
+  pair_manifest_strings_intern(&m->transforms, "");
+  return m;
+}
+
+void pair_manifest_destroy(pair_manifest* m){
+  pair_manifest_strings_free(&m->paths);
+  pair_manifest_strings_free(&m->transforms);
+  free(m->pairs);
+  free(m);
+}
+
+/* Add a pair. @transform may be 0 or "" for none.
+ */
+void pair_manifest_add(
+  pair_manifest* m,
+  const char* path_a,
+  const char* path_b,
+  pair_label label,
+  const char* transform)
+{
+  if(m->npairs == m->cap){
+    m->cap = m->cap ? 2*m->cap : 1024;
+    m->pairs = realloc(m->pairs, m->cap * sizeof(pair_manifest_pair));
+  }
+  m->pairs[m->npairs++] = (pair_manifest_pair){
+    pair_manifest_strings_intern(&m->paths, path_a),
+    pair_manifest_strings_intern(&m->paths, path_b),
+    pair_manifest_strings_intern(&m->transforms, transform ? transform : ""),
+    label
+  };
+}
+
+const char* pair_label_name(pair_label label){
+  return label == PAIR_DUP ? "dup" : "nondup";
+}
+
+/* Parse a label: dup/nondup, or 1/0. Return -1 if @s is neither.
+ */
+int pair_label_parse(const char* s){
+  if(!strcmp(s, "dup") || !strcmp(s, "1")) return PAIR_DUP;
+  if(!strcmp(s, "nondup") || !strcmp(s, "0")) return PAIR_NONDUP;
+  return -1;
+}
+
+/* Write @m to @fp as TSV. Return 0, or -1 on a write error.
+ */
+int pair_manifest_write_tsv(const pair_manifest* m, FILE* fp){
+  fprintf(fp, "# path_a\tpath_b\tlabel\ttransform\n");
+  for(size_t i=0; i<m->npairs; ++i){
+    const pair_manifest_pair* p = m->pairs + i;
+    fprintf(fp, "%s\t%s\t%s", m->paths.strs[p->a], m->paths.strs[p->b],
+      pair_label_name(p->label));
+    if(p->transform) fprintf(fp, "\t%s", m->transforms.strs[p->transform]);
+    fputc('\n', fp);
+  }
+  return ferror(fp) ? -1 : 0;
+}
+
+static int pair_manifest_write_strings(
+  const pair_manifest_strings* ss,
+  FILE* fp)
+{
+  if(1 != fwrite(&ss->n, sizeof ss->n, 1, fp)) return -1;
+  for(uint32_t i=0; i<ss->n; ++i){
+    uint32_t n = strlen(ss->strs[i]);
+    if(1 != fwrite(&n, sizeof n, 1, fp)
+      || (n && 1 != fwrite(ss->strs[i], n, 1, fp)))
+      return -1;
+  }
+  return 0;
+}
+
+/* Write @m to @fp in the binary format. Return 0, or -1 on a write error.
+ */
+int pair_manifest_write_binary(const pair_manifest* m, FILE* fp){
+  const uint64_t npairs = m->npairs;
+  if(1 != fwrite(PAIR_MANIFEST_MAGIC, SZ_PAIR_MANIFEST_MAGIC, 1, fp)
+    || pair_manifest_write_strings(&m->paths, fp)
+    || pair_manifest_write_strings(&m->transforms, fp)
+    || 1 != fwrite(&npairs, sizeof npairs, 1, fp)
+    || (npairs && npairs != fwrite(m->pairs, sizeof(pair_manifest_pair),
+      npairs, fp)))
+    return -1;
+  return 0;
+}
+
+static int pair_manifest_read_strings(pair_manifest_strings* ss, FILE* fp){
+  uint32_t count, n;
+  if(1 != fread(&count, sizeof count, 1, fp)) return -1;
+  char* s=0;
+  for(uint32_t i=0; i<count; ++i){
+    if(1 != fread(&n, sizeof n, 1, fp) || !(s = realloc(s, n+1))
+      || (n && 1 != fread(s, n, 1, fp))){
+      free(s);
+      return -1;
+    }
+    s[n] = 0;
+    // Interning keeps the file's order, so the indices in the pairs hold.
+    if(i != pair_manifest_strings_intern(ss, s)){
+      free(s);
+      return -1;
+    }
+  }
+  free(s);
+  return 0;
+}
+
+static int pair_manifest_read_binary(pair_manifest* m, FILE* fp){
+  uint64_t npairs;
+  // The empty transform is interned already, and comes first in the file.
+  pair_manifest_strings_free(&m->transforms);
+  memset(&m->transforms, 0, sizeof m->transforms);
+  if(pair_manifest_read_strings(&m->paths, fp)
+    || pair_manifest_read_strings(&m->transforms, fp)
+    || !m->transforms.n || *m->transforms.strs[0]
+    || 1 != fread(&npairs, sizeof npairs, 1, fp))
+    return -1;
+  // The count is the file's word: a regular file must hold that many, and
+  // the table grows as the pairs are read, so a stream can't claim more
+  // memory than it sends.
+  struct stat st;
+  const long at = ftell(fp);
+  if(!fstat(fileno(fp), &st) && S_ISREG(st.st_mode) && at >= 0
+    && npairs > (uint64_t) (st.st_size - at) / sizeof(pair_manifest_pair))
+    return -1;
+  while(m->npairs < npairs){
+    size_t n = npairs - m->npairs < 65536 ? npairs - m->npairs : 65536;
+    if(m->npairs + n > m->cap){
+      size_t cap = m->cap ? 2*m->cap : 65536;
+      if(cap > npairs) cap = npairs;
+      pair_manifest_pair* pairs = realloc(m->pairs,
+        cap * sizeof(pair_manifest_pair));
+      if(!pairs) return -1;
+      m->pairs = pairs;
+      m->cap = cap;
+    }
+    if(n != fread(m->pairs + m->npairs, sizeof(pair_manifest_pair), n, fp))
+      return -1;
+    m->npairs += n;
+  }
+  for(size_t i=0; i<m->npairs; ++i){
+    const pair_manifest_pair* p = m->pairs + i;
+    if(p->a >= m->paths.n || p->b >= m->paths.n
+      || p->transform >= m->transforms.n || p->label > PAIR_DUP)
+      return -1;
+  }
+  return 0;
+}
+
+/* Add the pair on TSV line @lineno, @line, @z bytes long. Return 0, or -1
+ * if it's malformed.
+ */
+static int pair_manifest_read_line(pair_manifest* m, char* line, size_t z,
+  int lineno)
+{
+  if(z && line[z-1] == '\n') line[--z] = 0;
+  if(!z || *line == '#') return 0;
+  char* fields[4]={0};
+  int n=0;
+  for(char* p = line; p && n < 4; ++n){
+    fields[n] = p;
+    if((p = strchr(p, '\t'))) *p++ = 0;
+  }
+  int label = n >= 3 ? pair_label_parse(fields[2]) : -1;
+  if(0 > label || !*fields[0] || !*fields[1]){
+    fprintf(stderr, "Malformed pair on line %d.\n", lineno);
+    return -1;
+  }
+  pair_manifest_add(m, fields[0], fields[1], label, fields[3]);
+  return 0;
+}
+
+/* Read TSV pairs from @fp, whose first @nhead bytes, @head, were read
+ * already to look for the magic.
+ */
+static int pair_manifest_read_tsv(pair_manifest* m, FILE* fp,
+  const char* head, size_t nhead)
+{
+  char* line=0;
+  size_t len=0;
+  ssize_t z;
+  int lineno=0, err=0;
+  // Lines wholly in the head, then the rest of its last line from @fp.
+  for(const char* nl; !err && (nl = memchr(head, '\n', nhead)); ){
+    const size_t n = nl + 1 - head;
+    line = realloc(line, len = n + 1);
+    memcpy(line, head, n);
+    line[n] = 0;
+    err = pair_manifest_read_line(m, line, n, ++lineno);
+    head += n;
+    nhead -= n;
+  }
+  while(!err && 0 < (z = getline(&line, &len, fp))){
+    if(nhead){
+      if(len < nhead + z + 1) line = realloc(line, len = nhead + z + 1);
+      memmove(line + nhead, line, z + 1);
+      memcpy(line, head, nhead);
+      z += nhead;
+      nhead = 0;
+    }
+    err = pair_manifest_read_line(m, line, z, ++lineno);
+  }
+  if(!err && nhead){
+    // The file ended inside the head, without a newline.
+    line = realloc(line, nhead + 1);
+    memcpy(line, head, nhead);
+    line[nhead] = 0;
+    err = pair_manifest_read_line(m, line, nhead, ++lineno);
+  }
+  free(line);
+  return err;
+}
+
+/* Read a manifest in either format from @fname ("-" for stdin). Return it,
+ * or 0 with the reason on stderr.
+ */
+pair_manifest* pair_manifest_read(const char* fname){
+  FILE* fp = strcmp(fname, "-") ? fopen(fname, "rb") : stdin;
+  if(!fp){
+    fprintf(stderr, "Failed to open pair manifest %s.\n", fname);
+    return 0;
+  }
+  pair_manifest* m = pair_manifest_create();
+  char magic[SZ_PAIR_MANIFEST_MAGIC]={0};
+  size_t n = fread(magic, 1, SZ_PAIR_MANIFEST_MAGIC, fp);
+  int z;
+  if(n == SZ_PAIR_MANIFEST_MAGIC
+    && !memcmp(magic, PAIR_MANIFEST_MAGIC, SZ_PAIR_MANIFEST_MAGIC)){
+    z = pair_manifest_read_binary(m, fp);
+  } else {
+    // ungetc only guarantees one byte back, and stdin may not seek, so the
+    // TSV reader starts from the peeked bytes.
+    z = pair_manifest_read_tsv(m, fp, magic, n);
+  }
+  if(fp != stdin) fclose(fp);
+  if(z){
+    fprintf(stderr, "Failed to read pair manifest %s.\n", fname);
+    pair_manifest_destroy(m);
+    return 0;
+  }
+  return m;
+}
+
+static int pair_manifest_collect(const dir_walk_entry* e, void* arg){
+  pair_manifest_strings* ss = (pair_manifest_strings*) arg;
+  pair_manifest_strings_intern(ss, e->path);
+  return 0;
+}
+
+static int pair_manifest_cmp_str(const void* a, const void* b){
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/* Add the pairs generate_duplicates and generate_nonduplicates would make
+ * from the regular files in @dir, without copying anything: each file with
+ * itself (dup), and each file with the one before it, in name order and
+ * wrapping around (nondup). With @ntransforms > 0, add both sets once per
+ * transform in @transforms instead. Return the number of entries that
+ * couldn't be read.
+ */
+long pair_manifest_add_dir(
+  pair_manifest* m,
+  const char* dir,
+  const char* const* transforms,
+  int ntransforms)
+{
+  pair_manifest_strings files={0};
+  dir_walk_opts opts = {0, 1, 1, 0};
+  long nerrors = dir_walk_run(dir, &opts, pair_manifest_collect, &files);
+  qsort(files.strs, files.n, sizeof(char*), pair_manifest_cmp_str);
+  for(int t=0; t < (ntransforms > 0 ? ntransforms : 1); ++t){
+    const char* transform = ntransforms > 0 ? transforms[t] : 0;
+    for(uint32_t i=0; i<files.n; ++i)
+      pair_manifest_add(m, files.strs[i], files.strs[i], PAIR_DUP, transform);
+    for(uint32_t i=0; files.n > 1 && i<files.n; ++i)
+      pair_manifest_add(m, files.strs[i],
+        files.strs[(i + files.n - 1) % files.n], PAIR_NONDUP, transform);
+  }
+  pair_manifest_strings_free(&files);
+  return nerrors;
+}
+
+#ifdef TEST_PAIR_MANIFEST
+static void check_same(const pair_manifest* m, const pair_manifest* n){
+  assert(m->npairs == n->npairs);
+  for(size_t i=0; i<m->npairs; ++i){
+    const pair_manifest_pair* p = m->pairs + i, * q = n->pairs + i;
+    assert(!strcmp(m->paths.strs[p->a], n->paths.strs[q->a]));
+    assert(!strcmp(m->paths.strs[p->b], n->paths.strs[q->b]));
+    assert(!strcmp(m->transforms.strs[p->transform],
+      n->transforms.strs[q->transform]));
+    assert(p->label == q->label);
+  }
+}
+
+int main(){
+  pair_manifest* m = pair_manifest_create();
+  pair_manifest_add(m, "x/1.jpg", "x/1.jpg", PAIR_DUP, 0);
+  pair_manifest_add(m, "x/1.jpg", "x/2 two.jpg", PAIR_NONDUP, "");
+  pair_manifest_add(m, "x/2 two.jpg", "x/2 two.jpg", PAIR_DUP, "crop:0.9");
+  for(int i=0; i<5000; ++i){
+    char a[32], b[32];
+    snprintf(a, sizeof a, "y/%d.jpg", i);
+    snprintf(b, sizeof b, "y/%d.jpg", (i+1) % 5000);
+    pair_manifest_add(m, a, b, PAIR_NONDUP, 0);
+  }
+  // Each path and transform is stored once.
+  assert(m->paths.n == 5002);
+  assert(m->transforms.n == 2);
+  assert(m->pairs[0].a == m->pairs[0].b && m->pairs[1].a == m->pairs[0].a);
+
+  char fname[] = "/tmp/test_pair_manifest_XXXXXX";
+  for(int binary=0; binary<2; ++binary){
+    int fd = mkstemp(fname);
+    assert(0 <= fd);
+    FILE* fp = fdopen(fd, "wb");
+    assert(!(binary ? pair_manifest_write_binary(m, fp)
+      : pair_manifest_write_tsv(m, fp)));
+    fclose(fp);
+    pair_manifest* n = pair_manifest_read(fname);
+    assert(n);
+    check_same(m, n);
+    pair_manifest_destroy(n);
+    remove(fname);
+    strcpy(fname + strlen(fname) - 6, "XXXXXX");
+  }
+
+  // Malformed TSV is rejected.
+  int fd = mkstemp(fname);
+  FILE* fp = fdopen(fd, "w");
+  fputs("a.jpg\tb.jpg\tmaybe\n", fp);
+  fclose(fp);
+  assert(!pair_manifest_read(fname));
+  remove(fname);
+
+  // Short lines, all or partly inside the peeked bytes, and no newline at
+  // the end.
+  static const char* const shorts[] = {"#\na\tb\tdup", "a\tb\t1\n#\nc\td\t0",
+    "abcdefg\th\tdup\n", "a\tb\t0\n", 0};
+  for(int i=0; shorts[i]; ++i){
+    strcpy(fname + strlen(fname) - 6, "XXXXXX");
+    fd = mkstemp(fname);
+    fp = fdopen(fd, "w");
+    fputs(shorts[i], fp);
+    fclose(fp);
+    pair_manifest* n = pair_manifest_read(fname);
+    assert(n && n->npairs == 1 + (i == 1));
+    assert(!strcmp(n->paths.strs[n->pairs[0].a], i == 2 ? "abcdefg" : "a"));
+    assert(n->pairs[0].label == (i == 3 ? PAIR_NONDUP : PAIR_DUP));
+    pair_manifest_destroy(n);
+    remove(fname);
+  }
+
+  // A binary header claiming more pairs than the file holds.
+  strcpy(fname + strlen(fname) - 6, "XXXXXX");
+  fd = mkstemp(fname);
+  fp = fdopen(fd, "wb");
+  const uint32_t none = 0, one = 1;
+  const uint64_t lots = (uint64_t) 1 << 60;
+  fwrite(PAIR_MANIFEST_MAGIC, SZ_PAIR_MANIFEST_MAGIC, 1, fp);
+  fwrite(&none, sizeof none, 1, fp);
+  fwrite(&one, sizeof one, 1, fp);
+  fwrite(&none, sizeof none, 1, fp);
+  fwrite(&lots, sizeof lots, 1, fp);
+  fclose(fp);
+  assert(!pair_manifest_read(fname));
+  remove(fname);
+
+  // From a directory.
+  char dir[] = "/tmp/test_pair_manifest_dir_XXXXXX";
+  assert(mkdtemp(dir));
+  char path[3][256];
+  for(int i=0; i<3; ++i){
+    snprintf(path[i], 256, "%s/%d.jpg", dir, i);
+    fclose(fopen(path[i], "w"));
+  }
+  pair_manifest* d = pair_manifest_create();
+  assert(!pair_manifest_add_dir(d, dir, 0, 0));
+  assert(d->npairs == 6 && d->paths.n == 3);
+  assert(!strcmp(d->paths.strs[d->pairs[3].a], path[0]));
+  assert(!strcmp(d->paths.strs[d->pairs[3].b], path[2]));
+  assert(d->pairs[3].label == PAIR_NONDUP && d->pairs[0].label == PAIR_DUP);
+  pair_manifest_destroy(d);
+  const char* const transforms[2] = {"flip:h", "jpeg:50"};
+  d = pair_manifest_create();
+  assert(!pair_manifest_add_dir(d, dir, transforms, 2));
+  assert(d->npairs == 12 && d->transforms.n == 3);
+  assert(!strcmp(d->transforms.strs[d->pairs[11].transform], "jpeg:50"));
+  pair_manifest_destroy(d);
+  for(int i=0; i<3; ++i) remove(path[i]);
+  remove(dir);
+
+  pair_manifest_destroy(m);
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#elif defined(CMD_PAIR_MANIFEST)
+int main(int argc, char* argv[argc]){
+  int binary=0;
+  char* from=0, * dir=0;
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--binary")) binary = 1;
+    else if(!strcmp(argv[i], "--from") && i+1 < argc) from = argv[++i];
+    else if(!dir) dir = argv[i];
+    else from = dir = 0, i = argc;
+  }
+  if(!from == !dir){
+    fprintf(stderr, "Usage: %s [--binary] {<SOURCE_DIR> | --from <MANIFEST>}\n",
+      argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  pair_manifest* m = from ? pair_manifest_read(from) : pair_manifest_create();
+  if(!m) exit(EXIT_FAILURE);
+  long nerrors = dir ? pair_manifest_add_dir(m, dir, 0, 0) : 0;
+  if(binary ? pair_manifest_write_binary(m, stdout)
+    : pair_manifest_write_tsv(m, stdout)){
+    fprintf(stderr, "Failed to write the manifest.\n");
+    exit(EXIT_FAILURE);
+  }
+  pair_manifest_destroy(m);
+  return nerrors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,823 @@
+/* prefetch.c
+ *
+ * Read whole image files into memory ahead of decode.
+ *
+ * A prefetcher keeps a window of files in flight: open, stat and read into
+ * a buffer from a pool. Completed buffers are handed to the caller, which
+ * decodes them with idhash_buffer while the next files are still being
+ * read, so I/O latency on cold or network storage overlaps with decode.
+ *
+ * There are two back ends with the same interface:
+ *
+ *   io_uring  one ring, driven by the thread that submits paths. openat and
+ *             statx for a file go out together, then reads until the file
+ *             is in memory. Uses the raw system calls from
+ *             <linux/io_uring.h>, so liburing is not needed.
+ *   threads   a few reader threads doing open/fstat/read/close. Used when
+ *             the kernel has no io_uring (or lacks openat/statx/read on
+ *             it), or when asked for.
+ *
+ * Files larger than prefetch_opts::max_size are not read. Their item comes
+ * back with no data, and the caller should open the file by path instead.
+ *
+ * Typical loop, on one thread:
+ *
+ *   while(next path){
+ *     while(prefetch_full(p)) consume(prefetch_next(p, 1));
+ *     prefetch_submit(p, seq++, path);
+ *     while((item = prefetch_next(p, 0))) consume(item);
+ *   }
+ *   while((item = prefetch_next(p, 1))) consume(item);
+ *
+ * consume() may run on any thread, and calls prefetch_release when it is
+ * done with the item.
+ *
+ * Compile test
+ *
+gcc prefetch.c -o test-prefetch -DTEST_PREFETCH -g -Wall -pthread
+ *
+ * Compile benchmark
+ *
+gcc prefetch.c -o prefetch-bench -DCMD_PREFETCH_BENCH -O2 -Wall -pthread
+ *
+ * Benchmark, cold page cache (dropping caches needs root)
+ *
+ * find <DIR> -type f | ./prefetch-bench --drop-caches --window 64
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef ERRNO_H
+#  define ERRNO_H
+#  include <errno.h>
+#endif
+
+#ifndef ASSERT_H
+#  define ASSERT_H
+#  include <assert.h>
+#endif
+
+#ifndef UNISTD_H
+#  define UNISTD_H
+#  include <unistd.h>
+#endif
+
+#ifndef FCNTL_H
+#  define FCNTL_H
+#  include <fcntl.h>
+#endif
+
+#ifndef STAT_H
+#  define STAT_H
+#  include <sys/stat.h>
+#endif
+
+#ifndef MMAN_H
+#  define MMAN_H
+#  include <sys/mman.h>
+#endif
+
+#ifndef SYSCALL_H
+#  define SYSCALL_H
+#  include <sys/syscall.h>
+#endif
+
+#ifndef PTHREAD_H
+#  define PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#ifndef STDINT_H
+#  define STDINT_H
+#  include <stdint.h>
+#endif
+
+#ifndef TIMING_H
+#  define TIMING_H
+#  include "timing.c"
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#  define PREFETCH_HAVE_URING 1
+#  ifndef LINUX_STAT_H
+#    define LINUX_STAT_H
+#    include <linux/stat.h>
+#  endif
+#  ifndef IO_URING_H
+#    define IO_URING_H
+#    include <linux/io_uring.h>
+#  endif
+#else
+#  define PREFETCH_HAVE_URING 0
+#endif
+
+#ifndef PREFETCH_DEFAULT_MAX_SIZE
+#  define PREFETCH_DEFAULT_MAX_SIZE (64<<20)
+#endif
+
+typedef struct prefetch_opts prefetch_opts;
+struct prefetch_opts {
+  int window;       // files in flight at once
+  int threads;      // reader threads for the thread back end, 0 for window
+  int uring;        // 1: io_uring if the kernel has it, 0: threads only
+  size_t max_size;  // larger files are not read, 0 for the default
+};
+
+// A file read (or not) by the prefetcher. @data holds @size bytes, or is 0
+// if the file was too large to prefetch or @err is set.
+typedef struct prefetch_item prefetch_item;
+struct prefetch_item {
+  uint64_t seq;
+  char* path;
+  char* data;
+  size_t size;
+  int err;
+  char* buf;   // pooled buffer behind @data
+  size_t cap;
+  prefetch_item* next;
+};
+
+enum { PREFETCH_OP_OPEN, PREFETCH_OP_STATX, PREFETCH_OP_READ };
+
+#if PREFETCH_HAVE_URING
+// One file in flight on the ring.
+typedef struct prefetch_slot prefetch_slot;
+struct prefetch_slot {
+  prefetch_item* item;
+  int fd;
+  int pending;
+  size_t off;
+  struct statx stx;
+  uint64_t started;  // for the read timing, with IDHASH_TIMING
+};
+#endif
+
+typedef struct prefetch prefetch;
+struct prefetch {
+  prefetch_opts opts;
+  int inflight;  // submitted and not yet returned by prefetch_next
+
+  // Items not in use, shared with the threads calling prefetch_release.
+  pthread_mutex_t pool_lock;
+  prefetch_item* pool;
+
+  // Thread back end: submitted items, and completed items.
+  pthread_t* threads;
+  int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done_cond;
+  prefetch_item* todo;
+  prefetch_item** todo_tail;
+  prefetch_item* done;
+  int stop;
+
+#if PREFETCH_HAVE_URING
+  // io_uring back end, used iff ring_fd >= 0.
+  int ring_fd;
+  void* sq_ring;
+  void* cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+  unsigned to_submit;
+  prefetch_slot* slots;
+  int* free_slots;
+  int nfree_slots;
+  prefetch_item* ready;
+#endif
+};
+
+static prefetch_item* prefetch_item_get(prefetch* p){
+  pthread_mutex_lock(&p->pool_lock);
+  prefetch_item* item = p->pool;
+  if(item) p->pool = item->next;
+  pthread_mutex_unlock(&p->pool_lock);
+  if(!item) item = calloc(1, sizeof(prefetch_item));
+  item->next = 0;
+  item->data = 0;
+  item->size = 0;
+  item->err = 0;
+  return item;
+}
+
+/* Return @item and its buffer to the pool, and free its path. Safe to call
+ * from any thread.
+ */
+void prefetch_release(prefetch* p, prefetch_item* item){
+  free(item->path);
+  item->path = 0;
+  pthread_mutex_lock(&p->pool_lock);
+  item->next = p->pool;
+  p->pool = item;
+  pthread_mutex_unlock(&p->pool_lock);
+}
+
+// Make room for @size bytes plus a terminating '\0' in @item. The buffer
+// only ever grows, so a pooled buffer stops being reallocated once it has
+// seen the largest file of the run.
+static int prefetch_item_reserve(prefetch_item* item, size_t size){
+  if(item->cap <= size){
+    char* buf = realloc(item->buf, size + 1);
+    if(!buf) return -1;
+    item->buf = buf;
+    item->cap = size + 1;
+  }
+  item->data = item->buf;
+  return 0;
+}
+
+// Report a file that wasn't read into memory: as an error, or (when too
+// large) as an item with no data.
+static void prefetch_item_skip(prefetch_item* item, int err){
+  item->err = err;
+  item->data = 0;
+  item->size = 0;
+}
+
+/* Open, stat and read @item->path on the calling thread.
+ */
+static void prefetch_item_read(prefetch* p, prefetch_item* item){
+  TIMING_START(t);
+  struct stat st;
+  int fd = open(item->path, O_RDONLY|O_CLOEXEC);
+  if(0 > fd || fstat(fd, &st)){
+    prefetch_item_skip(item, errno);
+    if(0 <= fd) close(fd);
+    return;
+  }
+  if((size_t) st.st_size > p->opts.max_size){
+    close(fd);
+    return;
+  }
+  if(prefetch_item_reserve(item, st.st_size)){
+    prefetch_item_skip(item, ENOMEM);
+    close(fd);
+    return;
+  }
+  size_t off=0;
+  while(off < (size_t) st.st_size){
+    ssize_t z = read(fd, item->data + off, st.st_size - off);
+    if(0 > z && errno == EINTR) continue;
+    if(0 > z){
+      prefetch_item_skip(item, errno);
+      close(fd);
+      return;
+    }
+    if(!z) break;
+    off += z;
+  }
+  item->size = off;
+  item->data[off] = 0;
+  close(fd);
+  TIMING_STOP(TIMING_READ, t);
+}
+
+static void* prefetch_thread(void* _arg){
+  prefetch* p = (prefetch*) _arg;
+  for(;;){
+    pthread_mutex_lock(&p->lock);
+    while(!p->todo && !p->stop)
+      pthread_cond_wait(&p->work, &p->lock);
+    prefetch_item* item = p->todo;
+    if(!item){
+      pthread_mutex_unlock(&p->lock);
+      break;
+    }
+    if(!(p->todo = item->next)) p->todo_tail = &p->todo;
+    pthread_mutex_unlock(&p->lock);
+
+    prefetch_item_read(p, item);
+
+    pthread_mutex_lock(&p->lock);
+    item->next = p->done;
+    p->done = item;
+    pthread_cond_signal(&p->done_cond);
+    pthread_mutex_unlock(&p->lock);
+  }
+  return 0;
+}
+
+#if PREFETCH_HAVE_URING
+static int prefetch_uring_enter(prefetch* p, unsigned min_complete){
+  unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+  for(;;){
+    int z = syscall(__NR_io_uring_enter, p->ring_fd, p->to_submit,
+      min_complete, flags, 0, 0);
+    if(0 <= z){
+      p->to_submit = (unsigned) z < p->to_submit ? p->to_submit - z : 0;
+      return 0;
+    }
+    if(errno != EINTR && errno != EAGAIN && errno != EBUSY) return -1;
+  }
+}
+
+static struct io_uring_sqe* prefetch_uring_sqe(prefetch* p){
+  unsigned tail = *p->sq_tail;
+  unsigned head = __atomic_load_n(p->sq_head, __ATOMIC_ACQUIRE);
+  // Each slot has at most two operations in flight, and the ring holds
+  // two entries per slot, so this only fills up between submissions.
+  if(tail - head > *p->sq_mask){
+    prefetch_uring_enter(p, 0);
+    head = __atomic_load_n(p->sq_head, __ATOMIC_ACQUIRE);
+  }
+  unsigned idx = tail & *p->sq_mask;
+  struct io_uring_sqe* sqe = p->sqes + idx;
+  memset(sqe, 0, sizeof *sqe);
+  p->sq_array[idx] = idx;
+  return sqe;
+}
+
+static void prefetch_uring_push(prefetch* p){
+  __atomic_store_n(p->sq_tail, *p->sq_tail + 1, __ATOMIC_RELEASE);
+  ++p->to_submit;
+}
+
+static void prefetch_uring_submit_read(prefetch* p, int slot){
+  prefetch_slot* s = p->slots + slot;
+  struct io_uring_sqe* sqe = prefetch_uring_sqe(p);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = s->fd;
+  sqe->addr = (uintptr_t)(s->item->data + s->off);
+  sqe->len = s->item->size - s->off;
+  sqe->off = s->off;
+  sqe->user_data = (uint64_t) slot << 8 | PREFETCH_OP_READ;
+  prefetch_uring_push(p);
+  s->pending = 1;
+}
+
+// Hand a finished slot's item back to the caller.
+static void prefetch_uring_complete(prefetch* p, int slot){
+  prefetch_slot* s = p->slots + slot;
+  if(0 <= s->fd) close(s->fd);
+  if(s->item->data){
+    s->item->data[s->item->size] = 0;
+    TIMING_STOP(TIMING_READ, s->started);
+  }
+  s->item->next = p->ready;
+  p->ready = s->item;
+  s->item = 0;
+  p->free_slots[p->nfree_slots++] = slot;
+}
+
+// Advance a slot's state machine by one completion.
+static void prefetch_uring_cqe(prefetch* p, struct io_uring_cqe* cqe){
+  const int slot = cqe->user_data >> 8, op = cqe->user_data & 0xff;
+  prefetch_slot* s = p->slots + slot;
+  prefetch_item* item = s->item;
+  --s->pending;
+  if(op == PREFETCH_OP_OPEN){
+    if(0 > cqe->res) item->err = -cqe->res;
+    else s->fd = cqe->res;
+  } else if(op == PREFETCH_OP_STATX){
+    if(0 > cqe->res) item->err = -cqe->res;
+  } else {
+    if(0 > cqe->res && cqe->res != -EINTR && cqe->res != -EAGAIN){
+      prefetch_item_skip(item, -cqe->res);
+      prefetch_uring_complete(p, slot);
+      return;
+    }
+    if(!cqe->res) item->size = s->off;  // file shrank
+    else if(0 < cqe->res) s->off += cqe->res;
+    if(s->off < item->size) prefetch_uring_submit_read(p, slot);
+    else prefetch_uring_complete(p, slot);
+    return;
+  }
+  if(s->pending) return;
+
+  // Both openat and statx are back.
+  if(item->err || s->stx.stx_size > p->opts.max_size){
+    prefetch_item_skip(item, item->err);
+    prefetch_uring_complete(p, slot);
+    return;
+  }
+  item->size = s->stx.stx_size;
+  if(prefetch_item_reserve(item, item->size)){
+    prefetch_item_skip(item, ENOMEM);
+    prefetch_uring_complete(p, slot);
+    return;
+  }
+  s->off = 0;
+  if(!item->size) prefetch_uring_complete(p, slot);
+  else prefetch_uring_submit_read(p, slot);
+}
+
+static void prefetch_uring_reap(prefetch* p){
+  unsigned head = *p->cq_head;
+  unsigned tail = __atomic_load_n(p->cq_tail, __ATOMIC_ACQUIRE);
+  for(; head != tail; ++head)
+    prefetch_uring_cqe(p, p->cqes + (head & *p->cq_mask));
+  __atomic_store_n(p->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Check that the kernel supports every operation the ring needs.
+static int prefetch_uring_probe(int fd){
+  const size_t n = sizeof(struct io_uring_probe)
+    + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = calloc(1, n);
+  int ok = !syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+    256);
+  const int ops[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ};
+  for(int i=0; ok && i<3; ++i)
+    ok = ops[i] <= probe->last_op
+      && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return ok;
+}
+
+// Set up the ring. Return 0, or -1 if io_uring can't be used here.
+static int prefetch_uring_init(prefetch* p){
+  struct io_uring_params params={0};
+  p->ring_fd = syscall(__NR_io_uring_setup, 2*p->opts.window, &params);
+  if(0 > p->ring_fd) return -1;
+  if(!prefetch_uring_probe(p->ring_fd)) goto fail;
+
+  p->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  p->cq_ring_size = params.cq_off.cqes
+    + params.cq_entries * sizeof(struct io_uring_cqe);
+  const int single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if(single && p->cq_ring_size > p->sq_ring_size)
+    p->sq_ring_size = p->cq_ring_size;
+  p->sq_ring = mmap(0, p->sq_ring_size, PROT_READ|PROT_WRITE,
+    MAP_SHARED|MAP_POPULATE, p->ring_fd, IORING_OFF_SQ_RING);
+  if(p->sq_ring == MAP_FAILED) goto fail;
+  p->cq_ring = single ? p->sq_ring : mmap(0, p->cq_ring_size,
+    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, p->ring_fd,
+    IORING_OFF_CQ_RING);
+  if(p->cq_ring == MAP_FAILED) goto fail;
+  p->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  p->sqes = mmap(0, p->sqes_size, PROT_READ|PROT_WRITE,
+    MAP_SHARED|MAP_POPULATE, p->ring_fd, IORING_OFF_SQES);
+  if(p->sqes == MAP_FAILED) goto fail;
+
+  char* sq = p->sq_ring, * cq = p->cq_ring;
+  p->sq_head = (unsigned*)(sq + params.sq_off.head);
+  p->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  p->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  p->sq_array = (unsigned*)(sq + params.sq_off.array);
+  p->cq_head = (unsigned*)(cq + params.cq_off.head);
+  p->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  p->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  p->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  p->slots = calloc(p->opts.window, sizeof(prefetch_slot));
+  p->free_slots = calloc(p->opts.window, sizeof(int));
+  for(int i=0; i<p->opts.window; ++i)
+    p->free_slots[p->nfree_slots++] = p->opts.window - 1 - i;
+  return 0;
+
+fail:
+  if(p->sqes && p->sqes != MAP_FAILED) munmap(p->sqes, p->sqes_size);
+  if(p->cq_ring && p->cq_ring != MAP_FAILED && p->cq_ring != p->sq_ring)
+    munmap(p->cq_ring, p->cq_ring_size);
+  if(p->sq_ring && p->sq_ring != MAP_FAILED)
+    munmap(p->sq_ring, p->sq_ring_size);
+  p->sqes = 0;
+  p->sq_ring = p->cq_ring = 0;
+  close(p->ring_fd);
+  p->ring_fd = -1;
+  return -1;
+}
+#endif
+
+/* Create a prefetcher. Uses io_uring if @opts asks for it and the kernel
+ * supports it, else reader threads.
+ */
+prefetch* prefetch_create(const prefetch_opts* opts){
+  prefetch* p = calloc(1, sizeof(prefetch));
+  p->opts = *opts;
+  if(p->opts.window < 1) p->opts.window = 1;
+  if(!p->opts.max_size) p->opts.max_size = PREFETCH_DEFAULT_MAX_SIZE;
+  pthread_mutex_init(&p->pool_lock, 0);
+#if PREFETCH_HAVE_URING
+  p->ring_fd = -1;
+  if(p->opts.uring && !prefetch_uring_init(p)) return p;
+#endif
+  p->opts.uring = 0;
+  pthread_mutex_init(&p->lock, 0);
+  pthread_cond_init(&p->work, 0);
+  pthread_cond_init(&p->done_cond, 0);
+  p->todo_tail = &p->todo;
+  p->nthreads = p->opts.threads > 0 ? p->opts.threads : p->opts.window;
+  p->threads = calloc(p->nthreads, sizeof(pthread_t));
+  for(int i=0; i<p->nthreads; ++i)
+    pthread_create(p->threads+i, 0, prefetch_thread, p);
+  return p;
+}
+
+/* Return 1 if the prefetcher is using io_uring.
+ */
+int prefetch_uses_uring(prefetch* p){
+  return p->opts.uring;
+}
+
+/* Return 1 if the window is full, i.e. prefetch_next has to be called
+ * before the next prefetch_submit.
+ */
+int prefetch_full(prefetch* p){
+  return p->inflight >= p->opts.window;
+}
+
+/* Start reading @path. Takes ownership of @path, which comes back in the
+ * item. Must not be called while prefetch_full.
+ */
+void prefetch_submit(prefetch* p, uint64_t seq, char* path){
+  assert(!prefetch_full(p));
+  prefetch_item* item = prefetch_item_get(p);
+  item->seq = seq;
+  item->path = path;
+  ++p->inflight;
+#if PREFETCH_HAVE_URING
+  if(p->opts.uring){
+    int slot = p->free_slots[--p->nfree_slots];
+    prefetch_slot* s = p->slots + slot;
+    *s = (prefetch_slot){.item = item, .fd = -1, .pending = 2};
+    TIMING_STAMP(s->started);
+
+    struct io_uring_sqe* sqe = prefetch_uring_sqe(p);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) path;
+    sqe->open_flags = O_RDONLY|O_CLOEXEC;
+    sqe->user_data = (uint64_t) slot << 8 | PREFETCH_OP_OPEN;
+    prefetch_uring_push(p);
+
+    sqe = prefetch_uring_sqe(p);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) path;
+    sqe->len = STATX_SIZE;
+    sqe->off = (uintptr_t) &s->stx;
+    sqe->user_data = (uint64_t) slot << 8 | PREFETCH_OP_STATX;
+    prefetch_uring_push(p);
+
+    prefetch_uring_enter(p, 0);
+    return;
+  }
+#endif
+  pthread_mutex_lock(&p->lock);
+  *p->todo_tail = item;
+  p->todo_tail = &item->next;
+  pthread_cond_signal(&p->work);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* Return a completed item, or 0 if none is ready. With @wait, block until
+ * one is ready, and return 0 only when nothing is in flight.
+ */
+prefetch_item* prefetch_next(prefetch* p, int wait){
+  prefetch_item* item=0;
+  if(!p->inflight) return 0;
+#if PREFETCH_HAVE_URING
+  if(p->opts.uring){
+    for(;;){
+      if(p->to_submit) prefetch_uring_enter(p, 0);
+      if(!p->ready) prefetch_uring_reap(p);
+      if(p->ready || !wait) break;
+      if(prefetch_uring_enter(p, 1)){
+        perror("io_uring_enter");
+        exit(EXIT_FAILURE);
+      }
+    }
+    if((item = p->ready)) p->ready = item->next;
+    if(item) --p->inflight;
+    return item;
+  }
+#endif
+  pthread_mutex_lock(&p->lock);
+  while(wait && !p->done)
+    pthread_cond_wait(&p->done_cond, &p->lock);
+  if((item = p->done)) p->done = item->next;
+  pthread_mutex_unlock(&p->lock);
+  if(item) --p->inflight;
+  return item;
+}
+
+/* Destroy the prefetcher. Everything submitted must have come back from
+ * prefetch_next and been released.
+ */
+void prefetch_destroy(prefetch* p){
+  assert(!p->inflight);
+#if PREFETCH_HAVE_URING
+  if(0 <= p->ring_fd){
+    munmap(p->sqes, p->sqes_size);
+    if(p->cq_ring != p->sq_ring) munmap(p->cq_ring, p->cq_ring_size);
+    munmap(p->sq_ring, p->sq_ring_size);
+    close(p->ring_fd);
+    free(p->slots);
+    free(p->free_slots);
+  }
+#endif
+  if(p->threads){
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for(int i=0; i<p->nthreads; ++i)
+      pthread_join(p->threads[i], 0);
+    free(p->threads);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work);
+    pthread_cond_destroy(&p->done_cond);
+  }
+  for(prefetch_item* item = p->pool, * next; item; item = next){
+    next = item->next;
+    free(item->buf);
+    free(item);
+  }
+  pthread_mutex_destroy(&p->pool_lock);
+  free(p);
+}
+
+#ifdef TEST_PREFETCH
+// Write @n bytes of a pattern that depends on @i to @path.
+static void write_test_file(const char* path, int i, size_t n){
+  FILE* fp = fopen(path, "wb");
+  assert(fp);
+  for(size_t k=0; k<n; ++k) fputc((int)((i*31 + k) & 0xff), fp);
+  fclose(fp);
+}
+
+static void check_item(prefetch_item* item, size_t* sizes, size_t max_size){
+  const int i = item->seq;
+  if(!sizes[i]){
+    // The missing file.
+    assert(item->err == ENOENT && !item->size);
+  } else if(sizes[i] > max_size){
+    assert(!item->err && !item->data && !item->size);
+  } else {
+    assert(!item->err && item->data && item->size == sizes[i]);
+    for(size_t k=0; k<item->size; ++k)
+      assert((unsigned char) item->data[k] == ((i*31 + k) & 0xff));
+  }
+}
+
+int main(){
+  char dir[] = "/tmp/test_prefetch_XXXXXX";
+  assert(mkdtemp(dir));
+  enum { N = 40 };
+  size_t sizes[N]={0};
+  char paths[N][256];
+  for(int i=0; i<N; ++i){
+    snprintf(paths[i], 256, "%s/%d", dir, i);
+    sizes[i] = i == 7 ? 0 : 1 + (size_t) i * 9973;
+    if(sizes[i]) write_test_file(paths[i], i, sizes[i]);
+  }
+  const size_t max_size = 300000;
+
+  for(int uring=0; uring<2; ++uring){
+    for(int window=1; window<=16; window*=4){
+      prefetch_opts opts = {window, 2, uring, max_size};
+      prefetch* p = prefetch_create(&opts);
+      if(uring && !prefetch_uses_uring(p))
+        fprintf(stderr, "io_uring not available, testing threads twice\n");
+      int seen[N]={0};
+      prefetch_item* item;
+      for(int i=0; i<N; ++i){
+        while(prefetch_full(p)){
+          item = prefetch_next(p, 1);
+          check_item(item, sizes, max_size);
+          ++seen[item->seq];
+          prefetch_release(p, item);
+        }
+        prefetch_submit(p, i, strdup(paths[i]));
+      }
+      while((item = prefetch_next(p, 1))){
+        check_item(item, sizes, max_size);
+        ++seen[item->seq];
+        prefetch_release(p, item);
+      }
+      for(int i=0; i<N; ++i) assert(seen[i] == 1);
+      prefetch_destroy(p);
+    }
+  }
+
+  for(int i=0; i<N; ++i) if(sizes[i]) remove(paths[i]);
+  assert(!remove(dir));
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#elif defined(CMD_PREFETCH_BENCH)
+#ifndef TIME_H
+#  define TIME_H
+#  include <time.h>
+#endif
+
+static double now(){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+static void drop_caches(){
+  sync();
+  FILE* fp = fopen("/proc/sys/vm/drop_caches", "w");
+  if(!fp || EOF == fputs("3\n", fp) || fclose(fp)){
+    perror("drop_caches (needs root)");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Read every file with plain read(), one at a time: the baseline.
+static void bench_serial(char** paths, size_t n, size_t* bytes){
+  prefetch_opts opts = {1, 1, 0, 0};
+  prefetch p = {.opts = opts};
+  p.opts.max_size = PREFETCH_DEFAULT_MAX_SIZE;
+  prefetch_item item={0};
+  for(size_t i=0; i<n; ++i){
+    item.path = paths[i];
+    item.data = 0;
+    item.size = 0;
+    prefetch_item_read(&p, &item);
+    *bytes += item.size;
+  }
+  free(item.buf);
+}
+
+static void bench_prefetch(char** paths, size_t n, size_t* bytes,
+  prefetch_opts* opts, const char** mode)
+{
+  prefetch* p = prefetch_create(opts);
+  *mode = prefetch_uses_uring(p) ? "io_uring" : "threads";
+  prefetch_item* item;
+  for(size_t i=0; i<n; ++i){
+    while(prefetch_full(p)){
+      item = prefetch_next(p, 1);
+      *bytes += item->size;
+      prefetch_release(p, item);
+    }
+    prefetch_submit(p, i, strdup(paths[i]));
+  }
+  while((item = prefetch_next(p, 1))){
+    *bytes += item->size;
+    prefetch_release(p, item);
+  }
+  prefetch_destroy(p);
+}
+
+int main(int argc, char* argv[argc]){
+  int window=64, threads=0, drop=0;
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--window") && i+1 < argc) window = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--threads") && i+1 < argc)
+      threads = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--drop-caches")) drop = 1;
+    else {
+      fprintf(stderr, "Usage: %s [--window <N>] [--threads <N>] "
+        "[--drop-caches] < PATHS\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  char** paths=0, * line=0;
+  size_t n=0, cap=0, len=0;
+  ssize_t z;
+  while(0 < (z = getline(&line, &len, stdin))){
+    if(line[z-1] == '\n') line[--z] = 0;
+    if(!z) continue;
+    if(n == cap) paths = realloc(paths, (cap = cap ? 2*cap : 1024)
+      * sizeof(char*));
+    paths[n++] = strdup(line);
+  }
+  free(line);
+
+  printf("# mode window files bytes seconds files/s MB/s\n");
+  for(int run=0; run<3; ++run){
+    size_t bytes=0;
+    const char* mode = "serial";
+    prefetch_opts opts = {window, threads, run == 2, 0};
+    if(drop) drop_caches();
+    double t = now();
+    if(run == 0) bench_serial(paths, n, &bytes);
+    else bench_prefetch(paths, n, &bytes, &opts, &mode);
+    t = now() - t;
+    printf("%s %d %zu %zu %.3f %.1f %.1f\n", mode, run ? window : 1, n, bytes,
+      t, n / t, bytes / t / 1e6);
+  }
+  for(size_t i=0; i<n; ++i) free(paths[i]);
+  free(paths);
+  return EXIT_SUCCESS;
+}
+#endif
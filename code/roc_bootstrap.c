@@ -0,0 +1,573 @@
+/* roc_bootstrap.c
+ *
+ * How stable is the ROC optimum? Resample the pairs many times and look at
+ * the spread of the AUC, of the optimal threshold, and of the TPR and FPR at
+ * each threshold.
+ *
+ * IDHash distances are integers in [0, 128], so the duplicate and
+ * non-duplicate scores are kept as two 129-bin histograms, and a whole ROC
+ * curve is two cumulative sums over them. Replicates use the Poisson
+ * bootstrap: each pair is drawn Poisson(1) times instead of sampling n pairs
+ * with replacement, which makes each bin's count an independent
+ * Poisson(count) draw. A replicate then costs 2 x 129 draws however many
+ * pairs there are, and millions of pairs resample as fast as a hundred.
+ *
+ * Replicates are split over threads, each with its own xoshiro256** RNG and
+ * its own histogram of optimal thresholds. Results are reproducible for the
+ * same seed and number of threads.
+ *
+ * Compile test
+ *
+gcc roc_bootstrap.c -o test-roc-bootstrap -DTEST_ROC_BOOTSTRAP -g -Wall -pthread `pkg-config vips --cflags --libs` -lm
+ *
+ * Compile
+ *
+gcc roc_bootstrap.c -o roc-bootstrap -DCMD_ROC_BOOTSTRAP -g -Wall -pthread `pkg-config vips --cflags --libs` -lm
+ *
+ * Usage
+ *
+ * ./roc-bootstrap [--profile <NAME>] [--replicates <B>] [--jobs <N>]
+ *     [--seed <S>] [--level <L>] {<DUP_DATA_FILE> <NONDUP_DATA_FILE> |
+ *     --manifest <MANIFEST> [--metric <NAME>[,<NAME>...]]}
+ *
+ * Data files are those written by idhash_directory; each row counts as its
+ * mean distance. A manifest is hashed first (see idhash_pairs.c). Prints the
+ * AUC, the optimal threshold and how often each threshold was optimal, and
+ * a table of TPR and FPR with L (default 0.95) confidence intervals per
+ * threshold.
+ *
+ * With --metric, a manifest's pairs are scored under each of the metrics
+ * (see metric.c) from the same hashes, and there's one report per metric,
+ * headed by its name, two blank lines apart.
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef STDINT_H
+#  define STDINT_H
+#  include <stdint.h>
+#endif
+
+#ifndef MATH_H
+#  define MATH_H
+#  include <math.h>
+#endif
+
+#ifndef PTHREAD_H
+#  define PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#ifndef IDHASH_PAIRS_H
+#  define IDHASH_PAIRS_H
+#  include "idhash_pairs.c"
+#endif
+
+// Distances 0 through 128, for any metric.
+#define ROC_NBINS (METRIC_MAX + 1)
+
+#ifndef ROC_BOOTSTRAP_DEFAULT_REPLICATES
+#  define ROC_BOOTSTRAP_DEFAULT_REPLICATES 10000
+#endif
+
+// Count of pairs at each distance.
+typedef struct roc_histogram roc_histogram;
+struct roc_histogram {
+  uint64_t count[ROC_NBINS];
+  uint64_t n;
+};
+
+/* Add @n distances from @scores to @h. Distances over 128 go in the last bin.
+ */
+void roc_histogram_add_scores(roc_histogram* h, const guint* scores, size_t n){
+  for(size_t i=0; i<n; ++i)
+    ++h->count[scores[i] < ROC_NBINS ? scores[i] : ROC_NBINS-1];
+  h->n += n;
+}
+
+/* Add the rows of the idhash_directory data file @fname to @h, each at its
+ * mean distance rounded to the nearest integer. Exit if the file can't be
+ * read.
+ */
+void roc_histogram_add_data_file(roc_histogram* h, const char* fname){
+  FILE* fp = fopen(fname, "r");
+  if(!fp){
+    fprintf(stderr, "Failed to open data file %s\n", fname);
+    exit(EXIT_FAILURE);
+  }
+  int nfiles=0, ndata=0;
+  idhash_stats_parse_header(&nfiles, &ndata, fp);
+  idhash_stats stats={0};  // data isn't parsed, so static alloc is fine
+  char* line=0;
+  size_t len=0;
+  while(0 < getline(&line, &len, fp)){
+    idhash_stats_parse_line(&stats, line);
+    const guint d = stats.mean + 0.5;
+    roc_histogram_add_scores(h, &d, 1);
+  }
+  free(line);
+  fclose(fp);
+}
+
+/* The ROC point of threshold @t for histograms @dup and @nondup: a pair is
+ * called a duplicate if its distance is at most @t.
+ */
+static void roc_histogram_rates(
+  const roc_histogram* dup,
+  const roc_histogram* nondup,
+  double tpr[ROC_NBINS],
+  double fpr[ROC_NBINS])
+{
+  uint64_t tp=0, fp=0;
+  for(int t=0; t<ROC_NBINS; ++t){
+    tp += dup->count[t];
+    fp += nondup->count[t];
+    tpr[t] = dup->n ? (double) tp / dup->n : -1;
+    fpr[t] = nondup->n ? (double) fp / nondup->n : -1;
+  }
+}
+
+/* The area under the ROC curve: the probability that a random duplicate pair
+ * is closer than a random non-duplicate pair, ties counting half.
+ */
+double roc_histogram_auc(const roc_histogram* dup, const roc_histogram* nondup){
+  if(!dup->n || !nondup->n) return -1;
+  double sum=0;
+  uint64_t farther = nondup->n;  // non-duplicates with distance > t
+  for(int t=0; t<ROC_NBINS; ++t){
+    farther -= nondup->count[t];
+    sum += dup->count[t] * (farther + 0.5 * nondup->count[t]);
+  }
+  return sum / dup->n / nondup->n;
+}
+
+/* The threshold closest to (0, 1), as roc_optimal_threshold picks it.
+ */
+int roc_histogram_optimal_threshold(
+  const roc_histogram* dup,
+  const roc_histogram* nondup)
+{
+  double tpr[ROC_NBINS], fpr[ROC_NBINS], dmin=DBL_MAX;
+  int best=0;
+  roc_histogram_rates(dup, nondup, tpr, fpr);
+  for(int t=0; t<ROC_NBINS; ++t){
+    roc_point p = {fpr[t], tpr[t]};
+    const double d = roc_square_distance_to_optimal(&p);
+    if(dmin > d){
+      dmin = d;
+      best = t;
+    }
+  }
+  return best;
+}
+
+// xoshiro256**, seeded through splitmix64.
+typedef struct roc_rng roc_rng;
+struct roc_rng {
+  uint64_t s[4];
+};
+
+static uint64_t roc_rng_rotl(uint64_t x, int k){
+  return x << k | x >> (64 - k);
+}
+
+void roc_rng_seed(roc_rng* r, uint64_t seed){
+  for(int i=0; i<4; ++i){
+    uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    r->s[i] = z ^ (z >> 31);
+  }
+}
+
+uint64_t roc_rng_next(roc_rng* r){
+  uint64_t* s = r->s;
+  const uint64_t result = roc_rng_rotl(s[1] * 5, 7) * 9, t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = roc_rng_rotl(s[3], 45);
+  return result;
+}
+
+/* Uniform in [0, 1).
+ */
+double roc_rng_uniform(roc_rng* r){
+  return (roc_rng_next(r) >> 11) * 0x1.0p-53;
+}
+
+/* A Poisson(@lambda) draw: multiplication of uniforms for small @lambda, and
+ * Hoermann's transformed rejection (PTRS) otherwise, which takes about one
+ * iteration whatever @lambda is.
+ */
+uint64_t roc_rng_poisson(roc_rng* r, double lambda){
+  if(lambda <= 0) return 0;
+  if(lambda < 10){
+    const double limit = exp(-lambda);
+    uint64_t k=0;
+    for(double p = roc_rng_uniform(r); p > limit; p *= roc_rng_uniform(r))
+      ++k;
+    return k;
+  }
+  const double slam = sqrt(lambda), loglam = log(lambda);
+  const double b = 0.931 + 2.53 * slam, a = -0.059 + 0.02483 * b;
+  const double invalpha = 1.1239 + 1.1328 / (b - 3.4);
+  const double vr = 0.9277 - 3.6224 / (b - 2);
+  int sign;  // lgamma_r instead of lgamma, which sets the global signgam
+  for(;;){
+    const double u = roc_rng_uniform(r) - 0.5, v = roc_rng_uniform(r);
+    const double us = 0.5 - fabs(u);
+    const double k = floor((2 * a / us + b) * u + lambda + 0.43);
+    if(us >= 0.07 && v <= vr) return k;
+    if(k < 0 || (us < 0.013 && v > us)) continue;
+    if(log(v) + log(invalpha) - log(a / (us * us) + b)
+      <= -lambda + k * loglam - lgamma_r(k + 1, &sign))
+      return k;
+  }
+}
+
+/* A Poisson bootstrap replicate of @h.
+ */
+void roc_histogram_resample(
+  const roc_histogram* h,
+  roc_histogram* out,
+  roc_rng* r)
+{
+  out->n = 0;
+  for(int t=0; t<ROC_NBINS; ++t)
+    out->n += out->count[t] = roc_rng_poisson(r, h->count[t]);
+}
+
+typedef struct roc_bootstrap_opts roc_bootstrap_opts;
+struct roc_bootstrap_opts {
+  int replicates;  // 0 for ROC_BOOTSTRAP_DEFAULT_REPLICATES
+  int jobs;        // threads, or 0 for one per online CPU
+  uint64_t seed;
+  double level;    // confidence level of the intervals, 0 for 0.95
+};
+
+typedef struct roc_bootstrap roc_bootstrap;
+struct roc_bootstrap {
+  int replicates;
+  double level;
+  // Point estimates from the data itself.
+  double auc;
+  int threshold;
+  double tpr[ROC_NBINS];
+  double fpr[ROC_NBINS];
+  // Bootstrap distributions.
+  double auc_mean;
+  double auc_lo;
+  double auc_hi;
+  uint64_t threshold_count[ROC_NBINS];  // replicates where t was optimal
+  int threshold_lo;
+  int threshold_hi;
+  double tpr_lo[ROC_NBINS];
+  double tpr_hi[ROC_NBINS];
+  double fpr_lo[ROC_NBINS];
+  double fpr_hi[ROC_NBINS];
+};
+
+typedef struct roc_bootstrap_work roc_bootstrap_work;
+struct roc_bootstrap_work {
+  const roc_histogram* dup;
+  const roc_histogram* nondup;
+  int begin;             // replicates [begin, end) are this thread's
+  int end;
+  uint64_t seed;
+  double* auc;           // per replicate, shared, disjoint ranges
+  float* tpr;            // per replicate x threshold
+  float* fpr;
+  uint64_t threshold_count[ROC_NBINS];  // this thread's only
+};
+
+static void* roc_bootstrap_worker(void* _arg){
+  roc_bootstrap_work* w = (roc_bootstrap_work*) _arg;
+  roc_rng rng;
+  roc_rng_seed(&rng, w->seed);
+  roc_histogram dup, nondup;
+  double tpr[ROC_NBINS], fpr[ROC_NBINS];
+  for(int i = w->begin; i < w->end; ++i){
+    // A replicate with no duplicates or no non-duplicates has no ROC curve:
+    // draw it again. Only likely with a handful of pairs.
+    do {
+      roc_histogram_resample(w->dup, &dup, &rng);
+      roc_histogram_resample(w->nondup, &nondup, &rng);
+    } while(w->dup->n && w->nondup->n && (!dup.n || !nondup.n));
+    w->auc[i] = roc_histogram_auc(&dup, &nondup);
+    ++w->threshold_count[roc_histogram_optimal_threshold(&dup, &nondup)];
+    roc_histogram_rates(&dup, &nondup, tpr, fpr);
+    for(int t=0; t<ROC_NBINS; ++t){
+      w->tpr[(size_t) i * ROC_NBINS + t] = tpr[t];
+      w->fpr[(size_t) i * ROC_NBINS + t] = fpr[t];
+    }
+  }
+  return 0;
+}
+
+static int roc_bootstrap_cmp_double(const void* a, const void* b){
+  const double x = *(const double*) a, y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+/* The @q quantile of the sorted @x, interpolating between neighbours.
+ */
+static double roc_bootstrap_quantile(const double* x, int n, double q){
+  const double pos = q * (n - 1);
+  const int i = pos;
+  return i+1 < n ? x[i] + (pos - i) * (x[i+1] - x[i]) : x[n-1];
+}
+
+/* Resample @dup and @nondup @opts->replicates times on @opts->jobs threads,
+ * and summarize into @res.
+ */
+roc_bootstrap* roc_bootstrap_run(
+  roc_bootstrap* res,
+  const roc_histogram* dup,
+  const roc_histogram* nondup,
+  const roc_bootstrap_opts* opts)
+{
+  memset(res, 0, sizeof(roc_bootstrap));
+  const int b = res->replicates = opts->replicates > 0 ? opts->replicates
+    : ROC_BOOTSTRAP_DEFAULT_REPLICATES;
+  res->level = opts->level > 0 && opts->level < 1 ? opts->level : 0.95;
+  res->auc = roc_histogram_auc(dup, nondup);
+  res->threshold = roc_histogram_optimal_threshold(dup, nondup);
+  roc_histogram_rates(dup, nondup, res->tpr, res->fpr);
+
+  double* auc = calloc(b, sizeof(double));
+  float* tpr = calloc((size_t) b * ROC_NBINS, sizeof(float));
+  float* fpr = calloc((size_t) b * ROC_NBINS, sizeof(float));
+  int jobs = opts->jobs > 0 ? opts->jobs : dir_walk_ncpus();
+  if(jobs > b) jobs = b;
+  roc_bootstrap_work* work = calloc(jobs, sizeof(roc_bootstrap_work));
+  pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+  for(int i=0; i<jobs; ++i){
+    work[i] = (roc_bootstrap_work){dup, nondup, (int64_t) b * i / jobs,
+      (int64_t) b * (i+1) / jobs, opts->seed + i, auc, tpr, fpr};
+    pthread_create(threads+i, 0, roc_bootstrap_worker, work+i);
+  }
+  for(int i=0; i<jobs; ++i){
+    pthread_join(threads[i], 0);
+    for(int t=0; t<ROC_NBINS; ++t)
+      res->threshold_count[t] += work[i].threshold_count[t];
+  }
+  free(threads);
+  free(work);
+
+  const double lo = (1 - res->level) / 2, hi = 1 - lo;
+  for(int i=0; i<b; ++i) res->auc_mean += auc[i] / b;
+  qsort(auc, b, sizeof(double), roc_bootstrap_cmp_double);
+  res->auc_lo = roc_bootstrap_quantile(auc, b, lo);
+  res->auc_hi = roc_bootstrap_quantile(auc, b, hi);
+
+  // Thresholds: the central @level of the optimal threshold's distribution.
+  uint64_t cum=0;
+  res->threshold_lo = -1;
+  for(int t=0; t<ROC_NBINS; ++t){
+    cum += res->threshold_count[t];
+    if(res->threshold_lo < 0 && cum > lo * b) res->threshold_lo = t;
+    if(cum >= hi * b){
+      res->threshold_hi = t;
+      break;
+    }
+  }
+
+  // Reuse the AUC buffer for one column of rates at a time.
+  for(int t=0; t<ROC_NBINS; ++t){
+    for(int i=0; i<b; ++i) auc[i] = tpr[(size_t) i * ROC_NBINS + t];
+    qsort(auc, b, sizeof(double), roc_bootstrap_cmp_double);
+    res->tpr_lo[t] = roc_bootstrap_quantile(auc, b, lo);
+    res->tpr_hi[t] = roc_bootstrap_quantile(auc, b, hi);
+    for(int i=0; i<b; ++i) auc[i] = fpr[(size_t) i * ROC_NBINS + t];
+    qsort(auc, b, sizeof(double), roc_bootstrap_cmp_double);
+    res->fpr_lo[t] = roc_bootstrap_quantile(auc, b, lo);
+    res->fpr_hi[t] = roc_bootstrap_quantile(auc, b, hi);
+  }
+  free(auc);
+  free(tpr);
+  free(fpr);
+  return res;
+}
+
+/* Print @res to @fp: the AUC and threshold with intervals, how often each
+ * threshold was optimal, and the per-threshold rates, in gnuplot columns.
+ */
+void roc_bootstrap_print(const roc_bootstrap* res, FILE* fp){
+  const int pct = 100 * res->level + 0.5;
+  fprintf(fp, "# replicates: %d\n", res->replicates);
+  fprintf(fp, "# auc: %f    mean: %f    %d%% ci: [%f, %f]\n", res->auc,
+    res->auc_mean, pct, res->auc_lo, res->auc_hi);
+  fprintf(fp, "# threshold: %d    %d%% ci: [%d, %d]\n", res->threshold, pct,
+    res->threshold_lo, res->threshold_hi);
+  fprintf(fp, "# optimal threshold distribution: threshold replicates "
+    "fraction\n");
+  for(int t=0; t<ROC_NBINS; ++t)
+    if(res->threshold_count[t])
+      fprintf(fp, "#   %d %" PRIu64 " %f\n", t, res->threshold_count[t],
+        (double) res->threshold_count[t] / res->replicates);
+  fprintf(fp, "# threshold FPR FPR_lo FPR_hi TPR TPR_lo TPR_hi\n");
+  for(int t=0; t<ROC_NBINS; ++t)
+    fprintf(fp, "%d %f %f %f %f %f %f\n", t, res->fpr[t], res->fpr_lo[t],
+      res->fpr_hi[t], res->tpr[t], res->tpr_lo[t], res->tpr_hi[t]);
+}
+
+#ifdef TEST_ROC_BOOTSTRAP
+int main(){
+  // Poisson draws have the right mean on both sides of the switch.
+  roc_rng rng;
+  roc_rng_seed(&rng, 1);
+  const double lambdas[] = {0.5, 3, 9.9, 10, 40, 1e5};
+  for(size_t j=0; j < sizeof lambdas / sizeof *lambdas; ++j){
+    double sum=0;
+    const int n = 20000;
+    for(int i=0; i<n; ++i) sum += roc_rng_poisson(&rng, lambdas[j]);
+    const double mean = sum / n;
+    assert(fabs(mean - lambdas[j]) < 5 * sqrt(lambdas[j] / n));
+  }
+
+  // Duplicates around 10, non-duplicates around 40, overlapping a little.
+  roc_histogram dup={0}, nondup={0};
+  for(int t=0; t<ROC_NBINS; ++t){
+    dup.count[t] = 1000 * exp(-(t-10)*(t-10) / 50.);
+    nondup.count[t] = 1000 * exp(-(t-40)*(t-40) / 100.);
+    dup.n += dup.count[t];
+    nondup.n += nondup.count[t];
+  }
+  roc_histogram same = dup;
+  assert(fabs(roc_histogram_auc(&dup, &same) - 0.5) < 1e-12);
+  const double auc = roc_histogram_auc(&dup, &nondup);
+  assert(0.95 < auc && auc < 1);
+  // The same threshold roc_optimal_threshold finds from the raw scores.
+  guint* scores[2] = {calloc(dup.n, sizeof(guint)),
+    calloc(nondup.n, sizeof(guint))};
+  size_t k[2]={0};
+  for(int t=0; t<ROC_NBINS; ++t){
+    for(uint64_t i=0; i<dup.count[t]; ++i) scores[0][k[0]++] = t;
+    for(uint64_t i=0; i<nondup.count[t]; ++i) scores[1][k[1]++] = t;
+  }
+  roc_source* source = roc_source_create();
+  roc_source_init_scores(source, scores[0], k[0], scores[1], k[1]);
+  guint range[2] = {0, ROC_NBINS}, threshold=0;
+  roc_optimal_threshold(&threshold, source, range);
+  roc_source_destroy(source);
+  assert((int) threshold == roc_histogram_optimal_threshold(&dup, &nondup));
+
+  roc_bootstrap_opts opts = {2000, 4, 7};
+  roc_bootstrap* res = calloc(1, sizeof(roc_bootstrap));
+  roc_bootstrap_run(res, &dup, &nondup, &opts);
+  assert(res->auc_lo <= res->auc && res->auc <= res->auc_hi);
+  assert(res->auc_hi - res->auc_lo < 0.02);
+  assert(res->threshold_lo <= res->threshold
+    && res->threshold <= res->threshold_hi);
+  uint64_t total=0;
+  for(int t=0; t<ROC_NBINS; ++t){
+    total += res->threshold_count[t];
+    assert(res->tpr_lo[t] <= res->tpr_hi[t]);
+    assert(res->fpr_lo[t] <= res->fpr_hi[t]);
+  }
+  assert(total == 2000);
+  // Reproducible for a seed and thread count.
+  roc_bootstrap* again = calloc(1, sizeof(roc_bootstrap));
+  roc_bootstrap_run(again, &dup, &nondup, &opts);
+  assert(!memcmp(res, again, sizeof(roc_bootstrap)));
+  roc_bootstrap_print(res, stdout);
+  free(res);
+  free(again);
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#elif defined(CMD_ROC_BOOTSTRAP)
+int main(int argc, char* argv[argc]){
+  vips_profile profile={0};
+  vips_profile_parse_args(&profile, DEFAULT_VIPS_PROFILE, &argc, argv);
+  roc_bootstrap_opts opts={0};
+  char* manifest=0, * files[2]={0};
+  int nfiles=0, nmetrics=1, named=0;
+  const metric* metrics[METRIC_COUNT] = {metric_registry};
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--replicates") && i+1 < argc)
+      opts.replicates = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--jobs") && i+1 < argc)
+      opts.jobs = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--seed") && i+1 < argc)
+      opts.seed = strtoull(argv[++i], 0, 0);
+    else if(!strcmp(argv[i], "--level") && i+1 < argc)
+      opts.level = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--manifest") && i+1 < argc)
+      manifest = argv[++i];
+    else if(!strcmp(argv[i], "--metric") && i+1 < argc){
+      nmetrics = metric_parse_list(argv[++i], metrics, METRIC_COUNT);
+      if(nmetrics < 0) exit(EXIT_FAILURE);
+      named = 1;
+    }
+    else if(nfiles < 2) files[nfiles++] = argv[i];
+    else nfiles = 3, i = argc;
+  }
+  if(manifest ? nfiles : nfiles != 2 || named){
+    fprintf(stderr, "Usage: %s [--profile <NAME>] [--replicates <B>] "
+      "[--jobs <N>] [--seed <S>] "
+      "[--level <L>] {<DUP_DATA_FILE> <NONDUP_DATA_FILE> | "
+      "--manifest <MANIFEST> [--metric <NAME>[,<NAME>...]]}\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  roc_histogram dup[METRIC_COUNT]={{{0}}}, nondup[METRIC_COUNT]={{{0}}};
+  if(manifest){
+    if(VIPS_INIT(argv[0]))
+      vips_error_exit(NULL);
+    vips_profile_apply(&profile);
+    pair_manifest* m = pair_manifest_read(manifest);
+    if(!m) exit(EXIT_FAILURE);
+    idhash_pairs_opts pairs_opts = {opts.jobs};
+    idhash_pairs* p = idhash_pairs_run(m, &pairs_opts);
+    guint* dist[METRIC_COUNT];
+    for(int j=0; j<nmetrics; ++j)
+      dist[j] = calloc(m->npairs + 1, sizeof(guint));
+    idhash_pairs_score_metrics(p, metrics, nmetrics, dist);
+    for(int j=0; j<nmetrics; ++j){
+      size_t n;
+      guint* scores = idhash_pairs_select(p, dist[j], PAIR_DUP, &n);
+      roc_histogram_add_scores(dup + j, scores, n);
+      free(scores);
+      scores = idhash_pairs_select(p, dist[j], PAIR_NONDUP, &n);
+      roc_histogram_add_scores(nondup + j, scores, n);
+      free(scores);
+      free(dist[j]);
+    }
+    idhash_pairs_destroy(p);
+    pair_manifest_destroy(m);
+  } else {
+    roc_histogram_add_data_file(dup, files[0]);
+    roc_histogram_add_data_file(nondup, files[1]);
+  }
+  if(!dup->n || !nondup->n){
+    fprintf(stderr, "Need both duplicate and non-duplicate pairs.\n");
+    exit(EXIT_FAILURE);
+  }
+  roc_bootstrap* res = calloc(1, sizeof(roc_bootstrap));
+  for(int j=0; j<nmetrics; ++j){
+    if(named) printf("%s# metric: %s\n", j ? "\n\n" : "", metrics[j]->name);
+    roc_bootstrap_run(res, dup + j, nondup + j, &opts);
+    roc_bootstrap_print(res, stdout);
+  }
+  free(res);
+  return EXIT_SUCCESS;
+}
+#endif
@@ -62,6 +62,12 @@ void roc_point_parse_dup_file(
 {
   // Counts of true positives and false negatives.
   int tp=0, fn=0;
+  if(source->dup_scores){
+    for(size_t i=0; i<source->ndup; ++i)
+      source->dup_scores[i] > threshold ? ++fn : ++tp;
+    point->tpr = (tp + fn) ? (double) tp / (tp + fn) : -1;
+    return;
+  }
   // The idhash_stats::data field of @stats is empty, so static alloc fine.
   idhash_stats stats={0}; 
   // Read lines until end of file, or a getline error.
@@ -92,6 +98,12 @@ void roc_point_parse_nondup_file(
 {
   // counters for true negatives and false positives.
   int tn=0, fp=0;
+  if(source->nondup_scores){
+    for(size_t i=0; i<source->nnondup; ++i)
+      source->nondup_scores[i] > threshold ? ++tn : ++fp;
+    point->fpr = (fp + tn) ? (double) fp / (fp + tn) : -1;
+    return;
+  }
 
   idhash_stats stats={0};
   
@@ -36,16 +36,34 @@ roc_source* roc_source_init(
   return source;
 }
 
+roc_source* roc_source_init_scores(
+  roc_source* source,
+  guint* dup_scores,
+  size_t ndup,
+  guint* nondup_scores,
+  size_t nnondup)
+{
+  source->dup_scores = dup_scores;
+  source->ndup = ndup;
+  source->nondup_scores = nondup_scores;
+  source->nnondup = nnondup;
+  return source;
+}
+
 roc_source* roc_source_destroy(roc_source* source){
   if(source->dupname) free(source->dupname);
   if(source->nondupname) free(source->nondupname);
-  fclose(source->fp_dup);
-  fclose(source->fp_nondup);
+  if(source->fp_dup) fclose(source->fp_dup);
+  if(source->fp_nondup) fclose(source->fp_nondup);
+  free(source->dup_scores);
+  free(source->nondup_scores);
   free(source);
   return source;
 }
 
 roc_source* roc_source_reset_fp(roc_source* source){
+  // Nothing to rewind for scores held in memory.
+  if(!source->fp_dup && !source->fp_nondup) return source;
   if(fclose(source->fp_dup) 
     || !(source->fp_dup = fopen(source->dupname, "r")))
   {
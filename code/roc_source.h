@@ -21,8 +21,8 @@
  */
 
 
-#ifndef ROC_SOURCE_H
-#  define ROC_SOURCE_H
+#ifndef ROC_SOURCE_H_INCLUDED
+#  define ROC_SOURCE_H_INCLUDED
 
 #  ifndef STDLIB_H
 #    define STDLIB_H
@@ -55,12 +55,24 @@ typedef struct roc_source roc_source;
  *  @var roc_source::nondupname non-duplicates data file name 
  *  @var roc_source::fp_dup duplicates data file pointer
  *  @var roc_source::fp_nondup non-duplicates data file pointer
+ *  @var roc_source::dup_scores duplicate distances held in memory, or NULL
+ *  @var roc_source::ndup number of duplicate distances
+ *  @var roc_source::nondup_scores non-duplicate distances held in memory, or
+ *  NULL
+ *  @var roc_source::nnondup number of non-duplicate distances
+ *
+ *  A source is either a pair of data files or a pair of score arrays (e.g.
+ *  from idhash_pairs.c). The file fields are NULL for the latter.
  */
 struct roc_source {
   char* dupname;
   char* nondupname;
   FILE* fp_dup;
   FILE* fp_nondup;
+  guint* dup_scores;
+  size_t ndup;
+  guint* nondup_scores;
+  size_t nnondup;
 };
 
 /** @brief Create a new empty roc_source.
@@ -73,6 +85,13 @@ roc_source* roc_source_create();
  */
 roc_source* roc_source_init(roc_source* source, char* dupname, char* nondupname);
 
+/** @brief Initialize an roc_source from distances held in memory, taking
+ *  ownership of the arrays.
+ *  @return roc_source*
+ */
+roc_source* roc_source_init_scores(roc_source* source, guint* dup_scores,
+  size_t ndup, guint* nondup_scores, size_t nnondup);
+
 /** @brief Destroy an roc_source, freeing its memory.
  *  @return roc_source*
  */
@@ -0,0 +1,169 @@
+/* sniff.c
+ *
+ * Identify an image file's format from its first bytes, regardless of its
+ * name.
+ *
+ * One pread of SZ_SNIFF bytes at offset 0 is enough for every format libvips
+ * is used with here:
+ *
+ *   JPEG  FF D8 FF
+ *   PNG   89 'P' 'N' 'G' 0D 0A 1A 0A
+ *   GIF   "GIF87a" | "GIF89a"
+ *   WebP  "RIFF" <size> "WEBP"
+ *   TIFF  "II" 2A 00 | "MM" 00 2A, or 2B for BigTIFF
+ *   HEIF  <size> "ftyp" <brand>, brand one of the HEIF/AVIF brands below
+ *
+ * Anything else is SNIFF_UNKNOWN, and isn't worth a libvips open.
+ *
+ * Compile test
+ *
+gcc sniff.c -o test-sniff -DTEST_SNIFF -g -Wall
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef ASSERT_H
+#  define ASSERT_H
+#  include <assert.h>
+#endif
+
+#ifndef UNISTD_H
+#  define UNISTD_H
+#  include <unistd.h>
+#endif
+
+#ifndef FCNTL_H
+#  define FCNTL_H
+#  include <fcntl.h>
+#endif
+
+#define SZ_SNIFF 16
+
+typedef enum sniff_type {
+  SNIFF_UNKNOWN,
+  SNIFF_JPEG,
+  SNIFF_PNG,
+  SNIFF_WEBP,
+  SNIFF_HEIF,
+  SNIFF_GIF,
+  SNIFF_TIFF,
+  NSNIFF_TYPE
+} sniff_type;
+
+/* Name of @type, as returned by the sniff_* functions, for reports.
+ */
+const char* sniff_type_name(int type){
+  static const char* names[NSNIFF_TYPE] = {
+    "unknown", "jpeg", "png", "webp", "heif", "gif", "tiff"
+  };
+  return 0 <= type && type < NSNIFF_TYPE ? names[type] : "error";
+}
+
+// 0-terminated list of ftyp brands read by the heif loader.
+static const char* sniff_heif_brands[] = {
+  "heic", "heix", "hevc", "hevx", "heim", "heis", "mif1", "msf1", "avif",
+  "avis", 0
+};
+
+/* Identify the format of the file starting with the @n bytes in @b.
+ */
+sniff_type sniff_bytes(const unsigned char* b, size_t n){
+  if(n >= 3 && b[0] == 0xff && b[1] == 0xd8 && b[2] == 0xff)
+    return SNIFF_JPEG;
+  if(n >= 8 && !memcmp(b, "\x89PNG\r\n\x1a\n", 8))
+    return SNIFF_PNG;
+  if(n >= 6 && (!memcmp(b, "GIF87a", 6) || !memcmp(b, "GIF89a", 6)))
+    return SNIFF_GIF;
+  if(n >= 12 && !memcmp(b, "RIFF", 4) && !memcmp(b+8, "WEBP", 4))
+    return SNIFF_WEBP;
+  if(n >= 4 && ((b[0] == 'I' && b[1] == 'I' && (b[2] == 42 || b[2] == 43)
+    && !b[3]) || (b[0] == 'M' && b[1] == 'M' && !b[2]
+    && (b[3] == 42 || b[3] == 43))))
+    return SNIFF_TIFF;
+  if(n >= 12 && !memcmp(b+4, "ftyp", 4))
+    for(const char** brand = sniff_heif_brands; *brand; ++brand)
+      if(!memcmp(b+8, *brand, 4)) return SNIFF_HEIF;
+  return SNIFF_UNKNOWN;
+}
+
+/* Identify the format of the open file @fd, with one pread. Return -1 if the
+ * read fails.
+ */
+int sniff_fd(int fd){
+  unsigned char b[SZ_SNIFF];
+  ssize_t z = pread(fd, b, SZ_SNIFF, 0);
+  return 0 > z ? -1 : (int) sniff_bytes(b, z);
+}
+
+/* Identify the format of the file @name relative to the directory @dirfd
+ * (or AT_FDCWD). Return -1 if it can't be opened or read.
+ */
+int sniff_at(int dirfd, const char* name){
+  int fd = openat(dirfd, name, O_RDONLY|O_CLOEXEC);
+  if(0 > fd) return -1;
+  int type = sniff_fd(fd);
+  close(fd);
+  return type;
+}
+
+/* Identify the format of the file at @path. Return -1 if it can't be opened
+ * or read.
+ */
+int sniff_path(const char* path){
+  return sniff_at(AT_FDCWD, path);
+}
+
+#ifdef TEST_SNIFF
+int main(){
+  static const struct { const char* bytes; size_t n; sniff_type type; } cases[]
+    = {
+    {"\xff\xd8\xff\xe0\0\x10JFIF", 10, SNIFF_JPEG},
+    {"\x89PNG\r\n\x1a\n\0\0\0\rIHDR", 16, SNIFF_PNG},
+    {"GIF89a\x01\0\x01\0", 10, SNIFF_GIF},
+    {"RIFF\x24\0\0\0WEBPVP8 ", 16, SNIFF_WEBP},
+    {"II*\0\x08\0\0\0", 8, SNIFF_TIFF},
+    {"MM\0*\0\0\0\x08", 8, SNIFF_TIFF},
+    {"\0\0\0\x18" "ftypheic\0\0\0\0", 16, SNIFF_HEIF},
+    {"\0\0\0\x1c" "ftypavif\0\0\0\0", 16, SNIFF_HEIF},
+    {"\0\0\0\x18" "ftypisom\0\0\0\0", 16, SNIFF_UNKNOWN},  // mp4
+    {"RIFF\x24\0\0\0WAVEfmt ", 16, SNIFF_UNKNOWN},
+    {"\xff\xd8", 2, SNIFF_UNKNOWN},  // too short
+    {"hello, world\n", 13, SNIFF_UNKNOWN},
+    {"", 0, SNIFF_UNKNOWN},
+  };
+  for(size_t i=0; i<sizeof cases / sizeof *cases; ++i)
+    assert(cases[i].type
+      == sniff_bytes((const unsigned char*) cases[i].bytes, cases[i].n));
+
+  // From a file, through the fd and path entry points.
+  char fname[] = "/tmp/test_sniff_XXXXXX";
+  int fd = mkstemp(fname);
+  assert(0 <= fd);
+  assert(SNIFF_UNKNOWN == sniff_fd(fd));
+  assert(16 == write(fd, cases[1].bytes, 16));
+  assert(SNIFF_PNG == sniff_fd(fd));
+  assert(SNIFF_PNG == sniff_path(fname));
+  close(fd);
+  remove(fname);
+  assert(-1 == sniff_path(fname));
+  assert(!strcmp("error", sniff_type_name(-1)));
+  assert(!strcmp("heif", sniff_type_name(SNIFF_HEIF)));
+
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,526 @@
+/* synth_hashes.c
+ *
+ * Generate a hash database (hash_db.c) of random IDHashes with planted
+ * clusters of near-duplicates at chosen distances, plus the list of planted
+ * pairs, for testing and timing distance search on tables of 1M-100M hashes
+ * without decoding an image.
+ *
+ * Difference hashes are uniform. Importance masks have about as many bits
+ * as histogram_importance gives: it keeps every bin from the median up, so
+ * a direction has at least 32 of 64 bits, and more when differences tie at
+ * the median. A mask here has --importance-bits bits plus a geometric(1/2)
+ * number of ties.
+ *
+ * Cluster c has --cluster-size hashes: a center, which is a random hash
+ * like the rest, and members at the --distances from it, in turn. A member
+ * copies the center and flips exactly d difference bits inside the center's
+ * importance masks, so it is at distance d from the center whatever its
+ * own masks are. Its masks are then jittered by moving --jitter bits in
+ * each direction. Members of a cluster are usually near each other too.
+ *
+ * Hashes are placed by a fixed permutation of the table, so members of a
+ * cluster are spread out instead of next to each other (--no-shuffle keeps
+ * them together). The output is the same for the same seed, whatever
+ * --jobs is.
+ *
+ * The truth file lists every pair within a cluster at distance at most
+ * --radius (default the largest planted distance), one per line, as
+ *
+ *   <a>\t<b>\t<distance>
+ *
+ * with a < b indices into the table, ordered by cluster and then by a and
+ * b. Unrelated hashes can also be close by chance, so the file is a subset
+ * of the true pairs: it measures recall, and a reported pair outside it is
+ * checked by computing its distance. Uniform hashes are about 48 apart, so
+ * chance pairs are rare below distance 16.
+ *
+ * Compile test
+ *
+gcc synth_hashes.c -o test-synth-hashes -DTEST_SYNTH_HASHES -g -Wall -pthread `pkg-config vips --cflags --libs`
+ *
+ * Compile
+ *
+gcc synth_hashes.c -o synth-hashes -DCMD_SYNTH_HASHES -O2 -g -Wall -pthread `pkg-config vips --cflags --libs`
+ *
+ * Usage
+ *
+ * ./synth-hashes [--seed <N>] [--jobs <N>] [--clusters <N>]
+ *   [--cluster-size <N>] [--distances <D,D,...>] [--importance-bits <N>]
+ *   [--jitter <N>] [--radius <N>] [--no-shuffle] <COUNT> <DB> <TRUTH>
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef PTHREAD_H
+#  define PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#ifndef STDATOMIC_H
+#  define STDATOMIC_H
+#  include <stdatomic.h>
+#endif
+
+#ifndef HASH_DB_H
+#  define HASH_DB_H
+#  include "hash_db.c"
+#endif
+
+#ifndef DIR_WALK_H
+#  define DIR_WALK_H
+#  include "dir_walk.c"
+#endif
+
+// Hashes per unit of work. The random stream of a block depends only on
+// the seed and the block, so the output doesn't depend on the threads.
+#define SYNTH_HASHES_BLOCK 4096
+
+#define SYNTH_HASHES_MAX_DISTANCES 64
+
+#define SYNTH_HASHES_DEFAULT_DISTANCES "1,2,4,6,8,12,16"
+
+typedef struct synth_hashes_opts synth_hashes_opts;
+struct synth_hashes_opts {
+  guint64 seed;
+  int jobs;                 // threads, or 0 for one per online CPU
+  size_t clusters;
+  size_t cluster_size;      // hashes per cluster, center included
+  guint distances[SYNTH_HASHES_MAX_DISTANCES];
+  size_t ndistances;
+  int importance_bits;      // importance bits per direction, before ties
+  int jitter;               // importance bits moved per member and direction
+  guint radius;             // largest distance in the truth file
+  int shuffle;
+};
+
+static guint64 synth_hashes_rand(guint64* s){
+  guint64 z = (*s += 0x9e3779b97f4a7c15u);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+  return z ^ (z >> 31);
+}
+
+/* The start of the random stream for unit @i of @phase.
+ */
+static guint64 synth_hashes_stream(guint64 seed, int phase, guint64 i){
+  guint64 s = seed ^ ((guint64) phase << 62);
+  s += i * 0xd1b54a32d192ed03u;
+  synth_hashes_rand(&s);
+  return s;
+}
+
+/* Set bit number @k, counting from 0, among the bits of @z that are
+ * (@set) or aren't (!@set) already set. Return the bit.
+ */
+static guint64 synth_hashes_nth_bit(guint64 z, int k, int set){
+  guint64 w = set ? z : ~z;
+  for(; k; --k) w &= w - 1;
+  return w & -w;
+}
+
+/* A random mask with exactly @bits bits set.
+ */
+static guint64 synth_hashes_mask(guint64* s, int bits){
+  guint64 z = synth_hashes_rand(s);
+  int n = bit_array_sum(z);
+  for(; n > bits; --n)
+    z ^= synth_hashes_nth_bit(z, synth_hashes_rand(s) % n, 1);
+  for(; n < bits; ++n)
+    z |= synth_hashes_nth_bit(z, synth_hashes_rand(s) % (64 - n), 0);
+  return z;
+}
+
+/* A random importance mask: @opts->importance_bits bits plus ties.
+ */
+static guint64 synth_hashes_importance(guint64* s,
+  const synth_hashes_opts* opts)
+{
+  int bits = opts->importance_bits;
+  for(guint64 r = synth_hashes_rand(s); bits < 64 && (r & 1); r >>= 1) ++bits;
+  return synth_hashes_mask(s, bits);
+}
+
+/* Move @n set bits of @z to bits that weren't set.
+ */
+static guint64 synth_hashes_jitter(guint64* s, guint64 z, int n){
+  const int bits = bit_array_sum(z);
+  if(!bits || bits == 64) return z;
+  for(int i=0; i<n; ++i){
+    const int k_off = synth_hashes_rand(s) % bits;
+    const int k_on = synth_hashes_rand(s) % (64 - bits);
+    const guint64 off = synth_hashes_nth_bit(z, k_off, 1);
+    const guint64 on = synth_hashes_nth_bit(z, k_on, 0);
+    z ^= off | on;
+  }
+  return z;
+}
+
+idhash_hash synth_hashes_random(guint64* s, const synth_hashes_opts* opts){
+  idhash_hash h;
+  h.dx = synth_hashes_rand(s);
+  h.dy = synth_hashes_rand(s);
+  h.ix = synth_hashes_importance(s, opts);
+  h.iy = synth_hashes_importance(s, opts);
+  return h;
+}
+
+/* A hash at distance @d from @center, for @d at most the number of
+ * importance bits of @center.
+ */
+idhash_hash synth_hashes_near(
+  guint64* s,
+  const idhash_hash* center,
+  guint d,
+  const synth_hashes_opts* opts)
+{
+  idhash_hash h = *center;
+  // Flip d distinct bits among the nx + ny importance bits of the center,
+  // x bits first.
+  const int nx = bit_array_sum(center->ix), ny = bit_array_sum(center->iy);
+  guint64 left_x = center->ix, left_y = center->iy;
+  for(guint i=0; i<d; ++i){
+    const int k = synth_hashes_rand(s) % (nx + ny - i);
+    const int kx = bit_array_sum(left_x);
+    if(k < kx){
+      const guint64 b = synth_hashes_nth_bit(left_x, k, 1);
+      h.dx ^= b, left_x ^= b;
+    } else {
+      const guint64 b = synth_hashes_nth_bit(left_y, k - kx, 1);
+      h.dy ^= b, left_y ^= b;
+    }
+  }
+  h.ix = synth_hashes_jitter(s, h.ix, opts->jitter);
+  h.iy = synth_hashes_jitter(s, h.iy, opts->jitter);
+  return h;
+}
+
+/* Where the @k-th hash generated goes in a table of @n: the first
+ * cluster_size are cluster 0, starting with its center, and so on. With
+ * @opts->shuffle this is k -> (a*k + b) mod n, for an a near n/phi with no
+ * factor in common with n, so consecutive k land far apart.
+ */
+typedef struct synth_hashes_perm synth_hashes_perm;
+struct synth_hashes_perm {
+  guint64 a;
+  guint64 b;
+  guint64 n;
+};
+
+static guint64 synth_hashes_gcd(guint64 a, guint64 b){
+  while(b){ guint64 t = a % b; a = b; b = t; }
+  return a;
+}
+
+synth_hashes_perm synth_hashes_perm_init(size_t n,
+  const synth_hashes_opts* opts)
+{
+  synth_hashes_perm p = {1, 0, n};
+  if(!opts->shuffle || n < 2) return p;
+  p.a = (guint64) (n * 0.6180339887) | 1;
+  while(synth_hashes_gcd(p.a, n) != 1) ++p.a;
+  guint64 s = opts->seed;
+  p.b = synth_hashes_rand(&s) % n;
+  return p;
+}
+
+static inline guint64 synth_hashes_place(const synth_hashes_perm* p,
+  guint64 k)
+{
+  return (guint64) (((unsigned __int128) p->a * k + p->b) % p->n);
+}
+
+typedef struct synth_hashes_work synth_hashes_work;
+struct synth_hashes_work {
+  idhash_hash* hashes;
+  size_t n;
+  const synth_hashes_opts* opts;
+  synth_hashes_perm perm;
+  int phase;
+  atomic_size_t next;
+};
+
+static void* synth_hashes_thread(void* arg){
+  synth_hashes_work* w = (synth_hashes_work*) arg;
+  const synth_hashes_opts* opts = w->opts;
+  const size_t csize = opts->cluster_size;
+  if(!w->phase){
+    // Every hash, with the ones that become members too.
+    const size_t nblocks = (w->n + SYNTH_HASHES_BLOCK - 1) / SYNTH_HASHES_BLOCK;
+    for(size_t i; (i = atomic_fetch_add(&w->next, 1)) < nblocks; ){
+      guint64 s = synth_hashes_stream(opts->seed, 0, i);
+      const size_t end = w->n < (i+1) * SYNTH_HASHES_BLOCK ? w->n
+        : (i+1) * SYNTH_HASHES_BLOCK;
+      for(size_t k=i * SYNTH_HASHES_BLOCK; k<end; ++k)
+        w->hashes[synth_hashes_place(&w->perm, k)] =
+          synth_hashes_random(&s, opts);
+    }
+  } else {
+    for(size_t c; (c = atomic_fetch_add(&w->next, 1)) < opts->clusters; ){
+      guint64 s = synth_hashes_stream(opts->seed, 1, c);
+      const idhash_hash center =
+        w->hashes[synth_hashes_place(&w->perm, c * csize)];
+      for(size_t m=1; m<csize; ++m){
+        const guint d = opts->distances[(m-1) % opts->ndistances];
+        w->hashes[synth_hashes_place(&w->perm, c * csize + m)] =
+          synth_hashes_near(&s, &center, d, opts);
+      }
+    }
+  }
+  return 0;
+}
+
+/* Fill the @n hashes of @hashes as described at the top, on @opts->jobs
+ * threads.
+ */
+void synth_hashes_fill(idhash_hash* hashes, size_t n,
+  const synth_hashes_opts* opts)
+{
+  int jobs = opts->jobs > 0 ? opts->jobs : dir_walk_ncpus();
+  pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+  synth_hashes_work w = {hashes, n, opts, synth_hashes_perm_init(n, opts)};
+  for(w.phase=0; w.phase<2; ++w.phase){
+    atomic_init(&w.next, 0);
+    for(int i=0; i<jobs; ++i)
+      pthread_create(threads + i, 0, synth_hashes_thread, &w);
+    for(int i=0; i<jobs; ++i)
+      pthread_join(threads[i], 0);
+  }
+  free(threads);
+}
+
+static int synth_hashes_cmp_u64(const void* a, const void* b){
+  const guint64 x = *(const guint64*) a, y = *(const guint64*) b;
+  return (x > y) - (x < y);
+}
+
+/* Write the pairs within each cluster of @hashes at distance at most
+ * @opts->radius to @fp. Return the number of pairs, or -1 on a write error.
+ */
+long synth_hashes_write_truth(FILE* fp, const idhash_hash* hashes, size_t n,
+  const synth_hashes_opts* opts)
+{
+  const synth_hashes_perm perm = synth_hashes_perm_init(n, opts);
+  const size_t csize = opts->cluster_size;
+  guint64* at = malloc(csize * sizeof *at + 1);
+  long npairs = 0;
+  for(size_t c=0; c<opts->clusters; ++c){
+    for(size_t m=0; m<csize; ++m)
+      at[m] = synth_hashes_place(&perm, c * csize + m);
+    qsort(at, csize, sizeof *at, synth_hashes_cmp_u64);
+    for(size_t i=0; i<csize; ++i)
+      for(size_t j=i+1; j<csize; ++j){
+        const guint d = idhash_hash_dist(hashes + at[i], hashes + at[j]);
+        if(d > opts->radius) continue;
+        if(0 > fprintf(fp, "%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT
+          "\t%u\n", at[i], at[j], d)){
+          free(at);
+          return -1;
+        }
+        ++npairs;
+      }
+  }
+  free(at);
+  return npairs;
+}
+
+/* Parse the comma-separated distances in @list into @opts. Return 0 on
+ * success, -1 if one isn't in [0, 64] or there are too many.
+ */
+int synth_hashes_parse_distances(synth_hashes_opts* opts, const char* list){
+  opts->ndistances = 0;
+  for(const char* p = list; *p; ){
+    char* end;
+    const long d = strtol(p, &end, 10);
+    if(end == p || d < 0 || d > 64
+      || opts->ndistances == SYNTH_HASHES_MAX_DISTANCES
+      || (*end && (*end != ',' || !end[1])))
+      return -1;
+    opts->distances[opts->ndistances++] = d;
+    p = *end ? end + 1 : end;
+  }
+  return opts->ndistances ? 0 : -1;
+}
+
+void synth_hashes_opts_init(synth_hashes_opts* opts){
+  *opts = (synth_hashes_opts){.seed = 1, .cluster_size = 8,
+    .importance_bits = 32, .jitter = 2, .shuffle = 1};
+  synth_hashes_parse_distances(opts, SYNTH_HASHES_DEFAULT_DISTANCES);
+  opts->radius = 16;
+}
+
+#ifdef TEST_SYNTH_HASHES
+int main(){
+  assert(synth_hashes_nth_bit(0xf0, 1, 1) == 0x20);
+  assert(synth_hashes_nth_bit(0xf0, 4, 0) == 0x100);
+  guint64 s = 7;
+  for(int bits=0; bits<=64; ++bits)
+    assert(bit_array_sum(synth_hashes_mask(&s, bits)) == bits);
+
+  synth_hashes_opts opts;
+  synth_hashes_opts_init(&opts);
+  assert(!synth_hashes_parse_distances(&opts, "0,3,64"));
+  assert(opts.ndistances == 3 && opts.distances[2] == 64);
+  assert(synth_hashes_parse_distances(&opts, "1,65"));
+  assert(synth_hashes_parse_distances(&opts, "1,"));
+  assert(synth_hashes_parse_distances(&opts, ""));
+
+  // Members are at exactly the planted distance.
+  synth_hashes_opts_init(&opts);
+  for(guint d=0; d<=64; ++d){
+    const idhash_hash c = synth_hashes_random(&s, &opts);
+    assert(bit_array_sum(c.ix) >= 32 && bit_array_sum(c.iy) >= 32);
+    const idhash_hash h = synth_hashes_near(&s, &c, d, &opts);
+    assert(idhash_hash_dist(&c, &h) == d);
+    assert(bit_array_sum(h.ix) == bit_array_sum(c.ix));
+  }
+
+  // The placement is a permutation.
+  for(size_t n=1; n<300; ++n){
+    const synth_hashes_perm p = synth_hashes_perm_init(n, &opts);
+    char* seen = calloc(n, 1);
+    for(size_t k=0; k<n; ++k){
+      const guint64 i = synth_hashes_place(&p, k);
+      assert(i < n && !seen[i]);
+      seen[i] = 1;
+    }
+    free(seen);
+  }
+
+  // Same table for any number of threads, and every planted pair is found
+  // by a scan.
+  const size_t n = 4000;
+  opts.clusters = 50;
+  idhash_hash* a = malloc(n * sizeof *a);
+  idhash_hash* b = malloc(n * sizeof *b);
+  opts.jobs = 1;
+  synth_hashes_fill(a, n, &opts);
+  opts.jobs = 4;
+  synth_hashes_fill(b, n, &opts);
+  assert(!memcmp(a, b, n * sizeof *a));
+
+  FILE* fp = tmpfile();
+  const long npairs = synth_hashes_write_truth(fp, a, n, &opts);
+  assert(npairs >= (long) (opts.clusters * (opts.cluster_size - 1)));
+  rewind(fp);
+  char* near = calloc(n, n / 8 + 1);
+  long found = 0, chance = 0;
+  for(size_t i=0; i<n; ++i)
+    for(size_t j=i+1; j<n; ++j)
+      if(idhash_hash_dist(a + i, a + j) <= opts.radius){
+        near[i * (n / 8 + 1) + j / 8] |= 1 << (j % 8);
+        ++found;
+      }
+  guint64 i, j;
+  guint d;
+  while(3 == fscanf(fp, "%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\t%u\n",
+    &i, &j, &d)){
+    assert(i < j && j < n && d <= opts.radius);
+    assert(idhash_hash_dist(a + i, a + j) == d);
+    assert(near[i * (n / 8 + 1) + j / 8] & (1 << (j % 8)));
+    --found;
+  }
+  chance = found;
+  assert(chance >= 0);
+  printf("%ld planted pairs, %ld by chance\n", npairs, chance);
+  fclose(fp);
+  free(near);
+  free(a);
+  free(b);
+
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#elif defined(CMD_SYNTH_HASHES)
+int main(int argc, char* argv[argc]){
+  synth_hashes_opts opts;
+  synth_hashes_opts_init(&opts);
+  long clusters = -1, radius = -1;
+  char* args[3] = {0};
+  int nargs = 0, usage = 0;
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--seed") && i+1 < argc)
+      opts.seed = strtoull(argv[++i], 0, 10);
+    else if(!strcmp(argv[i], "--jobs") && i+1 < argc)
+      opts.jobs = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--clusters") && i+1 < argc)
+      clusters = atol(argv[++i]);
+    else if(!strcmp(argv[i], "--cluster-size") && i+1 < argc)
+      opts.cluster_size = atol(argv[++i]);
+    else if(!strcmp(argv[i], "--distances") && i+1 < argc)
+      usage |= synth_hashes_parse_distances(&opts, argv[++i]);
+    else if(!strcmp(argv[i], "--importance-bits") && i+1 < argc)
+      opts.importance_bits = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--jitter") && i+1 < argc)
+      opts.jitter = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--radius") && i+1 < argc)
+      radius = atol(argv[++i]);
+    else if(!strcmp(argv[i], "--no-shuffle")) opts.shuffle = 0;
+    else if(nargs < 3) args[nargs++] = argv[i];
+    else usage = 1;
+  }
+  const long count = nargs == 3 ? atol(args[0]) : 0;
+  // One in 8 hashes in a cluster, by default.
+  if(clusters < 0 && opts.cluster_size)
+    clusters = count / 8 / opts.cluster_size;
+  opts.clusters = clusters;
+  if(radius < 0){
+    radius = 0;
+    for(size_t i=0; i<opts.ndistances; ++i)
+      if(opts.distances[i] > radius) radius = opts.distances[i];
+  }
+  opts.radius = radius;
+  if(usage || count < 1 || opts.cluster_size < 1
+    || opts.importance_bits < 0 || opts.importance_bits > 64
+    || opts.jitter < 0 || opts.clusters > count / opts.cluster_size){
+    fprintf(stderr, "Usage: %s [--seed <N>] [--jobs <N>] [--clusters <N>] "
+      "[--cluster-size <N>] [--distances <D,D,...>] [--importance-bits <N>] "
+      "[--jitter <N>] [--radius <N>] [--no-shuffle] <COUNT> <DB> <TRUTH>\n",
+      argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  for(size_t i=0; i<opts.ndistances; ++i)
+    if((int) opts.distances[i] > 2 * opts.importance_bits){
+      fprintf(stderr, "Distance %u is more than the %d importance bits.\n",
+        opts.distances[i], 2 * opts.importance_bits);
+      exit(EXIT_FAILURE);
+    }
+
+  hash_db* db = hash_db_create(args[1], count);
+  if(!db) exit(EXIT_FAILURE);
+  synth_hashes_fill(db->hashes, count, &opts);
+  FILE* fp = strcmp(args[2], "-") ? fopen(args[2], "w") : stdout;
+  long npairs = -1;
+  if(fp){
+    fprintf(fp, "# synth-hashes %ld --seed %" G_GUINT64_FORMAT " --clusters "
+      "%zu --cluster-size %zu --radius %u\n", count, opts.seed,
+      opts.clusters, opts.cluster_size, opts.radius);
+    npairs = synth_hashes_write_truth(fp, db->hashes, count, &opts);
+    if(fp != stdout && fclose(fp)) npairs = -1;
+  }
+  if(hash_db_close(db)){
+    fprintf(stderr, "Failed to write %s.\n", args[1]);
+    exit(EXIT_FAILURE);
+  }
+  if(npairs < 0){
+    fprintf(stderr, "Failed to write %s.\n", args[2]);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, "%ld hashes, %zu clusters, %ld pairs within %u\n", count,
+    opts.clusters, npairs, opts.radius);
+  return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,469 @@
+/* synth_pairs.c
+ *
+ * Near-duplicates made in memory: each original is decoded, transformed with
+ * libvips, and hashed from the result, without writing a file.
+ *
+ * A transform is a chain of steps joined by '+', e.g. "crop:0.9+jpeg:70":
+ *
+ *   jpeg:<Q>       re-encode as JPEG at quality Q (1-100) and decode again
+ *   resize:<S>     scale by S
+ *   crop:<F>       keep the centered F (0-1] of the width and height
+ *   bright:<B>     add B to every pixel
+ *   contrast:<C>   scale the distance of every pixel from 128 by C
+ *   watermark:<F>  paint a white box, F of the width and height, in the
+ *                  bottom right corner, where a logo usually goes
+ *   flip:h|v       mirror horizontally or vertically
+ *
+ * synth_pairs_hash is an idhash_pairs_hash_fn (see idhash_pairs.c) that
+ * applies the transform of a manifest pair before hashing, so a manifest of
+ * originals x transforms from pair_manifest_add_dir is scored on all cores
+ * with each transformed variant made and hashed once. synth_pairs_hash_all
+ * does all the transforms of a path together, decoding the original into
+ * memory once and running every chain from it. A chain ending in a
+ * JPEG re-encode is hashed from the encoded buffer with idhash_buffer, so it
+ * takes the same shrink-on-load path as a file would.
+ *
+ * Compile test
+ *
+gcc synth_pairs.c -o test-synth-pairs -DTEST_SYNTH_PAIRS -g -Wall -pthread `pkg-config vips --cflags --libs` -lm
+ *
+ * Run test
+ *
+ * ./test-synth-pairs <IMAGE>
+ *
+ * Compile
+ *
+gcc synth_pairs.c -o synth-pairs -DCMD_SYNTH_PAIRS -g -Wall -pthread `pkg-config vips --cflags --libs` -lm
+ *
+ * Usage
+ *
+ * ./synth-pairs [--profile <NAME>] [--jobs <N>] [--transforms <T>,<T>,...]
+ *     [--manifest] [--curve] {<SOURCE_DIR> | --from <MANIFEST>}
+ *
+ * Pairs every file in SOURCE_DIR with each transform of itself (dup) and of
+ * the file before it (nondup), SYNTH_DEFAULT_TRANSFORMS unless --transforms
+ * is given, then prints the optimal ROC threshold and the TPR and FPR of
+ * each transform at it. --manifest prints the manifest instead of scoring
+ * it, and --from scores an existing manifest.
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef IDHASH_H
+#  define IDHASH_H
+#  include "idhash.h"
+#endif
+
+#ifndef IDHASH_PAIRS_H
+#  define IDHASH_PAIRS_H
+#  include "idhash_pairs.c"
+#endif
+
+#define SYNTH_MAX_STEPS 8
+
+// Ten transforms covering what near-duplicates usually go through.
+#define SYNTH_DEFAULT_TRANSFORMS "jpeg:90,jpeg:70,jpeg:40,resize:0.5,"\
+  "resize:0.25,crop:0.9,crop:0.75,bright:20+contrast:1.2,watermark:0.2,flip:h"
+
+typedef enum synth_op {
+  SYNTH_JPEG,
+  SYNTH_RESIZE,
+  SYNTH_CROP,
+  SYNTH_BRIGHT,
+  SYNTH_CONTRAST,
+  SYNTH_WATERMARK,
+  SYNTH_FLIP,
+  NSYNTH_OP
+} synth_op;
+
+static const char* const synth_op_names[NSYNTH_OP] = {
+  "jpeg", "resize", "crop", "bright", "contrast", "watermark", "flip"
+};
+
+typedef struct synth_step synth_step;
+struct synth_step {
+  synth_op op;
+  double arg;  // for flip, VIPS_DIRECTION_*
+};
+
+/* Parse @transform into @steps. Return the number of steps, 0 for "", or -1
+ * with the reason in the vips error buffer.
+ */
+int synth_parse(const char* transform, synth_step steps[SYNTH_MAX_STEPS]){
+  int n=0;
+  for(const char* p = transform; *p; ){
+    const char* end = strchr(p, '+');
+    if(!end) end = p + strlen(p);
+    const char* colon = memchr(p, ':', end - p);
+    if(n == SYNTH_MAX_STEPS || !colon || (*end && !end[1])){
+      vips_error("synth", "bad transform %s", transform);
+      return -1;
+    }
+    int op=0;
+    while(op < NSYNTH_OP && (strlen(synth_op_names[op]) != (size_t)(colon - p)
+      || strncmp(synth_op_names[op], p, colon - p)))
+      ++op;
+    char* q;
+    double arg = strtod(colon + 1, &q);
+    if(op == SYNTH_FLIP && end - colon == 2
+      && (colon[1] == 'h' || colon[1] == 'v')){
+      arg = colon[1] == 'h' ? VIPS_DIRECTION_HORIZONTAL
+        : VIPS_DIRECTION_VERTICAL;
+      q = (char*) end;
+    }
+    if(op == NSYNTH_OP || q != end || q == colon + 1
+      || (op == SYNTH_JPEG && !(1 <= arg && arg <= 100))
+      || (op == SYNTH_RESIZE && !(0 < arg))
+      || ((op == SYNTH_CROP || op == SYNTH_WATERMARK)
+        && !(0 < arg && arg <= 1))){
+      vips_error("synth", "bad step %.*s in transform %s", (int)(end - p), p,
+        transform);
+      return -1;
+    }
+    steps[n++] = (synth_step){op, arg};
+    p = *end ? end + 1 : end;
+  }
+  return n;
+}
+
+/* Apply @step to @in, returning the result in @out. Takes ownership of @in.
+ * Not for SYNTH_JPEG. Return 0, or -1 with the reason in the vips error
+ * buffer.
+ */
+static int synth_apply(VipsImage* in, VipsImage** out, const synth_step* step){
+  const int width = vips_image_get_width(in);
+  const int height = vips_image_get_height(in);
+  int z=0;
+  VipsImage* t=0;
+  switch(step->op){
+    case SYNTH_RESIZE:
+      z = vips_resize(in, out, step->arg, NULL);
+      break;
+    case SYNTH_CROP: {
+      const int w = VIPS_MAX(1, width * step->arg);
+      const int h = VIPS_MAX(1, height * step->arg);
+      z = vips_crop(in, out, (width - w) / 2, (height - h) / 2, w, h, NULL);
+      break;
+    }
+    case SYNTH_BRIGHT:
+    case SYNTH_CONTRAST: {
+      const double a = step->op == SYNTH_CONTRAST ? step->arg : 1;
+      const double b = step->op == SYNTH_CONTRAST ? 128 * (1 - a) : step->arg;
+      // The linear result is float: clip it back to 8 bits.
+      z = vips_linear1(in, &t, a, b, NULL)
+        || vips_cast(t, out, VIPS_FORMAT_UCHAR, NULL);
+      break;
+    }
+    case SYNTH_WATERMARK: {
+      const int w = VIPS_MAX(1, width * step->arg);
+      const int h = VIPS_MAX(1, height * step->arg);
+      // Draw operations work in place, on an image in memory.
+      z = !(*out = vips_image_copy_memory(in))
+        || vips_draw_rect1(*out, 255, width - w, height - h, w, h,
+          "fill", TRUE, NULL);
+      if(z && *out){
+        g_object_unref(*out);
+        *out = 0;
+      }
+      break;
+    }
+    case SYNTH_FLIP:
+      z = vips_flip(in, out, (VipsDirection) step->arg, NULL);
+      break;
+    default:
+      vips_error("synth", "step %s can't be applied here",
+        synth_op_names[step->op]);
+      z = -1;
+  }
+  if(t) g_object_unref(t);
+  g_object_unref(in);
+  return z ? -1 : 0;
+}
+
+/* Apply the @nsteps @steps to @in, which is unreferenced, and hash the
+ * result into @out, naming it @path. Return 0, or -1 with the reason in the
+ * vips error buffer.
+ */
+static int synth_pairs_hash_steps(
+  VipsImage* in,
+  const char* path,
+  const synth_step* steps,
+  int nsteps,
+  idhash_hash* out)
+{
+  void* buf=0;
+  size_t len=0;
+  int z=0;
+  // Allocated per call: the result holds a whole path buffer.
+  idhash_result* res = calloc(1, sizeof(idhash_result));
+  if(!res){
+    vips_error("synth", "out of memory hashing %s", path);
+    g_object_unref(in);
+    return -1;
+  }
+  for(int i=0; i<nsteps && !z; ++i){
+    if(steps[i].op != SYNTH_JPEG){
+      VipsImage* next=0;
+      z = synth_apply(in, &next, steps + i);
+      in = z ? 0 : next;
+      continue;
+    }
+    // Encoding runs the whole pipeline, so the previous buffer, if any, is
+    // no longer needed once it's done.
+    void* prev = buf;
+    z = vips_jpegsave_buffer(in, &buf, &len, "Q", (int) steps[i].arg, NULL);
+    g_object_unref(in);
+    in = 0;
+    g_free(prev);
+    if(z) buf = 0;
+    else if(i+1 < nsteps)
+      z = !(in = vips_image_new_from_buffer(buf, len, "", NULL));
+  }
+  if(!z){
+    // @in is 0 here only if the chain ended with a JPEG re-encode.
+    z = in ? idhash_image(in, path, res)
+      : idhash_buffer(buf, len, path, res);
+    in = 0;
+  }
+  if(in) g_object_unref(in);
+  g_free(buf);
+  *out = idhash_hash_of(res);
+  free(res);
+  return z ? -1 : 0;
+}
+
+/* Hash the image at @path after applying @transform (see the top of this
+ * file), into @out. An idhash_pairs_hash_fn: @arg is unused. Return 0, or -1
+ * with the reason in the vips error buffer.
+ */
+int synth_pairs_hash(
+  const char* path,
+  const char* transform,
+  idhash_hash* out,
+  void* arg)
+{
+  synth_step steps[SYNTH_MAX_STEPS];
+  int nsteps = synth_parse(transform, steps);
+  if(nsteps < 0) return -1;
+  if(!nsteps) return idhash_pairs_hash_file(path, transform, out, arg);
+
+  VipsImage* in = vips_image_new_from_file(path, NULL);
+  if(!in) return -1;
+  return synth_pairs_hash_steps(in, path, steps, nsteps, out);
+}
+
+/* Hash the image at @path after applying each of the @n @transforms, into
+ * @out[i], like synth_pairs_hash, but decoding the original once for all of
+ * them. An idhash_pairs_hash_all_fn: @arg is unused. Set @failed[i] for each
+ * transform that fails, with the reason in the vips error buffer, and return
+ * how many did.
+ */
+int synth_pairs_hash_all(
+  const char* path,
+  const char* const* transforms,
+  int n,
+  idhash_hash* out,
+  char* failed,
+  void* arg)
+{
+  VipsImage* orig=0;
+  int load_failed=0, nfailed=0;
+  for(int i=0; i<n; ++i){
+    synth_step steps[SYNTH_MAX_STEPS];
+    const int nsteps = synth_parse(transforms[i], steps);
+    int z;
+    if(nsteps < 0) z = -1;
+    // The original itself keeps the shrink-on-load path of a file.
+    else if(!nsteps)
+      z = idhash_pairs_hash_file(path, transforms[i], out + i, arg);
+    else {
+      if(!orig && !load_failed){
+        VipsImage* in = vips_image_new_from_file(path, NULL);
+        if(in){
+          orig = vips_image_copy_memory(in);
+          g_object_unref(in);
+        }
+        load_failed = !orig;
+      }
+      z = load_failed ? -1
+        : synth_pairs_hash_steps(g_object_ref(orig), path, steps, nsteps,
+          out + i);
+    }
+    failed[i] = z != 0;
+    nfailed += failed[i];
+  }
+  if(orig) g_object_unref(orig);
+  return nfailed;
+}
+
+/* Split the comma separated @list into @transforms, at most @max. Return the
+ * number of transforms, or -1 if one doesn't parse. @list is modified.
+ */
+int synth_split_transforms(char* list, const char* transforms[], int max){
+  int n=0;
+  synth_step steps[SYNTH_MAX_STEPS];
+  for(char* t = strtok(list, ","); t; t = strtok(0, ",")){
+    if(n == max || 0 > synth_parse(t, steps)) return -1;
+    transforms[n++] = t;
+  }
+  return n;
+}
+
+#ifdef TEST_SYNTH_PAIRS
+int main(int argc, char* argv[argc]){
+  if(argc != 2){
+    fprintf(stderr, "Usage: %s <IMAGE>\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if(VIPS_INIT(argv[0]))
+    vips_error_exit(NULL);
+
+  synth_step steps[SYNTH_MAX_STEPS];
+  assert(0 == synth_parse("", steps));
+  assert(2 == synth_parse("crop:0.9+jpeg:70", steps));
+  assert(steps[0].op == SYNTH_CROP && steps[0].arg == 0.9);
+  assert(steps[1].op == SYNTH_JPEG && steps[1].arg == 70);
+  assert(1 == synth_parse("flip:v", steps) && steps[0].op == SYNTH_FLIP);
+  const char* bad[] = {"jpeg:0", "crop:1.5", "blur:2", "resize:", "flip:x",
+    "jpeg:70+", "crop", "resize:0.5x"};
+  for(size_t i=0; i < sizeof bad / sizeof *bad; ++i){
+    assert(-1 == synth_parse(bad[i], steps));
+    vips_error_clear();
+  }
+
+  char list[] = SYNTH_DEFAULT_TRANSFORMS;
+  const char* transforms[16];
+  const int n = synth_split_transforms(list, transforms, 16);
+  assert(n == 10);
+
+  idhash_hash h0, h, all[17];
+  char failed[17];
+  assert(!synth_pairs_hash(argv[1], "", &h0, 0));
+  for(int i=0; i<n; ++i){
+    if(synth_pairs_hash(argv[1], transforms[i], &h, 0)){
+      fprintf(stderr, "%s: %s", transforms[i], vips_error_buffer());
+      exit(EXIT_FAILURE);
+    }
+    printf("%s\t%u\n", transforms[i], idhash_hash_dist(&h0, &h));
+  }
+
+  // Decoding once gives the same hashes as decoding per transform.
+  transforms[n] = "";
+  assert(0 == synth_pairs_hash_all(argv[1], transforms, n+1, all, failed, 0));
+  assert(0 == idhash_hash_dist(&h0, all + n));
+  for(int i=0; i<n; ++i){
+    assert(!failed[i]);
+    assert(!synth_pairs_hash(argv[1], transforms[i], &h, 0));
+    assert(0 == idhash_hash_dist(&h, all + i));
+  }
+  const char* missing[] = {"", "crop:0.9"};
+  assert(2 == synth_pairs_hash_all("/nonexistent", missing, 2, all, failed, 0));
+  assert(failed[0] && failed[1]);
+  vips_error_clear();
+  vips_shutdown();
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#elif defined(CMD_SYNTH_PAIRS)
+int main(int argc, char* argv[argc]){
+  vips_profile profile={0};
+  vips_profile_parse_args(&profile, DEFAULT_VIPS_PROFILE, &argc, argv);
+  idhash_pairs_opts opts = {0, synth_pairs_hash, 0, synth_pairs_hash_all};
+  int manifest_only=0, curve=0;
+  char* list = SYNTH_DEFAULT_TRANSFORMS, * from=0, * dir=0;
+  for(int i=1; i<argc; ++i){
+    if(!strcmp(argv[i], "--jobs") && i+1 < argc) opts.jobs = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--transforms") && i+1 < argc) list = argv[++i];
+    else if(!strcmp(argv[i], "--manifest")) manifest_only = 1;
+    else if(!strcmp(argv[i], "--curve")) curve = 1;
+    else if(!strcmp(argv[i], "--from") && i+1 < argc) from = argv[++i];
+    else if(!dir) dir = argv[i];
+    else from = dir = 0, i = argc;
+  }
+  if(!from == !dir){
+    fprintf(stderr, "Usage: %s [--profile <NAME>] [--jobs <N>] "
+      "[--transforms <T>,<T>,...] [--manifest] [--curve] "
+      "{<SOURCE_DIR> | --from <MANIFEST>}\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if(VIPS_INIT(argv[0]))
+    vips_error_exit(NULL);
+  vips_profile_apply(&profile);
+
+  pair_manifest* m = from ? pair_manifest_read(from) : pair_manifest_create();
+  if(!m) exit(EXIT_FAILURE);
+  if(dir){
+    list = strdup(list);
+    const char* transforms[256];
+    const int n = synth_split_transforms(list, transforms, 256);
+    if(n < 1){
+      fprintf(stderr, "Bad transform list: %s", vips_error_buffer());
+      exit(EXIT_FAILURE);
+    }
+    if(pair_manifest_add_dir(m, dir, transforms, n))
+      fprintf(stderr, "Some entries of %s couldn't be read.\n", dir);
+    free(list);
+  }
+  if(manifest_only){
+    int z = pair_manifest_write_tsv(m, stdout);
+    pair_manifest_destroy(m);
+    return z ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  idhash_pairs* p = idhash_pairs_run(m, &opts);
+  fprintf(stderr, "%zu pairs, %zu images hashed, %zu failed\n", m->npairs,
+    p->nimages, p->nfailed);
+  size_t ndup, nnondup;
+  guint* dup = idhash_pairs_scores(p, PAIR_DUP, &ndup);
+  guint* nondup = idhash_pairs_scores(p, PAIR_NONDUP, &nnondup);
+  roc_source* source = roc_source_create();
+  roc_source_init_scores(source, dup, ndup, nondup, nnondup);
+  guint range[2] = {0, 129}, threshold=0;
+  if(curve) roc_curve_print(source, stdout, range);
+  roc_optimal_threshold(&threshold, source, range);
+  roc_point point={0};
+  roc_point_init(&point, source, threshold);
+  printf("# threshold: %u    fpr: %f    tpr: %f\n", threshold, point.fpr,
+    point.tpr);
+
+  // How each transform fares at the overall threshold.
+  printf("# transform\tdup_pairs\tmean_dup\ttpr\tfpr\n");
+  for(uint32_t t=0; t<m->transforms.n; ++t){
+    size_t n[2]={0}, hit[2]={0};
+    double sum=0;
+    for(size_t i=0; i<m->npairs; ++i){
+      const pair_manifest_pair* q = m->pairs + i;
+      if(q->transform != t || p->dist[i] == IDHASH_PAIRS_FAILED) continue;
+      ++n[q->label];
+      hit[q->label] += p->dist[i] <= threshold;
+      if(q->label == PAIR_DUP) sum += p->dist[i];
+    }
+    if(!n[PAIR_DUP] && !n[PAIR_NONDUP]) continue;
+    printf("%s\t%zu\t%.2f\t%f\t%f\n", *m->transforms.strs[t]
+      ? m->transforms.strs[t] : "-", n[PAIR_DUP],
+      n[PAIR_DUP] ? sum / n[PAIR_DUP] : -1.,
+      n[PAIR_DUP] ? (double) hit[PAIR_DUP] / n[PAIR_DUP] : -1.,
+      n[PAIR_NONDUP] ? (double) hit[PAIR_NONDUP] / n[PAIR_NONDUP] : -1.);
+  }
+
+  roc_source_destroy(source);
+  idhash_pairs_destroy(p);
+  pair_manifest_destroy(m);
+  vips_profile_print_stats(stderr);
+  return EXIT_SUCCESS;
+}
+#endif
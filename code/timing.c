@@ -0,0 +1,421 @@
+/* timing.c
+ *
+ * Per-stage latency histograms for the hash pipeline, compiled in with
+ * -DIDHASH_TIMING and to nothing otherwise.
+ *
+ * Code around a stage does
+ *
+ *   TIMING_START(t);
+ *   ...
+ *   TIMING_STOP(TIMING_DECODE, t);
+ *
+ * Each thread records into its own histograms, registered on a lock-free
+ * list the first time the thread records anything, so recording is two
+ * clock reads and a few relaxed stores with no lock and no shared cache
+ * line. timing_merge adds every thread's histograms up on demand, also
+ * while they are being written. Histograms are log-linear: exact below
+ * 16 ns, then 8 buckets per power of two (12.5% wide), from nanoseconds to
+ * hours in 496 buckets.
+ *
+ * Only long-lived threads should record: a thread's histograms are kept
+ * after it exits, so they still count in the totals.
+ *
+ * The stages:
+ *
+ *   read         reading a file into memory ahead of decode (prefetch.c)
+ *   open         the vips_thumbnail call: opening the image, reading its
+ *                header and setting up the shrink
+ *   decode       vips_image_wio_input: libvips is lazy, so this is where
+ *                the pixels are decoded, shrunk and converted
+ *   colourspace  setting up the grayscale conversion and band extraction
+ *   hash         the difference hashes and importances of the 8x8 pixels
+ *   distance     distances, timed per batch rather than per call, since one
+ *                call costs less than reading the clock
+ *   write        writing a record
+ *   image        one image through a stream worker, end to end
+ *
+ * Reports: timing_print_table, timing_print_json, and a live one-line meter
+ * (timing_meter_start), which rewrites itself in place on a terminal the
+ * way extras/meter.c does.
+ *
+ * Compile test
+ *
+gcc timing.c -o test-timing -DTEST_TIMING -DIDHASH_TIMING -g -Wall -pthread
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef STDINT_H
+#  define STDINT_H
+#  include <stdint.h>
+#endif
+
+#ifndef INTTYPES_H
+#  define INTTYPES_H
+#  include <inttypes.h>
+#endif
+
+#ifndef TIME_H
+#  define TIME_H
+#  include <time.h>
+#endif
+
+#ifndef UNISTD_H
+#  define UNISTD_H
+#  include <unistd.h>
+#endif
+
+#ifndef PTHREAD_H
+#  define PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#ifndef STDATOMIC_H
+#  define STDATOMIC_H
+#  include <stdatomic.h>
+#endif
+
+typedef enum timing_stage {
+  TIMING_READ,
+  TIMING_OPEN,
+  TIMING_DECODE,
+  TIMING_COLOURSPACE,
+  TIMING_HASH,
+  TIMING_DISTANCE,
+  TIMING_WRITE,
+  TIMING_IMAGE,
+  NTIMING_STAGE
+} timing_stage;
+
+static const char* const timing_stage_names[NTIMING_STAGE] = {
+  "read", "open", "decode", "colourspace", "hash", "distance", "write",
+  "image"
+};
+
+#ifdef IDHASH_TIMING
+#  define TIMING_START(t) uint64_t t = timing_now()
+#  define TIMING_STAMP(t) ((t) = timing_now())
+#  define TIMING_STOP(stage, t) timing_record((stage), timing_now() - (t))
+#else
+#  define TIMING_START(t) do {} while(0)
+#  define TIMING_STAMP(t) ((void) 0)
+#  define TIMING_STOP(stage, t) ((void) 0)
+#endif
+
+// Below 2^TIMING_SUB_BITS+1 ns every value has its own bucket; above, each
+// power of two is split into 2^TIMING_SUB_BITS.
+#define TIMING_SUB_BITS 3
+#define TIMING_SUB (1 << TIMING_SUB_BITS)
+#define TIMING_LINEAR (2 * TIMING_SUB)
+#define TIMING_NBUCKETS \
+  (TIMING_LINEAR + (64 - TIMING_SUB_BITS - 1) * TIMING_SUB)
+
+/* Monotonic time in nanoseconds.
+ */
+static inline uint64_t timing_now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static inline int timing_bucket(uint64_t ns){
+  if(ns < TIMING_LINEAR) return ns;
+  const int msb = 63 - __builtin_clzll(ns);
+  return TIMING_LINEAR + (msb - TIMING_SUB_BITS - 1) * TIMING_SUB
+    + ((ns >> (msb - TIMING_SUB_BITS)) & (TIMING_SUB - 1));
+}
+
+/* The smallest value that falls in bucket @b.
+ */
+static uint64_t timing_bucket_floor(int b){
+  if(b < TIMING_LINEAR) return b;
+  const int msb = (b - TIMING_LINEAR) / TIMING_SUB + TIMING_SUB_BITS + 1;
+  const uint64_t sub = (b - TIMING_LINEAR) % TIMING_SUB;
+  return (TIMING_SUB + sub) << (msb - TIMING_SUB_BITS);
+}
+
+// One thread's histograms. Only the owning thread writes them.
+typedef struct timing_thread timing_thread;
+struct timing_thread {
+  _Atomic uint64_t count[NTIMING_STAGE][TIMING_NBUCKETS];
+  _Atomic uint64_t total[NTIMING_STAGE];  // ns
+  _Atomic uint64_t max[NTIMING_STAGE];
+  timing_thread* next;
+};
+
+static _Atomic(timing_thread*) timing_threads;
+static _Atomic uint64_t timing_epoch;  // when the first thread registered
+static _Thread_local timing_thread* timing_self;
+
+static timing_thread* timing_register(){
+  timing_thread* t = calloc(1, sizeof(timing_thread));
+  uint64_t zero=0;
+  atomic_compare_exchange_strong(&timing_epoch, &zero, timing_now());
+  t->next = atomic_load(&timing_threads);
+  while(!atomic_compare_exchange_weak(&timing_threads, &t->next, t));
+  return timing_self = t;
+}
+
+static inline void timing_add(_Atomic uint64_t* x, uint64_t v){
+  // Single writer: a relaxed load and store, not a locked add.
+  atomic_store_explicit(x, atomic_load_explicit(x, memory_order_relaxed) + v,
+    memory_order_relaxed);
+}
+
+/* Record @ns spent in @stage on the calling thread.
+ */
+static inline void timing_record(timing_stage stage, uint64_t ns){
+  timing_thread* t = timing_self ? timing_self : timing_register();
+  timing_add(&t->count[stage][timing_bucket(ns)], 1);
+  timing_add(&t->total[stage], ns);
+  if(ns > atomic_load_explicit(&t->max[stage], memory_order_relaxed))
+    atomic_store_explicit(&t->max[stage], ns, memory_order_relaxed);
+}
+
+// All threads' histograms added up.
+typedef struct timing_summary timing_summary;
+struct timing_summary {
+  uint64_t count[NTIMING_STAGE][TIMING_NBUCKETS];
+  uint64_t n[NTIMING_STAGE];
+  uint64_t total[NTIMING_STAGE];
+  uint64_t max[NTIMING_STAGE];
+  double elapsed;  // seconds since the first recording
+};
+
+timing_summary* timing_merge(timing_summary* s){
+  memset(s, 0, sizeof(timing_summary));
+  for(timing_thread* t = atomic_load(&timing_threads); t; t = t->next){
+    for(int i=0; i<NTIMING_STAGE; ++i){
+      for(int b=0; b<TIMING_NBUCKETS; ++b){
+        const uint64_t c = atomic_load_explicit(&t->count[i][b],
+          memory_order_relaxed);
+        s->count[i][b] += c;
+        s->n[i] += c;
+      }
+      s->total[i] += atomic_load_explicit(&t->total[i], memory_order_relaxed);
+      const uint64_t max = atomic_load_explicit(&t->max[i],
+        memory_order_relaxed);
+      if(s->max[i] < max) s->max[i] = max;
+    }
+  }
+  const uint64_t epoch = atomic_load(&timing_epoch);
+  s->elapsed = epoch ? (timing_now() - epoch) / 1e9 : 0;
+  return s;
+}
+
+/* The @q quantile of @stage in ns, to within a bucket: the middle of the
+ * bucket it falls in, but never more than the maximum.
+ */
+uint64_t timing_quantile(const timing_summary* s, timing_stage stage, double q){
+  if(!s->n[stage]) return 0;
+  const uint64_t rank = q * (s->n[stage] - 1);
+  uint64_t cum=0;
+  for(int b=0; b<TIMING_NBUCKETS; ++b){
+    if((cum += s->count[stage][b]) > rank){
+      const uint64_t lo = timing_bucket_floor(b);
+      const uint64_t hi = b+1 < TIMING_NBUCKETS ? timing_bucket_floor(b+1)
+        : lo;
+      const uint64_t mid = lo + (hi - lo) / 2;
+      return mid < s->max[stage] ? mid : s->max[stage];
+    }
+  }
+  return s->max[stage];
+}
+
+/* Print a table of the stages that recorded anything: count, mean, p50,
+ * p90, p99 and max in microseconds, total seconds, and events per second of
+ * wall time.
+ */
+void timing_print_table(FILE* fp){
+  timing_summary* s = malloc(sizeof(timing_summary));
+  timing_merge(s);
+  fprintf(fp, "%-12s %10s %10s %10s %10s %10s %10s %10s %10s\n", "stage",
+    "count", "mean_us", "p50_us", "p90_us", "p99_us", "max_us", "total_s",
+    "per_s");
+  for(int i=0; i<NTIMING_STAGE; ++i){
+    if(!s->n[i]) continue;
+    fprintf(fp, "%-12s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f "
+      "%10.3f %10.1f\n", timing_stage_names[i], s->n[i],
+      s->total[i] / 1e3 / s->n[i], timing_quantile(s, i, 0.5) / 1e3,
+      timing_quantile(s, i, 0.9) / 1e3, timing_quantile(s, i, 0.99) / 1e3,
+      s->max[i] / 1e3, s->total[i] / 1e9,
+      s->elapsed > 0 ? s->n[i] / s->elapsed : 0);
+  }
+  fprintf(fp, "elapsed: %.3f s\n", s->elapsed);
+  free(s);
+}
+
+/* Print the same numbers as timing_print_table as one JSON object.
+ */
+void timing_print_json(FILE* fp){
+  timing_summary* s = malloc(sizeof(timing_summary));
+  timing_merge(s);
+  fprintf(fp, "{\"elapsed_s\": %.6f, \"stages\": {", s->elapsed);
+  int first=1;
+  for(int i=0; i<NTIMING_STAGE; ++i){
+    if(!s->n[i]) continue;
+    fprintf(fp, "%s\n  \"%s\": {\"count\": %" PRIu64 ", \"mean_us\": %.3f, "
+      "\"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, "
+      "\"max_us\": %.3f, \"total_s\": %.6f, \"per_s\": %.3f}",
+      first ? "" : ",", timing_stage_names[i], s->n[i],
+      s->total[i] / 1e3 / s->n[i], timing_quantile(s, i, 0.5) / 1e3,
+      timing_quantile(s, i, 0.9) / 1e3, timing_quantile(s, i, 0.99) / 1e3,
+      s->max[i] / 1e3, s->total[i] / 1e9,
+      s->elapsed > 0 ? s->n[i] / s->elapsed : 0);
+    first = 0;
+  }
+  fprintf(fp, "\n}}\n");
+  free(s);
+}
+
+/* Format the meter line into @buf: images done and per second, and the
+ * median time of the busiest stages.
+ */
+static int timing_meter_format(char* buf, size_t n, const timing_summary* s){
+  const timing_stage shown[] = {TIMING_READ, TIMING_DECODE, TIMING_HASH};
+  int z = snprintf(buf, n, "%" PRIu64 " images  %.1f/s",
+    s->n[TIMING_IMAGE], s->elapsed > 0 ? s->n[TIMING_IMAGE] / s->elapsed : 0);
+  for(size_t i=0; i < sizeof shown / sizeof *shown && z < (int) n; ++i)
+    if(s->n[shown[i]])
+      z += snprintf(buf + z, n - z, "  %s p50 %.2f ms",
+        timing_stage_names[shown[i]], timing_quantile(s, shown[i], 0.5) / 1e6);
+  return z < (int) n ? z : (int) n - 1;
+}
+
+typedef struct timing_meter timing_meter;
+struct timing_meter {
+  pthread_t thread;
+  int fd;
+  unsigned interval_ms;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+};
+
+static timing_meter timing_meter_state = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER
+};
+
+/* Overwrite the current line of @fd with @line, padding out what's left of
+ * a longer previous line.
+ */
+static void timing_meter_write(int fd, const char* line, int n, int* last){
+  char buf[512];
+  int z = snprintf(buf, sizeof buf, "\r%s%*s", line, *last > n ? *last - n : 0,
+    "");
+  if(z > (int) sizeof buf - 1) z = sizeof buf - 1;
+  if(0 > write(fd, buf, z)) return;
+  *last = n;
+}
+
+static void* timing_meter_thread(void* _arg){
+  timing_meter* m = (timing_meter*) _arg;
+  timing_summary* s = malloc(sizeof(timing_summary));
+  char line[256];
+  int last=0;
+  pthread_mutex_lock(&m->lock);
+  for(int stop=0; !stop; ){
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += m->interval_ms % 1000 * 1000000l;
+    until.tv_sec += m->interval_ms / 1000 + until.tv_nsec / 1000000000l;
+    until.tv_nsec %= 1000000000l;
+    while(!m->stop && !pthread_cond_timedwait(&m->cond, &m->lock, &until));
+    stop = m->stop;
+    pthread_mutex_unlock(&m->lock);
+    timing_merge(s);
+    timing_meter_write(m->fd, line, timing_meter_format(line, sizeof line, s),
+      &last);
+    pthread_mutex_lock(&m->lock);
+  }
+  pthread_mutex_unlock(&m->lock);
+  if(0 > write(m->fd, "\n", 1)) {}
+  free(s);
+  return 0;
+}
+
+/* Rewrite a meter line on @fd every @interval_ms until timing_meter_stop.
+ */
+void timing_meter_start(int fd, unsigned interval_ms){
+  timing_meter* m = &timing_meter_state;
+  m->fd = fd;
+  m->interval_ms = interval_ms ? interval_ms : 1000;
+  m->stop = 0;
+  pthread_create(&m->thread, 0, timing_meter_thread, m);
+}
+
+/* Write the final meter line and stop the meter.
+ */
+void timing_meter_stop(){
+  timing_meter* m = &timing_meter_state;
+  pthread_mutex_lock(&m->lock);
+  m->stop = 1;
+  pthread_cond_signal(&m->cond);
+  pthread_mutex_unlock(&m->lock);
+  pthread_join(m->thread, 0);
+}
+
+#ifdef TEST_TIMING
+#ifndef ASSERT_H
+#  define ASSERT_H
+#  include <assert.h>
+#endif
+
+static void* record_some(void* _arg){
+  const uint64_t base = (uintptr_t) _arg;
+  for(uint64_t i=1; i<=1000; ++i) timing_record(TIMING_HASH, base * i);
+  return 0;
+}
+
+int main(){
+  // Buckets are contiguous, ordered, and at most 12.5% wide.
+  for(int b=1; b<TIMING_NBUCKETS; ++b)
+    assert(timing_bucket_floor(b) > timing_bucket_floor(b-1));
+  for(uint64_t v=0; v<1000000; v += 1 + v/7){
+    const int b = timing_bucket(v);
+    assert(timing_bucket_floor(b) <= v);
+    assert(b+1 == TIMING_NBUCKETS || v < timing_bucket_floor(b+1));
+    assert(v - timing_bucket_floor(b) <= v / TIMING_SUB);
+  }
+  assert(timing_bucket(UINT64_MAX) == TIMING_NBUCKETS - 1);
+
+  timing_meter_start(STDERR_FILENO, 10);
+  pthread_t threads[4];
+  for(uintptr_t i=0; i<4; ++i)
+    pthread_create(threads+i, 0, record_some, (void*)(i+1) );
+  for(int i=0; i<4; ++i) pthread_join(threads[i], 0);
+  TIMING_START(t);
+  usleep(2000);
+  TIMING_STOP(TIMING_DECODE, t);
+  timing_meter_stop();
+
+  timing_summary* s = malloc(sizeof(timing_summary));
+  timing_merge(s);
+  assert(s->n[TIMING_HASH] == 4000 && s->max[TIMING_HASH] == 4000);
+  assert(s->total[TIMING_HASH] == 10 * 500500);
+  const uint64_t p50 = timing_quantile(s, TIMING_HASH, 0.5);
+  assert(850 < p50 && p50 < 1100);  // exact median is 960
+  assert(s->n[TIMING_DECODE] == 1 && s->max[TIMING_DECODE] >= 2000000);
+  assert(!s->n[TIMING_READ]);
+  free(s);
+  timing_print_table(stdout);
+  timing_print_json(stdout);
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#endif
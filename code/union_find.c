@@ -0,0 +1,269 @@
+/* union_find.c
+ *
+ * Disjoint sets over the indices 0..n-1 of a hash table, for turning
+ * matching pairs into groups of near-duplicates.
+ *
+ * A set is a tree of parent links, 4 bytes per index, and its root is
+ * always its smallest index: a union links the larger root under the
+ * smaller. That makes the groups, and the order they come out in, the same
+ * whatever order the pairs arrive in or how many threads add them.
+ *
+ * There are two ways to add a pair, on the same parent array:
+ *
+ *   union_find_union         one thread, with full path compression
+ *   union_find_union_atomic  any number of threads at once, lock-free: a
+ *                            root is linked with a compare-and-swap, which
+ *                            fails and retries if another thread linked it
+ *                            first, and paths are halved as they are walked
+ *
+ * The parent links are atomics either way; the single-threaded functions
+ * use relaxed loads and stores, which are ordinary moves.
+ *
+ * After the last union, union_find_groups chains the members of each set
+ * into a list in increasing order, with one more array of n, so groups can
+ * be walked without sorting. Memory is 8 bytes per index, whatever the
+ * number of pairs.
+ *
+ * Compile test
+ *
+gcc union_find.c -o test-union-find -DTEST_UNION_FIND -g -Wall -pthread
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STDINT_H
+#  define STDINT_H
+#  include <stdint.h>
+#endif
+
+#ifndef STDATOMIC_H
+#  define STDATOMIC_H
+#  include <stdatomic.h>
+#endif
+
+#ifndef ASSERT_H
+#  define ASSERT_H
+#  include <assert.h>
+#endif
+
+// End of a member list, and the largest table union_find can hold.
+#define UNION_FIND_NONE UINT32_MAX
+
+typedef struct union_find union_find;
+struct union_find {
+  _Atomic uint32_t* parent;
+  // After union_find_groups, the next member of the same set, or
+  // UNION_FIND_NONE.
+  uint32_t* next;
+  size_t n;
+};
+
+/* Create @n singleton sets. Return 0 if @n is too large or memory runs out.
+ */
+union_find* union_find_create(size_t n){
+  if(n >= UNION_FIND_NONE) return 0;
+  union_find* uf = calloc(1, sizeof *uf);
+  uf->parent = malloc(n * sizeof *uf->parent + 1);
+  if(!uf->parent){
+    free(uf);
+    return 0;
+  }
+  for(size_t i=0; i<n; ++i) atomic_init(uf->parent + i, i);
+  uf->n = n;
+  return uf;
+}
+
+void union_find_destroy(union_find* uf){
+  if(!uf) return;
+  free(uf->parent);
+  free(uf->next);
+  free(uf);
+}
+
+static inline uint32_t union_find_parent(const union_find* uf, uint32_t i){
+  return atomic_load_explicit(uf->parent + i, memory_order_relaxed);
+}
+
+/* The root of @i, pointing every index on the way straight at it.
+ * Single-threaded.
+ */
+uint32_t union_find_find(union_find* uf, uint32_t i){
+  uint32_t r = i;
+  for(uint32_t p; (p = union_find_parent(uf, r)) != r; ) r = p;
+  while(i != r){
+    const uint32_t p = union_find_parent(uf, i);
+    atomic_store_explicit(uf->parent + i, r, memory_order_relaxed);
+    i = p;
+  }
+  return r;
+}
+
+/* Merge the sets of @a and @b. Return 1 if they were different sets.
+ * Single-threaded.
+ */
+int union_find_union(union_find* uf, uint32_t a, uint32_t b){
+  a = union_find_find(uf, a);
+  b = union_find_find(uf, b);
+  if(a == b) return 0;
+  if(a > b){ const uint32_t t = a; a = b; b = t; }
+  atomic_store_explicit(uf->parent + b, a, memory_order_relaxed);
+  return 1;
+}
+
+/* The root of @i, while other threads may be linking roots. Each index
+ * walked is pointed at its grandparent; losing that race to another
+ * thread is harmless, since either link is to an ancestor.
+ */
+uint32_t union_find_find_atomic(union_find* uf, uint32_t i){
+  for(;;){
+    uint32_t p = atomic_load_explicit(uf->parent + i, memory_order_acquire);
+    if(p == i) return i;
+    const uint32_t g =
+      atomic_load_explicit(uf->parent + p, memory_order_acquire);
+    if(g != p)
+      atomic_compare_exchange_weak_explicit(uf->parent + i, &p, g,
+        memory_order_release, memory_order_relaxed);
+    i = g;
+  }
+}
+
+/* Merge the sets of @a and @b, while other threads do the same. Return 1 if
+ * this call merged two different sets.
+ */
+int union_find_union_atomic(union_find* uf, uint32_t a, uint32_t b){
+  for(;;){
+    a = union_find_find_atomic(uf, a);
+    b = union_find_find_atomic(uf, b);
+    if(a == b) return 0;
+    if(a > b){ const uint32_t t = a; a = b; b = t; }
+    // b is a root only if nothing linked it since it was found.
+    uint32_t expected = b;
+    if(atomic_compare_exchange_strong_explicit(uf->parent + b, &expected, a,
+      memory_order_acq_rel, memory_order_acquire))
+      return 1;
+  }
+}
+
+/* After the last union, point every index at its root and chain each set's
+ * members in increasing order from the root: uf->next[r], then
+ * uf->next[that], and so on. Return 0 on success, -1 if memory runs out.
+ */
+int union_find_groups(union_find* uf){
+  free(uf->next);
+  uf->next = malloc(uf->n * sizeof *uf->next + 1);
+  if(!uf->next) return -1;
+  for(size_t i=0; i<uf->n; ++i){
+    uf->next[i] = UNION_FIND_NONE;
+    union_find_find(uf, i);
+  }
+  // A root is smaller than its members, so pushing members onto the front
+  // of their root's list from the top down leaves each list in order.
+  for(size_t i=uf->n; i-- > 0; ){
+    const uint32_t r = union_find_parent(uf, i);
+    if(r == i) continue;
+    uf->next[i] = uf->next[r];
+    uf->next[r] = i;
+  }
+  return 0;
+}
+
+/* Whether @i is the root of a set with more than one member, after
+ * union_find_groups.
+ */
+static inline int union_find_is_group(const union_find* uf, uint32_t i){
+  return union_find_parent(uf, i) == i && uf->next[i] != UNION_FIND_NONE;
+}
+
+#ifdef TEST_UNION_FIND
+#ifndef PTHREAD_H
+#  define PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#define TEST_N 100000
+#define TEST_THREADS 8
+
+typedef struct test_arg test_arg;
+struct test_arg {
+  union_find* uf;
+  int t;
+};
+
+// Pair j of a block of ten indices b..b+9 is (b+j+1, b+j) for j < 5, and
+// (b+9, b+8) for j = 5: b..b+5 and b+8..b+9 are sets, b+6 and b+7 are on
+// their own.
+static void test_pair(uint32_t k, uint32_t* a, uint32_t* b){
+  const uint32_t base = k / 6 * 10, j = k % 6;
+  *a = j < 5 ? base + j + 1 : base + 9;
+  *b = j < 5 ? base + j : base + 8;
+}
+
+static void* test_thread(void* _arg){
+  test_arg* arg = (test_arg*) _arg;
+  uint32_t a, b;
+  for(uint32_t k=arg->t; k<TEST_N / 10 * 6; k+=TEST_THREADS){
+    test_pair(k, &a, &b);
+    union_find_union_atomic(arg->uf, a, b);
+  }
+  return 0;
+}
+
+static void test_check(union_find* uf){
+  assert(!union_find_groups(uf));
+  for(uint32_t i=0; i<TEST_N; ++i){
+    const uint32_t j = i % 10;
+    const uint32_t root = j <= 5 ? i - j : j >= 8 ? i - j + 8 : i;
+    assert(union_find_parent(uf, i) == root);
+    assert(union_find_is_group(uf, i) == (i == root && j != 6 && j != 7));
+  }
+}
+
+int main(){
+  union_find* uf = union_find_create(8);
+  assert(union_find_union(uf, 5, 2));
+  assert(union_find_union(uf, 7, 5));
+  assert(!union_find_union(uf, 2, 7));
+  assert(union_find_union(uf, 6, 4));
+  assert(union_find_find(uf, 7) == 2);
+  assert(!union_find_groups(uf));
+  assert(union_find_is_group(uf, 2) && union_find_is_group(uf, 4));
+  assert(!union_find_is_group(uf, 0) && !union_find_is_group(uf, 5));
+  assert(uf->next[2] == 5 && uf->next[5] == 7);
+  assert(uf->next[7] == UNION_FIND_NONE);
+  assert(uf->next[4] == 6 && uf->next[6] == UNION_FIND_NONE);
+  union_find_destroy(uf);
+
+  // Sequential and concurrent give the same sets.
+  uf = union_find_create(TEST_N);
+  uint32_t a, b;
+  for(uint32_t k=0; k<TEST_N / 10 * 6; ++k){
+    test_pair(k, &a, &b);
+    union_find_union(uf, a, b);
+  }
+  test_check(uf);
+  union_find_destroy(uf);
+
+  uf = union_find_create(TEST_N);
+  pthread_t threads[TEST_THREADS];
+  test_arg args[TEST_THREADS];
+  for(int t=0; t<TEST_THREADS; ++t){
+    args[t] = (test_arg){uf, t};
+    pthread_create(threads + t, 0, test_thread, args + t);
+  }
+  for(int t=0; t<TEST_THREADS; ++t) pthread_join(threads[t], 0);
+  test_check(uf);
+  union_find_destroy(uf);
+
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#endif
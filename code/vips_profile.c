@@ -0,0 +1,258 @@
+/* vips_profile.c
+ *
+ * Library-level libvips settings for the batch drivers.
+ *
+ * VIPS_INIT leaves libvips tuned for interactive work on a few large images:
+ * an operation cache holding up to 100 operations (and their decoded images
+ * and open files), and a threadpool as wide as the machine for every single
+ * pipeline. IDHash shrinks millions of small images to 8x8, so every
+ * operation is seen exactly once and a per-image pipeline has almost nothing
+ * to split between threads. A profile collects the settings that matter for
+ * that workload, so a driver can apply them all at once after VIPS_INIT.
+ *
+ * Presets:
+ *
+ *   default   leave every libvips default alone
+ *   bulk      no operation cache, one vips thread per decode, sequential
+ *             access hints, leak checking off. Parallelism comes from
+ *             running many images at once instead.
+ *
+ * Each setting may be overridden on the command line after the profile is
+ * chosen. A negative value means "leave the libvips default alone".
+ *
+ *   --profile <NAME>
+ *   --cache-max <N>           operations kept in the operation cache
+ *   --cache-max-mem <BYTES>   memory the operation cache may hold
+ *   --cache-max-files <N>     files the operation cache may keep open
+ *   --concurrency <N>         vips threads per decode pipeline
+ *   --sequential | --random   access hint for loaders that accept one
+ *   --profile-stats           print memory/file/RSS usage at exit
+ *
+ * Worker threads that call into libvips should call vips_thread_shutdown()
+ * before they exit, so libvips can free its per-thread buffers.
+ *
+ * Compile test
+ *
+gcc vips_profile.c -o test-vips-profile -DTEST_VIPS_PROFILE -g -Wall `pkg-config vips --cflags --libs`
+ *
+ * Run
+ *
+ * ./test-vips-profile --profile bulk --cache-max-files 10
+ *
+ */
+
+#ifndef STDLIB_H
+#  define STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#ifndef STDIO_H
+#  define STDIO_H
+#  include <stdio.h>
+#endif
+
+#ifndef STRING_H
+#  define STRING_H
+#  include <string.h>
+#endif
+
+#ifndef ASSERT_H
+#  define ASSERT_H
+#  include <assert.h>
+#endif
+
+#ifndef RESOURCE_H
+#  define RESOURCE_H
+#  include <sys/resource.h>
+#endif
+
+#ifndef VIPS_H
+#  define VIPS_H
+#  include <vips/vips.h>
+#endif
+
+#ifndef DEFAULT_VIPS_PROFILE
+#  define DEFAULT_VIPS_PROFILE "bulk"
+#endif
+
+typedef struct vips_profile vips_profile;
+struct vips_profile {
+  char name[32];
+  int cache_max;
+  gint64 cache_max_mem;
+  int cache_max_files;
+  int concurrency;
+  VipsAccess access;
+  int leak;
+  int print_stats;
+};
+
+// 0-terminated list of presets. -1 leaves the libvips default in place.
+static const vips_profile vips_profile_presets[] = {
+  {"default", -1, -1, -1, -1, VIPS_ACCESS_RANDOM, -1, 0},
+  {"bulk", 0, 0, 0, 1, VIPS_ACCESS_SEQUENTIAL, 0, 0},
+  {{0}}
+};
+
+// The profile most recently applied with vips_profile_apply. Loaders that
+// take an access hint read it from here.
+static vips_profile vips_profile_current =
+  {"default", -1, -1, -1, -1, VIPS_ACCESS_RANDOM, -1, 0};
+
+/* Copy the preset named @name into @profile. Return @profile, or 0 if there
+ * is no such preset.
+ */
+vips_profile* vips_profile_init(vips_profile* profile, const char* name){
+  for(const vips_profile* p = vips_profile_presets; *p->name; ++p){
+    if(!strcmp(p->name, name)){
+      *profile = *p;
+      return profile;
+    }
+  }
+  return 0;
+}
+
+static void vips_profile_usage_error(const char* opt){
+  fprintf(stderr, "Option %s: expected an argument.\n", opt);
+  exit(EXIT_FAILURE);
+}
+
+/* Initialize @profile from the preset @default_name, then apply any profile
+ * options found in @argv on top of it. Consumed options are removed from
+ * @argv and *@argc is updated, so the driver can check its positional
+ * arguments as before. Exit on an unknown preset or a missing argument.
+ */
+vips_profile* vips_profile_parse_args(
+  vips_profile* profile,
+  const char* default_name,
+  int* argc,
+  char** argv)
+{
+  if(!vips_profile_init(profile, default_name)){
+    fprintf(stderr, "Unknown vips profile %s.\n", default_name);
+    exit(EXIT_FAILURE);
+  }
+  // First pass: the preset, so the overrides apply on top of it regardless
+  // of their order on the command line.
+  for(int i=1; i<*argc; ++i){
+    if(strcmp(argv[i], "--profile")) continue;
+    if(i+1 >= *argc) vips_profile_usage_error(argv[i]);
+    if(!vips_profile_init(profile, argv[i+1])){
+      fprintf(stderr, "Unknown vips profile %s.\n", argv[i+1]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  int j=1;
+  for(int i=1; i<*argc; ++i){
+    char* opt = argv[i];
+    int has_arg = !strcmp(opt, "--profile") || !strcmp(opt, "--cache-max")
+      || !strcmp(opt, "--cache-max-mem") || !strcmp(opt, "--cache-max-files")
+      || !strcmp(opt, "--concurrency");
+    if(has_arg){
+      if(i+1 >= *argc) vips_profile_usage_error(opt);
+      char* val = argv[++i];
+      if(!strcmp(opt, "--cache-max")) profile->cache_max = atoi(val);
+      else if(!strcmp(opt, "--cache-max-mem"))
+        profile->cache_max_mem = strtoll(val, 0, 0);
+      else if(!strcmp(opt, "--cache-max-files"))
+        profile->cache_max_files = atoi(val);
+      else if(!strcmp(opt, "--concurrency")) profile->concurrency = atoi(val);
+    } else if(!strcmp(opt, "--sequential")){
+      profile->access = VIPS_ACCESS_SEQUENTIAL;
+    } else if(!strcmp(opt, "--random")){
+      profile->access = VIPS_ACCESS_RANDOM;
+    } else if(!strcmp(opt, "--profile-stats")){
+      profile->print_stats = 1;
+    } else {
+      argv[j++] = opt;
+    }
+  }
+  argv[j] = 0;
+  *argc = j;
+  return profile;
+}
+
+/* Push the settings in @profile into libvips. Call after VIPS_INIT and before
+ * any worker threads are started.
+ */
+const vips_profile* vips_profile_apply(const vips_profile* profile){
+  if(profile->cache_max >= 0) vips_cache_set_max(profile->cache_max);
+  if(profile->cache_max_mem >= 0)
+    vips_cache_set_max_mem((size_t) profile->cache_max_mem);
+  if(profile->cache_max_files >= 0)
+    vips_cache_set_max_files(profile->cache_max_files);
+  if(profile->concurrency > 0) vips_concurrency_set(profile->concurrency);
+  if(profile->leak >= 0) vips_leak_set(profile->leak);
+  vips_profile_current = *profile;
+  return profile;
+}
+
+/* The access hint of the applied profile, for vips_image_new_from_file and
+ * friends.
+ */
+VipsAccess vips_profile_access(){
+  return vips_profile_current.access;
+}
+
+/* Print the applied profile and the memory, open files and peak RSS used so
+ * far to @fp, on one line. Does nothing unless the profile asked for it with
+ * --profile-stats.
+ */
+void vips_profile_print_stats(FILE* fp){
+  if(!vips_profile_current.print_stats) return;
+  struct rusage usage={0};
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(fp, "profile: %s  vips_mem_highwater: %zu  vips_files: %d  "
+    "maxrss_kb: %ld\n", vips_profile_current.name,
+    vips_tracked_get_mem_highwater(), vips_tracked_get_files(),
+    usage.ru_maxrss);
+}
+
+/* Print a summary of @profile to @fp.
+ */
+void vips_profile_print(const vips_profile* profile, FILE* fp){
+  fprintf(fp, "profile: %s  cache_max: %d  cache_max_mem: %" G_GINT64_FORMAT
+    "  cache_max_files: %d  concurrency: %d  access: %s\n", profile->name,
+    profile->cache_max, profile->cache_max_mem, profile->cache_max_files,
+    profile->concurrency,
+    profile->access == VIPS_ACCESS_SEQUENTIAL ? "sequential" : "random");
+}
+
+#ifdef TEST_VIPS_PROFILE
+int main(int argc, char* argv[argc]){
+  if(VIPS_INIT(argv[0]))
+    vips_error_exit(NULL);
+
+  vips_profile profile={0};
+
+  // Known presets load, unknown ones don't.
+  assert(vips_profile_init(&profile, "default"));
+  assert(vips_profile_init(&profile, "bulk"));
+  assert(profile.cache_max == 0 && profile.concurrency == 1);
+  assert(!vips_profile_init(&profile, "no-such-profile"));
+
+  // Options are consumed, positional arguments are kept in order, and
+  // overrides apply on top of the preset wherever they appear.
+  {
+    char* args[] = {"prog", "--cache-max", "5", "a", "--profile", "default",
+      "b", "--sequential", 0};
+    int n = 8;
+    vips_profile_parse_args(&profile, "bulk", &n, args);
+    assert(n == 3);
+    assert(!strcmp(args[1], "a") && !strcmp(args[2], "b") && !args[3]);
+    assert(!strcmp(profile.name, "default"));
+    assert(profile.cache_max == 5);
+    assert(profile.access == VIPS_ACCESS_SEQUENTIAL);
+  }
+
+  vips_profile_parse_args(&profile, DEFAULT_VIPS_PROFILE, &argc, argv);
+  vips_profile_apply(&profile);
+  assert(vips_profile_access() == profile.access);
+  vips_profile_print(&profile, stdout);
+  profile.print_stats = 1;
+  vips_profile_apply(&profile);
+  vips_profile_print_stats(stdout);
+  puts("OK");
+  return EXIT_SUCCESS;
+}
+#endif